@@ -1,21 +1,31 @@
 #include "compiler.h"
+#include "dead_code.h"
+#include "peephole.h"
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 #include <cstring>
+#include <algorithm>
 #include <filesystem>
 
 namespace Tail
 {
 
-    Compiler::Compiler()
+    Compiler::Compiler(const CompilerOptions &opts) : options(opts)
     {
         contextStack.push_back(FunctionContext());
+        bytecode.version = options.bytecodeVersion;
+        if (options.bytecodeVersion == TVM::BYTECODE_VERSION_STACK)
+        {
+            bytecode.flags |= TVM::BYTECODE_FLAG_MAX_STACK;
+        }
     }
     TVM::BytecodeFile Compiler::compile(const std::vector<std::shared_ptr<Stmt>> &ast)
     {
         std::cout << "DEBUG: Compiling AST with " << ast.size() << " statements" << std::endl;
 
+        paramTypes = inferParamTypes(ast);
+
         for (const auto &stmt : ast)
         {
             if (auto func = std::dynamic_pointer_cast<FunctionStmt>(stmt))
@@ -48,12 +58,50 @@ namespace Tail
             throw std::runtime_error("Main function not found");
         }
 
-        if (bytecode.code.empty() || bytecode.code.back().opcode != TVM::OP_HALT)
+        if (options.optimizationLevel >= 1 && options.bytecodeVersion == TVM::BYTECODE_VERSION_STACK)
+        {
+            DeadCodeEliminator dce(bytecode);
+            dce.run();
+            const auto &stats = dce.getStats();
+            std::cout << "DEBUG: Dead code elimination: threaded " << stats.threadedJumps << " jumps, removed "
+                      << stats.unreachable << " unreachable instructions, " << stats.pushPopPairs
+                      << " push/pop pairs and " << stats.redundantJumps << " jumps to the next instruction"
+                      << std::endl;
+        }
+
+        if (options.bytecodeVersion == TVM::BYTECODE_VERSION_REGISTER)
+        {
+            if (bytecode.regCode.empty() || bytecode.regCode.back().opcode != TVM::ROP_HALT)
+            {
+                emitReg(TVM::ROP_HALT, 0);
+            }
+        }
+        else if (bytecode.code.empty() || bytecode.code.back().opcode != TVM::OP_HALT)
         {
             emit(TVM::OP_HALT);
         }
 
-        std::cout << "DEBUG: Generated " << bytecode.code.size() << " instructions" << std::endl;
+        if (options.superinstructions && options.bytecodeVersion == TVM::BYTECODE_VERSION_STACK)
+        {
+            PeepholeOptimizer peephole(bytecode);
+            peephole.run();
+            const auto &stats = peephole.getStats();
+            std::cout << "DEBUG: Fused " << stats.total() << " superinstructions (LOAD_LOAD_ADD: "
+                      << stats.loadLoadAdd << ", LT_LOCAL_CONST_JMP_IFNOT: " << stats.ltLocalConstJmpIfNot
+                      << ", INC_LOCAL: " << stats.incLocal << ", STORE_POP: " << stats.storePop << ")" << std::endl;
+        }
+
+        if (!inlinedCalls.empty())
+        {
+            std::cout << "DEBUG: Inlined " << inlinedCalls.size() << " calls:";
+            for (const auto &name : inlinedCalls)
+            {
+                std::cout << " " << name;
+            }
+            std::cout << std::endl;
+        }
+
+        std::cout << "DEBUG: Generated " << bytecode.code.size() + bytecode.regCode.size() << " instructions" << std::endl;
         std::cout << "DEBUG: Generated " << bytecode.constants.size() << " constants" << std::endl;
 
         bytecode.dump();
@@ -143,7 +191,7 @@ namespace Tail
         }
         else if (auto arr = std::dynamic_pointer_cast<ArrayExpr>(expr))
         {
-            compileArray(*arr);
+            compileArray(*arr, literalArrayType(*arr));
         }
         else if (auto idx = std::dynamic_pointer_cast<IndexExpr>(expr))
         {
@@ -162,6 +210,7 @@ namespace Tail
             compileExpr(stmt.initializer);
             uint32_t localIdx = currentContext().addLocal(stmt.name);
             emit(TVM::OP_STORE, localIdx);
+            emit(TVM::OP_POP);
         }
         else
         {
@@ -188,6 +237,7 @@ namespace Tail
             }
             uint32_t localIdx = currentContext().addLocal(stmt.name);
             emit(TVM::OP_STORE, localIdx);
+            emit(TVM::OP_POP);
         }
     }
 
@@ -215,6 +265,11 @@ namespace Tail
 
     void Compiler::compileExprStmt(const ExprStmt &stmt)
     {
+        if (compileAppend(stmt.expression))
+        {
+            return;
+        }
+
         compileExpr(stmt.expression);
 
         if (auto call = std::dynamic_pointer_cast<CallExpr>(stmt.expression))
@@ -232,10 +287,43 @@ namespace Tail
         emit(TVM::OP_POP);
     }
 
-    void Compiler::compileBlock(const BlockStmt &stmt)
+    // `s = s + a + b` on a str local, as a statement, appends a and b in
+    // place instead of building a new string each time (quadratic in a
+    // loop). Returns false, emitting nothing, for any other expression.
+    bool Compiler::compileAppend(const std::shared_ptr<Expr> &expr)
     {
+        auto assign = std::dynamic_pointer_cast<BinaryExpr>(expr);
+        if (!assign || assign->op != "=")
+        {
+            return false;
+        }
+        auto target = std::dynamic_pointer_cast<VariableExpr>(assign->left);
+        if (!target || !types.appendTarget(target->name))
+        {
+            return false;
+        }
+        uint32_t idx = resolveLocal(target->name);
+        std::vector<std::shared_ptr<Expr>> pieces = TypeInference::appendedPieces(target->name, assign->right);
+        if (idx == UINT32_MAX || pieces.empty())
+        {
+            return false;
+        }
 
-        contextStack.push_back(FunctionContext());
+        for (const auto &piece : pieces)
+        {
+            compileExpr(piece);
+            emit(TVM::OP_APPEND_LOCAL, idx);
+        }
+        return true;
+    }
+
+    void Compiler::compileBlock(const BlockStmt &stmt)
+    {
+        // Block scopes share the enclosing frame, so numbering continues
+        // from the parent instead of restarting at slot 0.
+        FunctionContext blockCtx;
+        blockCtx.nextLocal = currentContext().nextLocal;
+        contextStack.push_back(blockCtx);
 
         for (const auto &blockStmt : stmt.statements)
         {
@@ -298,14 +386,174 @@ namespace Tail
         loopStack.pop_back();
     }
 
+    // Whether `stmt` or any expression in it assigns or declares `name`.
+    // Statements and expressions of unknown kinds count as writes.
+    static bool writesName(const std::shared_ptr<Expr> &expr, const std::string &name)
+    {
+        if (!expr || std::dynamic_pointer_cast<LiteralExpr>(expr) || std::dynamic_pointer_cast<VariableExpr>(expr))
+        {
+            return false;
+        }
+        if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr))
+        {
+            auto target = std::dynamic_pointer_cast<VariableExpr>(bin->left);
+            if (bin->op == "=" && target && target->name == name)
+            {
+                return true;
+            }
+            return writesName(bin->left, name) || writesName(bin->right, name);
+        }
+        if (auto cmp = std::dynamic_pointer_cast<CompareExpr>(expr))
+        {
+            return writesName(cmp->left, name) || writesName(cmp->right, name);
+        }
+        if (auto log = std::dynamic_pointer_cast<LogicalExpr>(expr))
+        {
+            return writesName(log->left, name) || writesName(log->right, name);
+        }
+        if (auto call = std::dynamic_pointer_cast<CallExpr>(expr))
+        {
+            return std::any_of(call->args.begin(), call->args.end(),
+                               [&](const std::shared_ptr<Expr> &arg) { return writesName(arg, name); });
+        }
+        if (auto arr = std::dynamic_pointer_cast<ArrayExpr>(expr))
+        {
+            return std::any_of(arr->elements.begin(), arr->elements.end(),
+                               [&](const std::shared_ptr<Expr> &elem) { return writesName(elem, name); });
+        }
+        if (auto idx = std::dynamic_pointer_cast<IndexExpr>(expr))
+        {
+            return writesName(idx->array, name) || writesName(idx->index, name);
+        }
+        return true;
+    }
+
+    static bool writesName(const std::shared_ptr<Stmt> &stmt, const std::string &name)
+    {
+        if (!stmt || std::dynamic_pointer_cast<BreakStmt>(stmt) || std::dynamic_pointer_cast<ContinueStmt>(stmt) ||
+            std::dynamic_pointer_cast<FunctionStmt>(stmt))
+        {
+            return false;
+        }
+        if (auto varDecl = std::dynamic_pointer_cast<VarDeclStmt>(stmt))
+        {
+            return varDecl->name == name || writesName(varDecl->initializer, name);
+        }
+        if (auto arrayDecl = std::dynamic_pointer_cast<ArrayDeclStmt>(stmt))
+        {
+            return arrayDecl->name == name || writesName(arrayDecl->size, name) ||
+                   writesName(arrayDecl->initializer, name);
+        }
+        if (auto assign = std::dynamic_pointer_cast<AssignStmt>(stmt))
+        {
+            return assign->name == name || writesName(assign->value, name);
+        }
+        if (auto exprStmt = std::dynamic_pointer_cast<ExprStmt>(stmt))
+        {
+            return writesName(exprStmt->expression, name);
+        }
+        if (auto block = std::dynamic_pointer_cast<BlockStmt>(stmt))
+        {
+            return std::any_of(block->statements.begin(), block->statements.end(),
+                               [&](const std::shared_ptr<Stmt> &inner) { return writesName(inner, name); });
+        }
+        if (auto ifStmt = std::dynamic_pointer_cast<IfStmt>(stmt))
+        {
+            return writesName(ifStmt->condition, name) || writesName(ifStmt->thenBranch, name) ||
+                   writesName(ifStmt->elseBranch, name);
+        }
+        if (auto whileStmt = std::dynamic_pointer_cast<WhileStmt>(stmt))
+        {
+            return writesName(whileStmt->condition, name) || writesName(whileStmt->body, name);
+        }
+        if (auto forStmt = std::dynamic_pointer_cast<ForStmt>(stmt))
+        {
+            return writesName(forStmt->initializer, name) || writesName(forStmt->condition, name) ||
+                   writesName(forStmt->increment, name) || writesName(forStmt->body, name);
+        }
+        if (auto returnStmt = std::dynamic_pointer_cast<ReturnStmt>(stmt))
+        {
+            return writesName(returnStmt->value, name);
+        }
+        return true;
+    }
+
+    // Recognises `for (int i = K; i < Array.length(a); i = i + C) body`
+    // with K >= 0, 0 < C < 2^31, and neither i nor a written in body. In
+    // the body 0 <= i < length(a) and a is an array (ARRAY_LEN in the
+    // condition checked it), so a[i] needs no checks: the condition is the
+    // one check, hoisted out of every access.
+    bool Compiler::boundedIndexLoop(const ForStmt &stmt, std::string &arrayName, std::string &indexName) const
+    {
+        auto init = std::dynamic_pointer_cast<VarDeclStmt>(stmt.initializer);
+        auto start = init ? std::dynamic_pointer_cast<LiteralExpr>(init->initializer) : nullptr;
+        if (!start || init->type != "int" || !start->value.isInt() || start->value.asInt() < 0)
+        {
+            return false;
+        }
+        indexName = init->name;
+
+        auto cond = std::dynamic_pointer_cast<CompareExpr>(stmt.condition);
+        auto counter = cond ? std::dynamic_pointer_cast<VariableExpr>(cond->left) : nullptr;
+        auto length = cond ? std::dynamic_pointer_cast<CallExpr>(cond->right) : nullptr;
+        if (!counter || cond->op != "<" || counter->name != indexName || !length || !length->isNative ||
+            length->className != "Array" || length->methodName != "length" || length->args.size() != 1)
+        {
+            return false;
+        }
+        auto array = std::dynamic_pointer_cast<VariableExpr>(length->args[0]);
+        if (!array || array->name == indexName)
+        {
+            return false;
+        }
+        arrayName = array->name;
+
+        auto inc = std::dynamic_pointer_cast<BinaryExpr>(stmt.increment);
+        auto incTarget = inc ? std::dynamic_pointer_cast<VariableExpr>(inc->left) : nullptr;
+        auto sum = inc ? std::dynamic_pointer_cast<BinaryExpr>(inc->right) : nullptr;
+        auto sumLeft = sum ? std::dynamic_pointer_cast<VariableExpr>(sum->left) : nullptr;
+        auto step = sum ? std::dynamic_pointer_cast<LiteralExpr>(sum->right) : nullptr;
+        if (!incTarget || inc->op != "=" || incTarget->name != indexName || sum->op != "+" || !sumLeft ||
+            sumLeft->name != indexName || !step || !step->value.isInt() || step->value.asInt() <= 0 ||
+            step->value.asInt() >= (int64_t(1) << 31))
+        {
+            return false;
+        }
+
+        return !writesName(stmt.body, indexName) && !writesName(stmt.body, arrayName);
+    }
+
+    // LOAD/STORE_INDEX_UNCHECKED operand for `expr` if an enclosing loop
+    // proved it in bounds, or UINT32_MAX
+    uint32_t Compiler::uncheckedIndexOperand(const IndexExpr &expr)
+    {
+        auto array = std::dynamic_pointer_cast<VariableExpr>(expr.array);
+        auto index = std::dynamic_pointer_cast<VariableExpr>(expr.index);
+        if (!array || !index)
+        {
+            return UINT32_MAX;
+        }
+        std::pair<uint32_t, uint32_t> locals(resolveLocal(array->name), resolveLocal(index->name));
+        if (std::find(uncheckedIndexes.begin(), uncheckedIndexes.end(), locals) == uncheckedIndexes.end())
+        {
+            return UINT32_MAX;
+        }
+        return locals.first << 16 | locals.second;
+    }
+
     void Compiler::compileFor(const ForStmt &stmt)
     {
+        std::string arrayName, indexName;
+        bool bounded = boundedIndexLoop(stmt, arrayName, indexName);
 
         if (stmt.initializer)
         {
             compileStmt(stmt.initializer);
         }
 
+        uint32_t arrayLocal = bounded ? resolveLocal(arrayName) : UINT32_MAX;
+        bounded = arrayLocal != UINT32_MAX;
+
         LoopContext loop;
         loopStack.push_back(loop);
 
@@ -315,10 +563,18 @@ namespace Tail
         {
             compileExpr(stmt.condition);
             uint32_t exitJump = emitJump(TVM::OP_JMP_IFNOT);
-            loop.breakPatches.push_back(exitJump);
+            loopStack.back().breakPatches.push_back(exitJump);
         }
 
+        if (bounded)
+        {
+            uncheckedIndexes.emplace_back(arrayLocal, resolveLocal(indexName));
+        }
         compileStmt(stmt.body);
+        if (bounded)
+        {
+            uncheckedIndexes.pop_back();
+        }
 
         if (!loopStack.back().continuePatches.empty())
         {
@@ -345,7 +601,20 @@ namespace Tail
 
     void Compiler::compileReturn(const ReturnStmt &stmt)
     {
-        if (stmt.value)
+        if (!inlineStack.empty())
+        {
+            compileInlineReturn(stmt);
+            return;
+        }
+        auto call = std::dynamic_pointer_cast<CallExpr>(stmt.value);
+        if (call && !call->isNative)
+        {
+            if (compileCall(*call, true))
+            {
+                return;
+            }
+        }
+        else if (stmt.value)
         {
             compileExpr(stmt.value);
         }
@@ -378,10 +647,8 @@ namespace Tail
         loopStack.back().continuePatches.push_back(jump);
     }
 
-    void Compiler::compileFunction(const FunctionStmt &stmt, const std::string &sourceFileName)
+    std::string Compiler::qualifiedFunctionName(const FunctionStmt &stmt, const std::string &sourceFileName)
     {
-        uint32_t funcAddr = bytecode.code.size();
-
         std::string functionName = stmt.name;
 
         if (!sourceFileName.empty() && stmt.name != "Main")
@@ -393,11 +660,29 @@ namespace Tail
                       << " → " << functionName << std::endl;
         }
 
+        return functionName;
+    }
+
+    void Compiler::compileFunction(const FunctionStmt &stmt, const std::string &sourceFileName)
+    {
+        if (options.bytecodeVersion == TVM::BYTECODE_VERSION_REGISTER)
+        {
+            compileRegFunction(stmt, sourceFileName);
+            return;
+        }
+
+        uint32_t funcAddr = bytecode.code.size();
+
+        std::string functionName = qualifiedFunctionName(stmt, sourceFileName);
+
         functionAddrs[functionName] = funcAddr;
 
+        functionBodies[functionName] = &stmt;
+
         if (stmt.name != "Main")
         {
             functionAddrs[stmt.name] = funcAddr;
+            functionBodies[stmt.name] = &stmt;
         }
 
         std::cout << "DEBUG: Compiling function " << functionName
@@ -423,6 +708,14 @@ namespace Tail
         }
 
         contextStack.push_back(funcCtx);
+        stackDepth = 0;
+        maxStackDepth = 0;
+        inlineLocals = 0;
+
+        TypeInference enclosingTypes = types;
+        types.analyze(stmt, provenParamTypes(stmt));
+        auto enclosingUnchecked = std::move(uncheckedIndexes);
+        uncheckedIndexes.clear();
 
         for (const auto &bodyStmt : stmt.body)
         {
@@ -431,6 +724,7 @@ namespace Tail
 
         if (bytecode.code.empty() ||
             (bytecode.code.back().opcode != TVM::OP_RET &&
+             bytecode.code.back().opcode != TVM::OP_TAILCALL &&
              bytecode.code.back().opcode != TVM::OP_HALT))
         {
             std::cout << "DEBUG: Adding implicit return for function " << functionName << std::endl;
@@ -439,12 +733,15 @@ namespace Tail
         }
 
         contextStack.pop_back();
+        types = enclosingTypes;
+        uncheckedIndexes = std::move(enclosingUnchecked);
 
         TVM::FunctionInfo info;
         info.name = functionName;
         info.address = funcAddr;
         info.arity = stmt.parameters.size();
-        info.locals = countingCtx.nextLocal;
+        info.locals = std::max(countingCtx.nextLocal, inlineLocals);
+        info.maxStack = maxStackDepth;
         bytecode.functions.push_back(info);
 
         std::cout << "DEBUG: Function " << functionName << " compiled, size: "
@@ -458,7 +755,7 @@ namespace Tail
     {
         for (const auto &stmt : stmts)
         {
-            if (auto varDecl = std::dynamic_pointer_cast<VarDeclStmt>(stmt))
+            if (std::dynamic_pointer_cast<VarDeclStmt>(stmt) || std::dynamic_pointer_cast<ArrayDeclStmt>(stmt))
             {
                 ctx.nextLocal++;
             }
@@ -492,7 +789,8 @@ namespace Tail
         }
     }
 
-    void Compiler::compileArrayDecl(const ArrayDeclStmt &stmt)
+    // Array type of a declaration, which takes a size or an initializer
+    TVM::ValueType Compiler::declaredArrayType(const ArrayDeclStmt &stmt) const
     {
         TVM::ValueType elemType;
         if (stmt.type == "int")
@@ -504,10 +802,20 @@ namespace Tail
         else
             throw std::runtime_error("Unsupported array type: " + stmt.type);
 
-        if (stmt.size)
+        if (stmt.size && stmt.initializer)
+        {
+            throw std::runtime_error("Array " + stmt.name + " takes a size or an initializer, not both");
+        }
+        return elemType;
+    }
+
+    void Compiler::compileArrayDecl(const ArrayDeclStmt &stmt)
+    {
+        TVM::ValueType elemType = declaredArrayType(stmt);
+
+        if (auto literal = std::dynamic_pointer_cast<ArrayExpr>(stmt.initializer))
         {
-            compileExpr(stmt.size);
-            compileNewArray(elemType, 0);
+            compileArray(*literal, elemType);
         }
         else if (stmt.initializer)
         {
@@ -515,12 +823,20 @@ namespace Tail
         }
         else
         {
-
-            compileNewArray(elemType, 0);
+            if (stmt.size)
+            {
+                compileExpr(stmt.size);
+            }
+            else
+            {
+                emitPushInt(0);
+            }
+            compileNewArray(elemType);
         }
 
         uint32_t localIdx = currentContext().addLocal(stmt.name);
         emit(TVM::OP_STORE, localIdx);
+        emit(TVM::OP_POP);
     }
 
     void Compiler::compileLiteral(const LiteralExpr &expr)
@@ -556,7 +872,7 @@ namespace Tail
         uint32_t idx = resolveLocal(expr.name);
         if (idx != UINT32_MAX)
         {
-            emit(TVM::OP_LOAD, idx);
+            emit(types.appendTarget(expr.name) ? TVM::OP_LOAD_STR : TVM::OP_LOAD, idx);
         }
         else
         {
@@ -574,21 +890,55 @@ namespace Tail
 
     void Compiler::compileBinary(const BinaryExpr &expr)
     {
+        if (expr.op == "=" && std::dynamic_pointer_cast<IndexExpr>(expr.left))
+        {
+            // STORE_INDEX leaves the value, like STORE
+            auto target = std::static_pointer_cast<IndexExpr>(expr.left);
+            uint32_t unchecked = uncheckedIndexOperand(*target);
+            if (unchecked != UINT32_MAX)
+            {
+                compileExpr(expr.right);
+                emit(TVM::OP_STORE_INDEX_UNCHECKED, unchecked);
+                return;
+            }
+            compileExpr(target->array);
+            compileExpr(target->index);
+            compileExpr(expr.right);
+            emit(TVM::OP_STORE_INDEX);
+            return;
+        }
+
+        if (expr.op == "=")
+        {
+            auto target = std::dynamic_pointer_cast<VariableExpr>(expr.left);
+            if (!target)
+            {
+                throw std::runtime_error("Invalid assignment target");
+            }
+            // STORE leaves the value on the stack, so the assignment is
+            // itself an expression; ExprStmt pops it as usual.
+            compileAssign(AssignStmt(target->name, expr.right));
+            return;
+        }
+
         compileExpr(expr.left);
         compileExpr(expr.right);
 
+        TVM::OpCode op;
         if (expr.op == "+")
-            emit(TVM::OP_ADD);
+            op = TVM::OP_ADD;
         else if (expr.op == "-")
-            emit(TVM::OP_SUB);
+            op = TVM::OP_SUB;
         else if (expr.op == "*")
-            emit(TVM::OP_MUL);
+            op = TVM::OP_MUL;
         else if (expr.op == "/")
-            emit(TVM::OP_DIV);
+            op = TVM::OP_DIV;
         else if (expr.op == "%")
-            emit(TVM::OP_MOD);
+            op = TVM::OP_MOD;
         else
             throw std::runtime_error("Unknown binary operator: " + expr.op);
+
+        emit(specialiseOpcode(op, expr.left, expr.right));
     }
 
     void Compiler::compileCompare(const CompareExpr &expr)
@@ -596,20 +946,78 @@ namespace Tail
         compileExpr(expr.left);
         compileExpr(expr.right);
 
+        TVM::OpCode op;
         if (expr.op == "==")
-            emit(TVM::OP_EQ);
+            op = TVM::OP_EQ;
         else if (expr.op == "!=")
-            emit(TVM::OP_NEQ);
+            op = TVM::OP_NEQ;
         else if (expr.op == "<")
-            emit(TVM::OP_LT);
+            op = TVM::OP_LT;
         else if (expr.op == "<=")
-            emit(TVM::OP_LTE);
+            op = TVM::OP_LTE;
         else if (expr.op == ">")
-            emit(TVM::OP_GT);
+            op = TVM::OP_GT;
         else if (expr.op == ">=")
-            emit(TVM::OP_GTE);
+            op = TVM::OP_GTE;
         else
             throw std::runtime_error("Unknown comparison operator: " + expr.op);
+
+        emit(specialiseOpcode(op, expr.left, expr.right));
+    }
+
+    // Picks the type-specialised form of a binary opcode when both operand
+    // types are known, or returns the generic opcode.
+    TVM::OpCode Compiler::specialiseOpcode(TVM::OpCode op, const std::shared_ptr<Expr> &left,
+                                           const std::shared_ptr<Expr> &right) const
+    {
+        StaticType leftType = types.exprType(left);
+        StaticType rightType = types.exprType(right);
+
+        if (leftType == StaticType::Int && rightType == StaticType::Int)
+        {
+            switch (op)
+            {
+            case TVM::OP_ADD: return TVM::OP_ADD_INT;
+            case TVM::OP_SUB: return TVM::OP_SUB_INT;
+            case TVM::OP_MUL: return TVM::OP_MUL_INT;
+            case TVM::OP_DIV: return TVM::OP_DIV_INT;
+            case TVM::OP_MOD: return TVM::OP_MOD_INT;
+            case TVM::OP_LT: return TVM::OP_LT_INT;
+            case TVM::OP_LTE: return TVM::OP_LTE_INT;
+            case TVM::OP_GT: return TVM::OP_GT_INT;
+            case TVM::OP_GTE: return TVM::OP_GTE_INT;
+            case TVM::OP_EQ: return TVM::OP_EQ_INT;
+            case TVM::OP_NEQ: return TVM::OP_NEQ_INT;
+            default: return op;
+            }
+        }
+        if (leftType == StaticType::Float && rightType == StaticType::Float)
+        {
+            switch (op)
+            {
+            case TVM::OP_ADD: return TVM::OP_ADD_FLOAT;
+            case TVM::OP_SUB: return TVM::OP_SUB_FLOAT;
+            case TVM::OP_MUL: return TVM::OP_MUL_FLOAT;
+            case TVM::OP_DIV: return TVM::OP_DIV_FLOAT;
+            case TVM::OP_LT: return TVM::OP_LT_FLOAT;
+            case TVM::OP_LTE: return TVM::OP_LTE_FLOAT;
+            case TVM::OP_GT: return TVM::OP_GT_FLOAT;
+            case TVM::OP_GTE: return TVM::OP_GTE_FLOAT;
+            case TVM::OP_EQ: return TVM::OP_EQ_FLOAT;
+            case TVM::OP_NEQ: return TVM::OP_NEQ_FLOAT;
+            default: return op;
+            }
+        }
+        if (leftType == StaticType::Str && rightType == StaticType::Str)
+        {
+            switch (op)
+            {
+            case TVM::OP_EQ: return TVM::OP_EQ_STR;
+            case TVM::OP_NEQ: return TVM::OP_NEQ_STR;
+            default: return op;
+            }
+        }
+        return op;
     }
 
     void Compiler::compileLogical(const LogicalExpr &expr)
@@ -619,19 +1027,27 @@ namespace Tail
             compileExpr(expr.right);
             emit(TVM::OP_NOT);
         }
-        else if (expr.op == "&&")
+        else if (expr.op == "-")
         {
-            compileExpr(expr.left);
-            uint32_t jump = emitJump(TVM::OP_JMP_IFNOT);
             compileExpr(expr.right);
-            patchJump(jump);
+            emit(TVM::OP_NEG);
         }
-        else if (expr.op == "||")
+        else if (expr.op == "&&" || expr.op == "||")
         {
+            // Short-circuit to a bool. Both paths leave exactly one value,
+            // which the operand-depth bookkeeping relies on.
+            TVM::OpCode shortCircuit = expr.op == "&&" ? TVM::OP_JMP_IFNOT : TVM::OP_JMP_IF;
             compileExpr(expr.left);
-            uint32_t jump = emitJump(TVM::OP_JMP_IF);
+            uint32_t leftJump = emitJump(shortCircuit);
             compileExpr(expr.right);
-            patchJump(jump);
+            uint32_t rightJump = emitJump(shortCircuit);
+            emitPushBool(expr.op == "&&");
+            uint32_t endJump = emitJump(TVM::OP_JMP);
+            patchJump(leftJump);
+            patchJump(rightJump);
+            adjustStack(-1); // The short-circuit path joins without that push
+            emitPushBool(expr.op != "&&");
+            patchJump(endJump);
         }
         else
         {
@@ -639,11 +1055,19 @@ namespace Tail
         }
     }
 
-    void Compiler::compileCall(const CallExpr &expr)
+    // With `tail` set (the value of a `return`), a call to a user function
+    // is emitted as OP_TAILCALL and true is returned; the caller then emits
+    // no RET. Inlined and native calls leave their result on the stack.
+    bool Compiler::compileCall(const CallExpr &expr, bool tail)
     {
         std::cout << "DEBUG compileCall: " << expr.className << "." << expr.methodName
                   << " (isNative: " << expr.isNative << ")" << std::endl;
 
+        if (!expr.isNative && compileInlineCall(expr))
+        {
+            return false;
+        }
+
         for (const auto &arg : expr.args)
         {
             compileExpr(arg);
@@ -665,11 +1089,21 @@ namespace Tail
             {
                 emit(TVM::OP_READ);
             }
+            else if (fullName == "Array.length")
+            {
+                if (expr.args.size() != 1)
+                {
+                    throw std::runtime_error("Array.length takes 1 argument");
+                }
+                emit(TVM::OP_ARRAY_LEN);
+            }
             else
             {
                 uint32_t idx = addNativeImport(fullName);
+                adjustStack(-static_cast<int32_t>(expr.args.size()));
                 emit(TVM::OP_CALL_NATIVE, idx);
             }
+            return false;
         }
         else
         {
@@ -690,17 +1124,15 @@ namespace Tail
             std::cout << "  Looking for function: " << functionToCall << std::endl;
 
             auto it = functionAddrs.find(functionToCall);
-            if (it != functionAddrs.end())
+            if (it == functionAddrs.end())
             {
-                emit(TVM::OP_CALL, it->second);
-                return;
+                it = functionAddrs.find(expr.methodName);
             }
-
-            it = functionAddrs.find(expr.methodName);
             if (it != functionAddrs.end())
             {
-                emit(TVM::OP_CALL, it->second);
-                return;
+                adjustStack(-static_cast<int32_t>(expr.args.size()));
+                emit(tail ? TVM::OP_TAILCALL : TVM::OP_CALL, it->second);
+                return tail;
             }
 
             std::cerr << "ERROR: Function '" << functionToCall << "' not found!" << std::endl;
@@ -714,25 +1146,94 @@ namespace Tail
         }
     }
 
-    void Compiler::compileArray(const ArrayExpr &expr)
+    // Type of an array literal outside a declaration, from its first element
+    TVM::ValueType Compiler::literalArrayType(const ArrayExpr &expr) const
     {
-
         if (expr.elements.empty())
         {
             throw std::runtime_error("Empty array needs type specification");
         }
 
-        for (const auto &elem : expr.elements)
+        switch (types.exprType(expr.elements[0]))
         {
-            compileExpr(elem);
+        case StaticType::Float:
+            return TVM::TYPE_ARRAY_FLOAT;
+        case StaticType::Str:
+            return TVM::TYPE_ARRAY_STRING;
+        default:
+            return TVM::TYPE_ARRAY_INT;
         }
+    }
 
-        emitPushInt(expr.elements.size());
-        emit(TVM::OP_NEW_ARRAY);
+    // Literal elements go into the pool entry NEW_ARRAY copies; the others
+    // are computed and stored one by one after it.
+    void Compiler::compileArray(const ArrayExpr &expr, TVM::ValueType arrayType)
+    {
+        std::vector<size_t> computed;
+        uint32_t constant = arrayConstant(expr, arrayType, computed);
+        emitPushInt(static_cast<int64_t>(expr.elements.size()));
+        emit(TVM::OP_NEW_ARRAY, constant);
+
+        for (size_t i : computed)
+        {
+            emit(TVM::OP_DUP);
+            emitPushInt(static_cast<int64_t>(i));
+            compileExpr(expr.elements[i]);
+            emit(TVM::OP_STORE_INDEX);
+            emit(TVM::OP_POP);
+        }
+    }
+
+    // Pool entry holding a literal's constant elements, with zeros (or "")
+    // where the others go; their positions are added to `computed`
+    uint32_t Compiler::arrayConstant(const ArrayExpr &expr, TVM::ValueType arrayType, std::vector<size_t> &computed)
+    {
+        std::vector<int64_t> ints;
+        std::vector<double> floats;
+        std::vector<std::string> strs;
+
+        for (size_t i = 0; i < expr.elements.size(); i++)
+        {
+            auto literal = std::dynamic_pointer_cast<LiteralExpr>(expr.elements[i]);
+            bool isConstant = false;
+            if (arrayType == TVM::TYPE_ARRAY_INT)
+            {
+                isConstant = literal && literal->value.isInt();
+                ints.push_back(isConstant ? literal->value.asInt() : 0);
+            }
+            else if (arrayType == TVM::TYPE_ARRAY_FLOAT)
+            {
+                isConstant = literal && (literal->value.isFloat() || literal->value.isInt());
+                floats.push_back(!isConstant ? 0.0
+                                 : literal->value.isFloat() ? literal->value.asFloat()
+                                                            : static_cast<double>(literal->value.asInt()));
+            }
+            else
+            {
+                isConstant = literal && literal->value.isStr();
+                strs.push_back(isConstant ? literal->value.asStr() : "");
+            }
+            if (!isConstant)
+            {
+                computed.push_back(i);
+            }
+        }
+
+        if (arrayType == TVM::TYPE_ARRAY_INT)
+            return addConstantArray(ints);
+        if (arrayType == TVM::TYPE_ARRAY_FLOAT)
+            return addConstantArray(floats);
+        return addConstantArray(strs);
     }
 
     void Compiler::compileIndex(const IndexExpr &expr)
     {
+        uint32_t unchecked = uncheckedIndexOperand(expr);
+        if (unchecked != UINT32_MAX)
+        {
+            emit(TVM::OP_LOAD_INDEX_UNCHECKED, unchecked);
+            return;
+        }
         compileExpr(expr.array);
         compileExpr(expr.index);
         emit(TVM::OP_LOAD_INDEX);
@@ -741,6 +1242,20 @@ namespace Tail
     void Compiler::emit(TVM::OpCode op, uint32_t operand)
     {
         bytecode.code.push_back(TVM::Instruction(op, operand));
+        adjustStack(TVM::stackEffect(op));
+    }
+
+    // Code is emitted in structured order and every join point is reached
+    // with the same depth, so a running count along the emission order sees
+    // every depth the function can reach at run time.
+    void Compiler::adjustStack(int32_t delta)
+    {
+        if (delta < 0 && static_cast<uint32_t>(-delta) > stackDepth)
+        {
+            throw std::runtime_error("Internal error: operand stack underflow while compiling");
+        }
+        stackDepth += delta;
+        maxStackDepth = std::max(maxStackDepth, stackDepth);
     }
 
     void Compiler::emitPushInt(int64_t value)
@@ -813,10 +1328,12 @@ namespace Tail
 
     uint32_t Compiler::addConstantFloat(double value)
     {
+        // Compare bit patterns: 0.0 == -0.0, yet they print differently and
+        // must not share a slot (NaN, unequal to itself, then dedups too)
         for (uint32_t i = 0; i < bytecode.constants.size(); i++)
         {
             if (bytecode.constants[i].type == TVM::TYPE_FLOAT &&
-                bytecode.constants[i].as.floatVal == value)
+                std::memcmp(&bytecode.constants[i].as.floatVal, &value, sizeof value) == 0)
             {
                 return i;
             }
@@ -872,6 +1389,47 @@ namespace Tail
         return constIdx;
     }
 
+    // Array constants name an entry of the matching pool; equal entries and
+    // their constants are shared
+    template <typename T>
+    static uint32_t addArrayConstant(std::vector<TVM::Constant> &constants, std::vector<std::vector<T>> &pool,
+                                     TVM::ValueType type, const std::vector<T> &arr)
+    {
+        uint32_t poolIdx = static_cast<uint32_t>(std::find(pool.begin(), pool.end(), arr) - pool.begin());
+        if (poolIdx == pool.size())
+        {
+            pool.push_back(arr);
+        }
+
+        for (uint32_t i = 0; i < constants.size(); i++)
+        {
+            if (constants[i].type == type && constants[i].as.arrayIdx == poolIdx)
+            {
+                return i;
+            }
+        }
+        TVM::Constant cst;
+        cst.type = type;
+        cst.as.arrayIdx = poolIdx;
+        constants.push_back(cst);
+        return static_cast<uint32_t>(constants.size() - 1);
+    }
+
+    uint32_t Compiler::addConstantArray(const std::vector<int64_t> &arr)
+    {
+        return addArrayConstant(bytecode.constants, bytecode.intArrays, TVM::TYPE_ARRAY_INT, arr);
+    }
+
+    uint32_t Compiler::addConstantArray(const std::vector<double> &arr)
+    {
+        return addArrayConstant(bytecode.constants, bytecode.floatArrays, TVM::TYPE_ARRAY_FLOAT, arr);
+    }
+
+    uint32_t Compiler::addConstantArray(const std::vector<std::string> &arr)
+    {
+        return addArrayConstant(bytecode.constants, bytecode.stringArrays, TVM::TYPE_ARRAY_STRING, arr);
+    }
+
     uint32_t Compiler::resolveLocal(const std::string &name)
     {
         for (int i = contextStack.size() - 1; i >= 0; i--)
@@ -881,6 +1439,10 @@ namespace Tail
             {
                 return it->second;
             }
+            if (contextStack[i].isolated)
+            {
+                break;
+            }
         }
         return UINT32_MAX;
     }
@@ -909,14 +1471,19 @@ namespace Tail
         return idx;
     }
 
-    void Compiler::compileNewArray(TVM::ValueType elemType, uint32_t size)
+    // The length is on the stack; the array starts zero-filled
+    void Compiler::compileNewArray(TVM::ValueType arrayType)
     {
-        TVM::Constant cst;
-        cst.type = elemType;
-        cst.as.arrayIdx = size;
-        uint32_t constIdx = bytecode.constants.size();
-        bytecode.constants.push_back(cst);
-        emit(TVM::OP_NEW_ARRAY, constIdx);
+        emit(TVM::OP_NEW_ARRAY, emptyArrayConstant(arrayType));
+    }
+
+    uint32_t Compiler::emptyArrayConstant(TVM::ValueType arrayType)
+    {
+        if (arrayType == TVM::TYPE_ARRAY_INT)
+            return addConstantArray(std::vector<int64_t>());
+        if (arrayType == TVM::TYPE_ARRAY_FLOAT)
+            return addConstantArray(std::vector<double>());
+        return addConstantArray(std::vector<std::string>());
     }
 
 }
\ No newline at end of file
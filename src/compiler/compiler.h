@@ -1,6 +1,7 @@
 #pragma once
 #include "../shared/bytecode.h"
 #include "../shared/ast.h"
+#include "types.h"
 #include <memory>
 #include <map>
 #include <vector>
@@ -9,10 +10,31 @@
 namespace Tail
 {
 
+    struct CompilerOptions
+    {
+        // Bytecode format to emit: TVM::BYTECODE_VERSION_STACK (default) or
+        // TVM::BYTECODE_VERSION_REGISTER
+        uint16_t bytecodeVersion = TVM::BYTECODE_VERSION_STACK;
+
+        // Fuse common stack-code sequences into superinstructions
+        bool superinstructions = true;
+
+        // Optimization level (tailc -O0/-O1/-O2): 0 none, 1 constant folding
+        // and dead-branch removal on the AST plus dead-code elimination on
+        // stack bytecode, 2 also algebraic simplification on inferred types.
+        // See AstOptimizer and DeadCodeEliminator.
+        int optimizationLevel = 2;
+
+        // At -O1 and above, calls to non-recursive user functions whose body
+        // has at most this many AST nodes are inlined into stack code
+        // (tailc --inline-threshold=N). 0 turns inlining off.
+        uint32_t inlineThreshold = 24;
+    };
+
     class Compiler
     {
     public:
-        Compiler();
+        Compiler(const CompilerOptions &options = CompilerOptions());
 
         TVM::BytecodeFile compile(const std::vector<std::shared_ptr<Stmt>> &ast);
 
@@ -41,6 +63,7 @@ namespace Tail
             uint32_t nextLocal = 0;
             uint32_t startAddr = 0;
             uint32_t paramCount = 0;
+            bool isolated = false; // An inlined body: names do not resolve past it
 
             bool hasLocal(const std::string &name) const
             {
@@ -57,18 +80,34 @@ namespace Tail
 
         struct LoopContext
         {
-            uint32_t breakAddr;    // Placeholder for break address
-            uint32_t continueAddr; // Placeholder for continue address
+            uint32_t breakAddr = 0;    // Placeholder for break address
+            uint32_t continueAddr = 0; // Placeholder for continue address
             std::vector<uint32_t> breakPatches;
             std::vector<uint32_t> continuePatches;
         };
 
         // State
+        CompilerOptions options;
         TVM::BytecodeFile bytecode;
         std::vector<FunctionContext> contextStack;
         std::vector<LoopContext> loopStack;
         std::map<std::string, uint32_t> globalMap;
         std::map<std::string, uint32_t> functionAddrs; // name -> address
+        std::map<uint32_t, uint32_t> functionArities;  // address -> arity
+        TypeInference types;                           // Current function's locals
+        ParamTypes paramTypes;                         // Whole program, see inferParamTypes()
+        uint32_t stackDepth = 0;                       // Operand depth at the emit point
+        // (array local, index local) pairs whose accesses compileFor proved
+        // in bounds, for the loop bodies being compiled
+        std::vector<std::pair<uint32_t, uint32_t>> uncheckedIndexes;
+        uint32_t maxStackDepth = 0;                    // Current function's high-water mark
+
+        // Inlining, see inliner.cpp
+        std::map<std::string, const FunctionStmt *> functionBodies; // name -> declaration
+        std::vector<const FunctionStmt *> inlineStack;             // Bodies being inlined, innermost last
+        std::vector<std::vector<uint32_t>> inlineReturns;           // Their return jumps to patch
+        uint32_t inlineLocals = 0;                                  // Slots the current function's inlined bodies use
+        std::vector<std::string> inlinedCalls;
 
         // Helpers
         FunctionContext &currentContext() { return contextStack.back(); }
@@ -81,14 +120,19 @@ namespace Tail
         void compileVarDecl(const VarDeclStmt &stmt);
         void compileAssign(const AssignStmt &stmt);
         void compileExprStmt(const ExprStmt &stmt);
+        bool compileAppend(const std::shared_ptr<Expr> &expr);
         void compileBlock(const BlockStmt &stmt);
         void compileIf(const IfStmt &stmt);
         void compileWhile(const WhileStmt &stmt);
         void compileFor(const ForStmt &stmt);
+        bool boundedIndexLoop(const ForStmt &stmt, std::string &arrayName, std::string &indexName) const;
+        uint32_t uncheckedIndexOperand(const IndexExpr &expr);
         void compileReturn(const ReturnStmt &stmt);
+        void compileInlineReturn(const ReturnStmt &stmt);
         void compileBreak(const BreakStmt &stmt);
         void compileContinue(const ContinueStmt &stmt);
         void compileArrayDecl(const ArrayDeclStmt &stmt);
+        TVM::ValueType declaredArrayType(const ArrayDeclStmt &stmt) const;
 
         // Expression compilers
         void compileLiteral(const LiteralExpr &expr);
@@ -96,12 +140,20 @@ namespace Tail
         void compileBinary(const BinaryExpr &expr);
         void compileCompare(const CompareExpr &expr);
         void compileLogical(const LogicalExpr &expr);
-        void compileCall(const CallExpr &expr);
-        void compileArray(const ArrayExpr &expr);
+        bool compileCall(const CallExpr &expr, bool tail = false);
+        const FunctionStmt *inlineCandidate(const CallExpr &expr, std::string &name) const;
+        bool compileInlineCall(const CallExpr &expr);
+        const std::vector<StaticType> &provenParamTypes(const FunctionStmt &function) const;
+        void compileArray(const ArrayExpr &expr, TVM::ValueType arrayType);
+        uint32_t arrayConstant(const ArrayExpr &expr, TVM::ValueType arrayType, std::vector<size_t> &computed);
+        TVM::ValueType literalArrayType(const ArrayExpr &expr) const;
         void compileIndex(const IndexExpr &expr);
+        TVM::OpCode specialiseOpcode(TVM::OpCode op, const std::shared_ptr<Expr> &left,
+                                     const std::shared_ptr<Expr> &right) const;
 
         // Code generation
         void emit(TVM::OpCode op, uint32_t operand = 0);
+        void adjustStack(int32_t delta);
         void emitPushInt(int64_t value);
         void emitPushFloat(double value);
         void emitPushBool(bool value);
@@ -131,9 +183,43 @@ namespace Tail
         uint32_t addNativeImport(const std::string &name);
 
         // Array support
-        void compileNewArray(TVM::ValueType elemType, uint32_t size);
+        void compileNewArray(TVM::ValueType arrayType);
+        uint32_t emptyArrayConstant(TVM::ValueType arrayType);
 
         void countLocals(const std::vector<std::shared_ptr<Stmt>> &stmts, FunctionContext &ctx);
+        std::string qualifiedFunctionName(const FunctionStmt &stmt, const std::string &sourceFileName);
+
+        // Register bytecode (version 2), see register_codegen.cpp. Locals
+        // occupy the low registers; temporaries are allocated stack-like
+        // above them.
+        uint32_t regTop = 0; // First free temporary register
+        uint32_t regMax = 0; // Register high-water mark of the current function
+
+        void compileRegFunction(const FunctionStmt &stmt, const std::string &sourceFileName);
+        void compileRegStmt(const std::shared_ptr<Stmt> &stmt);
+        void compileRegVarDecl(const VarDeclStmt &stmt);
+        void compileRegArrayDecl(const ArrayDeclStmt &stmt);
+        void compileRegBlock(const BlockStmt &stmt);
+        void compileRegIf(const IfStmt &stmt);
+        void compileRegWhile(const WhileStmt &stmt);
+        void compileRegFor(const ForStmt &stmt);
+        void compileRegReturn(const ReturnStmt &stmt);
+        uint32_t compileRegExpr(const std::shared_ptr<Expr> &expr, int32_t target = -1);
+        uint32_t compileRegAssign(const BinaryExpr &expr, int32_t target);
+        bool compileRegAppend(const std::shared_ptr<Expr> &expr);
+        uint32_t compileRegCall(const CallExpr &expr, int32_t target, bool tail = false);
+        uint32_t compileRegLogical(const LogicalExpr &expr, int32_t target);
+        uint32_t compileRegArray(const ArrayExpr &expr, TVM::ValueType arrayType, int32_t target);
+        uint32_t compileRegIndex(const IndexExpr &expr, int32_t target);
+        uint32_t compileRegIndexAssign(const IndexExpr &element, const std::shared_ptr<Expr> &value, int32_t target);
+        uint32_t compileRegOperandRK(const std::shared_ptr<Expr> &expr, uint32_t constantBit, uint32_t maxConstant);
+        uint32_t compileRegBranchIfFalse(const std::shared_ptr<Expr> &cond);
+
+        uint32_t allocReg();
+        uint32_t emitReg(TVM::RegOpCode op, uint32_t a, uint32_t b = 0, uint32_t c = 0);
+        void patchRegJump(uint32_t jumpAddr);
+        void patchRegJumps(const std::vector<uint32_t> &patches, uint32_t target);
+        uint32_t literalConstant(const LiteralExpr &expr);
     };
 
 } // namespace Tail
\ No newline at end of file
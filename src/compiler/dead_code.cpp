@@ -0,0 +1,303 @@
+#include "dead_code.h"
+#include <algorithm>
+
+namespace Tail
+{
+
+    static bool isJump(TVM::OpCode op)
+    {
+        return op == TVM::OP_JMP || op == TVM::OP_JMP_IF || op == TVM::OP_JMP_IFNOT;
+    }
+
+    // Leaves the function: nothing after it in the same block runs
+    static bool isExit(TVM::OpCode op)
+    {
+        return op == TVM::OP_RET || op == TVM::OP_TAILCALL || op == TVM::OP_HALT;
+    }
+
+    // Pushes a value and does nothing else, so popping it right away makes
+    // the pair a no-op
+    static bool isPurePush(TVM::OpCode op)
+    {
+        return op == TVM::OP_PUSH || op == TVM::OP_LOAD || op == TVM::OP_LOAD_STR || op == TVM::OP_LOAD_GLOBAL ||
+               op == TVM::OP_DUP;
+    }
+
+    DeadCodeEliminator::DeadCodeEliminator(TVM::BytecodeFile &bc) : bytecode(bc)
+    {
+    }
+
+    void DeadCodeEliminator::run()
+    {
+        auto &code = bytecode.code;
+        removed.assign(code.size(), false);
+
+        std::vector<uint32_t> starts;
+        for (const auto &info : bytecode.functions)
+        {
+            starts.push_back(info.address);
+        }
+        std::sort(starts.begin(), starts.end());
+
+        // A function runs up to the next one's entry; control never crosses
+        // between them except through CALL and RET.
+        for (size_t i = 0; i < starts.size(); i++)
+        {
+            uint32_t start = starts[i];
+            uint32_t end = i + 1 < starts.size() ? starts[i + 1] : static_cast<uint32_t>(code.size());
+            if (start >= end)
+            {
+                continue;
+            }
+
+            threadJumps(start, end);
+            std::vector<BasicBlock> blocks = buildBlocks(start, end);
+            removeUnreachable(blocks, end);
+            removePushPopPairs(blocks);
+            removeRedundantJumps(start, end);
+        }
+
+        compact();
+    }
+
+    std::vector<DeadCodeEliminator::BasicBlock> DeadCodeEliminator::buildBlocks(uint32_t start, uint32_t end) const
+    {
+        const auto &code = bytecode.code;
+        auto inRange = [&](uint32_t target) { return target >= start && target < end; };
+
+        std::vector<bool> leader(end - start, false);
+        leader[0] = true;
+        for (uint32_t pc = start; pc < end; pc++)
+        {
+            TVM::OpCode op = code[pc].opcode;
+            bool endsBlock = isJump(op) || isExit(op);
+            if (isJump(op) && inRange(code[pc].operand))
+            {
+                leader[code[pc].operand - start] = true;
+            }
+            if (endsBlock && pc + 1 < end)
+            {
+                leader[pc + 1 - start] = true;
+            }
+        }
+
+        std::vector<BasicBlock> blocks;
+        std::vector<uint32_t> blockAt(end - start, 0);
+        for (uint32_t pc = start; pc < end; pc++)
+        {
+            if (leader[pc - start])
+            {
+                blocks.push_back(BasicBlock{pc, pc + 1, {}});
+            }
+            else
+            {
+                blocks.back().end = pc + 1;
+            }
+            blockAt[pc - start] = static_cast<uint32_t>(blocks.size() - 1);
+        }
+
+        for (auto &block : blocks)
+        {
+            const TVM::Instruction &last = code[block.end - 1];
+            if (isJump(last.opcode) && inRange(last.operand))
+            {
+                block.successors.push_back(blockAt[last.operand - start]);
+            }
+            bool fallsThrough = last.opcode != TVM::OP_JMP && !isExit(last.opcode);
+            if (fallsThrough && block.end < end)
+            {
+                block.successors.push_back(blockAt[block.end - start]);
+            }
+        }
+        return blocks;
+    }
+
+    // JMP, JMP_IF or JMP_IFNOT to a JMP goes straight to where that one
+    // leads. The hop limit stops at loops made only of jumps.
+    void DeadCodeEliminator::threadJumps(uint32_t start, uint32_t end)
+    {
+        auto &code = bytecode.code;
+        for (uint32_t pc = start; pc < end; pc++)
+        {
+            if (!isJump(code[pc].opcode))
+            {
+                continue;
+            }
+            uint32_t target = code[pc].operand;
+            for (uint32_t hops = 0; hops < end - start && target >= start && target < end &&
+                                    code[target].opcode == TVM::OP_JMP && code[target].operand != target;
+                 hops++)
+            {
+                target = code[target].operand;
+            }
+            if (target != code[pc].operand)
+            {
+                code[pc].operand = target;
+                stats.threadedJumps++;
+            }
+        }
+    }
+
+    void DeadCodeEliminator::removeUnreachable(const std::vector<BasicBlock> &blocks, uint32_t end)
+    {
+        const auto &code = bytecode.code;
+        std::vector<bool> reached(blocks.size(), false);
+        std::vector<uint32_t> worklist = {0};
+        reached[0] = true;
+        while (!worklist.empty())
+        {
+            uint32_t index = worklist.back();
+            worklist.pop_back();
+            for (uint32_t successor : blocks[index].successors)
+            {
+                if (!reached[successor])
+                {
+                    reached[successor] = true;
+                    worklist.push_back(successor);
+                }
+            }
+        }
+
+        std::vector<bool> keep(code.size(), false);
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            if (reached[i])
+            {
+                keepBoundedLoopTail(blocks[i].end - 1, end, keep);
+            }
+        }
+
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            for (uint32_t pc = blocks[i].start; pc < blocks[i].end; pc++)
+            {
+                if (!reached[i] && !keep[pc])
+                {
+                    removed[pc] = true;
+                    stats.unreachable++;
+                }
+            }
+        }
+    }
+
+    // The verifier only accepts unchecked index ops inside a loop that ends
+    // by stepping its index and jumping back to the length guard (see
+    // BytecodeVerifier::verifyBoundedLoop). When the body never falls
+    // through - it always returns or breaks - that tail is dead but has to
+    // stay.
+    void DeadCodeEliminator::keepBoundedLoopTail(uint32_t guardJump, uint32_t end, std::vector<bool> &keep) const
+    {
+        const auto &code = bytecode.code;
+        if (code[guardJump].opcode != TVM::OP_JMP_IFNOT || guardJump < 4 ||
+            code[guardJump - 2].opcode != TVM::OP_ARRAY_LEN)
+        {
+            return;
+        }
+        uint32_t header = guardJump - 4;
+        uint32_t exit = code[guardJump].operand;
+        if (exit < guardJump + 7 || exit > end || code[exit - 1].opcode != TVM::OP_JMP || code[exit - 1].operand != header)
+        {
+            return;
+        }
+        for (uint32_t pc = exit - 6; pc < exit; pc++)
+        {
+            keep[pc] = true;
+        }
+    }
+
+    // A pure push directly followed by POP, within one block. Removing a
+    // pair can expose another around it, as in PUSH a; PUSH b; POP; POP.
+    void DeadCodeEliminator::removePushPopPairs(const std::vector<BasicBlock> &blocks)
+    {
+        const auto &code = bytecode.code;
+        for (const auto &block : blocks)
+        {
+            std::vector<uint32_t> kept;
+            for (uint32_t pc = block.start; pc < block.end; pc++)
+            {
+                if (removed[pc])
+                {
+                    continue;
+                }
+                if (code[pc].opcode == TVM::OP_POP && !kept.empty() && isPurePush(code[kept.back()].opcode))
+                {
+                    removed[kept.back()] = true;
+                    removed[pc] = true;
+                    kept.pop_back();
+                    stats.pushPopPairs++;
+                }
+                else
+                {
+                    kept.push_back(pc);
+                }
+            }
+        }
+    }
+
+    // A JMP whose target is the next instruction left once removed code is
+    // gone, such as the jump over an else branch that was unreachable.
+    // Scanning backwards lets a removal expose one in front of it.
+    void DeadCodeEliminator::removeRedundantJumps(uint32_t start, uint32_t end)
+    {
+        const auto &code = bytecode.code;
+        auto nextKept = [&](uint32_t pc)
+        {
+            while (pc < end && removed[pc])
+            {
+                pc++;
+            }
+            return pc;
+        };
+
+        for (uint32_t pc = end; pc-- > start;)
+        {
+            if (!removed[pc] && code[pc].opcode == TVM::OP_JMP && code[pc].operand >= start &&
+                code[pc].operand <= end && nextKept(code[pc].operand) == nextKept(pc + 1))
+            {
+                removed[pc] = true;
+                stats.redundantJumps++;
+            }
+        }
+    }
+
+    // Drops the removed instructions. An address maps to the first kept
+    // instruction at or after it; a jump to removed code only ever lands on
+    // no-ops, so that is where it would have ended up anyway.
+    void DeadCodeEliminator::compact()
+    {
+        auto &code = bytecode.code;
+        std::vector<uint32_t> newAddress(code.size() + 1, 0);
+        for (size_t pc = 0; pc < code.size(); pc++)
+        {
+            newAddress[pc + 1] = newAddress[pc] + (removed[pc] ? 0 : 1);
+        }
+        auto relocate = [&](uint32_t address)
+        {
+            return address < newAddress.size() ? newAddress[address] : address;
+        };
+
+        std::vector<TVM::Instruction> compacted;
+        compacted.reserve(newAddress.back());
+        for (size_t pc = 0; pc < code.size(); pc++)
+        {
+            if (removed[pc])
+            {
+                continue;
+            }
+            TVM::Instruction instr = code[pc];
+            if (isJump(instr.opcode) || instr.opcode == TVM::OP_CALL || instr.opcode == TVM::OP_TAILCALL)
+            {
+                instr.operand = relocate(instr.operand);
+            }
+            compacted.push_back(instr);
+        }
+        code = std::move(compacted);
+
+        for (auto &info : bytecode.functions)
+        {
+            info.address = relocate(info.address);
+        }
+        removed.clear();
+    }
+
+} // namespace Tail
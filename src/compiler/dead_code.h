@@ -0,0 +1,57 @@
+#pragma once
+#include "../shared/bytecode.h"
+#include <cstdint>
+#include <vector>
+
+namespace Tail
+{
+
+    // Cleans up finished stack code before the peephole pass: threads jumps
+    // whose target is another JMP, removes instructions no path from the
+    // function's entry reaches (code after a RET or TAILCALL, the implicit
+    // return behind an if/else that returns on both arms, ...), drops value
+    // pushes that are popped straight away and JMPs to the next instruction.
+    // Addresses in jumps, calls and the function table are rewritten to
+    // match.
+    class DeadCodeEliminator
+    {
+    public:
+        struct Stats
+        {
+            uint32_t threadedJumps = 0;
+            uint32_t unreachable = 0;
+            uint32_t pushPopPairs = 0;
+            uint32_t redundantJumps = 0;
+
+            uint32_t total() const { return threadedJumps + unreachable + pushPopPairs + redundantJumps; }
+        };
+
+        explicit DeadCodeEliminator(TVM::BytecodeFile &bytecode);
+
+        void run();
+        const Stats &getStats() const { return stats; }
+
+    private:
+        // Instructions [start, end) entered only at start and left only
+        // from end - 1. Successors are block indices.
+        struct BasicBlock
+        {
+            uint32_t start;
+            uint32_t end;
+            std::vector<uint32_t> successors;
+        };
+
+        TVM::BytecodeFile &bytecode;
+        Stats stats;
+        std::vector<bool> removed; // By instruction
+
+        std::vector<BasicBlock> buildBlocks(uint32_t start, uint32_t end) const;
+        void threadJumps(uint32_t start, uint32_t end);
+        void removeUnreachable(const std::vector<BasicBlock> &blocks, uint32_t end);
+        void removePushPopPairs(const std::vector<BasicBlock> &blocks);
+        void removeRedundantJumps(uint32_t start, uint32_t end);
+        void keepBoundedLoopTail(uint32_t guardJump, uint32_t end, std::vector<bool> &keep) const;
+        void compact();
+    };
+
+} // namespace Tail
@@ -0,0 +1,258 @@
+#include "compiler.h"
+#include <algorithm>
+#include <iostream>
+
+// Inlining of small user functions into their stack-code callers. The
+// callee's parameters and locals get fresh slots above the caller's live
+// locals, the arguments are stored into them, and each `return` jumps to
+// the end of the inlined body with its value on the stack. The jumps and
+// the nil pushed for falling off the end are cleaned up by dead-code
+// elimination, which runs at the same optimization levels.
+
+namespace Tail
+{
+
+    namespace
+    {
+        // Body size in AST nodes. Sets `blocked` for bodies that cannot be
+        // inlined: ones calling `self` and nested function declarations.
+        size_t exprCost(const std::shared_ptr<Expr> &expr, const std::string &self, bool &blocked)
+        {
+            if (!expr)
+            {
+                return 0;
+            }
+            if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr))
+            {
+                return 1 + exprCost(bin->left, self, blocked) + exprCost(bin->right, self, blocked);
+            }
+            if (auto cmp = std::dynamic_pointer_cast<CompareExpr>(expr))
+            {
+                return 1 + exprCost(cmp->left, self, blocked) + exprCost(cmp->right, self, blocked);
+            }
+            if (auto log = std::dynamic_pointer_cast<LogicalExpr>(expr))
+            {
+                return 1 + exprCost(log->left, self, blocked) + exprCost(log->right, self, blocked);
+            }
+            if (auto call = std::dynamic_pointer_cast<CallExpr>(expr))
+            {
+                if (!call->isNative && call->methodName == self)
+                {
+                    blocked = true;
+                }
+                size_t cost = 1;
+                for (const auto &arg : call->args)
+                {
+                    cost += exprCost(arg, self, blocked);
+                }
+                return cost;
+            }
+            if (auto arr = std::dynamic_pointer_cast<ArrayExpr>(expr))
+            {
+                size_t cost = 1;
+                for (const auto &elem : arr->elements)
+                {
+                    cost += exprCost(elem, self, blocked);
+                }
+                return cost;
+            }
+            if (auto idx = std::dynamic_pointer_cast<IndexExpr>(expr))
+            {
+                return 1 + exprCost(idx->array, self, blocked) + exprCost(idx->index, self, blocked);
+            }
+            return 1;
+        }
+
+        size_t stmtCost(const std::shared_ptr<Stmt> &stmt, const std::string &self, bool &blocked)
+        {
+            if (!stmt)
+            {
+                return 0;
+            }
+            if (auto varDecl = std::dynamic_pointer_cast<VarDeclStmt>(stmt))
+            {
+                return 1 + exprCost(varDecl->initializer, self, blocked);
+            }
+            if (auto arrayDecl = std::dynamic_pointer_cast<ArrayDeclStmt>(stmt))
+            {
+                return 1 + exprCost(arrayDecl->size, self, blocked) + exprCost(arrayDecl->initializer, self, blocked);
+            }
+            if (auto assign = std::dynamic_pointer_cast<AssignStmt>(stmt))
+            {
+                return 1 + exprCost(assign->value, self, blocked);
+            }
+            if (auto exprStmt = std::dynamic_pointer_cast<ExprStmt>(stmt))
+            {
+                return exprCost(exprStmt->expression, self, blocked);
+            }
+            if (auto ret = std::dynamic_pointer_cast<ReturnStmt>(stmt))
+            {
+                return 1 + exprCost(ret->value, self, blocked);
+            }
+            if (auto block = std::dynamic_pointer_cast<BlockStmt>(stmt))
+            {
+                size_t cost = 0;
+                for (const auto &inner : block->statements)
+                {
+                    cost += stmtCost(inner, self, blocked);
+                }
+                return cost;
+            }
+            if (auto ifStmt = std::dynamic_pointer_cast<IfStmt>(stmt))
+            {
+                return 1 + exprCost(ifStmt->condition, self, blocked) + stmtCost(ifStmt->thenBranch, self, blocked) +
+                       stmtCost(ifStmt->elseBranch, self, blocked);
+            }
+            if (auto whileStmt = std::dynamic_pointer_cast<WhileStmt>(stmt))
+            {
+                return 1 + exprCost(whileStmt->condition, self, blocked) + stmtCost(whileStmt->body, self, blocked);
+            }
+            if (auto forStmt = std::dynamic_pointer_cast<ForStmt>(stmt))
+            {
+                return 1 + stmtCost(forStmt->initializer, self, blocked) + exprCost(forStmt->condition, self, blocked) +
+                       exprCost(forStmt->increment, self, blocked) + stmtCost(forStmt->body, self, blocked);
+            }
+            if (std::dynamic_pointer_cast<FunctionStmt>(stmt))
+            {
+                blocked = true;
+            }
+            return 1;
+        }
+    } // namespace
+
+    const std::vector<StaticType> &Compiler::provenParamTypes(const FunctionStmt &function) const
+    {
+        static const std::vector<StaticType> none;
+        auto it = paramTypes.find(&function);
+        return it == paramTypes.end() ? none : it->second;
+    }
+
+    const FunctionStmt *Compiler::inlineCandidate(const CallExpr &expr, std::string &name) const
+    {
+        if (options.optimizationLevel < 1 || options.inlineThreshold == 0 ||
+            options.bytecodeVersion != TVM::BYTECODE_VERSION_STACK)
+        {
+            return nullptr;
+        }
+
+        // Same lookup as compileCall
+        name = expr.className.empty() ? expr.methodName : expr.className + "_" + expr.methodName;
+        auto it = functionBodies.find(name);
+        if (it == functionBodies.end())
+        {
+            name = expr.methodName;
+            it = functionBodies.find(name);
+        }
+        if (it == functionBodies.end())
+        {
+            return nullptr;
+        }
+
+        const FunctionStmt *callee = it->second;
+        if (callee->parameters.size() != expr.args.size() ||
+            std::find(inlineStack.begin(), inlineStack.end(), callee) != inlineStack.end())
+        {
+            return nullptr;
+        }
+
+        bool blocked = false;
+        size_t cost = 0;
+        for (const auto &stmt : callee->body)
+        {
+            cost += stmtCost(stmt, callee->name, blocked);
+        }
+        if (blocked || cost > options.inlineThreshold)
+        {
+            return nullptr;
+        }
+        return callee;
+    }
+
+    bool Compiler::compileInlineCall(const CallExpr &expr)
+    {
+        std::string name;
+        const FunctionStmt *callee = inlineCandidate(expr, name);
+        if (!callee)
+        {
+            return false;
+        }
+
+        // Every call site passes the parameter types the callee trusts
+        // (inferParamTypes), this one included
+        TypeInference calleeTypes;
+        calleeTypes.analyze(*callee, provenParamTypes(*callee));
+
+        // The callee's slots go above every local live at the call site
+        FunctionContext calleeCtx;
+        calleeCtx.nextLocal = currentContext().nextLocal;
+        calleeCtx.isolated = true;
+        uint32_t base = calleeCtx.nextLocal;
+
+        FunctionContext countingCtx;
+        countingCtx.nextLocal = base + static_cast<uint32_t>(callee->parameters.size());
+        countLocals(callee->body, countingCtx);
+        if (countingCtx.nextLocal > UINT8_MAX)
+        {
+            return false;
+        }
+        inlineLocals = std::max(inlineLocals, countingCtx.nextLocal);
+
+        std::cout << "DEBUG: Inlining " << name << " at local " << base << std::endl;
+
+        for (const auto &arg : expr.args)
+        {
+            compileExpr(arg);
+        }
+        for (size_t i = callee->parameters.size(); i-- > 0;)
+        {
+            emit(TVM::OP_STORE, base + static_cast<uint32_t>(i));
+            emit(TVM::OP_POP);
+        }
+        for (size_t i = 0; i < callee->parameters.size(); i++)
+        {
+            calleeCtx.addLocal(callee->parameters[i].name, true);
+        }
+
+        TypeInference callerTypes = types;
+        types = calleeTypes;
+        auto callerLoops = std::move(loopStack);
+        loopStack.clear();
+        contextStack.push_back(calleeCtx);
+        inlineStack.push_back(callee);
+        inlineReturns.emplace_back();
+
+        for (const auto &stmt : callee->body)
+        {
+            compileStmt(stmt);
+        }
+        emitPushNil(); // Falling off the end returns nil
+        patchJumps(inlineReturns.back(), bytecode.code.size());
+
+        inlineReturns.pop_back();
+        inlineStack.pop_back();
+        contextStack.pop_back();
+        loopStack = std::move(callerLoops);
+        types = callerTypes;
+
+        inlinedCalls.push_back(name);
+        return true;
+    }
+
+    // `return` inside an inlined body: the value stays on the stack for the
+    // caller and control goes to the end of the body
+    void Compiler::compileInlineReturn(const ReturnStmt &stmt)
+    {
+        if (stmt.value)
+        {
+            compileExpr(stmt.value);
+        }
+        else
+        {
+            emitPushNil();
+        }
+        inlineReturns.back().push_back(emitJump(TVM::OP_JMP));
+        // The value is accounted for where the returns meet
+        adjustStack(-1);
+    }
+
+} // namespace Tail
@@ -0,0 +1,514 @@
+#include "optimizer.h"
+#include "../shared/numbers.h"
+#include <cmath>
+
+namespace Tail
+{
+
+    // Value of a literal expression, or nullptr
+    static const Value *literalValue(const std::shared_ptr<Expr> &expr)
+    {
+        auto lit = std::dynamic_pointer_cast<LiteralExpr>(expr);
+        return lit ? &lit->value : nullptr;
+    }
+
+    static std::shared_ptr<Expr> makeLiteral(const Value &value)
+    {
+        return std::make_shared<LiteralExpr>(value);
+    }
+
+    // What the VM's toString gives for a literal: the text `+` concatenates
+    static std::string displayString(const Value &value)
+    {
+        if (value.isStr())
+        {
+            return value.asStr();
+        }
+        if (value.isInt())
+        {
+            return TVM::intToString(value.asInt());
+        }
+        if (value.isFloat())
+        {
+            return TVM::Value(value.asFloat()).toString(nullptr);
+        }
+        if (value.isBool())
+        {
+            return TVM::Value(value.asBool()).toString(nullptr);
+        }
+        return TVM::Value().toString(nullptr);
+    }
+
+    // Mirrors VM::valueEquals for literals, which are never arrays
+    static bool literalEquals(const Value &a, const Value &b)
+    {
+        if ((a.isInt() || a.isFloat()) && (b.isInt() || b.isFloat()))
+        {
+            if (a.isInt() && b.isInt())
+            {
+                return a.asInt() == b.asInt();
+            }
+            double l = a.isInt() ? static_cast<double>(a.asInt()) : a.asFloat();
+            double r = b.isInt() ? static_cast<double>(b.asInt()) : b.asFloat();
+            return l == r;
+        }
+        if (a.isStr() && b.isStr())
+        {
+            return a.asStr() == b.asStr();
+        }
+        if (a.isBool() && b.isBool())
+        {
+            return a.asBool() == b.asBool();
+        }
+        return a.isNil() && b.isNil();
+    }
+
+    // How conditions and the logical operators read a literal
+    static bool isTruthy(const Value &value)
+    {
+        if (value.isNil())
+        {
+            return false;
+        }
+        if (value.isInt())
+        {
+            return value.asInt() != 0;
+        }
+        if (value.isFloat())
+        {
+            return value.asFloat() != 0.0;
+        }
+        if (value.isBool())
+        {
+            return value.asBool();
+        }
+        return true;
+    }
+
+    static bool isIntLiteral(const std::shared_ptr<Expr> &expr, int64_t n)
+    {
+        const Value *value = literalValue(expr);
+        return value && value->isInt() && value->asInt() == n;
+    }
+
+    // Matches +0.0 but not -0.0, which identities like x - 0.0 depend on
+    static bool isFloatLiteral(const std::shared_ptr<Expr> &expr, double d)
+    {
+        const Value *value = literalValue(expr);
+        return value && value->isFloat() && value->asFloat() == d && !std::signbit(value->asFloat());
+    }
+
+    AstOptimizer::AstOptimizer(int lvl) : level(lvl), typed(false)
+    {
+    }
+
+    void AstOptimizer::run(std::vector<std::shared_ptr<Stmt>> &program)
+    {
+        if (level > 0)
+        {
+            optimizeBody(program);
+        }
+    }
+
+    void AstOptimizer::optimizeBody(std::vector<std::shared_ptr<Stmt>> &statements)
+    {
+        std::vector<std::shared_ptr<Stmt>> kept;
+        kept.reserve(statements.size());
+        for (const auto &stmt : statements)
+        {
+            if (auto optimized = optimizeStmt(stmt))
+            {
+                kept.push_back(optimized);
+            }
+        }
+        statements.swap(kept);
+    }
+
+    // Where a statement is required (loop bodies), a removed one becomes an
+    // empty block
+    std::shared_ptr<Stmt> AstOptimizer::optimizeNested(const std::shared_ptr<Stmt> &stmt)
+    {
+        auto optimized = optimizeStmt(stmt);
+        return optimized ? optimized : std::make_shared<BlockStmt>();
+    }
+
+    // Returns the statement to keep in place of `stmt`, or nullptr to drop it
+    std::shared_ptr<Stmt> AstOptimizer::optimizeStmt(const std::shared_ptr<Stmt> &stmt)
+    {
+        if (!stmt)
+        {
+            return stmt;
+        }
+
+        if (auto func = std::dynamic_pointer_cast<FunctionStmt>(stmt))
+        {
+            // Rewrites keep every value's type and only remove stores, so
+            // what the analysis trusts before them stays true after
+            typed = level >= 2;
+            if (typed)
+            {
+                types.analyze(*func);
+            }
+            optimizeBody(func->body);
+            typed = false;
+        }
+        else if (auto varDecl = std::dynamic_pointer_cast<VarDeclStmt>(stmt))
+        {
+            varDecl->initializer = optimizeExpr(varDecl->initializer);
+        }
+        else if (auto arrayDecl = std::dynamic_pointer_cast<ArrayDeclStmt>(stmt))
+        {
+            arrayDecl->size = optimizeExpr(arrayDecl->size);
+            arrayDecl->initializer = optimizeExpr(arrayDecl->initializer);
+        }
+        else if (auto assign = std::dynamic_pointer_cast<AssignStmt>(stmt))
+        {
+            assign->value = optimizeExpr(assign->value);
+        }
+        else if (auto exprStmt = std::dynamic_pointer_cast<ExprStmt>(stmt))
+        {
+            exprStmt->expression = optimizeExpr(exprStmt->expression);
+        }
+        else if (auto returnStmt = std::dynamic_pointer_cast<ReturnStmt>(stmt))
+        {
+            returnStmt->value = optimizeExpr(returnStmt->value);
+        }
+        else if (auto block = std::dynamic_pointer_cast<BlockStmt>(stmt))
+        {
+            optimizeBody(block->statements);
+        }
+        else if (auto ifStmt = std::dynamic_pointer_cast<IfStmt>(stmt))
+        {
+            ifStmt->condition = optimizeExpr(ifStmt->condition);
+            if (ifStmt->thenBranch)
+            {
+                optimizeBody(ifStmt->thenBranch->statements);
+            }
+            ifStmt->elseBranch = optimizeStmt(ifStmt->elseBranch);
+            if (const Value *cond = literalValue(ifStmt->condition))
+            {
+                stats.deadBranches++;
+                return isTruthy(*cond) ? ifStmt->thenBranch : ifStmt->elseBranch;
+            }
+        }
+        else if (auto whileStmt = std::dynamic_pointer_cast<WhileStmt>(stmt))
+        {
+            whileStmt->condition = optimizeExpr(whileStmt->condition);
+            whileStmt->body = optimizeNested(whileStmt->body);
+            const Value *cond = literalValue(whileStmt->condition);
+            if (cond && !isTruthy(*cond))
+            {
+                stats.deadBranches++;
+                return nullptr;
+            }
+        }
+        else if (auto forStmt = std::dynamic_pointer_cast<ForStmt>(stmt))
+        {
+            forStmt->initializer = optimizeStmt(forStmt->initializer);
+            forStmt->condition = optimizeExpr(forStmt->condition);
+            forStmt->increment = optimizeExpr(forStmt->increment);
+            forStmt->body = optimizeNested(forStmt->body);
+            // The initializer still runs; its variable was never scoped to
+            // the loop
+            const Value *cond = literalValue(forStmt->condition);
+            if (cond && !isTruthy(*cond))
+            {
+                stats.deadBranches++;
+                return forStmt->initializer;
+            }
+        }
+        return stmt;
+    }
+
+    std::shared_ptr<Expr> AstOptimizer::optimizeExpr(const std::shared_ptr<Expr> &expr)
+    {
+        if (!expr)
+        {
+            return expr;
+        }
+
+        if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr))
+        {
+            bin->left = optimizeExpr(bin->left);
+            bin->right = optimizeExpr(bin->right);
+            if (bin->op == "=")
+            {
+                return expr;
+            }
+            const Value *a = literalValue(bin->left);
+            const Value *b = literalValue(bin->right);
+            if (a && b)
+            {
+                if (auto folded = foldBinary(bin->op, *a, *b))
+                {
+                    stats.folded++;
+                    return folded;
+                }
+            }
+            auto simplified = simplifyBinary(*bin);
+            return simplified ? simplified : expr;
+        }
+        if (auto cmp = std::dynamic_pointer_cast<CompareExpr>(expr))
+        {
+            cmp->left = optimizeExpr(cmp->left);
+            cmp->right = optimizeExpr(cmp->right);
+            const Value *a = literalValue(cmp->left);
+            const Value *b = literalValue(cmp->right);
+            if (a && b)
+            {
+                if (auto folded = foldCompare(cmp->op, *a, *b))
+                {
+                    stats.folded++;
+                    return folded;
+                }
+            }
+            return expr;
+        }
+        if (auto log = std::dynamic_pointer_cast<LogicalExpr>(expr))
+        {
+            log->left = optimizeExpr(log->left);
+            log->right = optimizeExpr(log->right);
+            auto simplified = simplifyLogical(*log);
+            return simplified ? simplified : expr;
+        }
+        if (auto call = std::dynamic_pointer_cast<CallExpr>(expr))
+        {
+            for (auto &arg : call->args)
+            {
+                arg = optimizeExpr(arg);
+            }
+        }
+        else if (auto arr = std::dynamic_pointer_cast<ArrayExpr>(expr))
+        {
+            for (auto &elem : arr->elements)
+            {
+                elem = optimizeExpr(elem);
+            }
+        }
+        else if (auto idx = std::dynamic_pointer_cast<IndexExpr>(expr))
+        {
+            idx->array = optimizeExpr(idx->array);
+            idx->index = optimizeExpr(idx->index);
+        }
+        return expr;
+    }
+
+    // Mirrors VM::valueAdd and friends; nullptr where the VM would fail
+    std::shared_ptr<Expr> AstOptimizer::foldBinary(const std::string &op, const Value &a, const Value &b) const
+    {
+        if (a.isInt() && b.isInt())
+        {
+            // Two's-complement wraparound, as the VM's int arithmetic
+            int64_t l = a.asInt(), r = b.asInt();
+            if (op == "+")
+                return makeLiteral(Value(TVM::wrapAdd(l, r)));
+            if (op == "-")
+                return makeLiteral(Value(TVM::wrapSub(l, r)));
+            if (op == "*")
+                return makeLiteral(Value(TVM::wrapMul(l, r)));
+            // A zero divisor is a runtime error
+            if ((op == "/" || op == "%") && r != 0)
+                return makeLiteral(Value(op == "/" ? TVM::wrapDiv(l, r) : TVM::wrapMod(l, r)));
+            return nullptr;
+        }
+
+        if ((a.isInt() || a.isFloat()) && (b.isInt() || b.isFloat()))
+        {
+            double l = a.isInt() ? static_cast<double>(a.asInt()) : a.asFloat();
+            double r = b.isInt() ? static_cast<double>(b.asInt()) : b.asFloat();
+            if (op == "+")
+                return makeLiteral(Value(l + r));
+            // Only + widens an int operand, and % takes ints only
+            if (a.isInt() || b.isInt())
+                return nullptr;
+            if (op == "-")
+                return makeLiteral(Value(l - r));
+            if (op == "*")
+                return makeLiteral(Value(l * r));
+            if (op == "/" && r != 0.0)
+                return makeLiteral(Value(l / r));
+            return nullptr;
+        }
+
+        if (op == "+" && (a.isStr() || b.isStr()))
+        {
+            return makeLiteral(Value(displayString(a) + displayString(b)));
+        }
+        return nullptr;
+    }
+
+    // Mirrors VM::valueEquals and VM::valueLess and friends
+    std::shared_ptr<Expr> AstOptimizer::foldCompare(const std::string &op, const Value &a, const Value &b) const
+    {
+        if (op == "==" || op == "!=")
+        {
+            bool equal = literalEquals(a, b);
+            return makeLiteral(Value(op == "==" ? equal : !equal));
+        }
+
+        bool ints = a.isInt() && b.isInt();
+        if (!ints && !(a.isFloat() && b.isFloat()))
+        {
+            return nullptr;
+        }
+        auto compare = [&op](auto x, auto y) -> int
+        {
+            if (op == "<")
+                return x < y;
+            if (op == "<=")
+                return x <= y;
+            if (op == ">")
+                return x > y;
+            if (op == ">=")
+                return x >= y;
+            return -1;
+        };
+        int result = ints ? compare(a.asInt(), b.asInt()) : compare(a.asFloat(), b.asFloat());
+        return result < 0 ? nullptr : makeLiteral(Value(result == 1));
+    }
+
+    // Rewrites of a binary operator with at most one literal operand
+    std::shared_ptr<Expr> AstOptimizer::simplifyBinary(BinaryExpr &expr)
+    {
+        // (x + "a") + "b" -> x + "ab": a string operand makes + concatenate
+        // whatever x is
+        const Value *b = literalValue(expr.right);
+        auto inner = std::dynamic_pointer_cast<BinaryExpr>(expr.left);
+        if (expr.op == "+" && b && b->isStr() && inner && inner->op == "+")
+        {
+            const Value *a = literalValue(inner->right);
+            if (a && a->isStr())
+            {
+                inner->right = makeLiteral(Value(a->asStr() + b->asStr()));
+                stats.folded++;
+                return inner;
+            }
+        }
+
+        if (level < 2)
+        {
+            return nullptr;
+        }
+
+        // Identities exact for every value of the operand's type, including
+        // wrapped ints, NaNs and -0.0
+        StaticType left = typeOf(expr.left);
+        StaticType right = typeOf(expr.right);
+        std::shared_ptr<Expr> result;
+        if (expr.op == "+")
+        {
+            if (left == StaticType::Int && isIntLiteral(expr.right, 0))
+                result = expr.left;
+            else if (right == StaticType::Int && isIntLiteral(expr.left, 0))
+                result = expr.right;
+        }
+        else if (expr.op == "-")
+        {
+            if ((left == StaticType::Int && isIntLiteral(expr.right, 0)) ||
+                (left == StaticType::Float && isFloatLiteral(expr.right, 0.0)))
+                result = expr.left;
+        }
+        else if (expr.op == "*")
+        {
+            if ((left == StaticType::Int && isIntLiteral(expr.right, 1)) ||
+                (left == StaticType::Float && isFloatLiteral(expr.right, 1.0)))
+                result = expr.left;
+            else if ((right == StaticType::Int && isIntLiteral(expr.left, 1)) ||
+                     (right == StaticType::Float && isFloatLiteral(expr.left, 1.0)))
+                result = expr.right;
+        }
+        else if (expr.op == "/")
+        {
+            if ((left == StaticType::Int && isIntLiteral(expr.right, 1)) ||
+                (left == StaticType::Float && isFloatLiteral(expr.right, 1.0)))
+                result = expr.left;
+        }
+        if (result)
+        {
+            stats.simplified++;
+        }
+        return result;
+    }
+
+    // Unary ! and -, and short-circuit && and ||
+    std::shared_ptr<Expr> AstOptimizer::simplifyLogical(LogicalExpr &expr)
+    {
+        const Value *right = literalValue(expr.right);
+
+        if (expr.op == "!")
+        {
+            if (right)
+            {
+                stats.folded++;
+                return makeLiteral(Value(!isTruthy(*right)));
+            }
+            // !!b -> b for a bool b
+            auto inner = std::dynamic_pointer_cast<LogicalExpr>(expr.right);
+            if (level >= 2 && inner && inner->op == "!" && typeOf(inner->right) == StaticType::Bool)
+            {
+                stats.simplified++;
+                return inner->right;
+            }
+            return nullptr;
+        }
+
+        if (expr.op == "-")
+        {
+            if (right && right->isInt())
+            {
+                stats.folded++;
+                return makeLiteral(Value(TVM::wrapNeg(right->asInt())));
+            }
+            if (right && right->isFloat())
+            {
+                stats.folded++;
+                return makeLiteral(Value(-right->asFloat()));
+            }
+            return nullptr;
+        }
+
+        if (expr.op != "&&" && expr.op != "||")
+        {
+            return nullptr;
+        }
+
+        // The operator yields a bool: the constant if the left operand
+        // decides it, otherwise the right operand's truthiness
+        bool isAnd = expr.op == "&&";
+        const Value *left = literalValue(expr.left);
+        if (left)
+        {
+            if (isTruthy(*left) != isAnd)
+            {
+                stats.folded++;
+                return makeLiteral(Value(!isAnd));
+            }
+            if (right)
+            {
+                stats.folded++;
+                return makeLiteral(Value(isTruthy(*right)));
+            }
+            if (level >= 2 && typeOf(expr.right) == StaticType::Bool)
+            {
+                stats.simplified++;
+                return expr.right;
+            }
+            return nullptr;
+        }
+
+        // b && true -> b and b || false -> b; the right operand is only a
+        // constant, so dropping it skips no side effect
+        if (level >= 2 && right && isTruthy(*right) == isAnd && typeOf(expr.left) == StaticType::Bool)
+        {
+            stats.simplified++;
+            return expr.left;
+        }
+        return nullptr;
+    }
+
+    StaticType AstOptimizer::typeOf(const std::shared_ptr<Expr> &expr) const
+    {
+        return typed ? types.exprType(expr) : StaticType::Unknown;
+    }
+
+} // namespace Tail
@@ -0,0 +1,52 @@
+#pragma once
+#include "../shared/ast.h"
+#include "types.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace Tail
+{
+
+    // Rewrites a parsed program before it is compiled. Level 1 folds
+    // operators whose operands are all literals and drops branches and loops
+    // whose condition folds to a constant; level 2 also applies algebraic
+    // identities such as x * 1 -> x where type inference proves them exact.
+    // Folding follows the VM's semantics: anything the VM would reject at run
+    // time (division by zero, int * float, ...) is left for it to report.
+    class AstOptimizer
+    {
+    public:
+        struct Stats
+        {
+            uint32_t folded = 0;
+            uint32_t simplified = 0;
+            uint32_t deadBranches = 0;
+
+            uint32_t total() const { return folded + simplified + deadBranches; }
+        };
+
+        explicit AstOptimizer(int level);
+
+        void run(std::vector<std::shared_ptr<Stmt>> &program);
+        const Stats &getStats() const { return stats; }
+
+    private:
+        int level;
+        Stats stats;
+        TypeInference types; // Of the function being rewritten
+        bool typed;          // Whether `types` describes the current code
+
+        void optimizeBody(std::vector<std::shared_ptr<Stmt>> &statements);
+        std::shared_ptr<Stmt> optimizeStmt(const std::shared_ptr<Stmt> &stmt);
+        std::shared_ptr<Stmt> optimizeNested(const std::shared_ptr<Stmt> &stmt);
+        std::shared_ptr<Expr> optimizeExpr(const std::shared_ptr<Expr> &expr);
+
+        std::shared_ptr<Expr> foldBinary(const std::string &op, const Value &a, const Value &b) const;
+        std::shared_ptr<Expr> foldCompare(const std::string &op, const Value &a, const Value &b) const;
+        std::shared_ptr<Expr> simplifyBinary(BinaryExpr &expr);
+        std::shared_ptr<Expr> simplifyLogical(LogicalExpr &expr);
+        StaticType typeOf(const std::shared_ptr<Expr> &expr) const;
+    };
+
+} // namespace Tail
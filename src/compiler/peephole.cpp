@@ -0,0 +1,79 @@
+#include "peephole.h"
+
+namespace Tail
+{
+
+    PeepholeOptimizer::PeepholeOptimizer(TVM::BytecodeFile &bc) : bytecode(bc)
+    {
+    }
+
+    void PeepholeOptimizer::run()
+    {
+        auto &code = bytecode.code;
+        uint32_t pc = 0;
+
+        // Longest pattern first. Sequences never overlap: after a fusion
+        // the scan resumes behind the instructions it covered.
+        while (pc < code.size())
+        {
+            TVM::OpCode fused = TVM::OP_HALT;
+
+            if (matches(pc, {TVM::OP_LOAD, TVM::OP_PUSH, TVM::OP_ADD, TVM::OP_STORE, TVM::OP_POP}) &&
+                code[pc].operand == code[pc + 3].operand && isIntConstant(code[pc + 1].operand))
+            {
+                fused = TVM::OP_INC_LOCAL;
+                stats.incLocal++;
+            }
+            else if (matches(pc, {TVM::OP_LOAD, TVM::OP_PUSH, TVM::OP_LT, TVM::OP_JMP_IFNOT}))
+            {
+                fused = TVM::OP_LT_LOCAL_CONST_JMP_IFNOT;
+                stats.ltLocalConstJmpIfNot++;
+            }
+            else if (matches(pc, {TVM::OP_LOAD, TVM::OP_LOAD, TVM::OP_ADD}))
+            {
+                fused = TVM::OP_LOAD_LOAD_ADD;
+                stats.loadLoadAdd++;
+            }
+            else if (matches(pc, {TVM::OP_STORE, TVM::OP_POP}))
+            {
+                fused = TVM::OP_STORE_POP;
+                stats.storePop++;
+            }
+
+            if (fused != TVM::OP_HALT)
+            {
+                code[pc].opcode = fused;
+                pc += TVM::superinstructionLength(fused);
+            }
+            else
+            {
+                pc++;
+            }
+        }
+    }
+
+    bool PeepholeOptimizer::matches(uint32_t pc, std::initializer_list<TVM::OpCode> ops) const
+    {
+        const auto &code = bytecode.code;
+        if (pc + ops.size() > code.size())
+        {
+            return false;
+        }
+        // Typed forms match their generic opcode; fused handlers keep the
+        // generic semantics, which agree with the typed ones.
+        for (TVM::OpCode op : ops)
+        {
+            if (TVM::genericOpcode(code[pc++].opcode) != op)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool PeepholeOptimizer::isIntConstant(uint32_t index) const
+    {
+        return index < bytecode.constants.size() && bytecode.constants[index].type == TVM::TYPE_INT;
+    }
+
+} // namespace Tail
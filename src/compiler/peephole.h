@@ -0,0 +1,38 @@
+#pragma once
+#include "../shared/bytecode.h"
+#include <cstdint>
+#include <initializer_list>
+
+namespace Tail
+{
+
+    // Fuses common stack-bytecode sequences into superinstructions. Runs on
+    // finished code; see the superinstruction block in bytecode.h for the
+    // in-place encoding.
+    class PeepholeOptimizer
+    {
+    public:
+        struct Stats
+        {
+            uint32_t loadLoadAdd = 0;
+            uint32_t ltLocalConstJmpIfNot = 0;
+            uint32_t incLocal = 0;
+            uint32_t storePop = 0;
+
+            uint32_t total() const { return loadLoadAdd + ltLocalConstJmpIfNot + incLocal + storePop; }
+        };
+
+        explicit PeepholeOptimizer(TVM::BytecodeFile &bytecode);
+
+        void run();
+        const Stats &getStats() const { return stats; }
+
+    private:
+        TVM::BytecodeFile &bytecode;
+        Stats stats;
+
+        bool matches(uint32_t pc, std::initializer_list<TVM::OpCode> ops) const;
+        bool isIntConstant(uint32_t index) const;
+    };
+
+} // namespace Tail
@@ -0,0 +1,838 @@
+#include "compiler.h"
+#include <iostream>
+#include <stdexcept>
+
+// Code generation for the register ISA (bytecode version 2). The front end
+// and local numbering are shared with the stack generator in compiler.cpp:
+// local N lives in register N, and expression temporaries are allocated
+// above the last local and released as soon as their value is consumed.
+
+namespace Tail
+{
+
+    namespace
+    {
+        // Registers are addressed by the 8-bit A operand
+        constexpr uint32_t MAX_REGISTERS = 256;
+
+        TVM::RegOpCode arithmeticOp(const std::string &op)
+        {
+            if (op == "+")
+                return TVM::ROP_ADD;
+            if (op == "-")
+                return TVM::ROP_SUB;
+            if (op == "*")
+                return TVM::ROP_MUL;
+            if (op == "/")
+                return TVM::ROP_DIV;
+            if (op == "%")
+                return TVM::ROP_MOD;
+            throw std::runtime_error("Unknown binary operator: " + op);
+        }
+
+        TVM::RegOpCode compareOp(const std::string &op, bool branch)
+        {
+            static const std::string ops[] = {"==", "!=", "<", "<=", ">", ">="};
+            for (uint8_t i = 0; i < 6; i++)
+            {
+                if (ops[i] == op)
+                {
+                    return static_cast<TVM::RegOpCode>((branch ? TVM::ROP_JMP_IFNOT_EQ : TVM::ROP_EQ) + i);
+                }
+            }
+            throw std::runtime_error("Unknown comparison operator: " + op);
+        }
+    }
+
+    void Compiler::compileRegFunction(const FunctionStmt &stmt, const std::string &sourceFileName)
+    {
+        uint32_t funcAddr = bytecode.regCode.size();
+
+        std::string functionName = qualifiedFunctionName(stmt, sourceFileName);
+
+        functionAddrs[functionName] = funcAddr;
+        functionArities[funcAddr] = stmt.parameters.size();
+
+        if (stmt.name != "Main")
+        {
+            functionAddrs[stmt.name] = funcAddr;
+        }
+
+        std::cout << "DEBUG: Compiling function " << functionName
+                  << " (original: " << stmt.name << ") to registers at address " << funcAddr << std::endl;
+
+        FunctionContext countingCtx;
+        countingCtx.nextLocal = stmt.parameters.size();
+        countLocals(stmt.body, countingCtx);
+
+        FunctionContext funcCtx;
+        funcCtx.startAddr = funcAddr;
+        funcCtx.paramCount = stmt.parameters.size();
+
+        for (size_t i = 0; i < stmt.parameters.size(); i++)
+        {
+            funcCtx.addLocal(stmt.parameters[i].name, true);
+        }
+
+        // Nested function statements compile into their own register file
+        uint32_t savedTop = regTop;
+        uint32_t savedMax = regMax;
+        regTop = countingCtx.nextLocal;
+        regMax = regTop;
+
+        contextStack.push_back(funcCtx);
+
+        TypeInference enclosingTypes = types;
+        types.analyze(stmt, provenParamTypes(stmt));
+
+        for (const auto &bodyStmt : stmt.body)
+        {
+            compileRegStmt(bodyStmt);
+        }
+
+        if (bytecode.regCode.size() == funcAddr ||
+            (bytecode.regCode.back().opcode != TVM::ROP_RET &&
+             bytecode.regCode.back().opcode != TVM::ROP_TAILCALL &&
+             bytecode.regCode.back().opcode != TVM::ROP_HALT))
+        {
+            std::cout << "DEBUG: Adding implicit return for function " << functionName << std::endl;
+            uint32_t reg = allocReg();
+            emitReg(TVM::ROP_LOADK, reg, 0, literalConstant(LiteralExpr(Value())));
+            emitReg(TVM::ROP_RET, reg);
+        }
+
+        contextStack.pop_back();
+        types = enclosingTypes;
+
+        TVM::FunctionInfo info;
+        info.name = functionName;
+        info.address = funcAddr;
+        info.arity = stmt.parameters.size();
+        info.locals = regMax;
+        bytecode.functions.push_back(info);
+
+        std::cout << "DEBUG: Function " << functionName << " compiled, size: "
+                  << (bytecode.regCode.size() - funcAddr) << " instructions, "
+                  << regMax << " registers (locals: " << countingCtx.nextLocal << ")" << std::endl;
+
+        regTop = savedTop;
+        regMax = savedMax;
+    }
+
+    void Compiler::compileRegStmt(const std::shared_ptr<Stmt> &stmt)
+    {
+        if (auto varDecl = std::dynamic_pointer_cast<VarDeclStmt>(stmt))
+        {
+            compileRegVarDecl(*varDecl);
+        }
+        else if (auto assign = std::dynamic_pointer_cast<AssignStmt>(stmt))
+        {
+            uint32_t saved = regTop;
+            compileRegAssign(BinaryExpr(std::make_shared<VariableExpr>(assign->name), "=", assign->value), -1);
+            regTop = saved;
+        }
+        else if (auto exprStmt = std::dynamic_pointer_cast<ExprStmt>(stmt))
+        {
+            if (compileRegAppend(exprStmt->expression))
+            {
+                return;
+            }
+            uint32_t saved = regTop;
+            auto call = std::dynamic_pointer_cast<CallExpr>(exprStmt->expression);
+            if (call && call->isNative && call->className == "Console" &&
+                (call->methodName == "println" || call->methodName == "print") &&
+                call->args.size() == 1)
+            {
+                // Statement-level print has no result to materialise
+                uint32_t reg = compileRegExpr(call->args[0]);
+                emitReg(call->methodName == "println" ? TVM::ROP_PRINTLN : TVM::ROP_PRINT, reg);
+            }
+            else
+            {
+                compileRegExpr(exprStmt->expression);
+            }
+            regTop = saved;
+        }
+        else if (auto block = std::dynamic_pointer_cast<BlockStmt>(stmt))
+        {
+            compileRegBlock(*block);
+        }
+        else if (auto ifStmt = std::dynamic_pointer_cast<IfStmt>(stmt))
+        {
+            compileRegIf(*ifStmt);
+        }
+        else if (auto whileStmt = std::dynamic_pointer_cast<WhileStmt>(stmt))
+        {
+            compileRegWhile(*whileStmt);
+        }
+        else if (auto forStmt = std::dynamic_pointer_cast<ForStmt>(stmt))
+        {
+            compileRegFor(*forStmt);
+        }
+        else if (auto returnStmt = std::dynamic_pointer_cast<ReturnStmt>(stmt))
+        {
+            compileRegReturn(*returnStmt);
+        }
+        else if (std::dynamic_pointer_cast<BreakStmt>(stmt) || std::dynamic_pointer_cast<ContinueStmt>(stmt))
+        {
+            bool isBreak = std::dynamic_pointer_cast<BreakStmt>(stmt) != nullptr;
+            if (loopStack.empty())
+            {
+                throw std::runtime_error(isBreak ? "Break outside loop" : "Continue outside loop");
+            }
+            uint32_t jump = emitReg(TVM::ROP_JMP, 0, 0, 0xFFFFFFFF);
+            if (isBreak)
+                loopStack.back().breakPatches.push_back(jump);
+            else
+                loopStack.back().continuePatches.push_back(jump);
+        }
+        else if (auto func = std::dynamic_pointer_cast<FunctionStmt>(stmt))
+        {
+            compileRegFunction(*func, "");
+        }
+        else if (auto arrayDecl = std::dynamic_pointer_cast<ArrayDeclStmt>(stmt))
+        {
+            compileRegArrayDecl(*arrayDecl);
+        }
+        else
+        {
+            throw std::runtime_error("Unknown statement type");
+        }
+    }
+
+    void Compiler::compileRegVarDecl(const VarDeclStmt &stmt)
+    {
+        // Locals are pre-counted, so the register is known before the
+        // initializer runs and can be used as its destination directly.
+        uint32_t reg = currentContext().nextLocal;
+        uint32_t saved = regTop;
+
+        if (stmt.initializer)
+        {
+            compileRegExpr(stmt.initializer, reg);
+        }
+        else
+        {
+            Value init;
+            if (stmt.type == "int")
+                init = Value(static_cast<int64_t>(0));
+            else if (stmt.type == "float")
+                init = Value(0.0);
+            else if (stmt.type == "bool")
+                init = Value(false);
+            else if (stmt.type == "str")
+                init = Value(std::string(""));
+            emitReg(TVM::ROP_LOADK, reg, 0, literalConstant(LiteralExpr(init)));
+        }
+
+        regTop = saved;
+        currentContext().addLocal(stmt.name);
+    }
+
+    void Compiler::compileRegArrayDecl(const ArrayDeclStmt &stmt)
+    {
+        TVM::ValueType arrayType = declaredArrayType(stmt);
+        uint32_t reg = currentContext().nextLocal;
+        uint32_t saved = regTop;
+
+        if (auto literal = std::dynamic_pointer_cast<ArrayExpr>(stmt.initializer))
+        {
+            compileRegArray(*literal, arrayType, reg);
+        }
+        else if (stmt.initializer)
+        {
+            compileRegExpr(stmt.initializer, reg);
+        }
+        else
+        {
+            uint32_t length;
+            if (stmt.size)
+            {
+                length = compileRegExpr(stmt.size);
+            }
+            else
+            {
+                length = allocReg();
+                emitReg(TVM::ROP_LOADK, length, 0, addConstantInt(0));
+            }
+            emitReg(TVM::ROP_NEW_ARRAY, reg, length, emptyArrayConstant(arrayType));
+        }
+
+        regTop = saved;
+        currentContext().addLocal(stmt.name);
+    }
+
+    void Compiler::compileRegBlock(const BlockStmt &stmt)
+    {
+        FunctionContext blockCtx;
+        blockCtx.nextLocal = currentContext().nextLocal;
+        contextStack.push_back(blockCtx);
+
+        for (const auto &blockStmt : stmt.statements)
+        {
+            compileRegStmt(blockStmt);
+        }
+
+        contextStack.pop_back();
+    }
+
+    void Compiler::compileRegIf(const IfStmt &stmt)
+    {
+        uint32_t thenJump = compileRegBranchIfFalse(stmt.condition);
+
+        compileRegStmt(stmt.thenBranch);
+
+        if (stmt.elseBranch)
+        {
+            uint32_t elseJump = emitReg(TVM::ROP_JMP, 0, 0, 0xFFFFFFFF);
+            patchRegJump(thenJump);
+
+            compileRegStmt(stmt.elseBranch);
+            patchRegJump(elseJump);
+        }
+        else
+        {
+            patchRegJump(thenJump);
+        }
+    }
+
+    void Compiler::compileRegWhile(const WhileStmt &stmt)
+    {
+        loopStack.push_back(LoopContext());
+
+        uint32_t loopStart = bytecode.regCode.size();
+        uint32_t exitJump = compileRegBranchIfFalse(stmt.condition);
+
+        compileRegStmt(stmt.body);
+
+        patchRegJumps(loopStack.back().continuePatches, loopStart);
+        emitReg(TVM::ROP_JMP, 0, 0, loopStart);
+
+        patchRegJump(exitJump);
+        patchRegJumps(loopStack.back().breakPatches, bytecode.regCode.size());
+
+        loopStack.pop_back();
+    }
+
+    void Compiler::compileRegFor(const ForStmt &stmt)
+    {
+        if (stmt.initializer)
+        {
+            compileRegStmt(stmt.initializer);
+        }
+
+        loopStack.push_back(LoopContext());
+
+        uint32_t loopStart = bytecode.regCode.size();
+
+        if (stmt.condition)
+        {
+            loopStack.back().breakPatches.push_back(compileRegBranchIfFalse(stmt.condition));
+        }
+
+        compileRegStmt(stmt.body);
+
+        patchRegJumps(loopStack.back().continuePatches, bytecode.regCode.size());
+
+        if (stmt.increment)
+        {
+            uint32_t saved = regTop;
+            compileRegExpr(stmt.increment);
+            regTop = saved;
+        }
+
+        emitReg(TVM::ROP_JMP, 0, 0, loopStart);
+
+        patchRegJumps(loopStack.back().breakPatches, bytecode.regCode.size());
+
+        loopStack.pop_back();
+    }
+
+    void Compiler::compileRegReturn(const ReturnStmt &stmt)
+    {
+        uint32_t saved = regTop;
+        uint32_t reg;
+        auto call = std::dynamic_pointer_cast<CallExpr>(stmt.value);
+        if (call && !call->isNative)
+        {
+            compileRegCall(*call, -1, true);
+            regTop = saved;
+            return;
+        }
+        if (stmt.value)
+        {
+            reg = compileRegExpr(stmt.value);
+        }
+        else
+        {
+            reg = allocReg();
+            emitReg(TVM::ROP_LOADK, reg, 0, literalConstant(LiteralExpr(Value())));
+        }
+        emitReg(TVM::ROP_RET, reg);
+        regTop = saved;
+    }
+
+    // Compiles an expression and returns the register holding its value.
+    // With a target the value is written there; without one it may be a
+    // fresh temporary or, for plain variables, the local's own register.
+    uint32_t Compiler::compileRegExpr(const std::shared_ptr<Expr> &expr, int32_t target)
+    {
+        if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(expr))
+        {
+            uint32_t reg = target >= 0 ? static_cast<uint32_t>(target) : allocReg();
+            emitReg(TVM::ROP_LOADK, reg, 0, literalConstant(*lit));
+            return reg;
+        }
+        else if (auto var = std::dynamic_pointer_cast<VariableExpr>(expr))
+        {
+            uint32_t idx = resolveLocal(var->name);
+            if (idx == UINT32_MAX)
+            {
+                throw std::runtime_error("Undefined variable: " + var->name);
+            }
+            if (types.appendTarget(var->name))
+            {
+                // May hold the builder APPEND made of it
+                uint32_t reg = target >= 0 ? static_cast<uint32_t>(target) : allocReg();
+                emitReg(TVM::ROP_LOAD_STR, reg, idx);
+                return reg;
+            }
+            if (target >= 0 && static_cast<uint32_t>(target) != idx)
+            {
+                emitReg(TVM::ROP_MOVE, target, idx);
+                return target;
+            }
+            return idx;
+        }
+        else if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr))
+        {
+            if (bin->op == "=")
+            {
+                return compileRegAssign(*bin, target);
+            }
+
+            uint32_t saved = regTop;
+            uint32_t left = compileRegExpr(bin->left);
+            uint32_t right = compileRegOperandRK(bin->right, TVM::RK_CONSTANT_C, TVM::RK_CONSTANT_C - 1);
+            regTop = saved;
+
+            uint32_t reg = target >= 0 ? static_cast<uint32_t>(target) : allocReg();
+            emitReg(arithmeticOp(bin->op), reg, left, right);
+            return reg;
+        }
+        else if (auto cmp = std::dynamic_pointer_cast<CompareExpr>(expr))
+        {
+            uint32_t saved = regTop;
+            uint32_t left = compileRegExpr(cmp->left);
+            uint32_t right = compileRegOperandRK(cmp->right, TVM::RK_CONSTANT_C, TVM::RK_CONSTANT_C - 1);
+            regTop = saved;
+
+            uint32_t reg = target >= 0 ? static_cast<uint32_t>(target) : allocReg();
+            emitReg(compareOp(cmp->op, false), reg, left, right);
+            return reg;
+        }
+        else if (auto log = std::dynamic_pointer_cast<LogicalExpr>(expr))
+        {
+            return compileRegLogical(*log, target);
+        }
+        else if (auto call = std::dynamic_pointer_cast<CallExpr>(expr))
+        {
+            return compileRegCall(*call, target);
+        }
+        else if (auto arr = std::dynamic_pointer_cast<ArrayExpr>(expr))
+        {
+            return compileRegArray(*arr, literalArrayType(*arr), target);
+        }
+        else if (auto idx = std::dynamic_pointer_cast<IndexExpr>(expr))
+        {
+            return compileRegIndex(*idx, target);
+        }
+
+        throw std::runtime_error("Unknown expression type");
+    }
+
+    uint32_t Compiler::compileRegAssign(const BinaryExpr &expr, int32_t target)
+    {
+        if (auto element = std::dynamic_pointer_cast<IndexExpr>(expr.left))
+        {
+            return compileRegIndexAssign(*element, expr.right, target);
+        }
+        auto var = std::dynamic_pointer_cast<VariableExpr>(expr.left);
+        if (!var)
+        {
+            throw std::runtime_error("Invalid assignment target");
+        }
+
+        uint32_t idx = resolveLocal(var->name);
+        if (idx == UINT32_MAX)
+        {
+            throw std::runtime_error("Undefined variable: " + var->name);
+        }
+
+        uint32_t saved = regTop;
+        compileRegExpr(expr.right, idx);
+        regTop = saved;
+
+        if (target >= 0 && static_cast<uint32_t>(target) != idx)
+        {
+            emitReg(TVM::ROP_MOVE, target, idx);
+            return target;
+        }
+        return idx;
+    }
+
+    // The register form of compileAppend(): one APPEND per piece, each
+    // evaluated just before it is appended
+    bool Compiler::compileRegAppend(const std::shared_ptr<Expr> &expr)
+    {
+        auto assign = std::dynamic_pointer_cast<BinaryExpr>(expr);
+        if (!assign || assign->op != "=")
+        {
+            return false;
+        }
+        auto target = std::dynamic_pointer_cast<VariableExpr>(assign->left);
+        if (!target || !types.appendTarget(target->name))
+        {
+            return false;
+        }
+        uint32_t idx = resolveLocal(target->name);
+        std::vector<std::shared_ptr<Expr>> pieces = TypeInference::appendedPieces(target->name, assign->right);
+        if (idx == UINT32_MAX || pieces.empty())
+        {
+            return false;
+        }
+
+        uint32_t saved = regTop;
+        for (const auto &piece : pieces)
+        {
+            uint32_t value = compileRegOperandRK(piece, TVM::RK_CONSTANT_C, TVM::RK_CONSTANT_C - 1);
+            emitReg(TVM::ROP_APPEND, idx, 0, value);
+            regTop = saved;
+        }
+        return true;
+    }
+
+    uint32_t Compiler::compileRegLogical(const LogicalExpr &expr, int32_t target)
+    {
+        uint32_t saved = regTop;
+
+        if (expr.op == "!" || expr.op == "-")
+        {
+            uint32_t operand = compileRegExpr(expr.right);
+            regTop = saved;
+            uint32_t reg = target >= 0 ? static_cast<uint32_t>(target) : allocReg();
+            emitReg(expr.op == "!" ? TVM::ROP_NOT : TVM::ROP_NEG, reg, operand);
+            return reg;
+        }
+
+        if (expr.op != "&&" && expr.op != "||")
+        {
+            throw std::runtime_error("Unknown logical operator: " + expr.op);
+        }
+
+        // Both operands land in one temporary so the short-circuit branch
+        // can skip the right-hand side without moving anything.
+        uint32_t tmp = allocReg();
+        compileRegExpr(expr.left, tmp);
+        uint32_t jump = emitReg(expr.op == "&&" ? TVM::ROP_JMP_IFNOT : TVM::ROP_JMP_IF, tmp, 0, 0xFFFFFFFF);
+        compileRegExpr(expr.right, tmp);
+        patchRegJump(jump);
+
+        if (target >= 0)
+        {
+            emitReg(TVM::ROP_MOVE, target, tmp);
+            regTop = saved;
+            return target;
+        }
+        return tmp;
+    }
+
+    // Literal elements come from the pool entry NEW_ARRAY copies; the others
+    // are stored one by one. Those may read the target, so then the array
+    // is built in a temporary and moved there at the end.
+    uint32_t Compiler::compileRegArray(const ArrayExpr &expr, TVM::ValueType arrayType, int32_t target)
+    {
+        std::vector<size_t> computed;
+        uint32_t constant = arrayConstant(expr, arrayType, computed);
+
+        uint32_t saved = regTop;
+        uint32_t reg = target >= 0 && computed.empty() ? static_cast<uint32_t>(target) : allocReg();
+        uint32_t elements = regTop;
+
+        uint32_t length = allocReg();
+        emitReg(TVM::ROP_LOADK, length, 0, addConstantInt(static_cast<int64_t>(expr.elements.size())));
+        emitReg(TVM::ROP_NEW_ARRAY, reg, length, constant);
+        regTop = elements;
+
+        for (size_t i : computed)
+        {
+            auto position = std::make_shared<LiteralExpr>(Value(static_cast<int64_t>(i)));
+            uint32_t index = compileRegOperandRK(position, TVM::RK_CONSTANT_B, TVM::RK_CONSTANT_B - 1);
+            uint32_t value = compileRegExpr(expr.elements[i]);
+            emitReg(TVM::ROP_STORE_INDEX, reg, index, value);
+            regTop = elements;
+        }
+
+        if (target >= 0)
+        {
+            if (reg != static_cast<uint32_t>(target))
+            {
+                emitReg(TVM::ROP_MOVE, target, reg);
+            }
+            regTop = saved;
+            return target;
+        }
+        return reg;
+    }
+
+    uint32_t Compiler::compileRegIndex(const IndexExpr &expr, int32_t target)
+    {
+        uint32_t saved = regTop;
+        uint32_t array = compileRegExpr(expr.array);
+        uint32_t index = compileRegOperandRK(expr.index, TVM::RK_CONSTANT_C, TVM::RK_CONSTANT_C - 1);
+        regTop = saved;
+
+        uint32_t reg = target >= 0 ? static_cast<uint32_t>(target) : allocReg();
+        emitReg(TVM::ROP_LOAD_INDEX, reg, array, index);
+        return reg;
+    }
+
+    // The stored value is the assignment's result, as in the stack code
+    uint32_t Compiler::compileRegIndexAssign(const IndexExpr &element, const std::shared_ptr<Expr> &value,
+                                             int32_t target)
+    {
+        uint32_t saved = regTop;
+        uint32_t array = compileRegExpr(element.array);
+        uint32_t index = compileRegOperandRK(element.index, TVM::RK_CONSTANT_B, TVM::RK_CONSTANT_B - 1);
+        uint32_t reg = compileRegExpr(value);
+        emitReg(TVM::ROP_STORE_INDEX, array, index, reg);
+        regTop = saved;
+
+        if (target >= 0)
+        {
+            if (reg != static_cast<uint32_t>(target))
+            {
+                emitReg(TVM::ROP_MOVE, target, reg);
+            }
+            return target;
+        }
+        if (reg < saved)
+        {
+            return reg; // A local's own register
+        }
+        uint32_t result = allocReg();
+        if (result != reg)
+        {
+            emitReg(TVM::ROP_MOVE, result, reg);
+        }
+        return result;
+    }
+
+    // With `tail` set (the value of a `return`), a call to a script function
+    // is emitted as ROP_TAILCALL, which needs no RET after it, and the
+    // returned register is meaningless.
+    uint32_t Compiler::compileRegCall(const CallExpr &expr, int32_t target, bool tail)
+    {
+        std::cout << "DEBUG compileCall: " << expr.className << "." << expr.methodName
+                  << " (isNative: " << expr.isNative << ")" << std::endl;
+
+        std::string fullName = expr.className + "." + expr.methodName;
+        uint32_t saved = regTop;
+
+        if (expr.isNative && (fullName == "Console.println" || fullName == "Console.print"))
+        {
+            if (expr.args.size() != 1)
+            {
+                throw std::runtime_error(fullName + " expects one argument");
+            }
+            uint32_t value = compileRegExpr(expr.args[0]);
+            emitReg(fullName == "Console.println" ? TVM::ROP_PRINTLN : TVM::ROP_PRINT, value);
+            regTop = saved;
+
+            uint32_t reg = target >= 0 ? static_cast<uint32_t>(target) : allocReg();
+            emitReg(TVM::ROP_LOADK, reg, 0, literalConstant(LiteralExpr(Value())));
+            return reg;
+        }
+
+        if (expr.isNative && fullName == "Array.length")
+        {
+            if (expr.args.size() != 1)
+            {
+                throw std::runtime_error("Array.length takes 1 argument");
+            }
+            uint32_t array = compileRegExpr(expr.args[0]);
+            regTop = saved;
+
+            uint32_t reg = target >= 0 ? static_cast<uint32_t>(target) : allocReg();
+            emitReg(TVM::ROP_ARRAY_LEN, reg, array);
+            return reg;
+        }
+
+        if (expr.isNative && fullName == "Console.read")
+        {
+            uint32_t reg = target >= 0 ? static_cast<uint32_t>(target) : allocReg();
+            emitReg(TVM::ROP_READ, reg);
+            return reg;
+        }
+
+        // Arguments are evaluated into consecutive registers; for script
+        // functions they become the first registers of the callee's window.
+        uint32_t base = regTop;
+        for (const auto &arg : expr.args)
+        {
+            compileRegExpr(arg, allocReg());
+        }
+        regTop = saved;
+
+        if (expr.isNative)
+        {
+            if (expr.args.size() > 0xFF)
+            {
+                throw std::runtime_error("Too many arguments to native " + fullName);
+            }
+            uint32_t idx = addNativeImport(fullName);
+            uint32_t reg = target >= 0 ? static_cast<uint32_t>(target) : allocReg();
+            emitReg(TVM::ROP_CALL_NATIVE, reg, base,
+                    (static_cast<uint32_t>(expr.args.size()) << TVM::NATIVE_ARGC_SHIFT) | idx);
+            return reg;
+        }
+
+        std::string functionToCall = expr.className.empty()
+                                         ? expr.methodName
+                                         : expr.className + "_" + expr.methodName;
+
+        auto it = functionAddrs.find(functionToCall);
+        if (it == functionAddrs.end())
+        {
+            it = functionAddrs.find(expr.methodName);
+        }
+        if (it == functionAddrs.end())
+        {
+            throw std::runtime_error("Function " + expr.className + "." + expr.methodName + " not found");
+        }
+
+        // The callee reads its parameters straight out of the argument
+        // registers, so a count mismatch cannot be caught at run time.
+        if (functionArities[it->second] != expr.args.size())
+        {
+            throw std::runtime_error("Function " + functionToCall + " expects " +
+                                     std::to_string(functionArities[it->second]) + " arguments, got " +
+                                     std::to_string(expr.args.size()));
+        }
+
+        if (tail)
+        {
+            emitReg(TVM::ROP_TAILCALL, 0, base, it->second);
+            return base;
+        }
+
+        uint32_t reg = target >= 0 ? static_cast<uint32_t>(target) : allocReg();
+        emitReg(TVM::ROP_CALL, reg, base, it->second);
+        return reg;
+    }
+
+    // Returns a register, or a constant index tagged with constantBit when
+    // the operand is a literal that fits the operand field.
+    uint32_t Compiler::compileRegOperandRK(const std::shared_ptr<Expr> &expr, uint32_t constantBit, uint32_t maxConstant)
+    {
+        if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(expr))
+        {
+            uint32_t idx = literalConstant(*lit);
+            if (idx <= maxConstant)
+            {
+                return idx | constantBit;
+            }
+        }
+        return compileRegExpr(expr);
+    }
+
+    // Emits a conditional jump taken when cond is false and returns its
+    // address for patching. Comparisons fuse into a single compare-branch.
+    uint32_t Compiler::compileRegBranchIfFalse(const std::shared_ptr<Expr> &cond)
+    {
+        uint32_t saved = regTop;
+        uint32_t jump;
+
+        if (auto cmp = std::dynamic_pointer_cast<CompareExpr>(cond))
+        {
+            uint32_t left = compileRegExpr(cmp->left);
+            uint32_t right = compileRegOperandRK(cmp->right, TVM::RK_CONSTANT_B, TVM::RK_CONSTANT_B - 1);
+            jump = emitReg(compareOp(cmp->op, true), left, right, 0xFFFFFFFF);
+        }
+        else
+        {
+            uint32_t reg = compileRegExpr(cond);
+            jump = emitReg(TVM::ROP_JMP_IFNOT, reg, 0, 0xFFFFFFFF);
+        }
+
+        regTop = saved;
+        return jump;
+    }
+
+    uint32_t Compiler::allocReg()
+    {
+        if (regTop >= MAX_REGISTERS)
+        {
+            throw std::runtime_error("Function needs more than " + std::to_string(MAX_REGISTERS) +
+                                     " registers");
+        }
+        uint32_t reg = regTop++;
+        if (regTop > regMax)
+        {
+            regMax = regTop;
+        }
+        return reg;
+    }
+
+    uint32_t Compiler::emitReg(TVM::RegOpCode op, uint32_t a, uint32_t b, uint32_t c)
+    {
+        if (a >= MAX_REGISTERS || b > 0xFFFF)
+        {
+            throw std::runtime_error("Register operand out of range");
+        }
+        bytecode.regCode.push_back(TVM::RegInstruction(op, static_cast<uint8_t>(a),
+                                                       static_cast<uint16_t>(b), c));
+        return bytecode.regCode.size() - 1;
+    }
+
+    void Compiler::patchRegJump(uint32_t jumpAddr)
+    {
+        bytecode.regCode[jumpAddr].c = bytecode.regCode.size();
+    }
+
+    void Compiler::patchRegJumps(const std::vector<uint32_t> &patches, uint32_t target)
+    {
+        for (uint32_t addr : patches)
+        {
+            bytecode.regCode[addr].c = target;
+        }
+    }
+
+    uint32_t Compiler::literalConstant(const LiteralExpr &expr)
+    {
+        if (expr.value.isInt())
+            return addConstantInt(expr.value.asInt());
+        if (expr.value.isFloat())
+            return addConstantFloat(expr.value.asFloat());
+        if (expr.value.isBool())
+            return addConstantBool(expr.value.asBool());
+        if (expr.value.isStr())
+            return addConstantString(expr.value.asStr());
+        if (expr.value.isNil())
+        {
+            for (uint32_t i = 0; i < bytecode.constants.size(); i++)
+            {
+                if (bytecode.constants[i].type == TVM::TYPE_NIL)
+                {
+                    return i;
+                }
+            }
+            TVM::Constant cst;
+            cst.type = TVM::TYPE_NIL;
+            bytecode.constants.push_back(cst);
+            return bytecode.constants.size() - 1;
+        }
+        throw std::runtime_error("Unsupported literal type");
+    }
+
+} // namespace Tail
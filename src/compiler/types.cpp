@@ -0,0 +1,477 @@
+#include "types.h"
+#include <algorithm>
+
+namespace Tail
+{
+
+    StaticType staticTypeFromName(const std::string &name)
+    {
+        if (name == "int")
+            return StaticType::Int;
+        if (name == "float")
+            return StaticType::Float;
+        if (name == "bool")
+            return StaticType::Bool;
+        if (name == "str")
+            return StaticType::Str;
+        return StaticType::Unknown;
+    }
+
+    TVM::ValueType runtimeType(StaticType type)
+    {
+        switch (type)
+        {
+        case StaticType::Int:
+            return TVM::TYPE_INT;
+        case StaticType::Float:
+            return TVM::TYPE_FLOAT;
+        case StaticType::Bool:
+            return TVM::TYPE_BOOL;
+        case StaticType::Str:
+            return TVM::TYPE_STRING;
+        default:
+            return TVM::TYPE_NIL;
+        }
+    }
+
+    void TypeInference::analyze(const FunctionStmt &function, const std::vector<StaticType> &paramTypes)
+    {
+        declared.clear();
+        trusted.clear();
+        appendTargets.clear();
+        stores.clear();
+        calls.clear();
+
+        for (size_t i = 0; i < function.parameters.size(); i++)
+        {
+            StaticType type = i < paramTypes.size() ? paramTypes[i] : StaticType::Unknown;
+            declare(function.parameters[i].name, type == StaticType::Unknown ? "" : function.parameters[i].type);
+        }
+        for (const auto &stmt : function.body)
+        {
+            collect(stmt);
+        }
+
+        for (const auto &[name, type] : declared)
+        {
+            if (type != StaticType::Unknown)
+            {
+                trusted[name] = type;
+            }
+        }
+
+        // Distrusting one local can change the type of expressions stored
+        // into others, so iterate until nothing changes. Each round only
+        // removes entries, which bounds the loop.
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (const auto &[name, value] : stores)
+            {
+                auto it = trusted.find(name);
+                if (it != trusted.end() && exprType(value) != it->second)
+                {
+                    trusted.erase(it);
+                    changed = true;
+                }
+            }
+        }
+
+        for (const auto &[name, value] : stores)
+        {
+            if (localType(name) == StaticType::Str && !appendedPieces(name, value).empty())
+            {
+                appendTargets.insert(name);
+            }
+        }
+    }
+
+    // Whether expr reads the variable `name`
+    static bool mentions(const std::shared_ptr<Expr> &expr, const std::string &name)
+    {
+        if (!expr)
+        {
+            return false;
+        }
+        if (auto var = std::dynamic_pointer_cast<VariableExpr>(expr))
+        {
+            return var->name == name;
+        }
+        if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr))
+        {
+            return mentions(bin->left, name) || mentions(bin->right, name);
+        }
+        if (auto cmp = std::dynamic_pointer_cast<CompareExpr>(expr))
+        {
+            return mentions(cmp->left, name) || mentions(cmp->right, name);
+        }
+        if (auto log = std::dynamic_pointer_cast<LogicalExpr>(expr))
+        {
+            return mentions(log->left, name) || mentions(log->right, name);
+        }
+        if (auto call = std::dynamic_pointer_cast<CallExpr>(expr))
+        {
+            return std::any_of(call->args.begin(), call->args.end(),
+                               [&](const std::shared_ptr<Expr> &arg) { return mentions(arg, name); });
+        }
+        if (auto arr = std::dynamic_pointer_cast<ArrayExpr>(expr))
+        {
+            return std::any_of(arr->elements.begin(), arr->elements.end(),
+                               [&](const std::shared_ptr<Expr> &elem) { return mentions(elem, name); });
+        }
+        if (auto idx = std::dynamic_pointer_cast<IndexExpr>(expr))
+        {
+            return mentions(idx->array, name) || mentions(idx->index, name);
+        }
+        return false;
+    }
+
+    std::vector<std::shared_ptr<Expr>> TypeInference::appendedPieces(const std::string &name,
+                                                                     const std::shared_ptr<Expr> &value)
+    {
+        // `s + a + b` parses as ((s + a) + b): walk down the left spine
+        std::vector<std::shared_ptr<Expr>> pieces;
+        std::shared_ptr<Expr> expr = value;
+        while (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr))
+        {
+            if (bin->op != "+")
+            {
+                return {};
+            }
+            pieces.push_back(bin->right);
+            expr = bin->left;
+        }
+        auto base = std::dynamic_pointer_cast<VariableExpr>(expr);
+        if (!base || base->name != name)
+        {
+            return {};
+        }
+        std::reverse(pieces.begin(), pieces.end());
+
+        // Appending piece by piece changes `name` before later pieces are
+        // evaluated, so only the first may read it (as in s = s + s)
+        if (std::any_of(pieces.begin() + 1, pieces.end(),
+                        [&](const std::shared_ptr<Expr> &piece) { return mentions(piece, name); }))
+        {
+            return {};
+        }
+        return pieces;
+    }
+
+    StaticType TypeInference::localType(const std::string &name) const
+    {
+        auto it = trusted.find(name);
+        return it != trusted.end() ? it->second : StaticType::Unknown;
+    }
+
+    StaticType TypeInference::exprType(const std::shared_ptr<Expr> &expr) const
+    {
+        if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(expr))
+        {
+            if (lit->value.isInt())
+                return StaticType::Int;
+            if (lit->value.isFloat())
+                return StaticType::Float;
+            if (lit->value.isBool())
+                return StaticType::Bool;
+            if (lit->value.isStr())
+                return StaticType::Str;
+            return StaticType::Unknown;
+        }
+        if (auto var = std::dynamic_pointer_cast<VariableExpr>(expr))
+        {
+            return localType(var->name);
+        }
+        if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr))
+        {
+            if (bin->op == "=")
+            {
+                return exprType(bin->right);
+            }
+
+            StaticType left = exprType(bin->left);
+            StaticType right = exprType(bin->right);
+            if (bin->op == "+" && (left == StaticType::Str || right == StaticType::Str))
+            {
+                return StaticType::Str;
+            }
+            if (left == StaticType::Int && right == StaticType::Int)
+            {
+                return StaticType::Int;
+            }
+            if (left == StaticType::Float && right == StaticType::Float && bin->op != "%")
+            {
+                return StaticType::Float;
+            }
+            if (bin->op == "+" &&
+                ((left == StaticType::Int && right == StaticType::Float) ||
+                 (left == StaticType::Float && right == StaticType::Int)))
+            {
+                return StaticType::Float;
+            }
+            return StaticType::Unknown;
+        }
+        if (std::dynamic_pointer_cast<CompareExpr>(expr))
+        {
+            return StaticType::Bool;
+        }
+        if (auto log = std::dynamic_pointer_cast<LogicalExpr>(expr))
+        {
+            if (log->op == "!")
+            {
+                return StaticType::Bool;
+            }
+            if (log->op == "-")
+            {
+                StaticType operand = exprType(log->right);
+                return (operand == StaticType::Int || operand == StaticType::Float) ? operand : StaticType::Unknown;
+            }
+            return StaticType::Unknown;
+        }
+        if (auto call = std::dynamic_pointer_cast<CallExpr>(expr))
+        {
+            if (call->isNative && call->className == "Console" && call->methodName == "read")
+            {
+                return StaticType::Str;
+            }
+        }
+        return StaticType::Unknown;
+    }
+
+    void TypeInference::declare(const std::string &name, const std::string &typeName)
+    {
+        StaticType type = staticTypeFromName(typeName);
+        auto it = declared.find(name);
+        if (it == declared.end())
+        {
+            declared[name] = type;
+        }
+        else if (it->second != type)
+        {
+            // Same name declared with different types in different scopes;
+            // locals are resolved by name, so trust neither.
+            it->second = StaticType::Unknown;
+        }
+    }
+
+    void TypeInference::collect(const std::shared_ptr<Stmt> &stmt)
+    {
+        if (!stmt)
+        {
+            return;
+        }
+
+        if (auto varDecl = std::dynamic_pointer_cast<VarDeclStmt>(stmt))
+        {
+            declare(varDecl->name, varDecl->type);
+            if (varDecl->initializer)
+            {
+                stores.emplace_back(varDecl->name, varDecl->initializer);
+                collectExpr(varDecl->initializer);
+            }
+        }
+        else if (auto arrayDecl = std::dynamic_pointer_cast<ArrayDeclStmt>(stmt))
+        {
+            declared[arrayDecl->name] = StaticType::Unknown;
+            collectExpr(arrayDecl->size);
+            collectExpr(arrayDecl->initializer);
+        }
+        else if (auto assign = std::dynamic_pointer_cast<AssignStmt>(stmt))
+        {
+            stores.emplace_back(assign->name, assign->value);
+            collectExpr(assign->value);
+        }
+        else if (auto exprStmt = std::dynamic_pointer_cast<ExprStmt>(stmt))
+        {
+            collectExpr(exprStmt->expression);
+        }
+        else if (auto block = std::dynamic_pointer_cast<BlockStmt>(stmt))
+        {
+            for (const auto &inner : block->statements)
+            {
+                collect(inner);
+            }
+        }
+        else if (auto ifStmt = std::dynamic_pointer_cast<IfStmt>(stmt))
+        {
+            collectExpr(ifStmt->condition);
+            collect(ifStmt->thenBranch);
+            collect(ifStmt->elseBranch);
+        }
+        else if (auto whileStmt = std::dynamic_pointer_cast<WhileStmt>(stmt))
+        {
+            collectExpr(whileStmt->condition);
+            collect(whileStmt->body);
+        }
+        else if (auto forStmt = std::dynamic_pointer_cast<ForStmt>(stmt))
+        {
+            collect(forStmt->initializer);
+            collectExpr(forStmt->condition);
+            collectExpr(forStmt->increment);
+            collect(forStmt->body);
+        }
+        else if (auto returnStmt = std::dynamic_pointer_cast<ReturnStmt>(stmt))
+        {
+            collectExpr(returnStmt->value);
+        }
+        // Nested functions are analysed when they are compiled
+    }
+
+    void TypeInference::collectExpr(const std::shared_ptr<Expr> &expr)
+    {
+        if (!expr)
+        {
+            return;
+        }
+
+        if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr))
+        {
+            if (bin->op == "=")
+            {
+                if (auto target = std::dynamic_pointer_cast<VariableExpr>(bin->left))
+                {
+                    stores.emplace_back(target->name, bin->right);
+                }
+            }
+            collectExpr(bin->left);
+            collectExpr(bin->right);
+        }
+        else if (auto cmp = std::dynamic_pointer_cast<CompareExpr>(expr))
+        {
+            collectExpr(cmp->left);
+            collectExpr(cmp->right);
+        }
+        else if (auto log = std::dynamic_pointer_cast<LogicalExpr>(expr))
+        {
+            collectExpr(log->left);
+            collectExpr(log->right);
+        }
+        else if (auto call = std::dynamic_pointer_cast<CallExpr>(expr))
+        {
+            if (!call->isNative)
+            {
+                calls.push_back(call.get());
+            }
+            for (const auto &arg : call->args)
+            {
+                collectExpr(arg);
+            }
+        }
+        else if (auto arr = std::dynamic_pointer_cast<ArrayExpr>(expr))
+        {
+            for (const auto &elem : arr->elements)
+            {
+                collectExpr(elem);
+            }
+        }
+        else if (auto idx = std::dynamic_pointer_cast<IndexExpr>(expr))
+        {
+            collectExpr(idx->array);
+            collectExpr(idx->index);
+        }
+    }
+
+    // Every function declaration in stmt, nested ones included
+    static void collectFunctions(const std::shared_ptr<Stmt> &stmt, std::vector<const FunctionStmt *> &functions)
+    {
+        if (auto func = std::dynamic_pointer_cast<FunctionStmt>(stmt))
+        {
+            functions.push_back(func.get());
+            for (const auto &inner : func->body)
+            {
+                collectFunctions(inner, functions);
+            }
+        }
+        else if (auto block = std::dynamic_pointer_cast<BlockStmt>(stmt))
+        {
+            for (const auto &inner : block->statements)
+            {
+                collectFunctions(inner, functions);
+            }
+        }
+        else if (auto ifStmt = std::dynamic_pointer_cast<IfStmt>(stmt))
+        {
+            collectFunctions(ifStmt->thenBranch, functions);
+            collectFunctions(ifStmt->elseBranch, functions);
+        }
+        else if (auto whileStmt = std::dynamic_pointer_cast<WhileStmt>(stmt))
+        {
+            collectFunctions(whileStmt->body, functions);
+        }
+        else if (auto forStmt = std::dynamic_pointer_cast<ForStmt>(stmt))
+        {
+            collectFunctions(forStmt->body, functions);
+        }
+    }
+
+    ParamTypes inferParamTypes(const std::vector<std::shared_ptr<Stmt>> &program)
+    {
+        std::vector<const FunctionStmt *> functions;
+        for (const auto &stmt : program)
+        {
+            collectFunctions(stmt, functions);
+        }
+
+        // Calls resolve by name; a name declared twice resolves to
+        // whichever was compiled last, so neither trusts its parameters
+        std::map<std::string, const FunctionStmt *> byName;
+        for (const FunctionStmt *function : functions)
+        {
+            auto [it, added] = byName.emplace(function->name, function);
+            if (!added)
+            {
+                it->second = nullptr;
+            }
+        }
+
+        ParamTypes result;
+        for (const FunctionStmt *function : functions)
+        {
+            std::vector<StaticType> &types = result[function];
+            for (const auto &param : function->parameters)
+            {
+                StaticType type = staticTypeFromName(param.type);
+                bool numeric = (type == StaticType::Int || type == StaticType::Float);
+                types.push_back(numeric && byName[function->name] ? type : StaticType::Unknown);
+            }
+        }
+
+        // Each round only distrusts parameters, which bounds the loop
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (const FunctionStmt *caller : functions)
+            {
+                TypeInference inference;
+                inference.analyze(*caller, result[caller]);
+                for (const CallExpr *call : inference.userCalls())
+                {
+                    // Same lookup as Compiler::compileCall
+                    auto it = call->className.empty() ? byName.end() : byName.find(call->className + "_" + call->methodName);
+                    if (it == byName.end())
+                    {
+                        it = byName.find(call->methodName);
+                    }
+                    if (it == byName.end() || !it->second)
+                    {
+                        continue;
+                    }
+                    std::vector<StaticType> &types = result[it->second];
+                    for (size_t i = 0; i < types.size(); i++)
+                    {
+                        if (types[i] != StaticType::Unknown &&
+                            (i >= call->args.size() || inference.exprType(call->args[i]) != types[i]))
+                        {
+                            types[i] = StaticType::Unknown;
+                            changed = true;
+                        }
+                    }
+                }
+            }
+        }
+        return result;
+    }
+
+} // namespace Tail
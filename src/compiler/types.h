@@ -0,0 +1,79 @@
+#pragma once
+#include "../shared/ast.h"
+#include "../shared/bytecode.h"
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Tail
+{
+
+    // Compile-time knowledge about the runtime type of a value
+    enum class StaticType : uint8_t
+    {
+        Unknown,
+        Int,
+        Float,
+        Bool,
+        Str
+    };
+
+    StaticType staticTypeFromName(const std::string &name);
+    TVM::ValueType runtimeType(StaticType type);
+
+    // Per-function type inference. Declared types are only hints: the
+    // language lets `int x` be assigned anything. A local is trusted to
+    // hold its declared type only if every store to it provably does, so
+    // code specialised on trusted types never sees another type. Params
+    // are stored to by call sites, so their types come from
+    // inferParamTypes().
+    class TypeInference
+    {
+    public:
+        // paramTypes: proven type of each parameter; missing entries are
+        // Unknown
+        void analyze(const FunctionStmt &function, const std::vector<StaticType> &paramTypes = {});
+
+        // Trusted type of a local, or Unknown
+        StaticType localType(const std::string &name) const;
+
+        StaticType exprType(const std::shared_ptr<Expr> &expr) const;
+
+        // Whether `name` is a trusted str local that some `name = name + ...`
+        // extends. Those statements compile to OP_APPEND_LOCAL (ROP_APPEND),
+        // so its loads must be OP_LOAD_STR (ROP_LOAD_STR).
+        bool appendTarget(const std::string &name) const { return appendTargets.count(name) != 0; }
+
+        // Calls to user functions in the body, nested functions excluded
+        const std::vector<const CallExpr *> &userCalls() const { return calls; }
+
+        // Operands `first + a + b ...` appends to `name`, in order, or an
+        // empty list if the expression is not of that form
+        static std::vector<std::shared_ptr<Expr>> appendedPieces(const std::string &name,
+                                                                 const std::shared_ptr<Expr> &value);
+
+    private:
+        std::map<std::string, StaticType> declared;
+        std::map<std::string, StaticType> trusted;
+        std::set<std::string> appendTargets;
+        std::vector<std::pair<std::string, std::shared_ptr<Expr>>> stores;
+        std::vector<const CallExpr *> calls;
+
+        void declare(const std::string &name, const std::string &typeName);
+        void collect(const std::shared_ptr<Stmt> &stmt);
+        void collectExpr(const std::shared_ptr<Expr> &expr);
+    };
+
+    // Proven parameter types of every user function in a program, nested
+    // ones included. A numeric parameter is trusted only if every call
+    // site passes an argument of exactly its declared type: an int passed
+    // to a float parameter stays an int, as the generic operators see it.
+    // Trusting one function's parameters can prove the arguments it passes
+    // on, so this is a fixpoint; unlisted functions trust no parameters.
+    using ParamTypes = std::map<const FunctionStmt *, std::vector<StaticType>>;
+    ParamTypes inferParamTypes(const std::vector<std::shared_ptr<Stmt>> &program);
+
+} // namespace Tail
@@ -1,8 +1,10 @@
 #include "bytecode.h"
+#include "numbers.h"
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 #include <cstring>
+#include <stdexcept>
 
 namespace TVM {
 
@@ -77,10 +79,20 @@ std::vector<uint8_t> BytecodeFile::serialize() const {
     writeUint16(data, flags);          // Flags 0
     
     // Code section
-    writeUint32(data, static_cast<uint32_t>(code.size()));
-    for (const auto& instr : code) {
-        data.push_back(static_cast<uint8_t>(instr.opcode));
-        writeUint32(data, instr.operand);
+    if (version == BYTECODE_VERSION_REGISTER) {
+        writeUint32(data, static_cast<uint32_t>(regCode.size()));
+        for (const auto& instr : regCode) {
+            data.push_back(static_cast<uint8_t>(instr.opcode));
+            data.push_back(instr.a);
+            writeUint16(data, instr.b);
+            writeUint32(data, instr.c);
+        }
+    } else {
+        writeUint32(data, static_cast<uint32_t>(code.size()));
+        for (const auto& instr : code) {
+            data.push_back(static_cast<uint8_t>(instr.opcode));
+            writeUint32(data, instr.operand);
+        }
     }
     
     // Constants
@@ -161,6 +173,9 @@ std::vector<uint8_t> BytecodeFile::serialize() const {
         writeUint32(data, func.address);
         data.push_back(func.arity);
         data.push_back(func.locals);
+        if (flags & BYTECODE_FLAG_MAX_STACK) {
+            writeUint32(data, func.maxStack);
+        }
     }
     
     // Native imports
@@ -189,13 +204,27 @@ bool BytecodeFile::deserialize(const std::vector<uint8_t>& data) {
     // Code section
     if (ptr + 4 > end) return false;
     uint32_t codeSize = readUint32(ptr);
-    if (ptr + codeSize * 5 > end) return false; // 1 byte opcode + 4 bytes operand per instruction
     
-    code.resize(codeSize);
-    for (uint32_t i = 0; i < codeSize; i++) {
-        if (ptr + 1 > end) return false;
-        code[i].opcode = static_cast<OpCode>(*ptr++);
-        code[i].operand = readUint32(ptr);
+    if (version == BYTECODE_VERSION_REGISTER) {
+        // 1 byte opcode + 1 byte A + 2 bytes B + 4 bytes C per instruction
+        if (static_cast<size_t>(end - ptr) < static_cast<size_t>(codeSize) * 8) return false;
+        
+        regCode.resize(codeSize);
+        for (uint32_t i = 0; i < codeSize; i++) {
+            regCode[i].opcode = static_cast<RegOpCode>(*ptr++);
+            regCode[i].a = *ptr++;
+            regCode[i].b = readUint16(ptr);
+            regCode[i].c = readUint32(ptr);
+        }
+    } else {
+        if (ptr + codeSize * 5 > end) return false; // 1 byte opcode + 4 bytes operand per instruction
+        
+        code.resize(codeSize);
+        for (uint32_t i = 0; i < codeSize; i++) {
+            if (ptr + 1 > end) return false;
+            code[i].opcode = static_cast<OpCode>(*ptr++);
+            code[i].operand = readUint32(ptr);
+        }
     }
     
     // Constants
@@ -336,6 +365,11 @@ bool BytecodeFile::deserialize(const std::vector<uint8_t>& data) {
         
         if (ptr + 1 > end) return false;
         functions[i].locals = *ptr++;
+        
+        if (flags & BYTECODE_FLAG_MAX_STACK) {
+            if (ptr + 4 > end) return false;
+            functions[i].maxStack = readUint32(ptr);
+        }
     }
     
     // Native imports
@@ -364,19 +398,43 @@ bool BytecodeFile::deserialize(const std::vector<uint8_t>& data) {
     return true;
 }
 
+static thread_local BigIntHeap* bigIntHeap = nullptr;
+
+BigIntHeapScope::BigIntHeapScope(BigIntHeap& heap) : previous(bigIntHeap) {
+    bigIntHeap = &heap;
+}
+
+BigIntHeapScope::~BigIntHeapScope() {
+    bigIntHeap = previous;
+}
+
+uint32_t boxBigInt(int64_t value) {
+    if (!bigIntHeap) {
+        throw std::logic_error("No VM heap to box the integer " + intToString(value));
+    }
+    return bigIntHeap->boxInt(value);
+}
+
+int64_t bigIntAt(uint32_t handle) {
+    return bigIntHeap->boxedInt(handle);
+}
+
 std::string Value::toString(const BytecodeFile* prog) const {
-    switch (type) {
+    switch (type()) {
         case TYPE_NIL:
             return "nil";
         case TYPE_INT:
-            return std::to_string(as.intVal);
+            return intToString(asInt());
         case TYPE_FLOAT:
-            return std::to_string(as.floatVal);
+            return floatToString(asFloat());
         case TYPE_BOOL:
-            return as.boolVal ? "true" : "false";
+            return asBool() ? "true" : "false";
         case TYPE_STRING:
-            if (prog && as.stringIdx < prog->strings.size())
-                return prog->strings[as.stringIdx];
+            // Only the VM's string heap can resolve runtime strings
+            if (isInlineString())
+                return std::string(inlineChars(), inlineLength());
+            if (prog && asIndex() < prog->strings.size())
+                return prog->strings[asIndex()];
             return "[string]";
         case TYPE_ARRAY_INT:
             return "[int array]";
@@ -384,21 +442,23 @@ std::string Value::toString(const BytecodeFile* prog) const {
             return "[float array]";
         case TYPE_ARRAY_STRING:
             return "[string array]";
+        case TYPE_STRING_BUILDER:
+            return "[string builder]";
         default:
             return "[unknown]";
     }
 }
 
 bool Value::isTruthy() const {
-    switch (type) {
+    switch (type()) {
         case TYPE_NIL:
             return false;
         case TYPE_INT:
-            return as.intVal != 0;
+            return asInt() != 0;
         case TYPE_FLOAT:
-            return as.floatVal != 0.0;
+            return asFloat() != 0.0;
         case TYPE_BOOL:
-            return as.boolVal;
+            return asBool();
         case TYPE_STRING:
             return true; // Strings are always truthy
         default:
@@ -406,10 +466,182 @@ bool Value::isTruthy() const {
     }
 }
 
+uint32_t superinstructionLength(OpCode op) {
+    switch (op) {
+        case OP_LOAD_LOAD_ADD: return 3;
+        case OP_LT_LOCAL_CONST_JMP_IFNOT: return 4;
+        case OP_INC_LOCAL: return 5;
+        case OP_STORE_POP: return 2;
+        default: return 1;
+    }
+}
+
+OpCode genericOpcode(OpCode op) {
+    switch (op) {
+        case OP_ADD_INT: case OP_ADD_FLOAT: return OP_ADD;
+        case OP_SUB_INT: case OP_SUB_FLOAT: return OP_SUB;
+        case OP_MUL_INT: case OP_MUL_FLOAT: return OP_MUL;
+        case OP_DIV_INT: case OP_DIV_FLOAT: return OP_DIV;
+        case OP_MOD_INT: return OP_MOD;
+        case OP_LT_INT: case OP_LT_FLOAT: return OP_LT;
+        case OP_LTE_INT: case OP_LTE_FLOAT: return OP_LTE;
+        case OP_GT_INT: case OP_GT_FLOAT: return OP_GT;
+        case OP_GTE_INT: case OP_GTE_FLOAT: return OP_GTE;
+        case OP_EQ_INT: case OP_EQ_FLOAT: case OP_EQ_STR: return OP_EQ;
+        case OP_NEQ_INT: case OP_NEQ_FLOAT: case OP_NEQ_STR: return OP_NEQ;
+        default: return op;
+    }
+}
+
+int32_t stackEffect(OpCode op) {
+    switch (genericOpcode(op)) {
+        case OP_PUSH: case OP_DUP: case OP_LOAD: case OP_LOAD_STR: case OP_LOAD_GLOBAL:
+        case OP_READ: case OP_LOAD_INDEX_UNCHECKED:
+        case OP_CALL: case OP_CALL_NATIVE:
+        case OP_LOAD_LOAD_ADD:
+            return 1;
+        case OP_POP:
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+        case OP_EQ: case OP_NEQ: case OP_LT: case OP_LTE: case OP_GT: case OP_GTE:
+        case OP_AND: case OP_OR:
+        case OP_JMP_IF: case OP_JMP_IFNOT:
+        case OP_RET:
+        case OP_LOAD_INDEX:
+        case OP_PRINT: case OP_PRINTLN:
+        case OP_STORE_POP: case OP_APPEND_LOCAL:
+            return -1;
+        case OP_STORE_INDEX:
+            return -2;
+        default:
+            return 0;
+    }
+}
+
+static const char* regOpName(RegOpCode op) {
+    switch (op) {
+        case ROP_MOVE: return "MOVE";
+        case ROP_LOADK: return "LOADK";
+        case ROP_ADD: return "ADD";
+        case ROP_SUB: return "SUB";
+        case ROP_MUL: return "MUL";
+        case ROP_DIV: return "DIV";
+        case ROP_MOD: return "MOD";
+        case ROP_NEG: return "NEG";
+        case ROP_EQ: return "EQ";
+        case ROP_NEQ: return "NEQ";
+        case ROP_LT: return "LT";
+        case ROP_LTE: return "LTE";
+        case ROP_GT: return "GT";
+        case ROP_GTE: return "GTE";
+        case ROP_NOT: return "NOT";
+        case ROP_JMP: return "JMP";
+        case ROP_JMP_IF: return "JMP_IF";
+        case ROP_JMP_IFNOT: return "JMP_IFNOT";
+        case ROP_CALL: return "CALL";
+        case ROP_RET: return "RET";
+        case ROP_CALL_NATIVE: return "CALL_NATIVE";
+        case ROP_TAILCALL: return "TAILCALL";
+        case ROP_JMP_IFNOT_EQ: return "JMP_IFNOT_EQ";
+        case ROP_JMP_IFNOT_NEQ: return "JMP_IFNOT_NEQ";
+        case ROP_JMP_IFNOT_LT: return "JMP_IFNOT_LT";
+        case ROP_JMP_IFNOT_LTE: return "JMP_IFNOT_LTE";
+        case ROP_JMP_IFNOT_GT: return "JMP_IFNOT_GT";
+        case ROP_JMP_IFNOT_GTE: return "JMP_IFNOT_GTE";
+        case ROP_NEW_ARRAY: return "NEW_ARRAY";
+        case ROP_LOAD_INDEX: return "LOAD_INDEX";
+        case ROP_STORE_INDEX: return "STORE_INDEX";
+        case ROP_ARRAY_LEN: return "ARRAY_LEN";
+        case ROP_LOAD_STR: return "LOAD_STR";
+        case ROP_APPEND: return "APPEND";
+        case ROP_PRINT: return "PRINT";
+        case ROP_READ: return "READ";
+        case ROP_PRINTLN: return "PRINTLN";
+        case ROP_HALT: return "HALT";
+        default: return nullptr;
+    }
+}
+
+static std::string rkOperand(uint32_t operand, uint32_t constantBit) {
+    if (operand & constantBit) {
+        return "K" + std::to_string(operand & ~constantBit);
+    }
+    return "r" + std::to_string(operand);
+}
+
+static void dumpRegInstruction(const RegInstruction& instr) {
+    const char* name = regOpName(instr.opcode);
+    if (!name) {
+        std::cout << "UNKNOWN(" << std::hex << (int)instr.opcode << std::dec << ")";
+        return;
+    }
+    std::cout << name;
+    
+    switch (instr.opcode) {
+        case ROP_MOVE:
+        case ROP_NEG:
+        case ROP_NOT:
+        case ROP_ARRAY_LEN:
+        case ROP_LOAD_STR:
+            std::cout << " r" << (int)instr.a << ", r" << instr.b;
+            break;
+        case ROP_LOADK:
+            std::cout << " r" << (int)instr.a << ", K" << instr.c;
+            break;
+        case ROP_ADD: case ROP_SUB: case ROP_MUL: case ROP_DIV: case ROP_MOD:
+        case ROP_EQ: case ROP_NEQ: case ROP_LT: case ROP_LTE: case ROP_GT: case ROP_GTE:
+        case ROP_LOAD_INDEX:
+            std::cout << " r" << (int)instr.a << ", r" << instr.b << ", " << rkOperand(instr.c, RK_CONSTANT_C);
+            break;
+        case ROP_NEW_ARRAY:
+            std::cout << " r" << (int)instr.a << ", r" << instr.b << ", K" << instr.c;
+            break;
+        case ROP_STORE_INDEX:
+            std::cout << " r" << (int)instr.a << ", " << rkOperand(instr.b, RK_CONSTANT_B) << ", "
+                      << rkOperand(instr.c, RK_CONSTANT_C);
+            break;
+        case ROP_APPEND:
+            std::cout << " r" << (int)instr.a << ", " << rkOperand(instr.c, RK_CONSTANT_C);
+            break;
+        case ROP_JMP:
+            std::cout << " " << instr.c;
+            break;
+        case ROP_JMP_IF:
+        case ROP_JMP_IFNOT:
+            std::cout << " r" << (int)instr.a << ", " << instr.c;
+            break;
+        case ROP_JMP_IFNOT_EQ: case ROP_JMP_IFNOT_NEQ: case ROP_JMP_IFNOT_LT:
+        case ROP_JMP_IFNOT_LTE: case ROP_JMP_IFNOT_GT: case ROP_JMP_IFNOT_GTE:
+            std::cout << " r" << (int)instr.a << ", " << rkOperand(instr.b, RK_CONSTANT_B) << ", " << instr.c;
+            break;
+        case ROP_CALL:
+            std::cout << " r" << (int)instr.a << ", r" << instr.b << ", @" << instr.c;
+            break;
+        case ROP_TAILCALL:
+            std::cout << " r" << instr.b << ", @" << instr.c;
+            break;
+        case ROP_CALL_NATIVE:
+            std::cout << " r" << (int)instr.a << ", r" << instr.b << ", native "
+                      << (instr.c & NATIVE_INDEX_MASK) << " argc=" << (instr.c >> NATIVE_ARGC_SHIFT);
+            break;
+        case ROP_RET:
+        case ROP_PRINT:
+        case ROP_READ:
+        case ROP_PRINTLN:
+            std::cout << " r" << (int)instr.a;
+            break;
+        default:
+            break;
+    }
+}
+
 void BytecodeFile::dump() const {
     std::cout << "=== TAIL Bytecode Dump ===" << std::endl;
     std::cout << "Version: " << version << std::endl;
-    std::cout << "Code size: " << code.size() << " instructions" << std::endl;
+    if (version == BYTECODE_VERSION_REGISTER) {
+        std::cout << "Code size: " << regCode.size() << " register instructions" << std::endl;
+    } else {
+        std::cout << "Code size: " << code.size() << " instructions" << std::endl;
+    }
     std::cout << "Constants: " << constants.size() << std::endl;
     std::cout << "Strings: " << strings.size() << std::endl;
     std::cout << "Int arrays: " << intArrays.size() << std::endl;
@@ -449,19 +681,51 @@ void BytecodeFile::dump() const {
                 case OP_STORE: std::cout << "STORE " << code[i].operand; break;
                 case OP_LOAD_GLOBAL: std::cout << "LOAD_GLOBAL " << code[i].operand; break;
                 case OP_STORE_GLOBAL: std::cout << "STORE_GLOBAL " << code[i].operand; break;
+                case OP_LOAD_STR: std::cout << "LOAD_STR " << code[i].operand; break;
+                case OP_APPEND_LOCAL: std::cout << "APPEND_LOCAL " << code[i].operand; break;
                 case OP_JMP: std::cout << "JMP " << code[i].operand; break;
                 case OP_JMP_IF: std::cout << "JMP_IF " << code[i].operand; break;
                 case OP_JMP_IFNOT: std::cout << "JMP_IFNOT " << code[i].operand; break;
                 case OP_CALL: std::cout << "CALL " << code[i].operand; break;
+                case OP_TAILCALL: std::cout << "TAILCALL " << code[i].operand; break;
                 case OP_RET: std::cout << "RET"; break;
                 case OP_CALL_NATIVE: std::cout << "CALL_NATIVE " << code[i].operand; break;
                 case OP_NEW_ARRAY: std::cout << "NEW_ARRAY " << code[i].operand; break;
                 case OP_LOAD_INDEX: std::cout << "LOAD_INDEX"; break;
                 case OP_STORE_INDEX: std::cout << "STORE_INDEX"; break;
+                case OP_LOAD_INDEX_UNCHECKED: std::cout << "LOAD_INDEX_UNCHECKED " << (code[i].operand >> 16) << "[" << (code[i].operand & 0xFFFF) << "]"; break;
+                case OP_STORE_INDEX_UNCHECKED: std::cout << "STORE_INDEX_UNCHECKED " << (code[i].operand >> 16) << "[" << (code[i].operand & 0xFFFF) << "]"; break;
                 case OP_ARRAY_LEN: std::cout << "ARRAY_LEN"; break;
                 case OP_PRINT: std::cout << "PRINT"; break;
                 case OP_READ: std::cout << "READ"; break;
                 case OP_PRINTLN: std::cout << "PRINTLN"; break;
+                case OP_LOAD_LOAD_ADD: std::cout << "LOAD_LOAD_ADD " << code[i].operand; break;
+                case OP_LT_LOCAL_CONST_JMP_IFNOT: std::cout << "LT_LOCAL_CONST_JMP_IFNOT " << code[i].operand; break;
+                case OP_INC_LOCAL: std::cout << "INC_LOCAL " << code[i].operand; break;
+                case OP_STORE_POP: std::cout << "STORE_POP " << code[i].operand; break;
+                case OP_ADD_INT: std::cout << "ADD_INT"; break;
+                case OP_SUB_INT: std::cout << "SUB_INT"; break;
+                case OP_MUL_INT: std::cout << "MUL_INT"; break;
+                case OP_DIV_INT: std::cout << "DIV_INT"; break;
+                case OP_MOD_INT: std::cout << "MOD_INT"; break;
+                case OP_ADD_FLOAT: std::cout << "ADD_FLOAT"; break;
+                case OP_SUB_FLOAT: std::cout << "SUB_FLOAT"; break;
+                case OP_MUL_FLOAT: std::cout << "MUL_FLOAT"; break;
+                case OP_DIV_FLOAT: std::cout << "DIV_FLOAT"; break;
+                case OP_LT_INT: std::cout << "LT_INT"; break;
+                case OP_LTE_INT: std::cout << "LTE_INT"; break;
+                case OP_GT_INT: std::cout << "GT_INT"; break;
+                case OP_GTE_INT: std::cout << "GTE_INT"; break;
+                case OP_EQ_INT: std::cout << "EQ_INT"; break;
+                case OP_NEQ_INT: std::cout << "NEQ_INT"; break;
+                case OP_EQ_STR: std::cout << "EQ_STR"; break;
+                case OP_NEQ_STR: std::cout << "NEQ_STR"; break;
+                case OP_LT_FLOAT: std::cout << "LT_FLOAT"; break;
+                case OP_LTE_FLOAT: std::cout << "LTE_FLOAT"; break;
+                case OP_GT_FLOAT: std::cout << "GT_FLOAT"; break;
+                case OP_GTE_FLOAT: std::cout << "GTE_FLOAT"; break;
+                case OP_EQ_FLOAT: std::cout << "EQ_FLOAT"; break;
+                case OP_NEQ_FLOAT: std::cout << "NEQ_FLOAT"; break;
                 case OP_HALT: std::cout << "HALT"; break;
                 default: std::cout << "UNKNOWN(" << std::hex << (int)code[i].opcode << std::dec << ")"; break;
             }
@@ -469,6 +733,15 @@ void BytecodeFile::dump() const {
         }
     }
     
+    if (!regCode.empty()) {
+        std::cout << "\n=== Register Code ===" << std::endl;
+        for (size_t i = 0; i < regCode.size(); i++) {
+            std::cout << std::setw(4) << std::setfill('0') << i << std::setfill(' ') << ": ";
+            dumpRegInstruction(regCode[i]);
+            std::cout << std::endl;
+        }
+    }
+    
     // Dump strings
     if (!strings.empty()) {
         std::cout << "\n=== Strings ===" << std::endl;
@@ -503,7 +776,8 @@ void BytecodeFile::dump() const {
         for (const auto& func : functions) {
             std::cout << func.name << " @ " << func.address 
                       << " (arity=" << (int)func.arity 
-                      << ", locals=" << (int)func.locals << ")" << std::endl;
+                      << ", locals=" << (int)func.locals
+                      << ", maxStack=" << func.maxStack << ")" << std::endl;
         }
     }
     
@@ -1,10 +1,15 @@
 #pragma once
 #include <cstdint>
+#include <cstring>
 #include <vector>
 #include <string>
 #include <map>
 #include <memory>
 
+#ifndef TVM_NAN_BOXING
+#define TVM_NAN_BOXING 0
+#endif
+
 namespace TVM
 {
 
@@ -44,6 +49,14 @@ namespace TVM
         OP_STORE = 0x41,
         OP_LOAD_GLOBAL = 0x42,
         OP_STORE_GLOBAL = 0x43,
+        // LOAD for a str local the compiler appends to in place: if the
+        // slot holds the builder OP_APPEND_LOCAL turned it into, pushes
+        // its contents as a string.
+        OP_LOAD_STR = 0x44,
+        // `s = s + x` / `s += x` on a str local as a statement: pops x and
+        // appends it to the local, which becomes a string builder on the
+        // first append. Falls back to ADD if the local holds no string.
+        OP_APPEND_LOCAL = 0x45,
 
         // Control flow
         OP_JMP = 0x50,
@@ -52,22 +65,167 @@ namespace TVM
         OP_CALL = 0x53,
         OP_RET = 0x54,
         OP_CALL_NATIVE = 0x55,
+        // `return f(...)`: calls f in place of the current frame. The
+        // arguments become f's first locals and f returns straight to the
+        // caller's caller. Operand: f's address, as for OP_CALL.
+        OP_TAILCALL = 0x56,
 
         // Arrays
         OP_NEW_ARRAY = 0x60,
         OP_LOAD_INDEX = 0x61,
         OP_STORE_INDEX = 0x62,
         OP_ARRAY_LEN = 0x63,
+        // Operand: array local << 16 | index local. Emitted only inside a
+        // loop whose condition bounds the index by the array's length, so
+        // the handlers skip the type and bounds checks (the verifier
+        // checks the loop's shape).
+        OP_LOAD_INDEX_UNCHECKED = 0x64,
+        OP_STORE_INDEX_UNCHECKED = 0x65,
 
         // I/O
         OP_PRINT = 0x70,
         OP_READ = 0x71,
         OP_PRINTLN = 0x72,
 
+        // Superinstructions (emitted by the peephole pass). Each replaces
+        // only the first opcode of the sequence it covers; the rest stay in
+        // place as its operands, so addresses never move and a jump into
+        // the middle of a sequence still runs the unfused code.
+        OP_LOAD_LOAD_ADD = 0x80,            // LOAD a; LOAD b; ADD
+        OP_LT_LOCAL_CONST_JMP_IFNOT = 0x81, // LOAD x; PUSH k; LT; JMP_IFNOT t
+        OP_INC_LOCAL = 0x82,                // LOAD i; PUSH k; ADD; STORE i; POP
+        OP_STORE_POP = 0x83,                // STORE x; POP
+
+        // Type-specialised arithmetic and comparisons, emitted when the
+        // compiler has proven both operands' types. Handlers do no type
+        // checks (division and modulo still check for zero).
+        OP_ADD_INT = 0x90,
+        OP_SUB_INT = 0x91,
+        OP_MUL_INT = 0x92,
+        OP_DIV_INT = 0x93,
+        OP_MOD_INT = 0x94,
+        OP_ADD_FLOAT = 0x98,
+        OP_SUB_FLOAT = 0x99,
+        OP_MUL_FLOAT = 0x9A,
+        OP_DIV_FLOAT = 0x9B,
+        OP_LT_INT = 0xA0,
+        OP_LTE_INT = 0xA1,
+        OP_GT_INT = 0xA2,
+        OP_GTE_INT = 0xA3,
+        OP_EQ_INT = 0xA4,
+        OP_NEQ_INT = 0xA5,
+        OP_EQ_STR = 0xA6,                   // Same handle, else same bytes
+        OP_NEQ_STR = 0xA7,
+        OP_LT_FLOAT = 0xA8,
+        OP_LTE_FLOAT = 0xA9,
+        OP_GT_FLOAT = 0xAA,
+        OP_GTE_FLOAT = 0xAB,
+        OP_EQ_FLOAT = 0xAC,
+        OP_NEQ_FLOAT = 0xAD,
+
+        // Quickened forms. VM-internal: the generic handlers rewrite linked
+        // instructions into these after observing operand types, and the
+        // guard in each one reverts it. Never valid in a bytecode file.
+        OP_ADD_INT_QUICK = 0xC0,
+        OP_SUB_INT_QUICK = 0xC1,
+        OP_MUL_INT_QUICK = 0xC2,
+        OP_LT_INT_QUICK = 0xC3,
+        OP_LTE_INT_QUICK = 0xC4,
+        OP_GT_INT_QUICK = 0xC5,
+        OP_GTE_INT_QUICK = 0xC6,
+        OP_ADD_FLOAT_QUICK = 0xC8,
+        OP_SUB_FLOAT_QUICK = 0xC9,
+        OP_MUL_FLOAT_QUICK = 0xCA,
+        OP_LT_FLOAT_QUICK = 0xCB,
+        OP_LTE_FLOAT_QUICK = 0xCC,
+        OP_GT_FLOAT_QUICK = 0xCD,
+        OP_GTE_FLOAT_QUICK = 0xCE,
+
         // System
         OP_HALT = 0xFF
     };
 
+    // Number of instructions a superinstruction spans (1 for plain opcodes)
+    uint32_t superinstructionLength(OpCode op);
+
+    // Generic opcode a type-specialised one stands for (identity otherwise)
+    OpCode genericOpcode(OpCode op);
+
+    // Net change in operand-stack depth caused by a stack-ISA instruction.
+    // OP_CALL and OP_CALL_NATIVE count only their result: the arguments they
+    // consume depend on the call site. OP_TAILCALL counts neither, as control
+    // does not come back.
+    int32_t stackEffect(OpCode op);
+
+    // Bytecode format versions. Version 1 is the stack ISA above; version 2
+    // is the register ISA below. The VM picks its engine from the header.
+    constexpr uint16_t BYTECODE_VERSION_STACK = 1;
+    constexpr uint16_t BYTECODE_VERSION_REGISTER = 2;
+
+    // Header flags
+    constexpr uint16_t BYTECODE_FLAG_MAX_STACK = 0x0001; // FunctionInfo::maxStack is stored
+
+    // Register ISA (version 2). Three-address form: A is the destination
+    // register (or the tested register for branches), B and C are source
+    // registers, constant indices or a jump target. Operands marked RK may
+    // name a constant instead of a register by setting the RK_CONSTANT bit.
+    enum RegOpCode : uint8_t
+    {
+        ROP_MOVE = 0x01,    // R[A] = R[B]
+        ROP_LOADK = 0x02,   // R[A] = K[C]
+
+        ROP_ADD = 0x10,     // R[A] = R[B] + RK(C)
+        ROP_SUB = 0x11,
+        ROP_MUL = 0x12,
+        ROP_DIV = 0x13,
+        ROP_MOD = 0x14,
+        ROP_NEG = 0x15,     // R[A] = -R[B]
+
+        ROP_EQ = 0x20,      // R[A] = R[B] == RK(C)
+        ROP_NEQ = 0x21,
+        ROP_LT = 0x22,
+        ROP_LTE = 0x23,
+        ROP_GT = 0x24,
+        ROP_GTE = 0x25,
+
+        ROP_NOT = 0x32,     // R[A] = !R[B]
+
+        ROP_JMP = 0x50,             // pc = C
+        ROP_JMP_IF = 0x51,          // if R[A] then pc = C
+        ROP_JMP_IFNOT = 0x52,       // if !R[A] then pc = C
+        ROP_CALL = 0x53,            // R[A] = call C with args R[B]..
+        ROP_RET = 0x54,             // return R[A]
+        ROP_CALL_NATIVE = 0x55,     // R[A] = native (C & 0xFFFFFF), (C >> 24) args from R[B]..
+        ROP_TAILCALL = 0x56,        // return call C with args R[B].., in place of this frame
+
+        ROP_JMP_IFNOT_EQ = 0x58,    // if !(R[A] == RK(B)) then pc = C
+        ROP_JMP_IFNOT_NEQ = 0x59,
+        ROP_JMP_IFNOT_LT = 0x5A,
+        ROP_JMP_IFNOT_LTE = 0x5B,
+        ROP_JMP_IFNOT_GT = 0x5C,
+        ROP_JMP_IFNOT_GTE = 0x5D,
+
+        ROP_NEW_ARRAY = 0x60,   // R[A] = new array of K[C]'s type, length R[B]
+        ROP_LOAD_INDEX = 0x61,  // R[A] = R[B][RK(C)]
+        ROP_STORE_INDEX = 0x62, // R[A][RK(B)] = RK(C)
+        ROP_ARRAY_LEN = 0x63,   // R[A] = length of R[B]
+
+        // In-place appends to a str local, as OP_LOAD_STR / OP_APPEND_LOCAL
+        ROP_LOAD_STR = 0x68, // R[A] = R[B], a builder read as its string
+        ROP_APPEND = 0x69,   // R[A] += RK(C)
+
+        ROP_PRINT = 0x70,   // print R[A]
+        ROP_READ = 0x71,    // R[A] = line from stdin
+        ROP_PRINTLN = 0x72, // print R[A] and a newline
+
+        ROP_HALT = 0xFF
+    };
+
+    constexpr uint32_t RK_CONSTANT_C = 0x80000000u;
+    constexpr uint16_t RK_CONSTANT_B = 0x8000u;
+    constexpr uint32_t NATIVE_ARGC_SHIFT = 24;
+    constexpr uint32_t NATIVE_INDEX_MASK = 0x00FFFFFFu;
+
     enum ValueType : uint8_t
     {
         TYPE_NIL = 0,
@@ -77,7 +235,8 @@ namespace TVM
         TYPE_STRING = 4,
         TYPE_ARRAY_INT = 5,
         TYPE_ARRAY_FLOAT = 6,
-        TYPE_ARRAY_STRING = 7
+        TYPE_ARRAY_STRING = 7,
+        TYPE_STRING_BUILDER = 8 // Runtime only: Str.builder() and appended-to str locals
     };
 
     struct Constant
@@ -108,27 +267,41 @@ namespace TVM
         Instruction(OpCode op, uint32_t opnd = 0) : opcode(op), operand(opnd) {}
     };
 
+    struct RegInstruction
+    {
+        RegOpCode opcode;
+        uint8_t a;
+        uint16_t b;
+        uint32_t c;
+
+        RegInstruction() : opcode(ROP_HALT), a(0), b(0), c(0) {}
+        RegInstruction(RegOpCode op, uint8_t ra, uint16_t rb = 0, uint32_t rc = 0)
+            : opcode(op), a(ra), b(rb), c(rc) {}
+    };
+
     struct FunctionInfo
     {
         std::string name;
         uint32_t address;
         uint8_t arity;
         uint8_t locals;
+        uint32_t maxStack; // Operand-stack high-water mark above the locals
 
-        FunctionInfo() : address(0), arity(0), locals(0) {}
+        FunctionInfo() : address(0), arity(0), locals(0), maxStack(0) {}
         FunctionInfo(const std::string &n, uint32_t addr, uint8_t a, uint8_t l)
-            : name(n), address(addr), arity(a), locals(l) {}
+            : name(n), address(addr), arity(a), locals(l), maxStack(0) {}
     };
 
     struct BytecodeFile
     {
         // Header
         uint32_t magic = 0x5441494C; // "TAIL"
-        uint16_t version = 1;
+        uint16_t version = BYTECODE_VERSION_STACK;
         uint16_t flags = 0;
 
-        // Code section
+        // Code section (code for version 1, regCode for version 2)
         std::vector<Instruction> code;
+        std::vector<RegInstruction> regCode;
 
         // Data section
         std::vector<Constant> constants;
@@ -151,29 +324,223 @@ namespace TVM
         void dump() const;
     };
 
-    // Value for VM runtime
+#if defined(__GNUC__) || defined(__clang__)
+#define TVM_COLD __attribute__((cold, noinline))
+#define TVM_LIKELY(x) __builtin_expect(!!(x), 1)
+#else
+#define TVM_COLD
+#define TVM_LIKELY(x) (x)
+#endif
+
+    // Integers outside the inline range of a NaN-boxed Value are boxed as
+    // objects in the heap of the VM running on this thread, and the Value
+    // holds the box's handle, so they are collected like strings. Boxing
+    // never collects.
+    class BigIntHeap
+    {
+    public:
+        virtual uint32_t boxInt(int64_t value) = 0;
+        virtual int64_t boxedInt(uint32_t handle) const = 0;
+
+    protected:
+        ~BigIntHeap() = default;
+    };
+
+    // Makes `heap` this thread's BigIntHeap until destroyed
+    class BigIntHeapScope
+    {
+    public:
+        explicit BigIntHeapScope(BigIntHeap &heap);
+        ~BigIntHeapScope();
+
+        BigIntHeapScope(const BigIntHeapScope &) = delete;
+        BigIntHeapScope &operator=(const BigIntHeapScope &) = delete;
+
+    private:
+        BigIntHeap *previous;
+    };
+
+    TVM_COLD uint32_t boxBigInt(int64_t value);
+    TVM_COLD int64_t bigIntAt(uint32_t handle);
+
+    // Value for VM runtime. Code goes through the accessors only, so the
+    // representation is a build choice: by default (TVM_NAN_BOXING, CMake
+    // option TAIL_NAN_BOXING) a value is one NaN-boxed 64-bit word, otherwise
+    // it is a tag plus a union, which is easier to read in a debugger.
+    //
+    // A string is either held inline (at most INLINE_STRING_MAX bytes) or is
+    // the handle of an object in the VM's string heap; handles below the
+    // constant pool's size name the pool's strings.
     class Value
     {
     public:
-        ValueType type;
+        static constexpr uint32_t INLINE_STRING_MAX = 4;
+
+#if TVM_NAN_BOXING
+        Value() : bits(QNAN | (uint64_t(TYPE_NIL) << TAG_SHIFT)) {}
+        Value(int64_t v)
+        {
+            if (TVM_LIKELY(static_cast<uint64_t>(v) - static_cast<uint64_t>(INT_MIN_INLINE) <= INT_PAYLOAD))
+            {
+                bits = INT_PREFIX | (static_cast<uint64_t>(v) & INT_PAYLOAD);
+            }
+            else
+            {
+                bits = QNAN | (uint64_t(TAG_BIGINT) << TAG_SHIFT) | boxBigInt(v);
+            }
+        }
+        Value(double v)
+        {
+            if (v != v)
+            {
+                bits = CANONICAL_NAN; // Keep real NaNs out of the boxed space
+            }
+            else
+            {
+                std::memcpy(&bits, &v, sizeof(bits));
+            }
+        }
+        Value(bool v) : bits(QNAN | (uint64_t(TYPE_BOOL) << TAG_SHIFT) | (v ? 1 : 0)) {}
+        Value(uint32_t idx, ValueType t) : bits(QNAN | (uint64_t(t) << TAG_SHIFT) | idx) {}
+
+        static Value inlineString(const char *chars, uint32_t length)
+        {
+            Value v;
+            v.bits = QNAN | (uint64_t(TAG_INLINE_STRING) << TAG_SHIFT) | (uint64_t(length) << INLINE_LENGTH_SHIFT);
+            std::memcpy(&v.bits, chars, length); // Low-order bytes
+            return v;
+        }
+
+        bool isFloat() const { return (bits & QNAN) != QNAN; }
+        bool isInt() const { return isSmallInt() || isBoxedInt(); }
+        bool isBoxedInt() const { return (bits & ~PAYLOAD32) == (QNAN | (uint64_t(TAG_BIGINT) << TAG_SHIFT)); }
+        bool isString() const { return type() == TYPE_STRING; }
+        ValueType type() const
+        {
+            if (isFloat())
+            {
+                return TYPE_FLOAT;
+            }
+            if (bits & SIGN)
+            {
+                return TYPE_INT;
+            }
+            uint8_t tag = static_cast<uint8_t>(bits >> TAG_SHIFT);
+            if (tag & TAG_INTERNAL)
+            {
+                return tag == TAG_BIGINT ? TYPE_INT : TYPE_STRING;
+            }
+            return static_cast<ValueType>(tag);
+        }
+
+        int64_t asInt() const
+        {
+            if (TVM_LIKELY(isSmallInt()))
+            {
+                // Sign-extend the 50-bit payload
+                return static_cast<int64_t>(bits << (64 - INT_BITS)) >> (64 - INT_BITS);
+            }
+            return bigIntAt(static_cast<uint32_t>(bits));
+        }
+        double asFloat() const
+        {
+            double v;
+            std::memcpy(&v, &bits, sizeof(v));
+            return v;
+        }
+        bool asBool() const { return (bits & 1) != 0; }
+        uint32_t asIndex() const { return static_cast<uint32_t>(bits); } // String, array or boxed int
+
+        bool isInlineString() const
+        {
+            return (bits & ~(PAYLOAD32 | INLINE_LENGTH_MASK)) == (QNAN | (uint64_t(TAG_INLINE_STRING) << TAG_SHIFT));
+        }
+        uint32_t inlineLength() const { return static_cast<uint32_t>((bits & INLINE_LENGTH_MASK) >> INLINE_LENGTH_SHIFT); }
+        const char *inlineChars() const { return reinterpret_cast<const char *>(&bits); }
+
+        // Doubles are stored as themselves. Everything else is a quiet NaN
+        // with bit 50 also set, which no canonicalised double uses: with
+        // the sign bit set the low 50 bits are an integer, without it bits
+        // 32-39 hold a ValueType (or an internal tag) and the low 32 the
+        // payload. Inline strings keep their bytes in the low 32 bits and
+        // their length in bits 40-42. Public for the JIT, which tests and
+        // builds words in generated code.
+        static constexpr uint64_t SIGN = 0x8000000000000000ULL;
+        static constexpr uint64_t QNAN = 0x7FFC000000000000ULL;
+        static constexpr uint64_t CANONICAL_NAN = 0x7FF8000000000000ULL;
+        static constexpr uint64_t INT_PREFIX = SIGN | QNAN;
+        static constexpr int INT_BITS = 50;
+        static constexpr uint64_t INT_PAYLOAD = (1ULL << INT_BITS) - 1;
+        static constexpr int64_t INT_MIN_INLINE = -(1LL << (INT_BITS - 1));
+        static constexpr int TAG_SHIFT = 32;
+        static constexpr uint64_t PAYLOAD32 = 0xFFFFFFFFULL;
+        static constexpr uint8_t TAG_INTERNAL = 0x80;
+        static constexpr uint8_t TAG_BIGINT = 0x80;
+        static constexpr uint8_t TAG_INLINE_STRING = 0x81;
+        static constexpr int INLINE_LENGTH_SHIFT = 40;
+        static constexpr uint64_t INLINE_LENGTH_MASK = 7ULL << INLINE_LENGTH_SHIFT;
+
+    private:
+        // Inline ints are exactly the words at or above INT_PREFIX
+        bool isSmallInt() const { return bits >= INT_PREFIX; }
+
+        uint64_t bits;
+#else
+        Value() : tag(TYPE_NIL), inlineLen(NOT_INLINE) { as.intVal = 0; }
+        Value(int64_t v) : tag(TYPE_INT), inlineLen(NOT_INLINE) { as.intVal = v; }
+        Value(double v) : tag(TYPE_FLOAT), inlineLen(NOT_INLINE) { as.floatVal = v; }
+        Value(bool v) : tag(TYPE_BOOL), inlineLen(NOT_INLINE) { as.boolVal = v; }
+        Value(uint32_t idx, ValueType t) : tag(t), inlineLen(NOT_INLINE) { as.index = idx; }
+
+        static Value inlineString(const char *chars, uint32_t length)
+        {
+            Value v;
+            v.tag = TYPE_STRING;
+            v.inlineLen = static_cast<uint8_t>(length);
+            std::memcpy(v.as.chars, chars, length);
+            return v;
+        }
+
+        bool isFloat() const { return tag == TYPE_FLOAT; }
+        bool isInt() const { return tag == TYPE_INT; }
+        bool isBoxedInt() const { return false; }
+        bool isString() const { return tag == TYPE_STRING; }
+        ValueType type() const { return tag; }
+
+        int64_t asInt() const { return as.intVal; }
+        double asFloat() const { return as.floatVal; }
+        bool asBool() const { return as.boolVal; }
+        uint32_t asIndex() const { return as.index; }
+
+        bool isInlineString() const { return inlineLen != NOT_INLINE; }
+        uint32_t inlineLength() const { return inlineLen; }
+        const char *inlineChars() const { return as.chars; }
+
+    private:
+        static constexpr uint8_t NOT_INLINE = 0xFF;
+
+        ValueType tag;
+        uint8_t inlineLen; // NOT_INLINE unless an inline string
         union
         {
             int64_t intVal;
             double floatVal;
             bool boolVal;
-            uint32_t stringIdx;
-            uint32_t arrayIdx;
+            uint32_t index;
+            char chars[8];
         } as;
+#endif
 
-        Value() : type(TYPE_NIL) { as.intVal = 0; }
-        Value(int64_t v) : type(TYPE_INT) { as.intVal = v; }
-        Value(double v) : type(TYPE_FLOAT) { as.floatVal = v; }
-        Value(bool v) : type(TYPE_BOOL) { as.boolVal = v; }
-        Value(const std::string&, uint32_t idx) : type(TYPE_STRING) { as.stringIdx = idx; }
-        Value(uint32_t idx, ValueType t) : type(t) { as.arrayIdx = idx; }
-
+    public:
         std::string toString(const BytecodeFile *prog = nullptr) const;
         bool isTruthy() const;
     };
 
+#if TVM_NAN_BOXING
+    static_assert(sizeof(Value) == sizeof(uint64_t), "NaN-boxed Value must be one machine word");
+#if defined(__BYTE_ORDER__)
+    static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "Inline strings assume a little-endian word");
+#endif
+#endif
+
 }
\ No newline at end of file
@@ -0,0 +1,94 @@
+#include "numbers.h"
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+
+namespace TVM
+{
+
+    char *formatInt(char *out, int64_t value)
+    {
+        return std::to_chars(out, out + NUMBER_TEXT_MAX, value).ptr;
+    }
+
+    char *formatFloat(char *out, double value)
+    {
+        char *end = std::to_chars(out, out + NUMBER_TEXT_MAX, value).ptr;
+        // Shortest form of an integral double has no point: keep it a float.
+        // inf and nan stay as they are.
+        for (const char *c = out; c < end; c++)
+        {
+            if (*c == '.' || *c == 'e' || *c == 'n')
+            {
+                return end;
+            }
+        }
+        std::memcpy(end, ".0", 2);
+        return end + 2;
+    }
+
+    std::string intToString(int64_t value)
+    {
+        char text[NUMBER_TEXT_MAX];
+        return std::string(text, formatInt(text, value));
+    }
+
+    std::string floatToString(double value)
+    {
+        char text[NUMBER_TEXT_MAX];
+        return std::string(text, formatFloat(text, value));
+    }
+
+    // The number inside `text`: surrounding whitespace and a leading '+'
+    // removed (from_chars accepts neither)
+    static std::string_view numberText(std::string_view text)
+    {
+        auto space = [](char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v'; };
+        while (!text.empty() && space(text.front()))
+        {
+            text.remove_prefix(1);
+        }
+        while (!text.empty() && space(text.back()))
+        {
+            text.remove_suffix(1);
+        }
+        if (text.size() > 1 && text.front() == '+' && text[1] != '-')
+        {
+            text.remove_prefix(1);
+        }
+        return text;
+    }
+
+    bool parseInt(std::string_view text, int64_t &value)
+    {
+        text = numberText(text);
+        int64_t parsed;
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), parsed);
+        if (error != std::errc() || end != text.data() + text.size())
+        {
+            return false;
+        }
+        value = parsed;
+        return true;
+    }
+
+    bool parseFloat(std::string_view text, double &value)
+    {
+        text = numberText(text);
+        double parsed;
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), parsed);
+        // Out of range is an error for from_chars; strtod's answer (inf, or
+        // 0 on underflow) is still the nearest double
+        if (error == std::errc::result_out_of_range && end == text.data() + text.size())
+        {
+            parsed = std::strtod(std::string(text).c_str(), nullptr);
+        }
+        else if (error != std::errc() || end != text.data() + text.size())
+        {
+            return false;
+        }
+        value = parsed;
+        return true;
+    }
+
+} // namespace TVM
@@ -0,0 +1,75 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Number helpers shared by the runtime and the compiler.
+//
+// Int arithmetic wraps on overflow (two's complement), division included.
+// The interpreters,
+// the JIT helpers, the Array kernels and the constant folder all go
+// through these, so every path computes the same result and none relies
+// on signed overflow, which C++ leaves undefined.
+//
+// Number <-> text conversion: what `+` concatenates, what Console.println
+// prints and what IO.toInt/IO.toFloat read. Built on
+// std::to_chars/std::from_chars, so it ignores the locale, never allocates
+// on its own and never throws. Floats print as the shortest text that
+// reads back as the same double, with ".0" added when that would look like
+// an int ("2.0", "0.1", "1e+100").
+
+namespace TVM
+{
+
+    inline int64_t wrapAdd(int64_t a, int64_t b)
+    {
+        return static_cast<int64_t>(static_cast<uint64_t>(a) + static_cast<uint64_t>(b));
+    }
+
+    inline int64_t wrapSub(int64_t a, int64_t b)
+    {
+        return static_cast<int64_t>(static_cast<uint64_t>(a) - static_cast<uint64_t>(b));
+    }
+
+    inline int64_t wrapMul(int64_t a, int64_t b)
+    {
+        return static_cast<int64_t>(static_cast<uint64_t>(a) * static_cast<uint64_t>(b));
+    }
+
+    inline int64_t wrapNeg(int64_t a)
+    {
+        return static_cast<int64_t>(0 - static_cast<uint64_t>(a));
+    }
+
+    // Truncating division; the divisor must not be zero. INT64_MIN / -1,
+    // the one quotient that does not fit, wraps to INT64_MIN and leaves a
+    // remainder of 0 instead of trapping (SIGFPE on x86).
+    inline int64_t wrapDiv(int64_t a, int64_t b)
+    {
+        return b == -1 ? wrapNeg(a) : a / b;
+    }
+
+    inline int64_t wrapMod(int64_t a, int64_t b)
+    {
+        return b == -1 ? 0 : a % b;
+    }
+
+    // Enough for any int64_t or double
+    constexpr size_t NUMBER_TEXT_MAX = 32;
+
+    // Writes the text of `value` at `out`, which must have room for
+    // NUMBER_TEXT_MAX characters, and returns one past its end
+    char *formatInt(char *out, int64_t value);
+    char *formatFloat(char *out, double value);
+
+    std::string intToString(int64_t value);
+    std::string floatToString(double value);
+
+    // Whole-string parses. Surrounding ASCII whitespace and a leading '+'
+    // are allowed; anything else that is not part of the number, or an int
+    // out of range, fails and leaves `value` alone.
+    bool parseInt(std::string_view text, int64_t &value);
+    bool parseFloat(std::string_view text, double &value);
+
+} // namespace TVM
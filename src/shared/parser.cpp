@@ -191,7 +191,15 @@ namespace Tail
 
                 auto paramName = consume(TokenType::IDENTIFIER, "Expected parameter name");
 
-                parameters.push_back({typeToken.text, paramName.text});
+                // Array parameter: `int xs[]`
+                std::string paramType = typeToken.text;
+                if (match(TokenType::LEFT_BRACKET))
+                {
+                    consume(TokenType::RIGHT_BRACKET, "Expected ']' after '[' in array parameter");
+                    paramType += "[]";
+                }
+
+                parameters.push_back({paramType, paramName.text});
 
             } while (match(TokenType::COMMA));
         }
@@ -231,16 +239,18 @@ namespace Tail
         bool isMutable = match(TokenType::UNMUT) || match(TokenType::MUT);
         (void)isMutable;
 
-        if (isTypeToken(peek().type))
+        // `int xs[n];` or `int xs[] = [...];`
+        if (isTypeToken(peek().type) && pos + 2 < tokens.size() &&
+            tokens[pos + 1].type == TokenType::IDENTIFIER &&
+            tokens[pos + 2].type == TokenType::LEFT_BRACKET)
         {
-            pos = savedPos;
-            return parseVarDeclaration();
+            return parseArrayDeclaration();
         }
 
-        if (check(TokenType::IDENTIFIER) && pos + 1 < tokens.size() &&
-            tokens[pos + 1].type == TokenType::LEFT_BRACKET)
+        if (isTypeToken(peek().type))
         {
-            return parseArrayDeclaration();
+            pos = savedPos;
+            return parseVarDeclaration();
         }
 
         auto expr = parseExpression();
@@ -327,6 +337,7 @@ namespace Tail
         auto condition = parseExpression();
         consume(TokenType::RIGHT_PAREN, "Expected ')' after condition");
 
+        consume(TokenType::LEFT_BRACE, "Expected '{' after if condition");
         auto thenBranch = parseBlock();
 
         std::shared_ptr<Stmt> elseBranch = nullptr;
@@ -338,6 +349,7 @@ namespace Tail
             }
             else
             {
+                consume(TokenType::LEFT_BRACE, "Expected '{' after 'else'");
                 elseBranch = parseBlock();
             }
         }
@@ -448,10 +460,40 @@ namespace Tail
             {
                 return std::make_shared<BinaryExpr>(var, "=", value);
             }
+            if (auto index = std::dynamic_pointer_cast<IndexExpr>(expr))
+            {
+                return std::make_shared<BinaryExpr>(index, "=", value);
+            }
 
             error(peek(), "Invalid assignment target");
         }
 
+        // `x op= e` is `x = x op e`. The target is evaluated twice, so an
+        // indexed one may only use variables and literals.
+        static const std::vector<std::pair<TokenType, std::string>> compoundOps = {
+            {TokenType::PLUS_EQUAL, "+"}, {TokenType::MINUS_EQUAL, "-"}, {TokenType::STAR_EQUAL, "*"},
+            {TokenType::SLASH_EQUAL, "/"}, {TokenType::MOD_EQUAL, "%"}};
+        for (const auto &[token, op] : compoundOps)
+        {
+            if (!match(token))
+            {
+                continue;
+            }
+            auto value = parseAssignment();
+
+            auto simple = [](const std::shared_ptr<Expr> &operand)
+            {
+                return std::dynamic_pointer_cast<VariableExpr>(operand) || std::dynamic_pointer_cast<LiteralExpr>(operand);
+            };
+            auto index = std::dynamic_pointer_cast<IndexExpr>(expr);
+            if (std::dynamic_pointer_cast<VariableExpr>(expr) || (index && simple(index->array) && simple(index->index)))
+            {
+                return std::make_shared<BinaryExpr>(expr, "=", std::make_shared<BinaryExpr>(expr, op, value));
+            }
+
+            error(peek(), "Invalid compound assignment target");
+        }
+
         return expr;
     }
 
@@ -537,6 +579,12 @@ namespace Tail
                 auto name = consume(TokenType::IDENTIFIER, "Expected property name after '.'");
                 expr = std::make_shared<GetExpr>(expr, name.text);
             }
+            else if (match(TokenType::LEFT_BRACKET))
+            {
+                auto index = parseExpression();
+                consume(TokenType::RIGHT_BRACKET, "Expected ']' after index");
+                expr = std::make_shared<IndexExpr>(expr, index);
+            }
             else
             {
                 break;
@@ -584,11 +632,31 @@ namespace Tail
             consume(TokenType::RIGHT_PAREN, "Expected ')' after expression");
             return expr;
         }
+        if (match(TokenType::LEFT_BRACKET))
+        {
+            return parseArrayLiteral();
+        }
 
         error(peek(), "Expected expression");
         return nullptr;
     }
 
+    std::shared_ptr<Expr> Parser::parseArrayLiteral()
+    {
+        std::vector<std::shared_ptr<Expr>> elements;
+
+        if (!check(TokenType::RIGHT_BRACKET))
+        {
+            do
+            {
+                elements.push_back(parseExpression());
+            } while (match(TokenType::COMMA));
+        }
+
+        consume(TokenType::RIGHT_BRACKET, "Expected ']' after array elements");
+        return std::make_shared<ArrayExpr>(elements);
+    }
+
     bool Parser::isTypeToken(TokenType type) const
     {
         switch (type)
@@ -625,7 +693,7 @@ namespace Tail
                 bool isNative = false;
 
                 static const std::vector<std::string> realNatives = {
-                    "Console", "Math", "String", "Array", "File", "System"};
+                    "Console", "Math", "String", "Str", "IO", "Array", "File", "System"};
 
                 bool isRealNative = false;
                 for (const auto &lib : realNatives)
@@ -1,22 +1,165 @@
 #include "vm/vm.h"
+#include "vm/verifier.h"
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <filesystem>
+#include <chrono>
+
+static void printUsage() {
+    std::cerr << "Usage: tail [options] <file.tailc>" << std::endl;
+    std::cerr << "Executes Tail bytecode in the Tail Virtual Machine." << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --dispatch=<mode>  Interpreter dispatch: threaded (default) or switch" << std::endl;
+    std::cerr << "  --no-quicken       Keep generic opcodes instead of specialising them at run time" << std::endl;
+    std::cerr << "  --jit              Compile hot functions to native code (x86-64 Linux)" << std::endl;
+    std::cerr << "  --jit-threshold=N  Calls or loop iterations before a function is compiled (default "
+              << TVM::VM::DEFAULT_JIT_THRESHOLD << ")" << std::endl;
+    std::cerr << "  --simd=<level>     Array.* kernels: avx2, sse2 or scalar (default: best the CPU has)" << std::endl;
+    std::cerr << "  --stack-size=N     Value stack capacity in slots (default "
+              << TVM::VM::DEFAULT_STACK_SLOTS << ")" << std::endl;
+    std::cerr << "  --max-heap=N[K|M|G] Fail once live heap objects would exceed N bytes" << std::endl;
+    std::cerr << "  --gc-stress        Collect garbage before every heap allocation" << std::endl;
+    std::cerr << "  --gc-stats         Print collections, pause times and bytes freed on exit" << std::endl;
+    std::cerr << "  --stats            Print instruction count and throughput on exit" << std::endl;
+    std::cerr << "  --unbuffered       Write program output at every print (default: per line on a" << std::endl;
+    std::cerr << "                     terminal, in 64K blocks otherwise)" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "First compile your Tail source code:" << std::endl;
+    std::cerr << "  tailc program.tail" << std::endl;
+    std::cerr << "Then execute it:" << std::endl;
+    std::cerr << "  tail program.tailc" << std::endl;
+}
+
+// Accepts a byte count with an optional K, M or G suffix
+static size_t parseSize(const std::string& text) {
+    size_t end = 0;
+    unsigned long long value = std::stoull(text, &end);
+    std::string suffix = text.substr(end);
+    if (suffix == "K" || suffix == "k") {
+        value <<= 10;
+    } else if (suffix == "M" || suffix == "m") {
+        value <<= 20;
+    } else if (suffix == "G" || suffix == "g") {
+        value <<= 30;
+    } else if (!suffix.empty()) {
+        throw std::invalid_argument("bad size suffix");
+    }
+    return static_cast<size_t>(value);
+}
+
+static const char* simdName(TVM::SimdLevel level) {
+    switch (level) {
+    case TVM::SimdLevel::AVX2:
+        return "avx2";
+    case TVM::SimdLevel::SSE2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+static void printGcStats(const TVM::VM& vm) {
+    const TVM::GcStats& gc = vm.getGcStats();
+    std::cerr << "[gc] collections: " << gc.collections << std::endl;
+    std::cerr << "[gc] pause: " << gc.totalPauseMs << " ms total, "
+              << gc.maxPauseMs << " ms max" << std::endl;
+    std::cerr << "[gc] freed: " << gc.bytesFreed << " bytes in "
+              << gc.objectsFreed << " objects" << std::endl;
+    std::cerr << "[gc] allocated: " << gc.bytesAllocated << " bytes, peak live "
+              << gc.peakBytes << ", live at exit " << vm.getHeapBytes() << std::endl;
+}
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: tail <file.tailc>" << std::endl;
-        std::cerr << "Executes Tail bytecode in the Tail Virtual Machine." << std::endl;
-        std::cerr << std::endl;
-        std::cerr << "First compile your Tail source code:" << std::endl;
-        std::cerr << "  tailc program.tail" << std::endl;
-        std::cerr << "Then execute it:" << std::endl;
-        std::cerr << "  tail program.tailc" << std::endl;
-        return 1;
+    std::string inputFile;
+    TVM::DispatchMode dispatchMode = TVM::VM::threadedDispatchAvailable()
+        ? TVM::DispatchMode::Threaded
+        : TVM::DispatchMode::Switch;
+    bool printStats = false;
+    bool quickening = true;
+    bool jit = false;
+    uint32_t jitThreshold = TVM::VM::DEFAULT_JIT_THRESHOLD;
+    size_t stackSlots = TVM::VM::DEFAULT_STACK_SLOTS;
+    size_t maxHeap = 0;
+    bool gcStress = false;
+    bool printGc = false;
+    bool unbuffered = false;
+    bool simdSet = false;
+    TVM::SimdLevel simd = TVM::SimdLevel::Scalar;
+    
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        
+        if (arg == "--dispatch=switch") {
+            dispatchMode = TVM::DispatchMode::Switch;
+        } else if (arg == "--dispatch=threaded") {
+            if (!TVM::VM::threadedDispatchAvailable()) {
+                std::cerr << "Warning: threaded dispatch not built in, using switch" << std::endl;
+            }
+            dispatchMode = TVM::DispatchMode::Threaded;
+        } else if (arg == "--no-quicken") {
+            quickening = false;
+        } else if (arg == "--jit") {
+            if (!TVM::VM::jitAvailable()) {
+                std::cerr << "Warning: JIT not built in, interpreting" << std::endl;
+            }
+            jit = true;
+        } else if (arg.rfind("--jit-threshold=", 0) == 0) {
+            try {
+                jitThreshold = static_cast<uint32_t>(std::stoul(arg.substr(16)));
+            } catch (const std::exception&) {
+                std::cerr << "Error: Invalid JIT threshold: " << arg << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--simd=", 0) == 0) {
+            std::string name = arg.substr(7);
+            if (name == "avx2") {
+                simd = TVM::SimdLevel::AVX2;
+            } else if (name == "sse2") {
+                simd = TVM::SimdLevel::SSE2;
+            } else if (name == "scalar") {
+                simd = TVM::SimdLevel::Scalar;
+            } else {
+                std::cerr << "Error: Unknown SIMD level: " << arg << std::endl;
+                return 1;
+            }
+            simdSet = true;
+        } else if (arg.rfind("--stack-size=", 0) == 0) {
+            try {
+                stackSlots = static_cast<size_t>(std::stoull(arg.substr(13)));
+            } catch (const std::exception&) {
+                std::cerr << "Error: Invalid stack size: " << arg << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--max-heap=", 0) == 0) {
+            try {
+                maxHeap = parseSize(arg.substr(11));
+            } catch (const std::exception&) {
+                std::cerr << "Error: Invalid heap size: " << arg << std::endl;
+                return 1;
+            }
+        } else if (arg == "--gc-stress") {
+            gcStress = true;
+        } else if (arg == "--gc-stats") {
+            printGc = true;
+        } else if (arg == "--stats") {
+            printStats = true;
+        } else if (arg == "--unbuffered") {
+            unbuffered = true;
+        } else if (arg.rfind("--", 0) == 0 || !inputFile.empty()) {
+            std::cerr << "Error: Unknown argument: " << arg << std::endl;
+            printUsage();
+            return 1;
+        } else {
+            inputFile = arg;
+        }
     }
     
-    std::string inputFile = argv[1];
+    if (inputFile.empty()) {
+        printUsage();
+        return 1;
+    }
     
     // Check file extension
     std::filesystem::path inputPath(inputFile);
@@ -56,12 +199,21 @@ int main(int argc, char* argv[]) {
             return 1;
         }
         
+        TVM::VM vm;
+        
+        // Everything the interpreter no longer checks per instruction is
+        // proven here, once
+        try {
+            TVM::BytecodeVerifier(bytecode, vm).verify();
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        
         std::cout << "Tail Virtual Machine v1.0" << std::endl;
         std::cout << "=========================" << std::endl;
         
         // Execute
-        TVM::VM vm;
-        
         // Enable tracing with environment variable
         const char* traceEnv = std::getenv("TAIL_TRACE");
         if (traceEnv && std::string(traceEnv) == "1") {
@@ -69,11 +221,60 @@ int main(int argc, char* argv[]) {
             std::cout << "[Tracing enabled]" << std::endl;
         }
         
-        vm.execute(bytecode);
+        vm.setDispatchMode(dispatchMode);
+        vm.setQuickening(quickening);
+        vm.setJit(jit, jitThreshold);
+        vm.setStackSize(stackSlots);
+        vm.setMaxHeap(maxHeap);
+        vm.setGcStress(gcStress);
+        if (unbuffered) {
+            vm.setOutputMode(TVM::OutputMode::Unbuffered);
+        }
+        if (simdSet && !vm.setSimd(simd)) {
+            std::cerr << "Warning: " << simdName(simd) << " not supported here, using "
+                      << simdName(vm.getSimd()) << std::endl;
+        }
+        
+        auto startTime = std::chrono::steady_clock::now();
+        try {
+            vm.execute(bytecode);
+        } catch (const std::exception&) {
+            // An out-of-memory error is when the collector's numbers matter most
+            if (printGc) {
+                printGcStats(vm);
+            }
+            throw;
+        }
+        auto endTime = std::chrono::steady_clock::now();
         
         std::cout << "=========================" << std::endl;
         std::cout << "Program finished." << std::endl;
         
+        if (printStats) {
+            double seconds = std::chrono::duration<double>(endTime - startTime).count();
+            uint64_t instructions = vm.getInstructionCount();
+            std::cerr << "[stats] dispatch: "
+                      << (vm.getDispatchMode() == TVM::DispatchMode::Threaded ? "threaded" : "switch")
+                      << std::endl;
+            std::cerr << "[stats] simd: " << simdName(vm.getSimd()) << std::endl;
+            std::cerr << "[stats] instructions: " << instructions << std::endl;
+            std::cerr << "[stats] quickened: " << vm.getQuickenedCount()
+                      << " sites, deoptimized: " << vm.getDeoptimizedCount() << std::endl;
+            if (jit) {
+                // Instructions in compiled code are not counted above
+                std::cerr << "[stats] jit: " << vm.getJitCompiledCount() << " functions compiled" << std::endl;
+            }
+            std::cerr << "[stats] time: " << seconds << " s" << std::endl;
+            if (seconds > 0) {
+                std::cerr << "[stats] instructions/second: "
+                          << static_cast<uint64_t>(instructions / seconds) << std::endl;
+            }
+        }
+        
+        if (printGc) {
+            printGcStats(vm);
+        }
+        
         return 0;
         
     } catch (const std::exception& e) {
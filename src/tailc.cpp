@@ -1,4 +1,5 @@
 #include "compiler/compiler.h"
+#include "compiler/optimizer.h"
 #include "shared/lexer.h"
 #include "shared/parser.h"
 #include <iostream>
@@ -82,13 +83,22 @@ int main(int argc, char *argv[])
 {
     if (argc < 2)
     {
-        std::cerr << "Usage: tailc <file1.tail> [file2.tail ...] [-o output.tailc]" << std::endl;
+        std::cerr << "Usage: tailc <file1.tail> [file2.tail ...] [-o output.tailc] [--target=stack|register] [--[no-]superinstructions] [-O0|-O1|-O2] [--inline-threshold=N]" << std::endl;
         std::cerr << "Compiles Tail source code to Tail bytecode." << std::endl;
+        std::cerr << "  --target=stack     Emit stack bytecode (version 1, default)" << std::endl;
+        std::cerr << "  --target=register  Emit register bytecode (version 2)" << std::endl;
+        std::cerr << "  --superinstructions     Fuse common stack-code sequences in a peephole pass (default)" << std::endl;
+        std::cerr << "  --no-superinstructions  Skip that pass" << std::endl;
+        std::cerr << "  -O0, -O1, -O2      Optimization: none, constant folding and dead code, plus algebraic" << std::endl;
+        std::cerr << "                     simplification (default -O2)" << std::endl;
+        std::cerr << "  --inline-threshold=N  Inline calls to non-recursive functions of at most N AST nodes;" << std::endl;
+        std::cerr << "                     0 disables (default " << Tail::CompilerOptions().inlineThreshold << ", -O1 and above)" << std::endl;
         return 1;
     }
 
     std::vector<std::string> inputFiles;
     std::string outputFile;
+    Tail::CompilerOptions options;
 
     for (int i = 1; i < argc; i++) {
         std::string arg = argv[i];
@@ -100,6 +110,23 @@ int main(int argc, char *argv[])
                 std::cerr << "Error: -o flag requires output filename" << std::endl;
                 return 1;
             }
+        } else if (arg == "--target=stack") {
+            options.bytecodeVersion = TVM::BYTECODE_VERSION_STACK;
+        } else if (arg == "--target=register") {
+            options.bytecodeVersion = TVM::BYTECODE_VERSION_REGISTER;
+        } else if (arg == "--no-superinstructions") {
+            options.superinstructions = false;
+        } else if (arg == "--superinstructions") {
+            options.superinstructions = true;
+        } else if (arg == "-O0" || arg == "-O1" || arg == "-O2") {
+            options.optimizationLevel = arg[2] - '0';
+        } else if (arg.rfind("--inline-threshold=", 0) == 0) {
+            try {
+                options.inlineThreshold = static_cast<uint32_t>(std::stoul(arg.substr(19)));
+            } catch (const std::exception&) {
+                std::cerr << "Error: Invalid inline threshold: " << arg << std::endl;
+                return 1;
+            }
         } else if (endsWith(arg, ".tail")) {
             inputFiles.push_back(arg);
         } else {
@@ -202,6 +229,15 @@ int main(int argc, char *argv[])
                 return 1;
             }
             
+            Tail::AstOptimizer optimizer(options.optimizationLevel);
+            optimizer.run(ast);
+            const auto& optStats = optimizer.getStats();
+            if (optStats.total() > 0) {
+                std::cout << "  Optimized (-O" << options.optimizationLevel << "): " << optStats.folded
+                          << " folded, " << optStats.simplified << " simplified, " << optStats.deadBranches
+                          << " dead branches removed" << std::endl;
+            }
+            
             std::filesystem::path p(sourceFile);
             std::string moduleName = p.stem().string();
             bool isMainFile = std::find(inputFiles.begin(), inputFiles.end(), sourceFile) != inputFiles.end();
@@ -219,7 +255,7 @@ int main(int argc, char *argv[])
         }
         
         
-        Tail::Compiler compiler;
+        Tail::Compiler compiler(options);
         std::vector<std::shared_ptr<Tail::Stmt>> allStatements;
         bool hasMain = false;
         
@@ -273,7 +309,7 @@ int main(int argc, char *argv[])
         
         
         std::cout << "\nGenerating final bytecode..." << std::endl;
-        Tail::Compiler finalCompiler;
+        Tail::Compiler finalCompiler(options);
         auto bytecode = finalCompiler.compile(allStatements);
         
         
@@ -291,7 +327,8 @@ int main(int argc, char *argv[])
         std::cout << "\nSuccessfully compiled!" << std::endl;
         std::cout << "  Output: " << outputFile << std::endl;
         std::cout << "  Bytecode size: " << data.size() << " bytes" << std::endl;
-        std::cout << "  Instructions: " << bytecode.code.size() << std::endl;
+        std::cout << "  Bytecode version: " << bytecode.version << std::endl;
+        std::cout << "  Instructions: " << bytecode.code.size() + bytecode.regCode.size() << std::endl;
         std::cout << "  Constants: " << bytecode.constants.size() << std::endl;
         std::cout << "  Functions: " << bytecode.functions.size() << std::endl;
 
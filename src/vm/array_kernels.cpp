@@ -0,0 +1,635 @@
+#include "array_kernels.h"
+#include <limits>
+
+// SSE2 is part of x86-64, so only AVX2 needs a CPU check. Its kernels are
+// compiled for AVX2 through a target attribute rather than a global -mavx2,
+// which keeps the rest of the VM runnable on older CPUs.
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define TVM_SIMD_X86 1
+#include <immintrin.h>
+#define TVM_AVX2 __attribute__((target("avx2")))
+#else
+#define TVM_SIMD_X86 0
+#endif
+
+namespace TVM
+{
+
+    static const double NOT_A_NUMBER = std::numeric_limits<double>::quiet_NaN();
+
+    // Lane order shared by every float reduction; see array_kernels.h
+    static double reduceLanes(const double lanes[4])
+    {
+        return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+
+    // Scalar
+
+    static int64_t sumIntScalar(const int64_t *xs, size_t n)
+    {
+        uint64_t total = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            total += static_cast<uint64_t>(xs[i]);
+        }
+        return static_cast<int64_t>(total);
+    }
+
+    static double sumFloatScalar(const double *xs, size_t n)
+    {
+        double lanes[4] = {0.0, 0.0, 0.0, 0.0};
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            for (size_t lane = 0; lane < 4; lane++)
+            {
+                lanes[lane] += xs[i + lane];
+            }
+        }
+        double total = reduceLanes(lanes);
+        for (; i < n; i++)
+        {
+            total += xs[i];
+        }
+        return total;
+    }
+
+    static int64_t minIntScalar(const int64_t *xs, size_t n)
+    {
+        int64_t result = xs[0];
+        for (size_t i = 1; i < n; i++)
+        {
+            result = xs[i] < result ? xs[i] : result;
+        }
+        return result;
+    }
+
+    static int64_t maxIntScalar(const int64_t *xs, size_t n)
+    {
+        int64_t result = xs[0];
+        for (size_t i = 1; i < n; i++)
+        {
+            result = xs[i] > result ? xs[i] : result;
+        }
+        return result;
+    }
+
+    static double minFloatScalar(const double *xs, size_t n)
+    {
+        double result = xs[0];
+        for (size_t i = 0; i < n; i++)
+        {
+            if (xs[i] != xs[i])
+            {
+                return NOT_A_NUMBER;
+            }
+            result = xs[i] < result ? xs[i] : result;
+        }
+        return result;
+    }
+
+    static double maxFloatScalar(const double *xs, size_t n)
+    {
+        double result = xs[0];
+        for (size_t i = 0; i < n; i++)
+        {
+            if (xs[i] != xs[i])
+            {
+                return NOT_A_NUMBER;
+            }
+            result = xs[i] > result ? xs[i] : result;
+        }
+        return result;
+    }
+
+    static int64_t dotIntScalar(const int64_t *xs, const int64_t *ys, size_t n)
+    {
+        uint64_t total = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            total += static_cast<uint64_t>(xs[i]) * static_cast<uint64_t>(ys[i]);
+        }
+        return static_cast<int64_t>(total);
+    }
+
+    static double dotFloatScalar(const double *xs, const double *ys, size_t n)
+    {
+        double lanes[4] = {0.0, 0.0, 0.0, 0.0};
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            for (size_t lane = 0; lane < 4; lane++)
+            {
+                lanes[lane] += xs[i + lane] * ys[i + lane];
+            }
+        }
+        double total = reduceLanes(lanes);
+        for (; i < n; i++)
+        {
+            total += xs[i] * ys[i];
+        }
+        return total;
+    }
+
+    static void addIntScalar(int64_t *dst, const int64_t *src, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            dst[i] = static_cast<int64_t>(static_cast<uint64_t>(dst[i]) + static_cast<uint64_t>(src[i]));
+        }
+    }
+
+    static void addFloatScalar(double *dst, const double *src, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            dst[i] += src[i];
+        }
+    }
+
+    static void scaleIntScalar(int64_t *xs, int64_t k, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            xs[i] = static_cast<int64_t>(static_cast<uint64_t>(xs[i]) * static_cast<uint64_t>(k));
+        }
+    }
+
+    static void scaleFloatScalar(double *xs, double k, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            xs[i] *= k;
+        }
+    }
+
+    static const ArrayKernels SCALAR_KERNELS = {
+        sumIntScalar, sumFloatScalar,
+        minIntScalar, maxIntScalar, minFloatScalar, maxFloatScalar,
+        dotIntScalar, dotFloatScalar,
+        addIntScalar, addFloatScalar, scaleIntScalar, scaleFloatScalar};
+
+#if TVM_SIMD_X86
+
+    // SSE2: two registers cover the four float lanes. There is no 64-bit
+    // integer compare before SSE4.2, so integer min/max stay scalar.
+
+    // Low 64 bits of each product, built from 32x32->64 multiplies
+    static __m128i mulInt64Sse2(__m128i a, __m128i b)
+    {
+        __m128i low = _mm_mul_epu32(a, b);
+        __m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), b),
+                                      _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+        return _mm_add_epi64(low, _mm_slli_epi64(cross, 32));
+    }
+
+    static int64_t sumIntSse2(const int64_t *xs, size_t n)
+    {
+        __m128i acc = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 2 <= n; i += 2)
+        {
+            acc = _mm_add_epi64(acc, _mm_loadu_si128(reinterpret_cast<const __m128i *>(xs + i)));
+        }
+        int64_t lanes[2];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc);
+        uint64_t total = static_cast<uint64_t>(lanes[0]) + static_cast<uint64_t>(lanes[1]);
+        return static_cast<int64_t>(total + static_cast<uint64_t>(sumIntScalar(xs + i, n - i)));
+    }
+
+    static double sumFloatSse2(const double *xs, size_t n)
+    {
+        __m128d low = _mm_setzero_pd(), high = _mm_setzero_pd();
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            low = _mm_add_pd(low, _mm_loadu_pd(xs + i));
+            high = _mm_add_pd(high, _mm_loadu_pd(xs + i + 2));
+        }
+        double lanes[4];
+        _mm_storeu_pd(lanes, low);
+        _mm_storeu_pd(lanes + 2, high);
+        double total = reduceLanes(lanes);
+        for (; i < n; i++)
+        {
+            total += xs[i];
+        }
+        return total;
+    }
+
+    static double minFloatSse2(const double *xs, size_t n)
+    {
+        __m128d result = _mm_set1_pd(xs[0]);
+        __m128d unordered = _mm_setzero_pd();
+        size_t i = 0;
+        for (; i + 2 <= n; i += 2)
+        {
+            __m128d v = _mm_loadu_pd(xs + i);
+            unordered = _mm_or_pd(unordered, _mm_cmpunord_pd(v, v));
+            result = _mm_min_pd(v, result);
+        }
+        if (_mm_movemask_pd(unordered))
+        {
+            return NOT_A_NUMBER;
+        }
+        double lanes[2];
+        _mm_storeu_pd(lanes, result);
+        double best = minFloatScalar(lanes, 2);
+        for (; i < n; i++)
+        {
+            if (xs[i] != xs[i])
+            {
+                return NOT_A_NUMBER;
+            }
+            best = xs[i] < best ? xs[i] : best;
+        }
+        return best;
+    }
+
+    static double maxFloatSse2(const double *xs, size_t n)
+    {
+        __m128d result = _mm_set1_pd(xs[0]);
+        __m128d unordered = _mm_setzero_pd();
+        size_t i = 0;
+        for (; i + 2 <= n; i += 2)
+        {
+            __m128d v = _mm_loadu_pd(xs + i);
+            unordered = _mm_or_pd(unordered, _mm_cmpunord_pd(v, v));
+            result = _mm_max_pd(v, result);
+        }
+        if (_mm_movemask_pd(unordered))
+        {
+            return NOT_A_NUMBER;
+        }
+        double lanes[2];
+        _mm_storeu_pd(lanes, result);
+        double best = maxFloatScalar(lanes, 2);
+        for (; i < n; i++)
+        {
+            if (xs[i] != xs[i])
+            {
+                return NOT_A_NUMBER;
+            }
+            best = xs[i] > best ? xs[i] : best;
+        }
+        return best;
+    }
+
+    static int64_t dotIntSse2(const int64_t *xs, const int64_t *ys, size_t n)
+    {
+        __m128i acc = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 2 <= n; i += 2)
+        {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(xs + i));
+            __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ys + i));
+            acc = _mm_add_epi64(acc, mulInt64Sse2(x, y));
+        }
+        int64_t lanes[2];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc);
+        uint64_t total = static_cast<uint64_t>(lanes[0]) + static_cast<uint64_t>(lanes[1]);
+        return static_cast<int64_t>(total + static_cast<uint64_t>(dotIntScalar(xs + i, ys + i, n - i)));
+    }
+
+    static double dotFloatSse2(const double *xs, const double *ys, size_t n)
+    {
+        __m128d low = _mm_setzero_pd(), high = _mm_setzero_pd();
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            low = _mm_add_pd(low, _mm_mul_pd(_mm_loadu_pd(xs + i), _mm_loadu_pd(ys + i)));
+            high = _mm_add_pd(high, _mm_mul_pd(_mm_loadu_pd(xs + i + 2), _mm_loadu_pd(ys + i + 2)));
+        }
+        double lanes[4];
+        _mm_storeu_pd(lanes, low);
+        _mm_storeu_pd(lanes + 2, high);
+        double total = reduceLanes(lanes);
+        for (; i < n; i++)
+        {
+            total += xs[i] * ys[i];
+        }
+        return total;
+    }
+
+    static void addIntSse2(int64_t *dst, const int64_t *src, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 2 <= n; i += 2)
+        {
+            __m128i *d = reinterpret_cast<__m128i *>(dst + i);
+            __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+            _mm_storeu_si128(d, _mm_add_epi64(_mm_loadu_si128(d), s));
+        }
+        addIntScalar(dst + i, src + i, n - i);
+    }
+
+    static void addFloatSse2(double *dst, const double *src, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 2 <= n; i += 2)
+        {
+            _mm_storeu_pd(dst + i, _mm_add_pd(_mm_loadu_pd(dst + i), _mm_loadu_pd(src + i)));
+        }
+        addFloatScalar(dst + i, src + i, n - i);
+    }
+
+    static void scaleIntSse2(int64_t *xs, int64_t k, size_t n)
+    {
+        __m128i factor = _mm_set1_epi64x(k);
+        size_t i = 0;
+        for (; i + 2 <= n; i += 2)
+        {
+            __m128i *p = reinterpret_cast<__m128i *>(xs + i);
+            _mm_storeu_si128(p, mulInt64Sse2(_mm_loadu_si128(p), factor));
+        }
+        scaleIntScalar(xs + i, k, n - i);
+    }
+
+    static void scaleFloatSse2(double *xs, double k, size_t n)
+    {
+        __m128d factor = _mm_set1_pd(k);
+        size_t i = 0;
+        for (; i + 2 <= n; i += 2)
+        {
+            _mm_storeu_pd(xs + i, _mm_mul_pd(_mm_loadu_pd(xs + i), factor));
+        }
+        scaleFloatScalar(xs + i, k, n - i);
+    }
+
+    static const ArrayKernels SSE2_KERNELS = {
+        sumIntSse2, sumFloatSse2,
+        minIntScalar, maxIntScalar, minFloatSse2, maxFloatSse2,
+        dotIntSse2, dotFloatSse2,
+        addIntSse2, addFloatSse2, scaleIntSse2, scaleFloatSse2};
+
+    // AVX2: one register holds the four float lanes
+
+    TVM_AVX2 static __m256i mulInt64Avx2(__m256i a, __m256i b)
+    {
+        __m256i low = _mm256_mul_epu32(a, b);
+        __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                         _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+        return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+    }
+
+    TVM_AVX2 static int64_t sumIntAvx2(const int64_t *xs, size_t n)
+    {
+        __m256i acc = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            acc = _mm256_add_epi64(acc, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(xs + i)));
+        }
+        int64_t lanes[4];
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+        return static_cast<int64_t>(static_cast<uint64_t>(sumIntScalar(lanes, 4)) +
+                                    static_cast<uint64_t>(sumIntScalar(xs + i, n - i)));
+    }
+
+    TVM_AVX2 static double sumFloatAvx2(const double *xs, size_t n)
+    {
+        __m256d acc = _mm256_setzero_pd();
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            acc = _mm256_add_pd(acc, _mm256_loadu_pd(xs + i));
+        }
+        double lanes[4];
+        _mm256_storeu_pd(lanes, acc);
+        double total = reduceLanes(lanes);
+        for (; i < n; i++)
+        {
+            total += xs[i];
+        }
+        return total;
+    }
+
+    TVM_AVX2 static int64_t minIntAvx2(const int64_t *xs, size_t n)
+    {
+        __m256i result = _mm256_set1_epi64x(xs[0]);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(xs + i));
+            result = _mm256_blendv_epi8(result, v, _mm256_cmpgt_epi64(result, v));
+        }
+        int64_t lanes[4];
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), result);
+        int64_t best = minIntScalar(lanes, 4);
+        for (; i < n; i++)
+        {
+            best = xs[i] < best ? xs[i] : best;
+        }
+        return best;
+    }
+
+    TVM_AVX2 static int64_t maxIntAvx2(const int64_t *xs, size_t n)
+    {
+        __m256i result = _mm256_set1_epi64x(xs[0]);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(xs + i));
+            result = _mm256_blendv_epi8(result, v, _mm256_cmpgt_epi64(v, result));
+        }
+        int64_t lanes[4];
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), result);
+        int64_t best = maxIntScalar(lanes, 4);
+        for (; i < n; i++)
+        {
+            best = xs[i] > best ? xs[i] : best;
+        }
+        return best;
+    }
+
+    TVM_AVX2 static double minFloatAvx2(const double *xs, size_t n)
+    {
+        __m256d result = _mm256_set1_pd(xs[0]);
+        __m256d unordered = _mm256_setzero_pd();
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256d v = _mm256_loadu_pd(xs + i);
+            unordered = _mm256_or_pd(unordered, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+            result = _mm256_min_pd(v, result);
+        }
+        if (_mm256_movemask_pd(unordered))
+        {
+            return NOT_A_NUMBER;
+        }
+        double lanes[4];
+        _mm256_storeu_pd(lanes, result);
+        double best = minFloatScalar(lanes, 4);
+        for (; i < n; i++)
+        {
+            if (xs[i] != xs[i])
+            {
+                return NOT_A_NUMBER;
+            }
+            best = xs[i] < best ? xs[i] : best;
+        }
+        return best;
+    }
+
+    TVM_AVX2 static double maxFloatAvx2(const double *xs, size_t n)
+    {
+        __m256d result = _mm256_set1_pd(xs[0]);
+        __m256d unordered = _mm256_setzero_pd();
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256d v = _mm256_loadu_pd(xs + i);
+            unordered = _mm256_or_pd(unordered, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+            result = _mm256_max_pd(v, result);
+        }
+        if (_mm256_movemask_pd(unordered))
+        {
+            return NOT_A_NUMBER;
+        }
+        double lanes[4];
+        _mm256_storeu_pd(lanes, result);
+        double best = maxFloatScalar(lanes, 4);
+        for (; i < n; i++)
+        {
+            if (xs[i] != xs[i])
+            {
+                return NOT_A_NUMBER;
+            }
+            best = xs[i] > best ? xs[i] : best;
+        }
+        return best;
+    }
+
+    TVM_AVX2 static int64_t dotIntAvx2(const int64_t *xs, const int64_t *ys, size_t n)
+    {
+        __m256i acc = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(xs + i));
+            __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ys + i));
+            acc = _mm256_add_epi64(acc, mulInt64Avx2(x, y));
+        }
+        int64_t lanes[4];
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+        return static_cast<int64_t>(static_cast<uint64_t>(sumIntScalar(lanes, 4)) +
+                                    static_cast<uint64_t>(dotIntScalar(xs + i, ys + i, n - i)));
+    }
+
+    TVM_AVX2 static double dotFloatAvx2(const double *xs, const double *ys, size_t n)
+    {
+        __m256d acc = _mm256_setzero_pd();
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            // Multiply then add, not FMA, to round like the other levels
+            acc = _mm256_add_pd(acc, _mm256_mul_pd(_mm256_loadu_pd(xs + i), _mm256_loadu_pd(ys + i)));
+        }
+        double lanes[4];
+        _mm256_storeu_pd(lanes, acc);
+        double total = reduceLanes(lanes);
+        for (; i < n; i++)
+        {
+            total += xs[i] * ys[i];
+        }
+        return total;
+    }
+
+    TVM_AVX2 static void addIntAvx2(int64_t *dst, const int64_t *src, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i *d = reinterpret_cast<__m256i *>(dst + i);
+            __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+            _mm256_storeu_si256(d, _mm256_add_epi64(_mm256_loadu_si256(d), s));
+        }
+        addIntScalar(dst + i, src + i, n - i);
+    }
+
+    TVM_AVX2 static void addFloatAvx2(double *dst, const double *src, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            _mm256_storeu_pd(dst + i, _mm256_add_pd(_mm256_loadu_pd(dst + i), _mm256_loadu_pd(src + i)));
+        }
+        addFloatScalar(dst + i, src + i, n - i);
+    }
+
+    TVM_AVX2 static void scaleIntAvx2(int64_t *xs, int64_t k, size_t n)
+    {
+        __m256i factor = _mm256_set1_epi64x(k);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i *p = reinterpret_cast<__m256i *>(xs + i);
+            _mm256_storeu_si256(p, mulInt64Avx2(_mm256_loadu_si256(p), factor));
+        }
+        scaleIntScalar(xs + i, k, n - i);
+    }
+
+    TVM_AVX2 static void scaleFloatAvx2(double *xs, double k, size_t n)
+    {
+        __m256d factor = _mm256_set1_pd(k);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            _mm256_storeu_pd(xs + i, _mm256_mul_pd(_mm256_loadu_pd(xs + i), factor));
+        }
+        scaleFloatScalar(xs + i, k, n - i);
+    }
+
+    static const ArrayKernels AVX2_KERNELS = {
+        sumIntAvx2, sumFloatAvx2,
+        minIntAvx2, maxIntAvx2, minFloatAvx2, maxFloatAvx2,
+        dotIntAvx2, dotFloatAvx2,
+        addIntAvx2, addFloatAvx2, scaleIntAvx2, scaleFloatAvx2};
+
+#endif // TVM_SIMD_X86
+
+    bool simdSupported(SimdLevel level)
+    {
+        switch (level)
+        {
+        case SimdLevel::Scalar:
+            return true;
+#if TVM_SIMD_X86
+        case SimdLevel::SSE2:
+            return true;
+        case SimdLevel::AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+        }
+    }
+
+    SimdLevel bestSimdLevel()
+    {
+        for (SimdLevel level : {SimdLevel::AVX2, SimdLevel::SSE2})
+        {
+            if (simdSupported(level))
+            {
+                return level;
+            }
+        }
+        return SimdLevel::Scalar;
+    }
+
+    const ArrayKernels &arrayKernels(SimdLevel level)
+    {
+        switch (level)
+        {
+#if TVM_SIMD_X86
+        case SimdLevel::SSE2:
+            return SSE2_KERNELS;
+        case SimdLevel::AVX2:
+            return AVX2_KERNELS;
+#endif
+        default:
+            return SCALAR_KERNELS;
+        }
+    }
+
+} // namespace TVM
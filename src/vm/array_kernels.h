@@ -0,0 +1,49 @@
+#pragma once
+#include "vm.h"
+#include <cstddef>
+#include <cstdint>
+
+// Whole-array kernels behind the Array.* natives. Internal to tail_vm.
+//
+// Each SIMD level provides the same table. Integer kernels wrap on overflow
+// like the interpreter's int arithmetic. Float sums and dot products keep four
+// running partial sums (lane i takes elements i, i+4, ...) and add them as
+// (0+1)+(2+3) before the leftover elements, at every level, so a result does
+// not depend on the CPU it ran on - though it may round differently from a
+// left-to-right loop. Float min/max return NaN if any element is NaN.
+
+namespace TVM
+{
+
+    struct ArrayKernels
+    {
+        int64_t (*sumInt)(const int64_t *xs, size_t n);
+        double (*sumFloat)(const double *xs, size_t n);
+
+        // n must be at least 1
+        int64_t (*minInt)(const int64_t *xs, size_t n);
+        int64_t (*maxInt)(const int64_t *xs, size_t n);
+        double (*minFloat)(const double *xs, size_t n);
+        double (*maxFloat)(const double *xs, size_t n);
+
+        int64_t (*dotInt)(const int64_t *xs, const int64_t *ys, size_t n);
+        double (*dotFloat)(const double *xs, const double *ys, size_t n);
+
+        // In place: dst[i] += src[i] and xs[i] *= k. dst and src may be the
+        // same array.
+        void (*addInt)(int64_t *dst, const int64_t *src, size_t n);
+        void (*addFloat)(double *dst, const double *src, size_t n);
+        void (*scaleInt)(int64_t *xs, int64_t k, size_t n);
+        void (*scaleFloat)(double *xs, double k, size_t n);
+    };
+
+    // Whether this build and CPU can run `level`; Scalar always can
+    bool simdSupported(SimdLevel level);
+
+    // The widest supported level
+    SimdLevel bestSimdLevel();
+
+    // Kernels for a supported level
+    const ArrayKernels &arrayKernels(SimdLevel level);
+
+} // namespace TVM
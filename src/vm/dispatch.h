@@ -0,0 +1,50 @@
+#pragma once
+
+// Dispatch macros shared by the interpreter loops (vm.cpp, vm_register.cpp).
+// Internal to tail_vm; include after vm.h from a translation unit only.
+//
+// Each handler advances pc itself and ends with TVM_NEXT(). In the threaded
+// build that is an indirect jump straight to the next handler; otherwise it
+// loops back to the central switch. A loop using these must be a
+// template <bool Threaded> with locals `code`, `executed` and (threaded
+// builds) `dispatchTable`, and a `dispatch:` label in front of its switch.
+
+#ifndef TVM_THREADED_DISPATCH
+#define TVM_THREADED_DISPATCH 0
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#pragma GCC diagnostic ignored "-Wunused-label"
+#pragma GCC diagnostic ignored "-Wpedantic" // computed goto
+#endif
+
+#if TVM_THREADED_DISPATCH
+#define TVM_CASE(op) \
+    case op:         \
+    L_##op:
+#define TVM_NEXT()                                          \
+    do                                                      \
+    {                                                       \
+        if constexpr (Threaded)                             \
+        {                                                   \
+            ++executed;                                     \
+            goto *dispatchTable[code[pc].opcode];           \
+        }                                                   \
+        else                                                \
+        {                                                   \
+            goto dispatch;                                  \
+        }                                                   \
+    } while (0)
+#else
+#define TVM_CASE(op) case op:
+#define TVM_NEXT() goto dispatch
+#endif
+
+// Runs the instruction at pc again after its handler rewrote the opcode,
+// counting it once
+#define TVM_REDISPATCH() \
+    do                   \
+    {                    \
+        --executed;      \
+        TVM_NEXT();      \
+    } while (0)
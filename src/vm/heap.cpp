@@ -0,0 +1,305 @@
+#include "heap.h"
+#include <algorithm>
+#include <memory>
+#include <new>
+
+namespace TVM
+{
+
+    Heap::Heap()
+        : pinned(0), liveBytes(0), allocatedSinceSweep(0), nextCollection(MIN_COLLECTION_BYTES),
+          maxBytes(0), stress(false), requested(false)
+    {
+    }
+
+    Heap::~Heap()
+    {
+        clear();
+    }
+
+    void Heap::clear()
+    {
+        for (HeapObject *object : objects)
+        {
+            if (object)
+            {
+                destroy(object);
+            }
+        }
+        objects.clear();
+        freeHandles.clear();
+        grey.clear();
+        pinned = 0;
+        liveBytes = 0;
+        allocatedSinceSweep = 0;
+        nextCollection = MIN_COLLECTION_BYTES;
+        requested = false;
+        stats = GcStats();
+    }
+
+    void Heap::load(const std::vector<std::string> &pool)
+    {
+        clear();
+        objects.reserve(pool.size());
+        for (const auto &str : pool)
+        {
+            objects.push_back(newString(str));
+        }
+        pinned = static_cast<uint32_t>(pool.size());
+    }
+
+    Value Heap::makeString(std::string_view chars)
+    {
+        if (chars.size() <= Value::INLINE_STRING_MAX)
+        {
+            return Value::inlineString(chars.data(), static_cast<uint32_t>(chars.size()));
+        }
+        uint32_t handle = add(newString(chars), stringBytes(chars.size()));
+        return Value(handle, TYPE_STRING);
+    }
+
+    Value Heap::makeArray(ValueType type, uint32_t length)
+    {
+        size_t bytes = arrayBytes(type, length);
+        HeapArray *array = static_cast<HeapArray *>(::operator new(bytes));
+        array->marked = false;
+        array->length = length;
+        switch (type)
+        {
+        case TYPE_ARRAY_INT:
+            array->kind = ObjectKind::IntArray;
+            std::fill_n(array->ints(), length, 0);
+            break;
+        case TYPE_ARRAY_FLOAT:
+            array->kind = ObjectKind::FloatArray;
+            std::fill_n(array->floats(), length, 0.0);
+            break;
+        default:
+            array->kind = ObjectKind::StringArray;
+            std::uninitialized_fill_n(array->values(), length, Value::inlineString("", 0));
+            break;
+        }
+        return Value(add(array, bytes), type);
+    }
+
+    Value Heap::makeBuilder(std::string_view chars, size_t capacity)
+    {
+        HeapStringBuilder *builder = static_cast<HeapStringBuilder *>(::operator new(sizeof(HeapStringBuilder)));
+        builder->kind = ObjectKind::StringBuilder;
+        builder->marked = false;
+        builder->length = static_cast<uint32_t>(chars.size());
+        builder->capacity = static_cast<uint32_t>(capacity);
+        builder->chars = static_cast<char *>(::operator new(capacity));
+        builder->snapshot = Value();
+        std::copy(chars.begin(), chars.end(), builder->chars);
+        return Value(add(builder, builderBytes(capacity)), TYPE_STRING_BUILDER);
+    }
+
+    uint32_t Heap::boxInt(int64_t value)
+    {
+        HeapInt *box = static_cast<HeapInt *>(::operator new(sizeof(HeapInt)));
+        box->kind = ObjectKind::Int;
+        box->marked = false;
+        box->value = value;
+        return add(box, sizeof(HeapInt));
+    }
+
+    void Heap::append(HeapStringBuilder *builder, std::string_view chars)
+    {
+        size_t length = builder->length + chars.size();
+        if (length > builder->capacity)
+        {
+            size_t capacity = builderCapacity(builder->capacity, length);
+            char *grown = static_cast<char *>(::operator new(capacity));
+            std::copy_n(builder->chars, builder->length, grown);
+            ::operator delete(builder->chars);
+            account(capacity - builder->capacity);
+            builder->chars = grown;
+            builder->capacity = static_cast<uint32_t>(capacity);
+        }
+        std::copy(chars.begin(), chars.end(), builder->chars + builder->length);
+        builder->length = static_cast<uint32_t>(length);
+        builder->snapshot = Value();
+    }
+
+    HeapString *Heap::newString(std::string_view chars)
+    {
+        HeapString *str = static_cast<HeapString *>(::operator new(stringBytes(chars.size())));
+        str->kind = ObjectKind::String;
+        str->marked = false;
+        str->length = static_cast<uint32_t>(chars.size());
+        std::copy(chars.begin(), chars.end(), str->chars());
+        return str;
+    }
+
+    uint32_t Heap::add(HeapObject *object, size_t bytes)
+    {
+        account(bytes);
+
+        if (!freeHandles.empty())
+        {
+            uint32_t handle = freeHandles.back();
+            freeHandles.pop_back();
+            objects[handle] = object;
+            return handle;
+        }
+        objects.push_back(object);
+        return static_cast<uint32_t>(objects.size() - 1);
+    }
+
+    void Heap::account(size_t bytes)
+    {
+        liveBytes += bytes;
+        allocatedSinceSweep += bytes;
+        stats.bytesAllocated += bytes;
+        stats.peakBytes = std::max(stats.peakBytes, liveBytes);
+        requested = requested || collectionDue(0);
+    }
+
+    size_t Heap::sizeOf(const HeapObject *object)
+    {
+        switch (object->kind)
+        {
+        case ObjectKind::String:
+            return stringBytes(static_cast<const HeapString *>(object)->length);
+        case ObjectKind::IntArray:
+            return arrayBytes(TYPE_ARRAY_INT, static_cast<const HeapArray *>(object)->length);
+        case ObjectKind::FloatArray:
+            return arrayBytes(TYPE_ARRAY_FLOAT, static_cast<const HeapArray *>(object)->length);
+        case ObjectKind::StringArray:
+            return arrayBytes(TYPE_ARRAY_STRING, static_cast<const HeapArray *>(object)->length);
+        case ObjectKind::StringBuilder:
+            return builderBytes(static_cast<const HeapStringBuilder *>(object)->capacity);
+        case ObjectKind::Int:
+            return sizeof(HeapInt);
+        }
+        return 0;
+    }
+
+    void Heap::release(uint32_t handle)
+    {
+        HeapObject *object = objects[handle];
+        size_t bytes = sizeOf(object);
+        liveBytes -= bytes;
+        stats.bytesFreed += bytes;
+        stats.objectsFreed++;
+        destroy(object);
+        objects[handle] = nullptr;
+        freeHandles.push_back(handle);
+    }
+
+    void Heap::destroy(HeapObject *object)
+    {
+        if (object->kind == ObjectKind::StringBuilder)
+        {
+            ::operator delete(static_cast<HeapStringBuilder *>(object)->chars);
+        }
+        ::operator delete(object);
+    }
+
+    void Heap::beginCollection()
+    {
+        pauseStart = std::chrono::steady_clock::now();
+    }
+
+    void Heap::mark(const Value &value)
+    {
+        shade(value);
+
+        // Trace iteratively so deep object graphs cannot overflow the C stack
+        while (!grey.empty())
+        {
+            HeapObject *next = grey.back();
+            grey.pop_back();
+            trace(next);
+        }
+    }
+
+    // Marks the object `value` refers to, if any, and queues it for tracing
+    void Heap::shade(const Value &value)
+    {
+        switch (value.type())
+        {
+        case TYPE_INT:
+            if (!value.isBoxedInt())
+            {
+                return;
+            }
+            break;
+        case TYPE_STRING:
+            if (value.isInlineString())
+            {
+                return;
+            }
+            break;
+        case TYPE_ARRAY_INT:
+        case TYPE_ARRAY_FLOAT:
+        case TYPE_ARRAY_STRING:
+        case TYPE_STRING_BUILDER:
+            break;
+        default:
+            return;
+        }
+        HeapObject *object = objects[value.asIndex()];
+        if (object->marked)
+        {
+            return;
+        }
+        object->marked = true;
+        grey.push_back(object);
+    }
+
+    // Marks the objects `object` refers to
+    void Heap::trace(HeapObject *object)
+    {
+        switch (object->kind)
+        {
+        case ObjectKind::String:
+        case ObjectKind::IntArray:
+        case ObjectKind::FloatArray:
+        case ObjectKind::Int:
+            break;
+        case ObjectKind::StringArray:
+        {
+            HeapArray *array = static_cast<HeapArray *>(object);
+            for (uint32_t i = 0; i < array->length; i++)
+            {
+                shade(array->values()[i]);
+            }
+            break;
+        }
+        case ObjectKind::StringBuilder:
+            shade(static_cast<HeapStringBuilder *>(object)->snapshot);
+            break;
+        }
+    }
+
+    void Heap::sweep()
+    {
+        for (uint32_t handle = pinned; handle < objects.size(); handle++)
+        {
+            HeapObject *object = objects[handle];
+            if (!object)
+            {
+                continue;
+            }
+            if (object->marked)
+            {
+                object->marked = false;
+            }
+            else
+            {
+                release(handle);
+            }
+        }
+        allocatedSinceSweep = 0;
+        nextCollection = std::max(MIN_COLLECTION_BYTES, liveBytes);
+        requested = false;
+
+        double pauseMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - pauseStart).count();
+        stats.collections++;
+        stats.totalPauseMs += pauseMs;
+        stats.maxPauseMs = std::max(stats.maxPauseMs, pauseMs);
+    }
+
+} // namespace TVM
@@ -0,0 +1,236 @@
+#pragma once
+#include "../shared/bytecode.h"
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Garbage-collected heap for runtime strings, string builders, arrays and
+// boxed ints (see BigIntHeap). Values refer to objects by
+// handle (see Value), so an object can be freed and its handle reused
+// without the values that the stack and handlers copy around owning
+// anything.
+//
+// Collection is precise, non-moving mark-sweep. The heap does not know the
+// VM's roots: its owner marks every value it can still reach, then sweeps.
+// Between collections allocation is a plain malloc, and a collection is due
+// once the bytes allocated since the last one match what survived it, when
+// the heap limit would be exceeded, or on every allocation in stress mode.
+// Boxing an int never collects, so the owner also polls
+// collectionRequested() at points where it can.
+
+namespace TVM
+{
+
+    enum class ObjectKind : uint8_t
+    {
+        String,
+        IntArray,
+        FloatArray,
+        StringArray,
+        StringBuilder,
+        Int
+    };
+
+    struct HeapObject
+    {
+        ObjectKind kind;
+        bool marked;
+    };
+
+    // Immutable string; its characters follow it in the same block
+    struct HeapString : HeapObject
+    {
+        uint32_t length;
+
+        const char *chars() const { return reinterpret_cast<const char *>(this + 1); }
+        char *chars() { return reinterpret_cast<char *>(this + 1); }
+    };
+
+    // Fixed-length array; its elements follow it in the same block. Int and
+    // float arrays hold raw int64_t/double with no per-element tag, string
+    // arrays hold string Values.
+    struct HeapArray : HeapObject
+    {
+        uint32_t length;
+
+        int64_t *ints() { return reinterpret_cast<int64_t *>(this + 1); }
+        double *floats() { return reinterpret_cast<double *>(this + 1); }
+        Value *values() { return reinterpret_cast<Value *>(this + 1); }
+    };
+
+    // Mutable string. Its characters live in a separate buffer that doubles
+    // when full, so appends are amortised O(1) and the handle stays put.
+    // `snapshot` caches the contents as a string until the next append.
+    struct HeapStringBuilder : HeapObject
+    {
+        uint32_t length;
+        uint32_t capacity;
+        char *chars;
+        Value snapshot; // nil when stale
+
+        std::string_view view() const { return std::string_view(chars, length); }
+    };
+
+    // An int outside the inline range of a NaN-boxed Value
+    struct HeapInt : HeapObject
+    {
+        int64_t value;
+    };
+
+    static_assert(sizeof(HeapArray) % alignof(int64_t) == 0 && sizeof(HeapArray) % alignof(Value) == 0,
+                  "Array elements must be aligned");
+
+    struct GcStats
+    {
+        uint64_t collections = 0;
+        uint64_t objectsFreed = 0;
+        uint64_t bytesFreed = 0;
+        uint64_t bytesAllocated = 0;
+        size_t peakBytes = 0;
+        double totalPauseMs = 0;
+        double maxPauseMs = 0;
+    };
+
+    class Heap : public BigIntHeap
+    {
+    public:
+        Heap();
+        ~Heap();
+
+        Heap(const Heap &) = delete;
+        Heap &operator=(const Heap &) = delete;
+
+        // Interns the constant pool once per run as handles 0..N-1. They are
+        // never collected and do not count against the limit.
+        void load(const std::vector<std::string> &pool);
+
+        // Tuning. A limit of 0 means unbounded.
+        void setMaxBytes(size_t bytes) { maxBytes = bytes; }
+        size_t getMaxBytes() const { return maxBytes; }
+        void setStress(bool enable) { stress = enable; }
+
+        // Bytes a new object of the given size will take
+        static size_t stringBytes(size_t length) { return sizeof(HeapString) + length; }
+        static size_t arrayBytes(ValueType type, size_t length)
+        {
+            return sizeof(HeapArray) + length * (type == TYPE_ARRAY_STRING ? sizeof(Value) : sizeof(int64_t));
+        }
+        static size_t builderBytes(size_t capacity) { return sizeof(HeapStringBuilder) + capacity; }
+
+        // Buffer size a builder needs to hold `length` characters: doubling
+        // from `capacity`, at least MIN_BUILDER_CAPACITY
+        static size_t builderCapacity(size_t capacity, size_t length)
+        {
+            size_t grown = std::max(capacity, MIN_BUILDER_CAPACITY);
+            while (grown < length)
+            {
+                grown *= 2;
+            }
+            return grown;
+        }
+
+        // Whether the owner should collect before allocating `bytes`, and
+        // whether the allocation still does not fit once it has
+        bool collectionDue(size_t bytes) const
+        {
+            return stress || allocatedSinceSweep >= nextCollection ||
+                   (maxBytes && liveBytes + bytes > maxBytes);
+        }
+        bool fits(size_t bytes) const { return !maxBytes || liveBytes + bytes <= maxBytes; }
+
+        // Whether an allocation since the last collection has made one due.
+        // JIT code tests the flag in place.
+        bool collectionRequested() const { return requested; }
+        const bool *collectionRequestedFlag() const { return &requested; }
+
+        // A string value for chars: inline when short enough, otherwise a
+        // new heap object. Never collects.
+        Value makeString(std::string_view chars);
+
+        // A new array of `length` zeros (empty strings for TYPE_ARRAY_STRING)
+        // whose element type is given by `type`. Never collects.
+        Value makeArray(ValueType type, uint32_t length);
+
+        HeapArray *array(const Value &value) const { return static_cast<HeapArray *>(objects[value.asIndex()]); }
+
+        // A new builder holding chars with room for `capacity` characters
+        // (see builderCapacity). Never collects.
+        Value makeBuilder(std::string_view chars, size_t capacity);
+
+        // A box for an int outside the inline range. Never collects.
+        uint32_t boxInt(int64_t value) override;
+        int64_t boxedInt(uint32_t handle) const override
+        {
+            return static_cast<const HeapInt *>(objects[handle])->value;
+        }
+
+        HeapStringBuilder *builder(const Value &value) const
+        {
+            return static_cast<HeapStringBuilder *>(objects[value.asIndex()]);
+        }
+
+        // Bytes appending `extra` characters to `builder` adds to the heap:
+        // 0 unless its buffer has to grow
+        static size_t appendBytes(const HeapStringBuilder *builder, size_t extra)
+        {
+            size_t length = builder->length + extra;
+            return length <= builder->capacity ? 0 : builderCapacity(builder->capacity, length) - builder->capacity;
+        }
+
+        // Appends chars, growing the buffer as appendBytes says, and drops
+        // the snapshot. chars must not point into the builder. Never
+        // collects.
+        void append(HeapStringBuilder *builder, std::string_view chars);
+
+        // Characters of a string value. For an inline string the view points
+        // into `value` itself, so it must outlive the view.
+        std::string_view stringView(const Value &value) const
+        {
+            if (value.isInlineString())
+            {
+                return std::string_view(value.inlineChars(), value.inlineLength());
+            }
+            const HeapString *str = static_cast<const HeapString *>(objects[value.asIndex()]);
+            return std::string_view(str->chars(), str->length);
+        }
+
+        // Collection: mark from each root, then sweep what stayed unmarked
+        void beginCollection();
+        void mark(const Value &value);
+        void sweep();
+
+        size_t getLiveCount() const { return objects.size() - freeHandles.size() - pinned; }
+        size_t getLiveBytes() const { return liveBytes; }
+        const GcStats &getStats() const { return stats; }
+
+    private:
+        static constexpr size_t MIN_COLLECTION_BYTES = 1024 * 1024;
+        static constexpr size_t MIN_BUILDER_CAPACITY = 16;
+
+        std::vector<HeapObject *> objects; // Indexed by handle, nullptr if free
+        std::vector<uint32_t> freeHandles;
+        std::vector<HeapObject *> grey;    // Marked, children not yet traced
+        uint32_t pinned;                   // Pool handles, never swept
+        size_t liveBytes;                  // Excludes the pool
+        size_t allocatedSinceSweep;
+        size_t nextCollection;
+        size_t maxBytes;
+        bool stress;
+        bool requested;                    // See collectionRequested()
+        GcStats stats;
+        std::chrono::steady_clock::time_point pauseStart;
+
+        uint32_t add(HeapObject *object, size_t bytes);
+        void account(size_t bytes);
+        HeapString *newString(std::string_view chars);
+        void shade(const Value &value);
+        void trace(HeapObject *object);
+        static size_t sizeOf(const HeapObject *object);
+        void release(uint32_t handle);
+        static void destroy(HeapObject *object);
+        void clear();
+    };
+
+} // namespace TVM
@@ -0,0 +1,117 @@
+#include "input.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#ifdef _WIN32
+#include <io.h>
+#define TVM_READ _read
+#else
+#include <unistd.h>
+#define TVM_READ ::read
+#endif
+
+namespace TVM
+{
+
+    static constexpr int STDIN_FD = 0;
+
+    InputBuffer::InputBuffer() : capacity(0), start(0), end(0), atEnd(false)
+    {
+    }
+
+    bool InputBuffer::readLine(std::string_view &line)
+    {
+        size_t searched = 0; // Bytes after start known to hold no '\n'
+        for (;;)
+        {
+            const char *begin = data.get() + start;
+            size_t pending = end - start;
+            if (const void *newline = pending > searched ? std::memchr(begin + searched, '\n', pending - searched) : nullptr)
+            {
+                size_t length = static_cast<size_t>(static_cast<const char *>(newline) - begin);
+                line = std::string_view(begin, length);
+                start += length + 1;
+                return true;
+            }
+            searched = pending;
+            if (!fill())
+            {
+                if (start == end)
+                {
+                    return false;
+                }
+                line = std::string_view(data.get() + start, end - start);
+                start = end;
+                return true;
+            }
+        }
+    }
+
+    std::string_view InputBuffer::read(size_t count)
+    {
+        while (end - start < count && fill())
+        {
+        }
+        size_t length = std::min(count, end - start);
+        std::string_view chunk(data.get() + start, length);
+        start += length;
+        return chunk;
+    }
+
+    std::string_view InputBuffer::readAll()
+    {
+        while (fill())
+        {
+        }
+        std::string_view rest(data.get() + start, end - start);
+        start = end;
+        return rest;
+    }
+
+    // Reads one more chunk after the unconsumed bytes, first moving them to
+    // the front and doubling the buffer if they fill it. False at end of
+    // input.
+    bool InputBuffer::fill()
+    {
+        if (atEnd)
+        {
+            return false;
+        }
+        if (!data)
+        {
+            data.reset(new char[CHUNK]);
+            capacity = CHUNK;
+        }
+        if (start > 0)
+        {
+            std::memmove(data.get(), data.get() + start, end - start);
+            end -= start;
+            start = 0;
+        }
+        if (end == capacity)
+        {
+            std::unique_ptr<char[]> grown(new char[capacity * 2]);
+            std::memcpy(grown.get(), data.get(), end);
+            data = std::move(grown);
+            capacity *= 2;
+        }
+
+        for (;;)
+        {
+            size_t room = std::min<size_t>(capacity - end, 1u << 30);
+            auto got = TVM_READ(STDIN_FD, data.get() + end, static_cast<unsigned>(room));
+            if (got > 0)
+            {
+                end += static_cast<size_t>(got);
+                return true;
+            }
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            atEnd = true;
+            return false;
+        }
+    }
+
+} // namespace TVM
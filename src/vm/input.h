@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <string_view>
+
+// The VM's stdin. Reads large chunks with read() and splits lines with
+// memchr, instead of one std::getline per line through iostreams that are
+// synchronised with stdio. Internal to tail_vm.
+//
+// Views returned point into the buffer and stay valid only until the next
+// call; the caller copies what it keeps (into a heap string).
+
+namespace TVM
+{
+
+    class InputBuffer
+    {
+    public:
+        static constexpr size_t CHUNK = 1024 * 1024;
+
+        InputBuffer();
+
+        InputBuffer(const InputBuffer &) = delete;
+        InputBuffer &operator=(const InputBuffer &) = delete;
+
+        // Next line without its '\n'; false at end of input. A last line
+        // with no '\n' still counts.
+        bool readLine(std::string_view &line);
+
+        // The next `count` bytes, fewer at end of input (empty once it is
+        // reached)
+        std::string_view read(size_t count);
+
+        // Everything up to end of input
+        std::string_view readAll();
+
+    private:
+        std::unique_ptr<char[]> data; // Allocated on first use
+        size_t capacity;
+        size_t start;                 // Unconsumed bytes are [start, end)
+        size_t end;
+        bool atEnd;                   // read() returned 0 or failed
+
+        bool fill();
+    };
+
+} // namespace TVM
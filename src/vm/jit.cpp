@@ -0,0 +1,1447 @@
+#include "jit.h"
+#include "../shared/numbers.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+namespace TVM
+{
+
+    namespace
+    {
+        using Helper = int32_t (*)(VM *, DecodedInstruction *);
+
+        enum Reg : uint8_t
+        {
+            RAX = 0,
+            RCX = 1,
+            RDX = 2,
+            RBX = 3,
+            RSI = 6,
+            RDI = 7,
+            R12 = 12,
+            R13 = 13,
+            R14 = 14,
+            R15 = 15
+        };
+
+        // What a compiled function keeps in the callee-saved registers, so
+        // it survives helper calls. TOP is stored to vm->stackTop before a
+        // helper runs and reloaded after; COUNT is added to the VM's
+        // instruction count on the way out.
+        constexpr Reg VM_REG = RBX;
+        constexpr Reg TOP = R12;     // vm->stackTop
+        constexpr Reg LOCALS = R13;  // The frame's first local
+        constexpr Reg COUNT = R14;   // Instructions executed natively
+        constexpr Reg INT_TAG = R15; // Value::INT_PREFIX
+
+        enum Cond : uint8_t
+        {
+            CC_O = 0x0,
+            CC_B = 0x2,
+            CC_AE = 0x3,
+            CC_E = 0x4,
+            CC_NE = 0x5,
+            CC_BE = 0x6,
+            CC_A = 0x7,
+            CC_P = 0xA,
+            CC_L = 0xC,
+            CC_GE = 0xD,
+            CC_LE = 0xE,
+            CC_G = 0xF
+        };
+
+#if TVM_NAN_BOXING
+        // Holds exactly when cc does not, unordered float compares included
+        Cond negate(Cond cc) { return static_cast<Cond>(cc ^ 1); }
+#endif
+
+        enum Alu : uint8_t
+        {
+            ALU_ADD = 0x01,
+            ALU_OR = 0x09,
+            ALU_SUB = 0x29,
+            ALU_XOR = 0x31,
+            ALU_CMP = 0x39
+        };
+
+        enum Shift : uint8_t
+        {
+            SHIFT_SHL = 4,
+            SHIFT_SHR = 5,
+            SHIFT_SAR = 7
+        };
+
+        enum SseOp : uint8_t
+        {
+            SSE_ADD = 0x58,
+            SSE_MUL = 0x59,
+            SSE_SUB = 0x5C
+        };
+
+        // Just enough x86-64 for the translator. Every memory operand is
+        // [base + disp32]; labels are bound to code offsets and jumps to them
+        // patched once the function is complete.
+        class Assembler
+        {
+        public:
+            uint32_t newLabel()
+            {
+                positions.push_back(UNBOUND);
+                return static_cast<uint32_t>(positions.size() - 1);
+            }
+            void bind(uint32_t label) { positions[label] = code.size(); }
+            bool isBound(uint32_t label) const { return positions[label] != UNBOUND; }
+            size_t position(uint32_t label) const { return positions[label]; }
+
+            void push(Reg reg)
+            {
+                rexB(reg);
+                byte(0x50 + (reg & 7));
+            }
+            void pop(Reg reg)
+            {
+                rexB(reg);
+                byte(0x58 + (reg & 7));
+            }
+            void ret() { byte(0xC3); }
+            void jmpRsi() { bytes({0xFF, 0xE6}); }
+
+            void mov(Reg dst, Reg src)
+            {
+                rex(src, dst);
+                byte(0x89);
+                direct(src, dst);
+            }
+            void load(Reg dst, Reg base, int32_t disp)
+            {
+                rex(dst, base);
+                byte(0x8B);
+                memory(dst, base, disp);
+            }
+            void store(Reg base, int32_t disp, Reg src)
+            {
+                rex(src, base);
+                byte(0x89);
+                memory(src, base, disp);
+            }
+            void lea(Reg dst, Reg base, int32_t disp)
+            {
+                rex(dst, base);
+                byte(0x8D);
+                memory(dst, base, disp);
+            }
+            void movImm(Reg dst, uint64_t value)
+            {
+                rex(RAX, dst);
+                byte(0xB8 + (dst & 7));
+                imm(value, 8);
+            }
+            void alu(Alu op, Reg dst, Reg src)
+            {
+                rex(src, dst);
+                byte(op);
+                direct(src, dst);
+            }
+            void test(Reg a, Reg b)
+            {
+                rex(b, a);
+                byte(0x85);
+                direct(b, a);
+            }
+            void addImm(Reg dst, int32_t value)
+            {
+                rex(RAX, dst);
+                byte(0x81);
+                direct(RAX, dst);
+                imm(static_cast<uint32_t>(value), 4);
+            }
+            void addToMemory(Reg base, int32_t disp, Reg src)
+            {
+                rex(src, base);
+                byte(0x01);
+                memory(src, base, disp);
+            }
+            void imul(Reg dst, Reg src)
+            {
+                rex(dst, src);
+                bytes({0x0F, 0xAF});
+                direct(dst, src);
+            }
+            void shift(Shift kind, Reg reg, uint8_t count)
+            {
+                rex(RAX, reg);
+                byte(0xC1);
+                direct(static_cast<Reg>(kind), reg);
+                byte(count);
+            }
+            void cqo() { bytes({0x48, 0x99}); }
+            void idiv(Reg divisor)
+            {
+                rex(RAX, divisor);
+                byte(0xF7);
+                direct(static_cast<Reg>(7), divisor);
+            }
+            void cmpByteZero(Reg base)
+            {
+                rexB(base);
+                byte(0x80);
+                memory(static_cast<Reg>(7), base, 0);
+                byte(0);
+            }
+
+            // ecx = cc ? 1 : 0
+            void setToEcx(Cond cc) { bytes({0x0F, static_cast<uint8_t>(0x90 | cc), 0xC1, 0x0F, 0xB6, 0xC9}); }
+
+            // Scalar doubles in xmm0/xmm1
+            void loadSd(uint8_t xmm, Reg base, int32_t disp) { sse(0xF2, 0x10, xmm, base, disp); }
+            void storeSd(Reg base, int32_t disp, uint8_t xmm) { sse(0xF2, 0x11, xmm, base, disp); }
+            void arithSd(SseOp op, uint8_t xmm, Reg base, int32_t disp) { sse(0xF2, op, xmm, base, disp); }
+            void ucomisd(uint8_t a, uint8_t b) { bytes({0x66, 0x0F, 0x2E, static_cast<uint8_t>(0xC0 | (a << 3) | b)}); }
+
+            void callHelper(Helper helper, DecodedInstruction *instr)
+            {
+                mov(RDI, VM_REG);
+                movImm(RSI, reinterpret_cast<uint64_t>(instr));
+                movImm(RAX, reinterpret_cast<uint64_t>(helper));
+                bytes({0xFF, 0xD0}); // call rax
+            }
+            void testStatus() { bytes({0x85, 0xC0}); }    // test eax, eax
+            void cmpTaken() { bytes({0x83, 0xF8, 0x01}); } // cmp eax, 1
+
+            void jmp(uint32_t label) { jump({0xE9}, label); }
+            void jcc(Cond cc, uint32_t label) { jump({0x0F, static_cast<uint8_t>(0x80 | cc)}, label); }
+
+            size_t size() const { return code.size(); }
+
+            // Fills in the rel32 of every jump
+            void resolve()
+            {
+                for (const auto &fixup : fixups)
+                {
+                    int32_t rel = static_cast<int32_t>(static_cast<int64_t>(positions[fixup.label]) -
+                                                       static_cast<int64_t>(fixup.offset + 4));
+                    std::memcpy(&code[fixup.offset], &rel, sizeof(rel));
+                }
+            }
+
+            const std::vector<uint8_t> &data() const { return code; }
+
+        private:
+            static constexpr size_t UNBOUND = SIZE_MAX;
+
+            struct Fixup
+            {
+                size_t offset; // Position of the rel32
+                uint32_t label;
+            };
+
+            std::vector<uint8_t> code;
+            std::vector<Fixup> fixups;
+            std::vector<size_t> positions; // Per label, UNBOUND until bound
+
+            void byte(uint8_t value) { code.push_back(value); }
+            void bytes(std::initializer_list<uint8_t> values) { code.insert(code.end(), values); }
+            void imm(uint64_t value, int width)
+            {
+                for (int i = 0; i < width; i++)
+                {
+                    code.push_back(static_cast<uint8_t>(value >> (i * 8)));
+                }
+            }
+
+            // REX.W with the high bits of the ModRM reg and rm fields
+            void rex(Reg reg, Reg rm) { byte(0x48 | ((reg & 8) >> 1) | ((rm & 8) >> 3)); }
+            void rexB(Reg rm)
+            {
+                if (rm & 8)
+                {
+                    byte(0x41);
+                }
+            }
+            void direct(Reg reg, Reg rm) { byte(0xC0 | ((reg & 7) << 3) | (rm & 7)); }
+            void memory(Reg reg, Reg base, int32_t disp)
+            {
+                byte(0x80 | ((reg & 7) << 3) | (base & 7));
+                if ((base & 7) == 4)
+                {
+                    byte(0x24); // SIB: r12 as a base needs one
+                }
+                imm(static_cast<uint32_t>(disp), 4);
+            }
+            void sse(uint8_t prefix, uint8_t op, uint8_t xmm, Reg base, int32_t disp)
+            {
+                byte(prefix);
+                rexB(base);
+                bytes({0x0F, op});
+                memory(static_cast<Reg>(xmm), base, disp);
+            }
+
+            void jump(std::initializer_list<uint8_t> opcode, uint32_t label)
+            {
+                bytes(opcode);
+                fixups.push_back(Fixup{code.size(), label});
+                code.insert(code.end(), 4, 0);
+            }
+        };
+    } // namespace
+
+// Helper prologue/epilogue: pc is kept current so runtime errors report the
+// right instruction, and any exception is parked in the Jit for enter() to
+// rethrow once the native frames are gone.
+#define JIT_HELPER(name, ...)                                          \
+    static int32_t name(VM *vm, DecodedInstruction *instr)             \
+    {                                                                  \
+        try                                                            \
+        {                                                              \
+            vm->pc = static_cast<uint32_t>(instr - vm->code.data());   \
+            __VA_ARGS__                                                \
+        }                                                              \
+        catch (...)                                                    \
+        {                                                              \
+            vm->jit->error = std::current_exception();                 \
+            return Jit::STATUS_ERROR;                                  \
+        }                                                              \
+    }
+#define JIT_OP(name, call) JIT_HELPER(name, vm->call; return Jit::STATUS_OK;)
+// Typed forms run `body` if both operands pass `is`, as the interpreter's
+// do, and the generic operator otherwise
+#define JIT_TYPED(name, is, generic, ...)                              \
+    JIT_HELPER(name, {                                                 \
+        if (vm->stackTop[-1].is() && vm->stackTop[-2].is())            \
+        {                                                              \
+            __VA_ARGS__                                                \
+        }                                                              \
+        vm->generic();                                                 \
+        return Jit::STATUS_OK;                                         \
+    })
+#define JIT_UNCHECKED_BINARY(name, result)                             \
+    static int32_t name(VM *vm, DecodedInstruction *)                  \
+    {                                                                  \
+        Value &rhs = vm->stackTop[-1];                                 \
+        Value &lhs = vm->stackTop[-2];                                 \
+        lhs = Value(result);                                           \
+        --vm->stackTop;                                                \
+        return Jit::STATUS_OK;                                         \
+    }
+#define JIT_TYPED_BINARY(name, is, result, generic)                    \
+    JIT_TYPED(name, is, generic, {                                     \
+        Value &rhs = vm->stackTop[-1];                                 \
+        Value &lhs = vm->stackTop[-2];                                 \
+        lhs = Value(result);                                           \
+        --vm->stackTop;                                                \
+        return Jit::STATUS_OK;                                         \
+    })
+#define JIT_TYPED_COMPARE(name, is, get, op, generic)                  \
+    JIT_TYPED_BINARY(name, is, lhs.get() op rhs.get(), generic)
+
+    // One helper per opcode, each the body of the matching interpreter
+    // handler minus the pc bookkeeping.
+    struct JitHelpers
+    {
+        JIT_OP(push, push(instr->value))
+        JIT_OP(pop, pop())
+        JIT_HELPER(dup, {
+            Value top = vm->peek();
+            vm->push(top);
+            return Jit::STATUS_OK;
+        })
+        JIT_HELPER(swap, {
+            Value a = vm->pop();
+            Value b = vm->pop();
+            vm->push(a);
+            vm->push(b);
+            return Jit::STATUS_OK;
+        })
+
+        JIT_OP(add, opAdd())
+        JIT_OP(sub, opSub())
+        JIT_OP(mul, opMul())
+        JIT_OP(div, opDiv())
+        JIT_OP(mod, opMod())
+        JIT_OP(neg, opNeg())
+        JIT_OP(inc, opInc())
+        JIT_OP(dec, opDec())
+        JIT_OP(eq, opEq())
+        JIT_OP(neq, opNeq())
+        JIT_OP(lt, opLt())
+        JIT_OP(lte, opLte())
+        JIT_OP(gt, opGt())
+        JIT_OP(gte, opGte())
+        JIT_OP(logicalAnd, opAnd())
+        JIT_OP(logicalOr, opOr())
+        JIT_OP(logicalNot, opNot())
+
+        JIT_OP(load, opLoad(instr->operand))
+        JIT_OP(store, opStore(instr->operand))
+        JIT_OP(loadGlobal, opLoadGlobal(instr->operand))
+        JIT_OP(storeGlobal, opStoreGlobal(instr->operand))
+        JIT_OP(loadStr, opLoadStr(instr->operand))
+        JIT_OP(appendLocal, opAppendLocal(instr->operand))
+
+        // Branch helpers only decide; the jump itself is native. A backward
+        // jump first passes the interpreter's safe point.
+        JIT_OP(pollHeap, pollHeap())
+        JIT_HELPER(jmpIf, return vm->pop().isTruthy() ? Jit::STATUS_TAKEN : Jit::STATUS_OK;)
+        JIT_HELPER(jmpIfNot, return vm->pop().isTruthy() ? Jit::STATUS_OK : Jit::STATUS_TAKEN;)
+
+        // A compiled callee runs natively from here; anything else is
+        // interpreted until its RET brings the call stack back to our frame.
+        JIT_HELPER(call, {
+            Jit &jit = *vm->jit;
+            uint32_t callerDepth = static_cast<uint32_t>(vm->callStack.size());
+            vm->callFunction(instr->target.func);
+            if (!jit.enter(instr->target.func))
+            {
+                uint32_t savedExitDepth = vm->exitDepth;
+                vm->exitDepth = callerDepth;
+                jit.depth++;
+                vm->runInterpreter();
+                jit.depth--;
+                vm->exitDepth = savedExitDepth;
+            }
+            return vm->running ? Jit::STATUS_OK : Jit::STATUS_HALT;
+        })
+        // The callee takes over our frame and returns for us, so the native
+        // code exits after this. A tail call to the function itself does not
+        // come here: compile() turns it into frame reuse plus a native jump.
+        JIT_HELPER(tailCall, {
+            Jit &jit = *vm->jit;
+            vm->tailCallFunction(instr->target.func);
+            if (!jit.enter(instr->target.func))
+            {
+                uint32_t savedExitDepth = vm->exitDepth;
+                vm->exitDepth = static_cast<uint32_t>(vm->callStack.size()) - 1;
+                jit.depth++;
+                vm->runInterpreter();
+                jit.depth--;
+                vm->exitDepth = savedExitDepth;
+            }
+            return vm->running ? Jit::STATUS_OK : Jit::STATUS_HALT;
+        })
+        JIT_OP(selfTailCall, tailCallFunction(instr->target.func))
+        JIT_HELPER(ret, {
+            vm->returnFromFunction();
+            return vm->running ? Jit::STATUS_OK : Jit::STATUS_HALT;
+        })
+        JIT_HELPER(callNative, {
+            instr->target.native(*vm);
+            return Jit::STATUS_OK;
+        })
+
+        JIT_OP(newArray, opNewArray(instr->operand))
+        JIT_OP(loadIndex, opLoadIndex())
+        JIT_OP(storeIndex, opStoreIndex())
+        JIT_OP(arrayLen, opArrayLen())
+        JIT_OP(loadIndexUnchecked, opLoadIndexUnchecked(instr->operand))
+        JIT_OP(storeIndexUnchecked, opStoreIndexUnchecked(instr->operand))
+        JIT_OP(print, opPrint())
+        JIT_OP(read, opRead())
+        JIT_OP(println, opPrintln())
+
+        JIT_TYPED_BINARY(addInt, isInt, wrapAdd(lhs.asInt(), rhs.asInt()), opAdd)
+        JIT_TYPED_BINARY(subInt, isInt, wrapSub(lhs.asInt(), rhs.asInt()), opSub)
+        JIT_TYPED_BINARY(mulInt, isInt, wrapMul(lhs.asInt(), rhs.asInt()), opMul)
+        JIT_TYPED(divInt, isInt, opDiv, {
+            if (vm->stackTop[-1].asInt() == 0)
+            {
+                vm->runtimeError("Division by zero");
+            }
+            return divIntUnchecked(vm, instr);
+        })
+        JIT_TYPED(modInt, isInt, opMod, {
+            if (vm->stackTop[-1].asInt() == 0)
+            {
+                vm->runtimeError("Modulo by zero");
+            }
+            return modIntUnchecked(vm, instr);
+        })
+        JIT_TYPED_BINARY(addFloat, isFloat, lhs.asFloat() + rhs.asFloat(), opAdd)
+        JIT_TYPED_BINARY(subFloat, isFloat, lhs.asFloat() - rhs.asFloat(), opSub)
+        JIT_TYPED_BINARY(mulFloat, isFloat, lhs.asFloat() * rhs.asFloat(), opMul)
+        JIT_TYPED(divFloat, isFloat, opDiv, {
+            if (vm->stackTop[-1].asFloat() == 0.0)
+            {
+                vm->runtimeError("Division by zero");
+            }
+            return divFloatUnchecked(vm, instr);
+        })
+        JIT_TYPED_COMPARE(ltInt, isInt, asInt, <, opLt)
+        JIT_TYPED_COMPARE(lteInt, isInt, asInt, <=, opLte)
+        JIT_TYPED_COMPARE(gtInt, isInt, asInt, >, opGt)
+        JIT_TYPED_COMPARE(gteInt, isInt, asInt, >=, opGte)
+        JIT_TYPED_COMPARE(ltFloat, isFloat, asFloat, <, opLt)
+        JIT_TYPED_COMPARE(lteFloat, isFloat, asFloat, <=, opLte)
+        JIT_TYPED_COMPARE(gtFloat, isFloat, asFloat, >, opGt)
+        JIT_TYPED_COMPARE(gteFloat, isFloat, asFloat, >=, opGte)
+        JIT_TYPED_COMPARE(eqInt, isInt, asInt, ==, opEq)
+        JIT_TYPED_COMPARE(neqInt, isInt, asInt, !=, opNeq)
+        JIT_TYPED_COMPARE(eqFloat, isFloat, asFloat, ==, opEq)
+        JIT_TYPED_COMPARE(neqFloat, isFloat, asFloat, !=, opNeq)
+        JIT_TYPED(eqStr, isString, opEq, {
+            vm->stackTop[-2] = Value(vm->stringEquals(vm->stackTop[-2], vm->stackTop[-1]));
+            --vm->stackTop;
+            return Jit::STATUS_OK;
+        })
+        JIT_TYPED(neqStr, isString, opNeq, {
+            vm->stackTop[-2] = Value(!vm->stringEquals(vm->stackTop[-2], vm->stackTop[-1]));
+            --vm->stackTop;
+            return Jit::STATUS_OK;
+        })
+
+        JIT_OP(loadLoadAdd, push(vm->valueAdd(vm->localSlot(instr->operand), vm->localSlot(instr->aux))))
+        JIT_HELPER(ltLocalConstJmpIfNot, {
+            return vm->valueLess(vm->localSlot(instr->operand), instr->value) ? Jit::STATUS_OK
+                                                                              : Jit::STATUS_TAKEN;
+        })
+        JIT_HELPER(incLocal, {
+            Value &slot = vm->localSlot(instr->operand);
+            if (slot.isInt())
+            {
+                slot = Value(wrapAdd(slot.asInt(), instr->value.asInt()));
+            }
+            else
+            {
+                slot = vm->valueAdd(slot, instr->value);
+            }
+            return Jit::STATUS_OK;
+        })
+        JIT_OP(storePop, localSlot(instr->operand) = vm->pop())
+
+        JIT_HELPER(halt, {
+            vm->opHalt();
+            return Jit::STATUS_HALT;
+        })
+
+    private:
+        JIT_UNCHECKED_BINARY(divIntUnchecked, wrapDiv(lhs.asInt(), rhs.asInt()))
+        JIT_UNCHECKED_BINARY(modIntUnchecked, wrapMod(lhs.asInt(), rhs.asInt()))
+        JIT_UNCHECKED_BINARY(divFloatUnchecked, lhs.asFloat() / rhs.asFloat())
+    };
+
+#undef JIT_HELPER
+#undef JIT_OP
+#undef JIT_TYPED
+#undef JIT_UNCHECKED_BINARY
+#undef JIT_TYPED_BINARY
+#undef JIT_TYPED_COMPARE
+
+    namespace
+    {
+        // Helper for a bytecode opcode, nullptr if the translator has none.
+        // Quickened opcodes never reach here: compile() reads the file's
+        // opcodes, which the interpreter does not rewrite.
+        Helper helperFor(OpCode op)
+        {
+            switch (op)
+            {
+            case OP_PUSH: return JitHelpers::push;
+            case OP_POP: return JitHelpers::pop;
+            case OP_DUP: return JitHelpers::dup;
+            case OP_SWAP: return JitHelpers::swap;
+            case OP_ADD: return JitHelpers::add;
+            case OP_SUB: return JitHelpers::sub;
+            case OP_MUL: return JitHelpers::mul;
+            case OP_DIV: return JitHelpers::div;
+            case OP_MOD: return JitHelpers::mod;
+            case OP_NEG: return JitHelpers::neg;
+            case OP_INC: return JitHelpers::inc;
+            case OP_DEC: return JitHelpers::dec;
+            case OP_EQ: return JitHelpers::eq;
+            case OP_NEQ: return JitHelpers::neq;
+            case OP_LT: return JitHelpers::lt;
+            case OP_LTE: return JitHelpers::lte;
+            case OP_GT: return JitHelpers::gt;
+            case OP_GTE: return JitHelpers::gte;
+            case OP_AND: return JitHelpers::logicalAnd;
+            case OP_OR: return JitHelpers::logicalOr;
+            case OP_NOT: return JitHelpers::logicalNot;
+            case OP_LOAD: return JitHelpers::load;
+            case OP_STORE: return JitHelpers::store;
+            case OP_LOAD_GLOBAL: return JitHelpers::loadGlobal;
+            case OP_STORE_GLOBAL: return JitHelpers::storeGlobal;
+            case OP_LOAD_STR: return JitHelpers::loadStr;
+            case OP_APPEND_LOCAL: return JitHelpers::appendLocal;
+            case OP_JMP_IF: return JitHelpers::jmpIf;
+            case OP_JMP_IFNOT: return JitHelpers::jmpIfNot;
+            case OP_CALL: return JitHelpers::call;
+            case OP_TAILCALL: return JitHelpers::tailCall;
+            case OP_RET: return JitHelpers::ret;
+            case OP_CALL_NATIVE: return JitHelpers::callNative;
+            case OP_NEW_ARRAY: return JitHelpers::newArray;
+            case OP_LOAD_INDEX: return JitHelpers::loadIndex;
+            case OP_STORE_INDEX: return JitHelpers::storeIndex;
+            case OP_ARRAY_LEN: return JitHelpers::arrayLen;
+            case OP_LOAD_INDEX_UNCHECKED: return JitHelpers::loadIndexUnchecked;
+            case OP_STORE_INDEX_UNCHECKED: return JitHelpers::storeIndexUnchecked;
+            case OP_PRINT: return JitHelpers::print;
+            case OP_READ: return JitHelpers::read;
+            case OP_PRINTLN: return JitHelpers::println;
+            case OP_ADD_INT: return JitHelpers::addInt;
+            case OP_SUB_INT: return JitHelpers::subInt;
+            case OP_MUL_INT: return JitHelpers::mulInt;
+            case OP_DIV_INT: return JitHelpers::divInt;
+            case OP_MOD_INT: return JitHelpers::modInt;
+            case OP_ADD_FLOAT: return JitHelpers::addFloat;
+            case OP_SUB_FLOAT: return JitHelpers::subFloat;
+            case OP_MUL_FLOAT: return JitHelpers::mulFloat;
+            case OP_DIV_FLOAT: return JitHelpers::divFloat;
+            case OP_LT_INT: return JitHelpers::ltInt;
+            case OP_LTE_INT: return JitHelpers::lteInt;
+            case OP_GT_INT: return JitHelpers::gtInt;
+            case OP_GTE_INT: return JitHelpers::gteInt;
+            case OP_LT_FLOAT: return JitHelpers::ltFloat;
+            case OP_LTE_FLOAT: return JitHelpers::lteFloat;
+            case OP_GT_FLOAT: return JitHelpers::gtFloat;
+            case OP_GTE_FLOAT: return JitHelpers::gteFloat;
+            case OP_EQ_INT: return JitHelpers::eqInt;
+            case OP_NEQ_INT: return JitHelpers::neqInt;
+            case OP_EQ_FLOAT: return JitHelpers::eqFloat;
+            case OP_NEQ_FLOAT: return JitHelpers::neqFloat;
+            case OP_EQ_STR: return JitHelpers::eqStr;
+            case OP_NEQ_STR: return JitHelpers::neqStr;
+            case OP_LOAD_LOAD_ADD: return JitHelpers::loadLoadAdd;
+            case OP_LT_LOCAL_CONST_JMP_IFNOT: return JitHelpers::ltLocalConstJmpIfNot;
+            case OP_INC_LOCAL: return JitHelpers::incLocal;
+            case OP_STORE_POP: return JitHelpers::storePop;
+            case OP_HALT: return JitHelpers::halt;
+            default: return nullptr;
+            }
+        }
+    } // namespace
+
+    namespace
+    {
+        // Where generated code finds the VM state it touches directly
+        struct Layout
+        {
+            int32_t stackTop;             // Offset of vm->stackTop
+            int32_t instructionsExecuted; // Offset of vm->instructionsExecuted
+            const bool *collectionRequested;
+        };
+
+#if TVM_NAN_BOXING
+        // Inline ints are shifted up by this much so that the payload's
+        // sign is the register's and the CPU's overflow flag is the 50-bit
+        // one
+        constexpr uint8_t INT_SHIFT = 64 - Value::INT_BITS;
+
+        uint64_t bitsOf(const Value &value)
+        {
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            return bits;
+        }
+#endif
+
+        // Translates one function. Instructions are emitted in order; every
+        // branch target gets a label, which is also where the interpreter
+        // may enter. Inline code bails out to a cold stub, emitted after the
+        // body, that calls the opcode's helper and rejoins.
+        class Translator
+        {
+        public:
+            Translator(const FunctionInfo &func, uint32_t end, const std::vector<Instruction> &source,
+                       DecodedInstruction *decoded, const Layout &layout)
+                : func(func), start(func.address), end(end), source(source), decoded(decoded), layout(layout),
+                  targets(end - start), expanded(end - start), pending(0)
+            {
+                for (uint32_t pc = start; pc < end; pc++)
+                {
+                    labels.push_back(as.newLabel());
+                }
+                exit = as.newLabel();
+            }
+
+            // False if the function has code the translator cannot handle
+            bool translate()
+            {
+                if (!findTargets())
+                {
+                    return false;
+                }
+
+                as.push(RBX);
+                as.push(R12);
+                as.push(R13);
+                as.push(R14);
+                as.push(R15);
+                as.mov(VM_REG, RDI);
+                as.mov(LOCALS, RDX);
+                as.load(TOP, VM_REG, layout.stackTop);
+                as.alu(ALU_XOR, COUNT, COUNT);
+#if TVM_NAN_BOXING
+                as.movImm(INT_TAG, Value::INT_PREFIX);
+#endif
+                as.jmpRsi();
+
+                for (uint32_t pc = start; pc < end;)
+                {
+                    if (targets[pc - start])
+                    {
+                        flush();
+                        as.bind(labels[pc - start]);
+                    }
+                    if (!instruction(pc))
+                    {
+                        return false;
+                    }
+                }
+
+                // Deferred stubs may defer more, so no range-for
+                for (size_t i = 0; i < stubs.size(); i++)
+                {
+                    stubs[i]();
+                }
+
+                as.bind(exit);
+                as.addToMemory(VM_REG, layout.instructionsExecuted, COUNT);
+                as.pop(R15);
+                as.pop(R14);
+                as.pop(R13);
+                as.pop(R12);
+                as.pop(RBX);
+                as.ret();
+                as.resolve();
+                return true;
+            }
+
+            const std::vector<uint8_t> &code() const { return as.data(); }
+
+            // Offset of pc's code if the interpreter may enter there,
+            // SIZE_MAX otherwise
+            size_t entryPoint(uint32_t pc) const
+            {
+                uint32_t label = labels[pc - start];
+                return as.isBound(label) ? as.position(label) : SIZE_MAX;
+            }
+
+        private:
+            const FunctionInfo &func;
+            uint32_t start;
+            uint32_t end;
+            const std::vector<Instruction> &source;
+            DecodedInstruction *decoded;
+            Layout layout;
+
+            Assembler as;
+            std::vector<uint32_t> labels; // Per instruction
+            std::vector<bool> targets;    // Per instruction: a label is bound there
+            std::vector<bool> expanded;   // Per superinstruction: its covered instructions keep code
+            uint32_t exit;
+            std::vector<std::function<void()>> stubs;
+
+            // Instructions executed since COUNT was last brought up to date.
+            // Added before every label and every way out, so a count is
+            // never carried along a jump.
+            int32_t pending;
+
+            bool inRange(uint32_t pc) const { return pc >= start && pc < end; }
+            uint32_t label(uint32_t pc) const { return labels[pc - start]; }
+
+            bool findTargets()
+            {
+                // Control must never run off the end of the range, and every
+                // branch has to land inside it, since only the range gets
+                // labels
+                OpCode last = source[end - 1].opcode;
+                if (last != OP_RET && last != OP_TAILCALL && last != OP_JMP && last != OP_HALT)
+                {
+                    return false;
+                }
+
+                targets[0] = true;
+                for (uint32_t pc = start; pc < end; pc++)
+                {
+                    OpCode op = source[pc].opcode;
+                    if (op == OP_JMP || op == OP_JMP_IF || op == OP_JMP_IFNOT || op == OP_LT_LOCAL_CONST_JMP_IFNOT)
+                    {
+                        uint32_t target = op == OP_LT_LOCAL_CONST_JMP_IFNOT ? decoded[pc].aux : decoded[pc].operand;
+                        if (!inRange(target))
+                        {
+                            return false;
+                        }
+                        targets[target - start] = true;
+                    }
+                }
+
+                // A superinstruction continues after the instructions it
+                // covers. They get no code of their own unless something
+                // jumps into them, in which case the superinstruction jumps
+                // over them instead.
+                for (uint32_t pc = start; pc < end; pc++)
+                {
+                    uint32_t length = superinstructionLength(source[pc].opcode);
+                    if (length == 1)
+                    {
+                        continue;
+                    }
+                    if (!inRange(pc + length))
+                    {
+                        return false;
+                    }
+                    for (uint32_t covered = pc + 1; covered < pc + length; covered++)
+                    {
+                        if (targets[covered - start])
+                        {
+                            expanded[pc - start] = true;
+                            targets[pc + length - start] = true;
+                        }
+                    }
+                }
+                return true;
+            }
+
+            void flush()
+            {
+                if (pending > 0)
+                {
+                    as.addImm(COUNT, pending);
+                    pending = 0;
+                }
+            }
+
+            // A label whose code, a cold stub, is emitted after the body
+            uint32_t stub(std::function<void()> body)
+            {
+                uint32_t entry = as.newLabel();
+                stubs.push_back([this, entry, body] {
+                    as.bind(entry);
+                    body();
+                });
+                return entry;
+            }
+
+            // Helpers see the VM's stackTop, so TOP is written back around
+            // each call
+            void callHelper(Helper helper, DecodedInstruction *instr)
+            {
+                as.store(VM_REG, layout.stackTop, TOP);
+                as.callHelper(helper, instr);
+                as.load(TOP, VM_REG, layout.stackTop);
+            }
+            void exitUnlessOk()
+            {
+                as.testStatus();
+                as.jcc(CC_NE, exit);
+            }
+            void branchOnStatus(uint32_t target)
+            {
+                as.cmpTaken();
+                as.jcc(CC_E, label(target));
+                as.jcc(CC_A, exit);
+            }
+
+            // The opcode's helper in place of inline code that gave up
+            uint32_t slowPath(Helper helper, DecodedInstruction *instr, uint32_t resume)
+            {
+                return stub([this, helper, instr, resume] {
+                    callHelper(helper, instr);
+                    exitUnlessOk();
+                    as.jmp(resume);
+                });
+            }
+            uint32_t slowBranch(Helper helper, DecodedInstruction *instr, uint32_t target, uint32_t resume)
+            {
+                return stub([this, helper, instr, target, resume] {
+                    callHelper(helper, instr);
+                    branchOnStatus(target);
+                    as.jmp(resume);
+                });
+            }
+
+            bool instruction(uint32_t &pc)
+            {
+                DecodedInstruction *instr = &decoded[pc];
+                OpCode op = source[pc].opcode;
+                pending++;
+
+                if (op == OP_JMP)
+                {
+                    flush();
+                    if (instr->operand <= pc)
+                    {
+                        // The interpreter's safe point, tested in place
+                        uint32_t resume = as.newLabel();
+                        as.movImm(RAX, reinterpret_cast<uint64_t>(layout.collectionRequested));
+                        as.cmpByteZero(RAX);
+                        as.jcc(CC_NE, slowPath(JitHelpers::pollHeap, instr, resume));
+                        as.bind(resume);
+                    }
+                    as.jmp(label(instr->operand));
+                    pc++;
+                    return true;
+                }
+
+                if (op == OP_TAILCALL && instr->target.func == &func)
+                {
+                    // Self tail call: reset the frame, then loop back natively
+                    flush();
+                    callHelper(JitHelpers::selfTailCall, instr);
+                    exitUnlessOk();
+                    as.jmp(label(start));
+                    pc++;
+                    return true;
+                }
+
+#if TVM_NAN_BOXING
+                if (inlineInstruction(pc, op, instr))
+                {
+                    return true;
+                }
+#endif
+
+                Helper helper = helperFor(op);
+                if (!helper)
+                {
+                    return false;
+                }
+                flush();
+                callHelper(helper, instr);
+
+                switch (op)
+                {
+                case OP_JMP_IF:
+                case OP_JMP_IFNOT:
+                    branchOnStatus(instr->operand);
+                    break;
+                case OP_LT_LOCAL_CONST_JMP_IFNOT:
+                    branchOnStatus(instr->aux);
+                    break;
+                case OP_RET:
+                case OP_TAILCALL:
+                case OP_HALT:
+                    as.jmp(exit);
+                    break;
+                default:
+                    exitUnlessOk();
+                    break;
+                }
+                return next(pc, op);
+            }
+
+            // Moves past op, and past what it covers unless that keeps code
+            bool next(uint32_t &pc, OpCode op)
+            {
+                uint32_t length = superinstructionLength(op);
+                if (length > 1 && expanded[pc - start])
+                {
+                    flush();
+                    as.jmp(label(pc + length));
+                    length = 1;
+                }
+                pc += length;
+                return true;
+            }
+
+#if TVM_NAN_BOXING
+            static int32_t slot(int32_t index) { return index * static_cast<int32_t>(sizeof(Value)); }
+            static int32_t local(uint32_t index) { return slot(static_cast<int32_t>(index)); }
+
+            void pushRax()
+            {
+                as.store(TOP, 0, RAX);
+                as.addImm(TOP, slot(1));
+            }
+
+            // Jumps to slow unless rax and rcx are both inline ints
+            void checkInts(uint32_t slow)
+            {
+                as.alu(ALU_CMP, RAX, INT_TAG);
+                as.jcc(CC_B, slow);
+                as.alu(ALU_CMP, RCX, INT_TAG);
+                as.jcc(CC_B, slow);
+            }
+            // rax = the inline int whose value, shifted up, is in rax
+            void boxShifted()
+            {
+                as.shift(SHIFT_SHR, RAX, INT_SHIFT);
+                as.alu(ALU_OR, RAX, INT_TAG);
+            }
+            // rax = cc as a bool
+            void boxCondition(Cond cc)
+            {
+                as.setToEcx(cc);
+                as.movImm(RAX, bitsOf(Value(false)));
+                as.alu(ALU_OR, RAX, RCX);
+            }
+
+            // The constant of a superinstruction, shifted up, if it is an
+            // inline int
+            static bool shiftedConstant(const DecodedInstruction *instr, uint64_t &shifted)
+            {
+                uint64_t bits = bitsOf(instr->value);
+                shifted = bits << INT_SHIFT;
+                return bits >= Value::INT_PREFIX;
+            }
+
+            bool inlineInstruction(uint32_t &pc, OpCode op, DecodedInstruction *instr)
+            {
+                Helper helper = helperFor(op);
+                switch (op)
+                {
+                case OP_LOAD:
+                    as.load(RAX, LOCALS, local(instr->operand));
+                    pushRax();
+                    break;
+                case OP_STORE:
+                case OP_STORE_POP:
+                    as.load(RAX, TOP, slot(-1));
+                    as.store(LOCALS, local(instr->operand), RAX);
+                    if (op == OP_STORE_POP)
+                    {
+                        as.addImm(TOP, slot(-1));
+                    }
+                    break;
+                case OP_PUSH:
+                    as.movImm(RAX, bitsOf(instr->value));
+                    pushRax();
+                    break;
+                case OP_POP:
+                    as.addImm(TOP, slot(-1));
+                    break;
+                case OP_DUP:
+                    as.load(RAX, TOP, slot(-1));
+                    pushRax();
+                    break;
+                case OP_SWAP:
+                    as.load(RAX, TOP, slot(-1));
+                    as.load(RCX, TOP, slot(-2));
+                    as.store(TOP, slot(-2), RAX);
+                    as.store(TOP, slot(-1), RCX);
+                    break;
+
+                case OP_ADD:
+                case OP_ADD_INT:
+                case OP_SUB:
+                case OP_SUB_INT:
+                case OP_MUL:
+                case OP_MUL_INT:
+                    intArithmetic(op, instr, helper);
+                    break;
+                case OP_DIV:
+                case OP_DIV_INT:
+                case OP_MOD:
+                case OP_MOD_INT:
+                    intDivision(op == OP_MOD || op == OP_MOD_INT, instr, helper);
+                    break;
+                case OP_ADD_FLOAT:
+                    floatArithmetic(SSE_ADD, instr, helper);
+                    break;
+                case OP_SUB_FLOAT:
+                    floatArithmetic(SSE_SUB, instr, helper);
+                    break;
+                case OP_MUL_FLOAT:
+                    floatArithmetic(SSE_MUL, instr, helper);
+                    break;
+
+                case OP_LT:
+                case OP_LT_INT:
+                    return intCompare(pc, CC_L, helper);
+                case OP_LTE:
+                case OP_LTE_INT:
+                    return intCompare(pc, CC_LE, helper);
+                case OP_GT:
+                case OP_GT_INT:
+                    return intCompare(pc, CC_G, helper);
+                case OP_GTE:
+                case OP_GTE_INT:
+                    return intCompare(pc, CC_GE, helper);
+                case OP_EQ_INT:
+                    return intCompare(pc, CC_E, helper);
+                case OP_NEQ_INT:
+                    return intCompare(pc, CC_NE, helper);
+                // a < b is tested as b > a and so on, which reads only the
+                // carry and zero flags ucomisd sets
+                case OP_LT_FLOAT:
+                    return floatCompare(pc, 1, 0, CC_A, helper);
+                case OP_LTE_FLOAT:
+                    return floatCompare(pc, 1, 0, CC_AE, helper);
+                case OP_GT_FLOAT:
+                    return floatCompare(pc, 0, 1, CC_A, helper);
+                case OP_GTE_FLOAT:
+                    return floatCompare(pc, 0, 1, CC_AE, helper);
+
+                case OP_JMP_IF:
+                case OP_JMP_IFNOT:
+                    conditionalJump(op == OP_JMP_IF, instr, helper);
+                    break;
+
+                case OP_LOAD_LOAD_ADD:
+                {
+                    uint32_t resume = as.newLabel();
+                    uint32_t slow = slowPath(helper, instr, resume);
+                    as.load(RAX, LOCALS, local(instr->operand));
+                    as.load(RCX, LOCALS, local(instr->aux));
+                    checkInts(slow);
+                    as.shift(SHIFT_SHL, RAX, INT_SHIFT);
+                    as.shift(SHIFT_SHL, RCX, INT_SHIFT);
+                    as.alu(ALU_ADD, RAX, RCX);
+                    as.jcc(CC_O, slow);
+                    boxShifted();
+                    pushRax();
+                    as.bind(resume);
+                    break;
+                }
+                case OP_LT_LOCAL_CONST_JMP_IFNOT:
+                {
+                    uint64_t limit;
+                    if (!shiftedConstant(instr, limit))
+                    {
+                        return false;
+                    }
+                    flush();
+                    uint32_t resume = as.newLabel();
+                    as.load(RAX, LOCALS, local(instr->operand));
+                    as.alu(ALU_CMP, RAX, INT_TAG);
+                    as.jcc(CC_B, slowBranch(helper, instr, instr->aux, resume));
+                    as.shift(SHIFT_SHL, RAX, INT_SHIFT);
+                    as.movImm(RCX, limit);
+                    as.alu(ALU_CMP, RAX, RCX);
+                    as.jcc(CC_GE, label(instr->aux));
+                    as.bind(resume);
+                    break;
+                }
+                case OP_INC_LOCAL:
+                {
+                    uint64_t step;
+                    if (!shiftedConstant(instr, step))
+                    {
+                        return false;
+                    }
+                    uint32_t resume = as.newLabel();
+                    uint32_t slow = slowPath(helper, instr, resume);
+                    as.load(RAX, LOCALS, local(instr->operand));
+                    as.alu(ALU_CMP, RAX, INT_TAG);
+                    as.jcc(CC_B, slow);
+                    as.shift(SHIFT_SHL, RAX, INT_SHIFT);
+                    as.movImm(RCX, step);
+                    as.alu(ALU_ADD, RAX, RCX);
+                    as.jcc(CC_O, slow);
+                    boxShifted();
+                    as.store(LOCALS, local(instr->operand), RAX);
+                    as.bind(resume);
+                    break;
+                }
+                default:
+                    return false;
+                }
+                return next(pc, op);
+            }
+
+            void intArithmetic(OpCode op, DecodedInstruction *instr, Helper helper)
+            {
+                uint32_t resume = as.newLabel();
+                uint32_t slow = slowPath(helper, instr, resume);
+                as.load(RAX, TOP, slot(-2));
+                as.load(RCX, TOP, slot(-1));
+                checkInts(slow);
+                as.shift(SHIFT_SHL, RAX, INT_SHIFT);
+                as.shift(SHIFT_SHL, RCX, INT_SHIFT);
+                if (op == OP_MUL || op == OP_MUL_INT)
+                {
+                    as.shift(SHIFT_SAR, RAX, INT_SHIFT);
+                    as.imul(RAX, RCX);
+                }
+                else
+                {
+                    as.alu(op == OP_ADD || op == OP_ADD_INT ? ALU_ADD : ALU_SUB, RAX, RCX);
+                }
+                as.jcc(CC_O, slow);
+                boxShifted();
+                as.store(TOP, slot(-2), RAX);
+                as.addImm(TOP, slot(-1));
+                as.bind(resume);
+            }
+
+            // The helper reports a zero divisor, and takes the one quotient
+            // that does not fit inline: the smallest int divided by -1
+            void intDivision(bool modulo, DecodedInstruction *instr, Helper helper)
+            {
+                uint32_t resume = as.newLabel();
+                uint32_t slow = slowPath(helper, instr, resume);
+                as.load(RAX, TOP, slot(-2));
+                as.load(RCX, TOP, slot(-1));
+                checkInts(slow);
+                as.shift(SHIFT_SHL, RAX, INT_SHIFT);
+                as.shift(SHIFT_SAR, RAX, INT_SHIFT);
+                as.shift(SHIFT_SHL, RCX, INT_SHIFT);
+                as.shift(SHIFT_SAR, RCX, INT_SHIFT);
+                as.test(RCX, RCX);
+                as.jcc(CC_E, slow);
+                as.cqo();
+                as.idiv(RCX);
+                if (modulo)
+                {
+                    as.mov(RAX, RDX);
+                }
+                as.mov(RCX, RAX);
+                as.shift(SHIFT_SHL, RAX, INT_SHIFT);
+                as.mov(RDX, RAX);
+                as.shift(SHIFT_SAR, RDX, INT_SHIFT);
+                as.alu(ALU_CMP, RDX, RCX);
+                as.jcc(CC_NE, slow);
+                boxShifted();
+                as.store(TOP, slot(-2), RAX);
+                as.addImm(TOP, slot(-1));
+                as.bind(resume);
+            }
+
+            // A NaN result goes to the helper, which canonicalises it
+            void floatArithmetic(SseOp sseOp, DecodedInstruction *instr, Helper helper)
+            {
+                uint32_t resume = as.newLabel();
+                as.loadSd(0, TOP, slot(-2));
+                as.arithSd(sseOp, 0, TOP, slot(-1));
+                as.ucomisd(0, 0);
+                as.jcc(CC_P, slowPath(helper, instr, resume));
+                as.storeSd(TOP, slot(-2), 0);
+                as.addImm(TOP, slot(-1));
+                as.bind(resume);
+            }
+
+            // A compare followed by a conditional jump nothing else reaches
+            // becomes a native compare-and-branch
+            bool fusesWithJump(uint32_t pc) const
+            {
+                uint32_t jump = pc + 1;
+                return jump < end && !targets[jump - start] &&
+                       (source[jump].opcode == OP_JMP_IF || source[jump].opcode == OP_JMP_IFNOT);
+            }
+
+            // Branches on cc, the flags of the compare at pc, if it fuses;
+            // otherwise pushes cc as a bool. The operands are still on the
+            // stack, so TOP must move without touching the flags.
+            void endCompare(uint32_t &pc, Cond cc)
+            {
+                if (fusesWithJump(pc))
+                {
+                    DecodedInstruction *jump = &decoded[pc + 1];
+                    as.lea(TOP, TOP, slot(-2));
+                    as.jcc(source[pc + 1].opcode == OP_JMP_IF ? cc : negate(cc), label(jump->operand));
+                    pc += 2;
+                    return;
+                }
+                boxCondition(cc);
+                as.store(TOP, slot(-2), RAX);
+                as.addImm(TOP, slot(-1));
+                pc++;
+            }
+
+            // Where a compare at pc goes when the inline test does not
+            // apply: its helper, then the fused jump's if there is one
+            uint32_t compareSlowPath(uint32_t pc, Helper helper, uint32_t resume)
+            {
+                DecodedInstruction *instr = &decoded[pc];
+                if (!fusesWithJump(pc))
+                {
+                    return slowPath(helper, instr, resume);
+                }
+                DecodedInstruction *jump = &decoded[pc + 1];
+                Helper branch = helperFor(source[pc + 1].opcode);
+                pending++;
+                flush();
+                return stub([this, helper, instr, branch, jump, resume] {
+                    callHelper(helper, instr);
+                    exitUnlessOk();
+                    callHelper(branch, jump);
+                    branchOnStatus(jump->operand);
+                    as.jmp(resume);
+                });
+            }
+
+            bool intCompare(uint32_t &pc, Cond cc, Helper helper)
+            {
+                uint32_t resume = as.newLabel();
+                uint32_t slow = compareSlowPath(pc, helper, resume);
+                as.load(RAX, TOP, slot(-2));
+                as.load(RCX, TOP, slot(-1));
+                checkInts(slow);
+                as.shift(SHIFT_SHL, RAX, INT_SHIFT);
+                as.shift(SHIFT_SHL, RCX, INT_SHIFT);
+                as.alu(ALU_CMP, RAX, RCX);
+                endCompare(pc, cc);
+                as.bind(resume);
+                return true;
+            }
+
+            // Compares xmm`a` with xmm`b`, where xmm0 is the left operand
+            // and xmm1 the right. Every boxed value is a NaN, so unordered
+            // operands go to the helper, which tells a real NaN from an
+            // operand that is not a float.
+            bool floatCompare(uint32_t &pc, uint8_t a, uint8_t b, Cond cc, Helper helper)
+            {
+                uint32_t resume = as.newLabel();
+                uint32_t slow = compareSlowPath(pc, helper, resume);
+                as.loadSd(0, TOP, slot(-2));
+                as.loadSd(1, TOP, slot(-1));
+                as.ucomisd(a, b);
+                as.jcc(CC_P, slow);
+                endCompare(pc, cc);
+                as.bind(resume);
+                return true;
+            }
+
+            // True and false branch inline; other values go to the helper
+            // for their truthiness
+            void conditionalJump(bool onTrue, DecodedInstruction *instr, Helper helper)
+            {
+                flush();
+                uint32_t resume = as.newLabel();
+                uint32_t target = label(instr->operand);
+                as.load(RAX, TOP, slot(-1));
+                as.movImm(RCX, bitsOf(Value(true)));
+                as.alu(ALU_CMP, RAX, RCX);
+                uint32_t slow = stub([this, helper, instr, resume] {
+                    as.addImm(TOP, slot(1));
+                    callHelper(helper, instr);
+                    branchOnStatus(instr->operand);
+                    as.jmp(resume);
+                });
+                as.lea(TOP, TOP, slot(-1));
+                as.jcc(CC_E, onTrue ? target : resume);
+                as.movImm(RCX, bitsOf(Value(false)));
+                as.alu(ALU_CMP, RAX, RCX);
+                as.jcc(CC_E, onTrue ? resume : target);
+                as.jmp(slow);
+                as.bind(resume);
+            }
+#endif
+        };
+    } // namespace
+
+    Jit::Jit(VM &vm, uint32_t threshold)
+        : vm(vm), threshold(threshold), entries(vm.program->functions.size()), depth(0), compiledCount(0)
+    {
+        // A function's range runs up to the next function's entry point
+        const auto &functions = vm.program->functions;
+        std::vector<uint32_t> starts;
+        for (const auto &func : functions)
+        {
+            starts.push_back(func.address);
+        }
+        std::sort(starts.begin(), starts.end());
+
+        uint32_t codeSize = static_cast<uint32_t>(vm.program->code.size());
+        for (size_t i = 0; i < functions.size(); i++)
+        {
+            auto next = std::upper_bound(starts.begin(), starts.end(), functions[i].address);
+            entries[i].end = next == starts.end() ? codeSize : *next;
+        }
+    }
+
+    Jit::~Jit()
+    {
+        for (const auto &region : regions)
+        {
+            munmap(region.base, region.size);
+        }
+    }
+
+    bool Jit::enter(const FunctionInfo *func)
+    {
+        Entry &entry = entries[func - vm.program->functions.data()];
+        if (!entry.code && !compileIfHot(*func, entry, ++entry.calls))
+        {
+            return false;
+        }
+        return run(*func, entry, func->address);
+    }
+
+    bool Jit::enterLoop(const FunctionInfo *func, uint32_t header)
+    {
+        Entry &entry = entries[func - vm.program->functions.data()];
+        if (!entry.code && !compileIfHot(*func, entry, ++entry.backEdges))
+        {
+            return false;
+        }
+        return run(*func, entry, header);
+    }
+
+    bool Jit::compileIfHot(const FunctionInfo &func, Entry &entry, uint32_t heat)
+    {
+        if (entry.rejected || heat < threshold)
+        {
+            return false;
+        }
+        if (!compile(func, entry))
+        {
+            entry.rejected = true;
+            return false;
+        }
+        compiledCount++;
+        return true;
+    }
+
+    bool Jit::run(const FunctionInfo &func, Entry &entry, uint32_t at)
+    {
+        if (at < func.address || at >= entry.end || depth >= MAX_NATIVE_DEPTH)
+        {
+            return false;
+        }
+        uint32_t offset = entry.offsets[at - func.address];
+        if (offset == NO_CODE)
+        {
+            return false;
+        }
+
+        depth++;
+        int32_t status = reinterpret_cast<NativeCode>(entry.code)(&vm, entry.code + offset,
+                                                                   vm.stack.get() + vm.frameBase);
+        depth--;
+        if (status == STATUS_ERROR)
+        {
+            std::exception_ptr pending = error;
+            error = nullptr;
+            std::rethrow_exception(pending);
+        }
+        return true;
+    }
+
+    bool Jit::compile(const FunctionInfo &func, Entry &entry)
+    {
+        if (func.address >= entry.end)
+        {
+            return false;
+        }
+
+        auto offsetIn = [&](const auto &member) {
+            return static_cast<int32_t>(reinterpret_cast<const char *>(&member) - reinterpret_cast<const char *>(&vm));
+        };
+        Layout layout{offsetIn(vm.stackTop), offsetIn(vm.instructionsExecuted), vm.heap.collectionRequestedFlag()};
+        Translator translator(func, entry.end, vm.program->code, vm.code.data(), layout);
+        if (!translator.translate())
+        {
+            return false;
+        }
+        const std::vector<uint8_t> &code = translator.code();
+
+        // Written while writable, then flipped to executable
+        size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t size = (code.size() + pageSize - 1) / pageSize * pageSize;
+        void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            return false;
+        }
+        std::memcpy(base, code.data(), code.size());
+        if (mprotect(base, size, PROT_READ | PROT_EXEC) != 0)
+        {
+            munmap(base, size);
+            return false;
+        }
+        regions.push_back(Region{base, size});
+
+        entry.code = static_cast<uint8_t *>(base);
+        entry.offsets.resize(entry.end - func.address);
+        for (uint32_t pc = func.address; pc < entry.end; pc++)
+        {
+            size_t offset = translator.entryPoint(pc);
+            entry.offsets[pc - func.address] = offset == SIZE_MAX ? NO_CODE : static_cast<uint32_t>(offset);
+        }
+        return true;
+    }
+
+} // namespace TVM
@@ -0,0 +1,99 @@
+#pragma once
+#include "vm.h"
+#include <exception>
+#include <vector>
+
+// Baseline JIT for x86-64 Linux. Internal to tail_vm and only compiled when
+// TVM_JIT is set (CMake option TAIL_JIT).
+//
+// A function is translated into native code once it has been called
+// `threshold` times, or once its loops have jumped back that often; the
+// interpreter then moves into the native code at the loop header, so a hot
+// loop in Main is compiled too. Local loads and stores, pushes and pops, int
+// arithmetic and comparisons on inline ints, typed float arithmetic, and
+// compare-and-branch pairs run as inline machine code that keeps the stack
+// top and the instruction count in registers. Anything else, and every case
+// the inline code does not cover (a boxed int, a string operand, an
+// overflow), calls a helper that reuses the interpreter's operator
+// semantics, so both modes produce the same results and the same --stats
+// instruction count. A function the translator cannot handle stays
+// interpreted.
+
+namespace TVM
+{
+
+    class Jit
+    {
+    public:
+        // Result of a helper or of a compiled function. Errors travel as a
+        // status because C++ exceptions cannot unwind through generated
+        // frames, which have no unwind tables.
+        enum Status : int32_t
+        {
+            STATUS_OK = 0,    // Continue; from a compiled function: it returned
+            STATUS_TAKEN = 1, // Branch helpers: take the jump
+            STATUS_ERROR = 2, // The exception is held in `error`
+            STATUS_HALT = 3   // OP_HALT was executed
+        };
+
+        // Starts at `entry`, an instruction's code inside the function, with
+        // `locals` the frame's first local
+        using NativeCode = int32_t (*)(VM *, const uint8_t *entry, Value *locals);
+
+        Jit(VM &vm, uint32_t threshold);
+        ~Jit();
+
+        Jit(const Jit &) = delete;
+        Jit &operator=(const Jit &) = delete;
+
+        // Called by the interpreter once callFunction() has set up func's
+        // frame. Returns true if the body ran natively, in which case the
+        // frame is gone and pc is the return address.
+        bool enter(const FunctionInfo *func);
+
+        // Called by the interpreter on a backward jump to `header` in func's
+        // current frame. Returns true if the rest of the call ran natively,
+        // with the same outcome as enter().
+        bool enterLoop(const FunctionInfo *func, uint32_t header);
+
+        uint32_t getCompiledCount() const { return compiledCount; }
+
+    private:
+        friend struct JitHelpers;
+
+        static constexpr uint32_t NO_CODE = UINT32_MAX;
+
+        struct Entry
+        {
+            uint32_t calls = 0;
+            uint32_t backEdges = 0;
+            uint32_t end = 0;       // One past the function's last instruction
+            bool rejected = false;  // Not translatable, stays interpreted
+            uint8_t *code = nullptr;
+            std::vector<uint32_t> offsets; // Per instruction: its code's offset, or NO_CODE
+        };
+
+        struct Region
+        {
+            void *base;
+            size_t size;
+        };
+
+        // Bounds how deeply native frames and the interpreter runs they call
+        // back into may nest on the C stack; deeper calls are interpreted.
+        static constexpr uint32_t MAX_NATIVE_DEPTH = 1000;
+
+        VM &vm;
+        uint32_t threshold;
+        std::vector<Entry> entries; // Parallel to program->functions
+        std::vector<Region> regions;
+        uint32_t depth;
+        uint32_t compiledCount;
+        std::exception_ptr error;
+
+        bool compileIfHot(const FunctionInfo &func, Entry &entry, uint32_t heat);
+        bool run(const FunctionInfo &func, Entry &entry, uint32_t at);
+        bool compile(const FunctionInfo &func, Entry &entry);
+    };
+
+} // namespace TVM
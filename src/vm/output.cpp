@@ -0,0 +1,95 @@
+#include "output.h"
+#include "../shared/numbers.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#ifdef _WIN32
+#include <io.h>
+#define TVM_WRITE _write
+#define TVM_ISATTY _isatty
+#else
+#include <unistd.h>
+#define TVM_WRITE ::write
+#define TVM_ISATTY ::isatty
+#endif
+
+namespace TVM
+{
+
+    static constexpr int STDOUT_FD = 1;
+
+    // Writes all of [chars, chars + length) to stdout
+    static void writeAll(const char *chars, size_t length)
+    {
+        while (length > 0)
+        {
+            auto written = TVM_WRITE(STDOUT_FD, chars, static_cast<unsigned>(std::min<size_t>(length, 1u << 30)));
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return; // Nowhere to report it; the output is lost either way
+            }
+            chars += written;
+            length -= static_cast<size_t>(written);
+        }
+    }
+
+    OutputBuffer::OutputBuffer()
+        : data(new char[CAPACITY]), used(0),
+          mode(TVM_ISATTY(STDOUT_FD) ? OutputMode::LineBuffered : OutputMode::Buffered)
+    {
+    }
+
+    OutputBuffer::~OutputBuffer()
+    {
+        flush();
+    }
+
+    void OutputBuffer::write(std::string_view text)
+    {
+        if (text.size() > CAPACITY - used)
+        {
+            flush();
+            if (text.size() > CAPACITY)
+            {
+                writeAll(text.data(), text.size()); // Too big to buffer
+                return;
+            }
+        }
+        std::memcpy(data.get() + used, text.data(), text.size());
+        used += text.size();
+    }
+
+    void OutputBuffer::writeInt(int64_t value)
+    {
+        if (CAPACITY - used < NUMBER_TEXT_MAX)
+        {
+            flush();
+        }
+        used = formatInt(data.get() + used, value) - data.get();
+    }
+
+    void OutputBuffer::writeFloat(double value)
+    {
+        if (CAPACITY - used < NUMBER_TEXT_MAX)
+        {
+            flush();
+        }
+        used = formatFloat(data.get() + used, value) - data.get();
+    }
+
+    void OutputBuffer::flush()
+    {
+        // Whatever went through std::cout first (the VM's banner, trace
+        // lines) must come out first
+        std::cout.flush();
+        size_t length = used;
+        used = 0;
+        writeAll(data.get(), length);
+    }
+
+} // namespace TVM
@@ -0,0 +1,74 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+// The VM's stdout. Console.print/println and the PRINT opcodes format into
+// one fixed buffer that goes out in a single write() when it fills, instead
+// of a flushing std::cout << ... << std::endl per line. Internal to tail_vm.
+//
+// The owner flushes when output has to be visible: at exit, on
+// Console.flush(), before reading stdin and before anything else writes to
+// the terminal (std::cout, std::cerr, a child process).
+
+namespace TVM
+{
+
+    enum class OutputMode
+    {
+        Buffered,     // Flush when full (default when stdout is not a TTY)
+        LineBuffered, // Also after every newline (default on a TTY)
+        Unbuffered    // After every print (tail --unbuffered)
+    };
+
+    class OutputBuffer
+    {
+    public:
+        static constexpr size_t CAPACITY = 64 * 1024;
+
+        OutputBuffer();
+        ~OutputBuffer();
+
+        OutputBuffer(const OutputBuffer &) = delete;
+        OutputBuffer &operator=(const OutputBuffer &) = delete;
+
+        void setMode(OutputMode newMode) { mode = newMode; }
+        OutputMode getMode() const { return mode; }
+
+        void write(std::string_view text);
+        void writeInt(int64_t value);
+        void writeFloat(double value);
+
+        // End of a print: flushes if unbuffered
+        void endPrint()
+        {
+            if (mode == OutputMode::Unbuffered)
+            {
+                flush();
+            }
+        }
+
+        // End of a println: a newline, then flushes unless fully buffered
+        void endLine()
+        {
+            if (used == CAPACITY)
+            {
+                flush();
+            }
+            data[used++] = '\n';
+            if (mode != OutputMode::Buffered)
+            {
+                flush();
+            }
+        }
+
+        void flush();
+
+    private:
+        std::unique_ptr<char[]> data;
+        size_t used;
+        OutputMode mode;
+    };
+
+} // namespace TVM
@@ -0,0 +1,832 @@
+#include "verifier.h"
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace TVM
+{
+
+    BytecodeVerifier::BytecodeVerifier(const BytecodeFile &program, const VM &vm)
+        : program(program), vm(vm), func(nullptr), start(0), end(0), pc(0)
+    {
+    }
+
+    void BytecodeVerifier::verify()
+    {
+        verifyHeader();
+        verifyConstants();
+
+        bool registerCode = program.version == BYTECODE_VERSION_REGISTER;
+        size_t codeSize = registerCode ? program.regCode.size() : program.code.size();
+
+        starts.clear();
+        for (const auto &info : program.functions)
+        {
+            if (info.address >= codeSize)
+            {
+                fail("Function " + info.name + " starts at " + std::to_string(info.address) +
+                     ", past the end of the code");
+            }
+            starts.push_back(info.address);
+        }
+        std::sort(starts.begin(), starts.end());
+        // The loader decodes every instruction, and code no function owns
+        // would escape the per-function checks below
+        if (codeSize > 0 && (starts.empty() || starts.front() != 0))
+        {
+            fail("Code at PC=0 belongs to no function");
+        }
+        auto shared = std::adjacent_find(starts.begin(), starts.end());
+        if (shared != starts.end())
+        {
+            fail("Two functions start at " + std::to_string(*shared));
+        }
+
+        bool hasMain = false;
+        for (const auto &info : program.functions)
+        {
+            func = &info;
+            start = info.address;
+            end = functionEnd(info.address, codeSize);
+            pc = start;
+
+            // Parameters are the first locals; the frame layout relies on it
+            if (info.arity > info.locals)
+            {
+                fail("Declares " + std::to_string(info.arity) + " parameters but only " +
+                     std::to_string(info.locals) + " locals");
+            }
+            hasMain = hasMain || info.name == "Main";
+
+            if (registerCode)
+            {
+                verifyRegisterFunction();
+            }
+            else
+            {
+                verifyStackFunction();
+            }
+        }
+        func = nullptr;
+
+        if (!hasMain)
+        {
+            fail("Main function not found");
+        }
+    }
+
+    void BytecodeVerifier::verifyHeader()
+    {
+        if (program.version != BYTECODE_VERSION_STACK && program.version != BYTECODE_VERSION_REGISTER)
+        {
+            fail("Unsupported bytecode version " + std::to_string(program.version));
+        }
+    }
+
+    void BytecodeVerifier::verifyConstants()
+    {
+        for (size_t i = 0; i < program.constants.size(); i++)
+        {
+            const Constant &cst = program.constants[i];
+            size_t poolSize = 0;
+            switch (cst.type)
+            {
+            case TYPE_NIL:
+            case TYPE_INT:
+            case TYPE_FLOAT:
+            case TYPE_BOOL:
+                continue;
+            case TYPE_STRING:
+                poolSize = program.strings.size();
+                break;
+            case TYPE_ARRAY_INT:
+                poolSize = program.intArrays.size();
+                break;
+            case TYPE_ARRAY_FLOAT:
+                poolSize = program.floatArrays.size();
+                break;
+            case TYPE_ARRAY_STRING:
+                poolSize = program.stringArrays.size();
+                break;
+            default:
+                fail("Constant " + std::to_string(i) + " has unknown type " +
+                     std::to_string(static_cast<int>(cst.type)));
+            }
+            if (cst.as.stringIdx >= poolSize)
+            {
+                fail("Constant " + std::to_string(i) + " refers to pool entry " +
+                     std::to_string(cst.as.stringIdx) + " of " + std::to_string(poolSize));
+            }
+        }
+    }
+
+    uint32_t BytecodeVerifier::functionEnd(uint32_t address, size_t codeSize) const
+    {
+        auto next = std::upper_bound(starts.begin(), starts.end(), address);
+        return next == starts.end() ? static_cast<uint32_t>(codeSize) : *next;
+    }
+
+    const FunctionInfo *BytecodeVerifier::functionAt(uint32_t address) const
+    {
+        for (const auto &info : program.functions)
+        {
+            if (info.address == address)
+            {
+                return &info;
+            }
+        }
+        return nullptr;
+    }
+
+    // Abstract interpretation over operand depth, counted from the top of
+    // the frame's locals. Every reachable instruction must be entered at the
+    // same depth on all paths, no instruction may pop more than is there,
+    // and the deepest point must fit the function's declared maxStack.
+    // Unreachable code is never executed, but VM::link decodes it all, so
+    // its operands are checked too.
+    void BytecodeVerifier::verifyStackFunction()
+    {
+        const auto &code = program.code;
+        for (pc = start; pc < end; pc++)
+        {
+            checkStackOperands(code[pc]);
+        }
+
+        constexpr int32_t UNSEEN = -1;
+        std::vector<int32_t> depths(end - start, UNSEEN);
+        std::vector<uint32_t> worklist = {start};
+        depths[0] = 0;
+        uint32_t maxDepth = 0;
+
+        auto merge = [&](uint32_t target, uint32_t depth)
+        {
+            int32_t &seen = depths[target - start];
+            if (seen == UNSEEN)
+            {
+                seen = static_cast<int32_t>(depth);
+                worklist.push_back(target);
+            }
+            else if (seen != static_cast<int32_t>(depth))
+            {
+                fail("Reaches PC=" + std::to_string(target) + " with stack depth " + std::to_string(depth) +
+                     ", another path reaches it with " + std::to_string(seen));
+            }
+        };
+
+        while (!worklist.empty())
+        {
+            pc = worklist.back();
+            worklist.pop_back();
+            const Instruction &instr = code[pc];
+            uint32_t depth = static_cast<uint32_t>(depths[pc - start]);
+            uint32_t inputs = 0;
+            int32_t effect = stackEffect(instr.opcode);
+            uint32_t next = pc + 1;
+            bool fallsThrough = true;
+            bool branches = false;
+            uint32_t branchTarget = 0;
+
+            switch (instr.opcode)
+            {
+            case OP_PUSH:
+                break;
+            case OP_NEW_ARRAY:
+                inputs = 1;
+                break;
+            case OP_READ:
+            case OP_LOAD_GLOBAL:
+                break;
+            case OP_POP:
+            case OP_DUP:
+            case OP_NEG:
+            case OP_INC:
+            case OP_DEC:
+            case OP_NOT:
+            case OP_STORE_GLOBAL:
+            case OP_ARRAY_LEN:
+            case OP_PRINT:
+            case OP_PRINTLN:
+                inputs = 1;
+                break;
+            case OP_SWAP:
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_MOD:
+            case OP_EQ:
+            case OP_NEQ:
+            case OP_LT:
+            case OP_LTE:
+            case OP_GT:
+            case OP_GTE:
+            case OP_AND:
+            case OP_OR:
+            case OP_LOAD_INDEX:
+            // Operand types are not tracked: the typed handlers check the
+            // tags and fall back to the generic opcode themselves
+            case OP_ADD_INT:
+            case OP_SUB_INT:
+            case OP_MUL_INT:
+            case OP_DIV_INT:
+            case OP_MOD_INT:
+            case OP_ADD_FLOAT:
+            case OP_SUB_FLOAT:
+            case OP_MUL_FLOAT:
+            case OP_DIV_FLOAT:
+            case OP_LT_INT:
+            case OP_LTE_INT:
+            case OP_GT_INT:
+            case OP_GTE_INT:
+            case OP_LT_FLOAT:
+            case OP_LTE_FLOAT:
+            case OP_GT_FLOAT:
+            case OP_GTE_FLOAT:
+            case OP_EQ_INT:
+            case OP_NEQ_INT:
+            case OP_EQ_FLOAT:
+            case OP_NEQ_FLOAT:
+            case OP_EQ_STR:
+            case OP_NEQ_STR:
+                inputs = 2;
+                break;
+            case OP_STORE_INDEX:
+                inputs = 3;
+                break;
+            case OP_LOAD_INDEX_UNCHECKED:
+                verifyUncheckedIndex(instr.operand);
+                break;
+            case OP_STORE_INDEX_UNCHECKED:
+                verifyUncheckedIndex(instr.operand);
+                inputs = 1;
+                break;
+            case OP_LOAD:
+            case OP_LOAD_STR:
+                break;
+            case OP_STORE:
+            case OP_APPEND_LOCAL:
+                inputs = 1;
+                break;
+            case OP_JMP:
+                fallsThrough = false;
+                branches = true;
+                branchTarget = instr.operand;
+                break;
+            case OP_JMP_IF:
+            case OP_JMP_IFNOT:
+                inputs = 1;
+                branches = true;
+                branchTarget = instr.operand;
+                break;
+            case OP_CALL:
+            case OP_TAILCALL:
+            {
+                const FunctionInfo *callee = functionAt(instr.operand);
+                inputs = callee->arity;
+                // A tail call's callee replaces this frame and returns for it
+                fallsThrough = instr.opcode == OP_CALL;
+                effect = (fallsThrough ? 1 : 0) - static_cast<int32_t>(inputs);
+                break;
+            }
+            case OP_CALL_NATIVE:
+                inputs = nativeArity(instr.operand);
+                if (depth < inputs)
+                {
+                    fail(program.nativeImports[instr.operand] + " takes " + std::to_string(inputs) +
+                         " arguments, " + std::to_string(depth) + " on the stack");
+                }
+                effect = 1 - static_cast<int32_t>(inputs);
+                break;
+            case OP_RET:
+            case OP_HALT:
+                fallsThrough = false;
+                break;
+            case OP_LOAD_LOAD_ADD:
+            case OP_INC_LOCAL:
+            case OP_STORE_POP:
+                inputs = instr.opcode == OP_STORE_POP ? 1 : 0;
+                next = pc + superinstructionLength(instr.opcode);
+                break;
+            case OP_LT_LOCAL_CONST_JMP_IFNOT:
+                next = pc + superinstructionLength(instr.opcode);
+                branches = true;
+                branchTarget = code[pc + 3].operand;
+                break;
+            default:
+                if (instr.opcode >= OP_ADD_INT_QUICK && instr.opcode <= OP_GTE_FLOAT_QUICK)
+                {
+                    fail("Quickened opcode " + std::to_string(static_cast<int>(instr.opcode)) +
+                         " is VM-internal and not valid in a file");
+                }
+                fail("Unknown opcode " + std::to_string(static_cast<int>(instr.opcode)));
+            }
+
+            if (depth < inputs)
+            {
+                fail("Stack underflow: needs " + std::to_string(inputs) + " operands, " +
+                     std::to_string(depth) + " on the stack");
+            }
+            uint32_t after = static_cast<uint32_t>(static_cast<int32_t>(depth) + effect);
+            maxDepth = std::max(maxDepth, after);
+
+            if (branches)
+            {
+                merge(branchTarget, after);
+            }
+            if (fallsThrough)
+            {
+                if (next >= end)
+                {
+                    fail("Falls off the end of the function");
+                }
+                merge(next, after);
+            }
+        }
+
+        // Files without the flag get a bound from the code length at link
+        // time, which no function can exceed.
+        if ((program.flags & BYTECODE_FLAG_MAX_STACK) && maxDepth > func->maxStack)
+        {
+            pc = start;
+            fail("Operand stack reaches " + std::to_string(maxDepth) + " slots, maxStack is " +
+                 std::to_string(func->maxStack));
+        }
+    }
+
+    // The operands VM::link and the handlers use without checking: constant
+    // and native indexes, jump and call targets, locals, and the sequence a
+    // superinstruction covers
+    void BytecodeVerifier::checkStackOperands(const Instruction &instr)
+    {
+        switch (instr.opcode)
+        {
+        case OP_PUSH:
+            checkConstant(instr.operand, false);
+            break;
+        case OP_NEW_ARRAY:
+            checkConstant(instr.operand, true);
+            break;
+        case OP_LOAD:
+        case OP_LOAD_STR:
+        case OP_STORE:
+        case OP_APPEND_LOCAL:
+            checkLocal(instr.operand);
+            break;
+        case OP_LOAD_INDEX_UNCHECKED:
+        case OP_STORE_INDEX_UNCHECKED:
+            checkLocal(instr.operand >> 16);
+            checkLocal(instr.operand & 0xFFFF);
+            break;
+        case OP_JMP:
+        case OP_JMP_IF:
+        case OP_JMP_IFNOT:
+            checkTarget(instr.operand);
+            break;
+        case OP_CALL:
+        case OP_TAILCALL:
+            if (!functionAt(instr.operand))
+            {
+                fail(std::string(instr.opcode == OP_CALL ? "CALL" : "TAILCALL") + " target " +
+                     std::to_string(instr.operand) + " is not a function");
+            }
+            break;
+        case OP_CALL_NATIVE:
+            nativeArity(instr.operand);
+            break;
+        case OP_LOAD_LOAD_ADD:
+        case OP_LT_LOCAL_CONST_JMP_IFNOT:
+        case OP_INC_LOCAL:
+        case OP_STORE_POP:
+            verifySuperinstruction(instr);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // A superinstruction's handler reads its operands out of the
+    // instructions it covers, so they must still be the fused sequence.
+    void BytecodeVerifier::verifySuperinstruction(const Instruction &instr)
+    {
+        static const std::unordered_map<int, std::vector<OpCode>> sequences = {
+            {OP_LOAD_LOAD_ADD, {OP_LOAD, OP_LOAD, OP_ADD}},
+            {OP_LT_LOCAL_CONST_JMP_IFNOT, {OP_LOAD, OP_PUSH, OP_LT, OP_JMP_IFNOT}},
+            {OP_INC_LOCAL, {OP_LOAD, OP_PUSH, OP_ADD, OP_STORE, OP_POP}},
+            {OP_STORE_POP, {OP_STORE, OP_POP}},
+        };
+
+        const auto &code = program.code;
+        const auto &sequence = sequences.at(instr.opcode);
+        if (pc + sequence.size() > end)
+        {
+            fail("Truncated superinstruction");
+        }
+        for (size_t i = 1; i < sequence.size(); i++)
+        {
+            if (genericOpcode(code[pc + i].opcode) != sequence[i])
+            {
+                fail("Malformed superinstruction");
+            }
+        }
+        checkLocal(instr.operand);
+
+        switch (instr.opcode)
+        {
+        case OP_LOAD_LOAD_ADD:
+            checkLocal(code[pc + 1].operand);
+            break;
+        case OP_LT_LOCAL_CONST_JMP_IFNOT:
+            checkConstant(code[pc + 1].operand, false);
+            checkTarget(code[pc + 3].operand);
+            break;
+        case OP_INC_LOCAL:
+            if (code[pc + 3].operand != instr.operand)
+            {
+                fail("Malformed superinstruction");
+            }
+            if (code[pc + 1].operand >= program.constants.size() ||
+                program.constants[code[pc + 1].operand].type != TYPE_INT)
+            {
+                fail("INC_LOCAL needs an int constant");
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    uint32_t BytecodeVerifier::nativeArity(uint32_t importIndex)
+    {
+        if (importIndex >= program.nativeImports.size())
+        {
+            fail("Native import index " + std::to_string(importIndex) + " out of range");
+        }
+        const std::string &name = program.nativeImports[importIndex];
+        int32_t arity = vm.nativeArity(name);
+        if (arity < 0)
+        {
+            fail("Native function not implemented: " + name);
+        }
+        return static_cast<uint32_t>(arity);
+    }
+
+    // The generic opcode an instruction starts with; a superinstruction
+    // starts with the first opcode of the sequence it covers
+    static OpCode leadingOpcode(OpCode op)
+    {
+        switch (op)
+        {
+        case OP_LOAD_LOAD_ADD:
+        case OP_LT_LOCAL_CONST_JMP_IFNOT:
+        case OP_INC_LOCAL:
+            return OP_LOAD;
+        case OP_STORE_POP:
+            return OP_STORE;
+        default:
+            return genericOpcode(op);
+        }
+    }
+
+    // Whether op writes the local its operand names. A superinstruction's
+    // covered STORE is an instruction of its own and is checked as one.
+    static bool writesLocal(OpCode op)
+    {
+        switch (op)
+        {
+        case OP_STORE:
+        case OP_STORE_POP:
+        case OP_APPEND_LOCAL:
+        case OP_INC_LOCAL:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // An unchecked access to a[i] must sit in the body of a loop shaped
+    // like the compiler's bounds-check elimination emits it:
+    //
+    //      PUSH k; STORE i; POP                  k an int >= 0
+    //   h: LOAD i; LOAD a; ARRAY_LEN; LT; JMP_IFNOT e
+    //      body                                  no write to i or a
+    //      LOAD i; PUSH c; ADD; STORE i; POP     0 < c < 2^31
+    //      JMP h
+    //   e:
+    //
+    // where nothing jumps into the loop but to its body or increment. Every
+    // path to the access then passes the condition with i unchanged since,
+    // so 0 <= i < length(a), and ARRAY_LEN has checked that a is an array.
+    void BytecodeVerifier::verifyUncheckedIndex(uint32_t operand)
+    {
+        uint32_t array = operand >> 16;
+        uint32_t index = operand & 0xFFFF;
+        checkLocal(array);
+        checkLocal(index);
+
+        // The innermost loop guarding this pair
+        for (uint32_t header = pc; header-- > start;)
+        {
+            if (isBoundsGuard(header, array, index) && pc >= header + 5 && pc < program.code[header + 4].operand)
+            {
+                if (!boundedLoops.count(header))
+                {
+                    verifyBoundedLoop(header, array, index);
+                    boundedLoops.insert(header);
+                }
+                return;
+            }
+        }
+        fail("Unchecked index of local " + std::to_string(array) + " by local " + std::to_string(index) +
+             " outside a loop bounded by the array's length");
+    }
+
+    bool BytecodeVerifier::isBoundsGuard(uint32_t header, uint32_t array, uint32_t index) const
+    {
+        const auto &code = program.code;
+        return array != index && header + 5 <= end &&
+               code[header].opcode == OP_LOAD && code[header].operand == index &&
+               code[header + 1].opcode == OP_LOAD && code[header + 1].operand == array &&
+               code[header + 2].opcode == OP_ARRAY_LEN &&
+               (code[header + 3].opcode == OP_LT || code[header + 3].opcode == OP_LT_INT) &&
+               code[header + 4].opcode == OP_JMP_IFNOT;
+    }
+
+    void BytecodeVerifier::verifyBoundedLoop(uint32_t header, uint32_t array, uint32_t index)
+    {
+        const auto &code = program.code;
+        uint32_t exit = code[header + 4].operand;
+        uint32_t increment = exit - 6;
+        std::string loop = "Loop at PC=" + std::to_string(header);
+
+        if (header < start + 3 || code[header - 3].opcode != OP_PUSH ||
+            !isIntConstant(code[header - 3].operand, 0, INT64_MAX) ||
+            leadingOpcode(code[header - 2].opcode) != OP_STORE || code[header - 2].operand != index ||
+            code[header - 1].opcode != OP_POP)
+        {
+            fail(loop + " does not start its index at a non-negative int");
+        }
+
+        if (exit < header + 11 || exit > end ||
+            code[exit - 1].opcode != OP_JMP || code[exit - 1].operand != header ||
+            leadingOpcode(code[increment].opcode) != OP_LOAD || code[increment].operand != index ||
+            code[increment + 1].opcode != OP_PUSH || !isIntConstant(code[increment + 1].operand, 1, INT32_MAX) ||
+            (code[increment + 2].opcode != OP_ADD && code[increment + 2].opcode != OP_ADD_INT) ||
+            code[increment + 3].opcode != OP_STORE || code[increment + 3].operand != index ||
+            code[increment + 4].opcode != OP_POP)
+        {
+            fail(loop + " does not end by stepping its index and jumping back");
+        }
+
+        // The increment's own write may be fused into INC_LOCAL
+        for (uint32_t k = header; k < exit; k++)
+        {
+            if (writesLocal(code[k].opcode) && k != increment && k != increment + 3 &&
+                (code[k].operand == array || code[k].operand == index))
+            {
+                fail(loop + " writes its array or index at PC=" + std::to_string(k));
+            }
+        }
+
+        // Fused instructions keep their jump as a plain instruction, so
+        // scanning the plain jumps finds every branch target
+        for (uint32_t k = start; k < end; k++)
+        {
+            OpCode op = code[k].opcode;
+            if (op != OP_JMP && op != OP_JMP_IF && op != OP_JMP_IFNOT)
+            {
+                continue;
+            }
+            uint32_t target = code[k].operand;
+            bool fromInside = k >= header && k < exit;
+            bool intoPrologue = target + 2 >= header && target < header + 5 && target != header;
+            bool intoIncrement = target > increment && target < exit;
+            bool intoLoop = target >= header && target < exit;
+            if (intoPrologue || intoIncrement || (intoLoop && !fromInside))
+            {
+                fail(loop + " is entered by the jump at PC=" + std::to_string(k));
+            }
+        }
+    }
+
+    bool BytecodeVerifier::isIntConstant(uint32_t constIndex, int64_t min, int64_t max) const
+    {
+        if (constIndex >= program.constants.size())
+        {
+            return false;
+        }
+        const Constant &cst = program.constants[constIndex];
+        return cst.type == TYPE_INT && cst.as.intVal >= min && cst.as.intVal <= max;
+    }
+
+    void BytecodeVerifier::checkLocal(uint32_t index)
+    {
+        if (index >= func->locals)
+        {
+            fail("Local " + std::to_string(index) + " out of range (" + std::to_string(func->locals) + " locals)");
+        }
+    }
+
+    void BytecodeVerifier::checkTarget(uint32_t target)
+    {
+        if (target < start || target >= end)
+        {
+            fail("Jump target " + std::to_string(target) + " is outside the function");
+        }
+    }
+
+    // Register code needs no depth tracking: every operand names a slot of
+    // the frame directly. Checks that they all fall inside it and that
+    // control cannot leave the function except through RET, TAILCALL or
+    // HALT. Every
+    // instruction is checked, reachable or not, as VM::linkRegister decodes
+    // them all.
+    void BytecodeVerifier::verifyRegisterFunction()
+    {
+        const auto &code = program.regCode;
+        for (pc = start; pc < end; pc++)
+        {
+            const RegInstruction &instr = code[pc];
+            bool fallsThrough = true;
+
+            switch (instr.opcode)
+            {
+            case ROP_MOVE:
+            case ROP_NEG:
+            case ROP_NOT:
+                checkRegister(instr.a);
+                checkRegister(instr.b);
+                break;
+            case ROP_LOADK:
+                checkRegister(instr.a);
+                checkConstant(instr.c, false);
+                break;
+            case ROP_ADD:
+            case ROP_SUB:
+            case ROP_MUL:
+            case ROP_DIV:
+            case ROP_MOD:
+            case ROP_EQ:
+            case ROP_NEQ:
+            case ROP_LT:
+            case ROP_LTE:
+            case ROP_GT:
+            case ROP_GTE:
+                checkRegister(instr.a);
+                checkRegister(instr.b);
+                checkRK(instr.c, RK_CONSTANT_C);
+                break;
+            case ROP_JMP:
+                checkTarget(instr.c);
+                fallsThrough = false;
+                break;
+            case ROP_JMP_IF:
+            case ROP_JMP_IFNOT:
+                checkRegister(instr.a);
+                checkTarget(instr.c);
+                break;
+            case ROP_JMP_IFNOT_EQ:
+            case ROP_JMP_IFNOT_NEQ:
+            case ROP_JMP_IFNOT_LT:
+            case ROP_JMP_IFNOT_LTE:
+            case ROP_JMP_IFNOT_GT:
+            case ROP_JMP_IFNOT_GTE:
+                checkRegister(instr.a);
+                checkRK(instr.b, RK_CONSTANT_B);
+                checkTarget(instr.c);
+                break;
+            case ROP_CALL:
+            case ROP_TAILCALL:
+            {
+                std::string name = instr.opcode == ROP_CALL ? "CALL" : "TAILCALL";
+                const FunctionInfo *callee = functionAt(instr.c);
+                if (!callee)
+                {
+                    fail(name + " target " + std::to_string(instr.c) + " is not a function");
+                }
+                if (instr.b + callee->arity > func->locals)
+                {
+                    fail(name + " arguments R" + std::to_string(instr.b) + ".. run past the frame");
+                }
+                if (instr.opcode == ROP_CALL)
+                {
+                    checkRegister(instr.a);
+                }
+                else
+                {
+                    fallsThrough = false;
+                }
+                break;
+            }
+            case ROP_CALL_NATIVE:
+            {
+                uint32_t argc = instr.c >> NATIVE_ARGC_SHIFT;
+                uint32_t arity = nativeArity(instr.c & NATIVE_INDEX_MASK);
+                checkRegister(instr.a);
+                if (argc < arity)
+                {
+                    fail(program.nativeImports[instr.c & NATIVE_INDEX_MASK] + " takes " + std::to_string(arity) +
+                         " arguments, " + std::to_string(argc) + " passed");
+                }
+                if (instr.b + argc > func->locals)
+                {
+                    fail("CALL_NATIVE arguments R" + std::to_string(instr.b) + ".. run past the frame");
+                }
+                break;
+            }
+            case ROP_RET:
+                checkRegister(instr.a);
+                fallsThrough = false;
+                break;
+            case ROP_NEW_ARRAY:
+                checkRegister(instr.a);
+                checkRegister(instr.b);
+                checkConstant(instr.c, true);
+                break;
+            case ROP_LOAD_INDEX:
+                checkRegister(instr.a);
+                checkRegister(instr.b);
+                checkRK(instr.c, RK_CONSTANT_C);
+                break;
+            case ROP_STORE_INDEX:
+                checkRegister(instr.a);
+                checkRK(instr.b, RK_CONSTANT_B);
+                checkRK(instr.c, RK_CONSTANT_C);
+                break;
+            case ROP_ARRAY_LEN:
+            case ROP_LOAD_STR:
+                checkRegister(instr.a);
+                checkRegister(instr.b);
+                break;
+            case ROP_APPEND:
+                checkRegister(instr.a);
+                checkRK(instr.c, RK_CONSTANT_C);
+                break;
+            case ROP_PRINT:
+            case ROP_READ:
+            case ROP_PRINTLN:
+                checkRegister(instr.a);
+                break;
+            case ROP_HALT:
+                fallsThrough = false;
+                break;
+            default:
+                fail("Unknown register opcode " + std::to_string(static_cast<int>(instr.opcode)));
+            }
+
+            if (fallsThrough && pc + 1 >= end)
+            {
+                fail("Falls off the end of the function");
+            }
+        }
+    }
+
+    void BytecodeVerifier::checkRegister(uint32_t reg)
+    {
+        if (reg >= func->locals)
+        {
+            fail("Register R" + std::to_string(reg) + " out of range (" + std::to_string(func->locals) +
+                 " registers)");
+        }
+    }
+
+    void BytecodeVerifier::checkRK(uint32_t operand, uint32_t constantBit)
+    {
+        if (!(operand & constantBit))
+        {
+            checkRegister(operand);
+        }
+        else
+        {
+            checkConstant(operand & ~constantBit, false);
+        }
+    }
+
+    // Array constants are pool entries NEW_ARRAY copies, never values
+    void BytecodeVerifier::checkConstant(uint32_t index, bool array)
+    {
+        if (index >= program.constants.size())
+        {
+            fail("Constant index " + std::to_string(index) + " out of range");
+        }
+        ValueType type = program.constants[index].type;
+        bool isArray = type == TYPE_ARRAY_INT || type == TYPE_ARRAY_FLOAT || type == TYPE_ARRAY_STRING;
+        if (isArray != array)
+        {
+            fail("Constant " + std::to_string(index) + (array ? " is not an array" : " is an array"));
+        }
+    }
+
+    void BytecodeVerifier::fail(const std::string &message) const
+    {
+        std::stringstream ss;
+        ss << "Bytecode verification failed";
+        if (func)
+        {
+            ss << " in " << func->name << " at PC=" << pc;
+        }
+        ss << ": " << message;
+        throw std::runtime_error(ss.str());
+    }
+
+} // namespace TVM
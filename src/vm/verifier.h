@@ -0,0 +1,60 @@
+#pragma once
+#include "vm.h"
+#include <set>
+#include <string>
+#include <vector>
+
+// Load-time bytecode verifier. tail runs it once after deserializing a file,
+// and the VM executes only programs that passed: its handlers index locals,
+// constants, jump targets and natives without checking them, and trust that
+// no path pops below the frame or pushes past the function's maxStack.
+// Operand types are not verified; the typed opcodes check their own.
+
+namespace TVM
+{
+
+    class BytecodeVerifier
+    {
+    public:
+        // Natives are checked against what vm implements
+        BytecodeVerifier(const BytecodeFile &program, const VM &vm);
+
+        // Throws std::runtime_error naming the function, pc and broken rule
+        void verify();
+
+    private:
+        const BytecodeFile &program;
+        const VM &vm;
+        std::vector<uint32_t> starts;   // Sorted function addresses
+        const FunctionInfo *func;       // Function being verified
+        uint32_t start, end;            // Its code range
+        uint32_t pc;
+        std::set<uint32_t> boundedLoops; // Headers verifyBoundedLoop accepted
+
+        void verifyHeader();
+        void verifyConstants();
+        uint32_t functionEnd(uint32_t address, size_t codeSize) const;
+        const FunctionInfo *functionAt(uint32_t address) const;
+        void checkConstant(uint32_t index, bool array);
+
+        // Stack ISA (version 1)
+        void verifyStackFunction();
+        void checkStackOperands(const Instruction &instr);
+        void verifySuperinstruction(const Instruction &instr);
+        uint32_t nativeArity(uint32_t importIndex);
+        void checkLocal(uint32_t index);
+        void checkTarget(uint32_t target);
+        void verifyUncheckedIndex(uint32_t operand);
+        bool isBoundsGuard(uint32_t header, uint32_t array, uint32_t index) const;
+        void verifyBoundedLoop(uint32_t header, uint32_t array, uint32_t index);
+        bool isIntConstant(uint32_t constIndex, int64_t min, int64_t max) const;
+
+        // Register ISA (version 2)
+        void verifyRegisterFunction();
+        void checkRegister(uint32_t reg);
+        void checkRK(uint32_t operand, uint32_t constantBit);
+
+        [[noreturn]] void fail(const std::string &message) const;
+    };
+
+} // namespace TVM
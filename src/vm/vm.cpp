@@ -1,10 +1,19 @@
 #include "vm.h"
+#include "dispatch.h"
+#include "array_kernels.h"
+#include "../shared/numbers.h"
+#if TVM_JIT
+#include "jit.h"
+#endif
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 #include <cstdlib>
+#include <cstring>
 #include <limits>
 #include <iomanip>
+#include <unordered_map>
+#include <algorithm>
 
 #if defined(__GNUC__) || defined(__clang__)
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -17,67 +26,118 @@
 namespace TVM
 {
 
-    VM::VM() : program(nullptr), running(false), trace(false), pc(0)
+    static bool isArrayType(ValueType type)
+    {
+        return type == TYPE_ARRAY_INT || type == TYPE_ARRAY_FLOAT || type == TYPE_ARRAY_STRING;
+    }
+
+    static const char *valueTypeName(ValueType type)
+    {
+        switch (type)
+        {
+        case TYPE_INT:
+            return "int";
+        case TYPE_FLOAT:
+            return "float";
+        case TYPE_BOOL:
+            return "bool";
+        case TYPE_STRING:
+            return "str";
+        case TYPE_NIL:
+            return "nil";
+        case TYPE_ARRAY_INT:
+            return "int[]";
+        case TYPE_ARRAY_FLOAT:
+            return "float[]";
+        case TYPE_ARRAY_STRING:
+            return "str[]";
+        case TYPE_STRING_BUILDER:
+            return "string builder";
+        }
+        return "unknown";
+    }
+
+    VM::VM()
+        : program(nullptr), running(false), trace(false),
+          dispatchMode(threadedDispatchAvailable() ? DispatchMode::Threaded : DispatchMode::Switch),
+          pc(0), instructionsExecuted(0), quickening(true), quickenedSites(0), deoptimizedSites(0),
+          jit(nullptr), jitEnabled(false), jitThreshold(DEFAULT_JIT_THRESHOLD),
+          simdLevel(bestSimdLevel()), kernels(&arrayKernels(simdLevel)), exitDepth(0),
+          stackSlots(DEFAULT_STACK_SLOTS), stackTop(nullptr), frameBase(0), frameLocals(0)
     {
         initNativeFunctions();
     }
 
     VM::~VM()
     {
-        // Cleanup
+#if TVM_JIT
+        delete jit;
+#endif
     }
 
     void VM::initNativeFunctions()
     {
         // Console functions
-        nativeFuncs["Console.println"] = [](VM &vm)
+        defineNative("Console.println", 1, [](VM &vm)
         {
             Value val = vm.pop();
-            std::cout << val.toString(vm.program) << std::endl;
+            vm.writeValue(val);
+            vm.output.endLine();
             vm.push(Value()); // nil
-        };
+        });
 
-        nativeFuncs["Console.print"] = [](VM &vm)
+        defineNative("Console.print", 1, [](VM &vm)
         {
             Value val = vm.pop();
-            std::cout << val.toString(vm.program);
+            vm.writeValue(val);
+            vm.output.endPrint();
             vm.push(Value()); // nil
-        };
+        });
+
+        defineNative("Console.flush", 0, [](VM &vm)
+        {
+            vm.output.flush();
+            vm.push(Value()); // nil
+        });
 
         // System functions
-        nativeFuncs["System.command"] = [](VM &vm)
+        defineNative("System.command", 1, [](VM &vm)
         {
             Value cmd = vm.pop();
-            int result = system(cmd.toString(vm.program).c_str());
+            vm.output.flush(); // The command's output comes after ours
+            int result = system(vm.toString(cmd).c_str());
             vm.push(Value(static_cast<int64_t>(result)));
-        };
+        });
 
-        nativeFuncs["System.clear"] = [](VM &vm)
+        defineNative("System.clear", 0, [](VM &vm)
         {
+            vm.output.flush();
 #ifdef _WIN32
             system("cls");
 #else
             system("clear");
 #endif
             vm.push(Value()); // nil
-        };
+        });
 
-        nativeFuncs["System.pause"] = [](VM &vm)
+        defineNative("System.pause", 1, [](VM &vm)
         {
             Value msg = vm.pop();
-            if (msg.type != TYPE_NIL)
+            if (msg.type() != TYPE_NIL)
             {
-                std::cout << msg.toString(vm.program);
+                vm.writeValue(msg);
             }
             else
             {
-                std::cout << "Press Enter to continue...";
+                vm.output.write("Press Enter to continue...");
             }
-            std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            vm.output.flush();
+            std::string_view line;
+            vm.input.readLine(line);
             vm.push(Value()); // nil
-        };
+        });
 
-        nativeFuncs["System.platform"] = [](VM &vm)
+        defineNative("System.platform", 0, [](VM &vm)
         {
 #ifdef _WIN32
             std::string platform = "windows";
@@ -88,92 +148,572 @@ namespace TVM
 #else
             std::string platform = "unknown";
 #endif
-            uint32_t idx = vm.program->strings.size();
-            const_cast<BytecodeFile *>(vm.program)->strings.push_back(platform);
-            vm.push(Value(platform, idx));
-        };
+            vm.push(vm.newString(platform));
+        });
 
-        nativeFuncs["System.env"] = [](VM &vm)
+        defineNative("System.env", 1, [](VM &vm)
         {
             Value varName = vm.pop();
-            const char *value = std::getenv(varName.toString(vm.program).c_str());
+            const char *value = std::getenv(vm.toString(varName).c_str());
             if (value)
             {
-                uint32_t idx = vm.program->strings.size();
-                const_cast<BytecodeFile *>(vm.program)->strings.push_back(value);
-                vm.push(Value(value, idx));
+                vm.push(vm.newString(value));
             }
             else
             {
                 vm.push(Value()); // nil
             }
-        };
+        });
 
         // IO functions
-        nativeFuncs["IO.input"] = [](VM &vm)
+        defineNative("IO.input", 1, [](VM &vm)
         {
             Value prompt = vm.pop();
-            if (prompt.type != TYPE_NIL)
+            if (prompt.type() != TYPE_NIL)
+            {
+                vm.writeValue(prompt);
+            }
+            vm.push(vm.readLine());
+        });
+
+        // Console.read and IO.input give "" at end of input; these give nil.
+        // All of them share one buffered reader over stdin.
+        defineNative("IO.readLine", 0, [](VM &vm)
+        {
+            vm.output.flush();
+            std::string_view line;
+            vm.push(vm.input.readLine(line) ? vm.newString(line) : Value());
+        });
+
+        defineNative("IO.readChunk", 1, [](VM &vm)
+        {
+            Value count = vm.pop();
+            if (!count.isInt() || count.asInt() <= 0)
             {
-                std::cout << prompt.toString(vm.program);
+                vm.runtimeError("IO.readChunk expects a positive int byte count");
             }
-            std::string input;
-            std::getline(std::cin, input);
-            uint32_t idx = vm.program->strings.size();
-            const_cast<BytecodeFile *>(vm.program)->strings.push_back(input);
-            vm.push(Value(input, idx));
-        };
+            vm.output.flush();
+            std::string_view chunk = vm.input.read(static_cast<size_t>(count.asInt()));
+            vm.push(chunk.empty() ? Value() : vm.newString(chunk));
+        });
+
+        defineNative("IO.readAll", 0, [](VM &vm)
+        {
+            vm.output.flush();
+            vm.push(vm.newString(vm.input.readAll()));
+        });
 
-        nativeFuncs["IO.toInt"] = [](VM &vm)
+        // The remaining lines of stdin as a str[]; the language has no
+        // iterators, so a loop over Array.length stands in for one
+        defineNative("IO.lines", 0, [](VM &vm)
         {
-            Value strVal = vm.pop();
-            try
+            vm.output.flush();
+            std::string_view rest = vm.input.readAll();
+            size_t count = 0;
+            for (std::string_view text = rest; !text.empty(); count++)
             {
-                int64_t value = std::stoll(strVal.toString(vm.program));
-                vm.push(Value(value));
+                const void *newline = std::memchr(text.data(), '\n', text.size());
+                text.remove_prefix(newline ? static_cast<const char *>(newline) - text.data() + 1 : text.size());
             }
-            catch (...)
+            if (count > UINT32_MAX)
             {
-                vm.runtimeError("Failed to convert string to int");
+                vm.runtimeError("IO.lines: more than " + std::to_string(UINT32_MAX) + " lines");
             }
-        };
 
-        nativeFuncs["IO.toFloat"] = [](VM &vm)
+            vm.reserveHeap(Heap::arrayBytes(TYPE_ARRAY_STRING, count));
+            Value array = vm.heap.makeArray(TYPE_ARRAY_STRING, static_cast<uint32_t>(count));
+            Root root(vm, array);
+            std::string_view text = rest;
+            for (size_t i = 0; i < count; i++)
+            {
+                const void *newline = std::memchr(text.data(), '\n', text.size());
+                size_t length = newline ? static_cast<const char *>(newline) - text.data() : text.size();
+                Value line = vm.newString(text.substr(0, length));
+                vm.heap.array(array)->values()[i] = line;
+                text.remove_prefix(std::min(length + 1, text.size()));
+            }
+            vm.push(array);
+        });
+
+        // IO.toInt/IO.toFloat fail on text that is not a number;
+        // IO.tryInt/IO.tryFloat return nil instead
+        defineNative("IO.toInt", 1, [](VM &vm)
         {
-            Value strVal = vm.pop();
-            try
+            Value text = vm.pop();
+            int64_t value;
+            if (!vm.parseIntValue(text, value))
             {
-                double value = std::stod(strVal.toString(vm.program));
-                vm.push(Value(value));
+                vm.runtimeError("Failed to convert string to int");
             }
-            catch (...)
+            vm.push(Value(value));
+        });
+
+        defineNative("IO.toFloat", 1, [](VM &vm)
+        {
+            Value text = vm.pop();
+            double value;
+            if (!vm.parseFloatValue(text, value))
             {
                 vm.runtimeError("Failed to convert string to float");
             }
-        };
+            vm.push(Value(value));
+        });
+
+        defineNative("IO.tryInt", 1, [](VM &vm)
+        {
+            Value text = vm.pop();
+            int64_t value;
+            vm.push(vm.parseIntValue(text, value) ? Value(value) : Value());
+        });
+
+        defineNative("IO.tryFloat", 1, [](VM &vm)
+        {
+            Value text = vm.pop();
+            double value;
+            vm.push(vm.parseFloatValue(text, value) ? Value(value) : Value());
+        });
+
+        // Array functions. Array.length compiles to OP_ARRAY_LEN; these run a
+        // whole-array kernel (array_kernels.h) over the untagged elements.
+        // The in-place ones return nil.
+        defineNative("Array.sum", 1, [](VM &vm)
+        {
+            Value array = vm.pop();
+            HeapArray *elements = vm.checkNumericArray(array, "Array.sum");
+            if (array.type() == TYPE_ARRAY_INT)
+            {
+                vm.push(Value(vm.kernels->sumInt(elements->ints(), elements->length)));
+            }
+            else
+            {
+                vm.push(Value(vm.kernels->sumFloat(elements->floats(), elements->length)));
+            }
+        });
+
+        defineNative("Array.min", 1, [](VM &vm)
+        {
+            Value array = vm.pop();
+            HeapArray *elements = vm.checkNumericArray(array, "Array.min");
+            if (elements->length == 0)
+            {
+                vm.runtimeError("Array.min of an empty array");
+            }
+            if (array.type() == TYPE_ARRAY_INT)
+            {
+                vm.push(Value(vm.kernels->minInt(elements->ints(), elements->length)));
+            }
+            else
+            {
+                vm.push(Value(vm.kernels->minFloat(elements->floats(), elements->length)));
+            }
+        });
+
+        defineNative("Array.max", 1, [](VM &vm)
+        {
+            Value array = vm.pop();
+            HeapArray *elements = vm.checkNumericArray(array, "Array.max");
+            if (elements->length == 0)
+            {
+                vm.runtimeError("Array.max of an empty array");
+            }
+            if (array.type() == TYPE_ARRAY_INT)
+            {
+                vm.push(Value(vm.kernels->maxInt(elements->ints(), elements->length)));
+            }
+            else
+            {
+                vm.push(Value(vm.kernels->maxFloat(elements->floats(), elements->length)));
+            }
+        });
+
+        defineNative("Array.dot", 2, [](VM &vm)
+        {
+            Value b = vm.pop();
+            Value a = vm.pop();
+            HeapArray *xs = vm.checkNumericArray(a, "Array.dot");
+            HeapArray *ys = vm.checkNumericArray(b, "Array.dot");
+            vm.checkSameType(a, b, "Array.dot");
+            if (xs->length != ys->length)
+            {
+                vm.runtimeError("Array.dot expects arrays of the same length, got " + std::to_string(xs->length) +
+                                " and " + std::to_string(ys->length));
+            }
+            if (a.type() == TYPE_ARRAY_INT)
+            {
+                vm.push(Value(vm.kernels->dotInt(xs->ints(), ys->ints(), xs->length)));
+            }
+            else
+            {
+                vm.push(Value(vm.kernels->dotFloat(xs->floats(), ys->floats(), xs->length)));
+            }
+        });
+
+        // Array.add(a, b): a[i] += b[i]
+        defineNative("Array.add", 2, [](VM &vm)
+        {
+            Value b = vm.pop();
+            Value a = vm.pop();
+            HeapArray *dst = vm.checkNumericArray(a, "Array.add");
+            HeapArray *src = vm.checkNumericArray(b, "Array.add");
+            vm.checkSameType(a, b, "Array.add");
+            if (dst->length != src->length)
+            {
+                vm.runtimeError("Array.add expects arrays of the same length, got " + std::to_string(dst->length) +
+                                " and " + std::to_string(src->length));
+            }
+            if (a.type() == TYPE_ARRAY_INT)
+            {
+                vm.kernels->addInt(dst->ints(), src->ints(), dst->length);
+            }
+            else
+            {
+                vm.kernels->addFloat(dst->floats(), src->floats(), dst->length);
+            }
+            vm.push(Value()); // nil
+        });
+
+        // Array.scale(a, k): a[i] *= k. An int array needs an int factor.
+        defineNative("Array.scale", 2, [](VM &vm)
+        {
+            Value factor = vm.pop();
+            Value array = vm.pop();
+            HeapArray *elements = vm.checkNumericArray(array, "Array.scale");
+            if (array.type() == TYPE_ARRAY_INT && factor.isInt())
+            {
+                vm.kernels->scaleInt(elements->ints(), factor.asInt(), elements->length);
+            }
+            else if (array.type() == TYPE_ARRAY_FLOAT && (factor.isInt() || factor.isFloat()))
+            {
+                double k = factor.isInt() ? static_cast<double>(factor.asInt()) : factor.asFloat();
+                vm.kernels->scaleFloat(elements->floats(), k, elements->length);
+            }
+            else
+            {
+                vm.runtimeError(std::string("Array.scale cannot scale ") + valueTypeName(array.type()) + " by " +
+                                valueTypeName(factor.type()));
+            }
+            vm.push(Value()); // nil
+        });
+
+        // Array.fill(a, v): every element becomes v, converted as by a[i] = v
+        defineNative("Array.fill", 2, [](VM &vm)
+        {
+            Value value = vm.pop();
+            Value array = vm.pop();
+            HeapArray *elements = vm.checkArray(array);
+            if (elements->length == 0)
+            {
+                vm.push(Value()); // nil
+                return;
+            }
+            // The first store checks and converts the value, the rest copy it
+            vm.storeElement(array.type(), elements, 0, value);
+            switch (array.type())
+            {
+            case TYPE_ARRAY_INT:
+                std::fill_n(elements->ints() + 1, elements->length - 1, elements->ints()[0]);
+                break;
+            case TYPE_ARRAY_FLOAT:
+                std::fill_n(elements->floats() + 1, elements->length - 1, elements->floats()[0]);
+                break;
+            default:
+                std::fill_n(elements->values() + 1, elements->length - 1, elements->values()[0]);
+                break;
+            }
+            vm.push(Value()); // nil
+        });
+
+        // Array.copy(dst, src): the first src.length elements of dst become src's
+        defineNative("Array.copy", 2, [](VM &vm)
+        {
+            Value src = vm.pop();
+            Value dst = vm.pop();
+            HeapArray *to = vm.checkArray(dst);
+            HeapArray *from = vm.checkArray(src);
+            vm.checkSameType(dst, src, "Array.copy");
+            if (to->length < from->length)
+            {
+                vm.runtimeError("Array.copy cannot copy " + std::to_string(from->length) +
+                                " elements into an array of length " + std::to_string(to->length));
+            }
+            // Distinct arrays never overlap; copying one onto itself is a no-op
+            if (to != from)
+            {
+                switch (dst.type())
+                {
+                case TYPE_ARRAY_INT:
+                    std::copy_n(from->ints(), from->length, to->ints());
+                    break;
+                case TYPE_ARRAY_FLOAT:
+                    std::copy_n(from->floats(), from->length, to->floats());
+                    break;
+                default:
+                    std::copy_n(from->values(), from->length, to->values());
+                    break;
+                }
+            }
+            vm.push(Value()); // nil
+        });
+
+        // Array.sort(a): ascending in place; NaNs sort last, strings by bytes
+        defineNative("Array.sort", 1, [](VM &vm)
+        {
+            Value array = vm.pop();
+            HeapArray *elements = vm.checkArray(array);
+            switch (array.type())
+            {
+            case TYPE_ARRAY_INT:
+                std::sort(elements->ints(), elements->ints() + elements->length);
+                break;
+            case TYPE_ARRAY_FLOAT:
+                std::sort(elements->floats(), elements->floats() + elements->length,
+                          [](double x, double y) { return x < y || (x == x && y != y); });
+                break;
+            default:
+                std::sort(elements->values(), elements->values() + elements->length,
+                          [&vm](const Value &x, const Value &y) { return vm.heap.stringView(x) < vm.heap.stringView(y); });
+                break;
+            }
+            vm.push(Value()); // nil
+        });
 
         // Str functions
-        nativeFuncs["Str.array"] = [](VM &vm)
+        defineNative("Str.array", 0, [](VM &vm)
         {
             // Get number of arguments from stack
             // This is simplified - would need proper implementation
             vm.push(Value()); // nil for now
-        };
+        });
 
-        nativeFuncs["Str.length"] = [](VM &vm)
+        defineNative("Str.length", 1, [](VM &vm)
         {
             Value arr = vm.pop();
             (void)arr;
             vm.push(Value(static_cast<int64_t>(0)));
-        };
+        });
+
+        // Str.builder() is an empty string builder. Str.append(b, x) appends
+        // x, converted as by +, and returns b; Str.toString(b) returns the
+        // contents. Repeated appends are amortised O(1), unlike s = s + x.
+        defineNative("Str.builder", 0, [](VM &vm)
+        {
+            vm.push(vm.newBuilder(""));
+        });
+
+        defineNative("Str.append", 2, [](VM &vm)
+        {
+            // Both stay on the stack, and so reachable, while the buffer grows
+            vm.checkBuilder(vm.peek(1), "Str.append");
+            vm.appendTo(vm.peek(1), vm.peek());
+            vm.pop();
+        });
+
+        defineNative("Str.toString", 1, [](VM &vm)
+        {
+            Value &value = vm.peek();
+            if (value.type() == TYPE_STRING_BUILDER)
+            {
+                value = vm.builderString(value);
+            }
+            else if (value.type() != TYPE_STRING)
+            {
+                value = vm.newString(vm.toString(value));
+            }
+        });
         // Random functions (simplified)
-        nativeFuncs["Random.int"] = [](VM &vm)
+        defineNative("Random.int", 0, [](VM &vm)
         {
             // Simplified random
             static int seed = 12345;
             seed = (seed * 1103515245 + 12345) & 0x7fffffff;
             vm.push(Value(static_cast<int64_t>(seed % 100)));
-        };
+        });
+    }
+
+    void VM::defineNative(const std::string &name, uint8_t arity, NativeFunction function)
+    {
+        nativeFuncs[name] = Native{function, arity};
+    }
+
+    int32_t VM::nativeArity(const std::string &name) const
+    {
+        auto it = nativeFuncs.find(name);
+        return it == nativeFuncs.end() ? -1 : it->second.arity;
+    }
+
+    bool VM::threadedDispatchAvailable()
+    {
+        return TVM_THREADED_DISPATCH != 0;
+    }
+
+    void VM::setDispatchMode(DispatchMode mode)
+    {
+        dispatchMode = threadedDispatchAvailable() ? mode : DispatchMode::Switch;
+    }
+
+    bool VM::jitAvailable()
+    {
+#if TVM_JIT
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void VM::setJit(bool enable, uint32_t threshold)
+    {
+        jitEnabled = enable && jitAvailable();
+        jitThreshold = std::max<uint32_t>(threshold, 1);
+    }
+
+    bool VM::simdAvailable(SimdLevel level)
+    {
+        return simdSupported(level);
+    }
+
+    bool VM::setSimd(SimdLevel level)
+    {
+        if (!simdSupported(level))
+        {
+            return false;
+        }
+        simdLevel = level;
+        kernels = &arrayKernels(level);
+        return true;
+    }
+
+    uint32_t VM::getJitCompiledCount() const
+    {
+#if TVM_JIT
+        return jit ? jit->getCompiledCount() : 0;
+#else
+        return 0;
+#endif
+    }
+
+    Value VM::constantValue(const Constant &cst)
+    {
+        switch (cst.type)
+        {
+        case TYPE_INT:
+            return Value(cst.as.intVal);
+        case TYPE_FLOAT:
+            return Value(cst.as.floatVal);
+        case TYPE_BOOL:
+            return Value(cst.as.boolVal);
+        case TYPE_STRING:
+            return Value(cst.as.stringIdx, cst.type);
+        case TYPE_ARRAY_INT:
+        case TYPE_ARRAY_FLOAT:
+        case TYPE_ARRAY_STRING:
+            // Not values: NEW_ARRAY copies them (the verifier rejects a PUSH)
+        case TYPE_STRING_BUILDER:
+        case TYPE_NIL:
+            break;
+        }
+        return Value();
+    }
+
+    void VM::link()
+    {
+        std::unordered_map<uint32_t, const FunctionInfo *> functionsByAddress;
+        for (const auto &func : program->functions)
+        {
+            functionsByAddress.emplace(func.address, &func);
+        }
+
+        // Files written before maxStack was recorded: no instruction grows the
+        // operand stack by more than one, so the code length bounds it.
+        if (!(program->flags & BYTECODE_FLAG_MAX_STACK))
+        {
+            for (auto &func : program->functions)
+            {
+                func.maxStack = static_cast<uint32_t>(program->code.size());
+            }
+        }
+
+        linkConstants();
+        const auto &source = program->code;
+        code.assign(source.size(), DecodedInstruction());
+
+        for (pc = 0; pc < source.size(); pc++)
+        {
+            DecodedInstruction &instr = code[pc];
+            instr.opcode = source[pc].opcode;
+            instr.operand = source[pc].operand;
+
+            switch (instr.opcode)
+            {
+            case OP_PUSH:
+                instr.value = constantValues[instr.operand];
+                break;
+            case OP_CALL:
+            case OP_TAILCALL:
+                instr.target.func = functionsByAddress.at(instr.operand);
+                break;
+            case OP_LOAD_GLOBAL:
+            case OP_STORE_GLOBAL:
+                // Sized once here so the handlers can index directly
+                if (instr.operand >= globals.size())
+                {
+                    globals.resize(instr.operand + 1);
+                }
+                break;
+            case OP_LOAD_LOAD_ADD:
+            case OP_LT_LOCAL_CONST_JMP_IFNOT:
+            case OP_INC_LOCAL:
+            case OP_STORE_POP:
+                linkSuperinstruction(instr);
+                break;
+            case OP_CALL_NATIVE:
+                instr.target.native = nativeFuncs.at(program->nativeImports[instr.operand]).function;
+                break;
+            default:
+                break;
+            }
+        }
+
+        // Handlers advance pc without a bounds test, so the stream must end
+        // in HALT for a fall-through off the last function to stop cleanly.
+        if (code.empty() || code.back().opcode != OP_HALT)
+        {
+            code.push_back(DecodedInstruction());
+        }
+        pc = 0;
+    }
+
+    // Values of the constant pool, decoded once. Big ints among them are
+    // boxed in the heap, so collectGarbage keeps the table as a root.
+    void VM::linkConstants()
+    {
+        constantValues.clear();
+        constantValues.reserve(program->constants.size());
+        for (const Constant &cst : program->constants)
+        {
+            constantValues.push_back(constantValue(cst));
+        }
+    }
+
+    // Pulls a superinstruction's operands out of the instructions it covers;
+    // the verifier has checked they still form the fused sequence.
+    void VM::linkSuperinstruction(DecodedInstruction &instr)
+    {
+        const auto &source = program->code;
+        switch (instr.opcode)
+        {
+        case OP_LOAD_LOAD_ADD:
+            instr.aux = source[pc + 1].operand;
+            break;
+        case OP_LT_LOCAL_CONST_JMP_IFNOT:
+            instr.value = constantValues[source[pc + 1].operand];
+            instr.aux = source[pc + 3].operand;
+            break;
+        case OP_INC_LOCAL:
+            instr.value = constantValues[source[pc + 1].operand];
+            break;
+        default:
+            break;
+        }
     }
 
     void VM::execute(BytecodeFile &bytecode)
@@ -181,11 +721,29 @@ namespace TVM
         program = &bytecode;
         running = true;
         pc = 0;
+        instructionsExecuted = 0;
+        quickenedSites = 0;
+        deoptimizedSites = 0;
+        exitDepth = 0;
 
         globals.clear();
-        stack.clear();
+        BigIntHeapScope bigInts(heap);
+        heap.load(program->strings);
+        nativeRoots.clear();
         callStack.clear();
-        locals.clear();
+        stack.reset(new Value[stackSlots]);
+        stackTop = stack.get();
+        callStack.reserve(INITIAL_CALL_FRAMES);
+
+        bool registerCode = program->version == BYTECODE_VERSION_REGISTER;
+        if (registerCode)
+        {
+            linkRegister();
+        }
+        else
+        {
+            link();
+        }
 
         const FunctionInfo *mainFunc = nullptr;
         for (const auto &func : program->functions)
@@ -202,424 +760,930 @@ namespace TVM
             throw std::runtime_error("Main function not found");
         }
 
-        CallFrame frame;
-        frame.returnAddr = UINT32_MAX;
-        frame.localStart = 0;
-        frame.argCount = 0;
-        frame.func = mainFunc;
-        callStack.push_back(frame);
-
-        locals.resize(mainFunc->locals);
+        callStack.push_back(CallFrame{UINT32_MAX, 0, mainFunc, 0});
+        reserveFrame(0, mainFunc);
+        stackTop = stack.get() + mainFunc->locals;
+        frameBase = 0;
+        frameLocals = mainFunc->locals;
         pc = mainFunc->address;
 
+#if TVM_JIT
+        // The JIT translates stack bytecode only, and traced runs stay in
+        // the interpreter so every instruction is seen.
+        delete jit;
+        jit = jitEnabled && !registerCode && !trace ? new Jit(*this, jitThreshold) : nullptr;
+#endif
+
+        // Trace lines go through std::cout; keep the program's output in
+        // step with them
+        if (trace)
+        {
+            output.setMode(OutputMode::Unbuffered);
+        }
+
         try
         {
-            while (running && pc < program->code.size())
+            if (registerCode)
             {
-                auto &instr = program->code[pc];
-
-                if (trace)
-                {
-                    traceInstruction(instr);
-                    traceStack();
-                }
-
-                executeInstruction(instr);
-
-                if (instr.opcode != OP_JMP &&
-                    instr.opcode != OP_JMP_IF &&
-                    instr.opcode != OP_JMP_IFNOT &&
-                    instr.opcode != OP_CALL &&
-                    instr.opcode != OP_RET)
-                {
-                    pc++;
-                }
+                // Tracing needs a hook before every instruction, which only
+                // the switch loop provides.
+                bool threaded = dispatchMode == DispatchMode::Threaded && !trace;
+                threaded ? runRegister<true>() : runRegister<false>();
+            }
+            else
+            {
+                runInterpreter();
             }
+            output.flush();
         }
         catch (const std::exception &e)
         {
+            output.flush();
             std::cerr << "VM Runtime Error: " << e.what() << std::endl;
             dumpState();
             throw;
         }
     }
 
-    void VM::executeInstruction(Instruction &instr)
+// Typed handler bodies: combine the top two stack slots in place. The
+// binary form takes the result as an expression over `lhs` and `rhs`.
+#define TVM_TYPED_BINARY(result)                         \
+    do                                                   \
+    {                                                    \
+        Value &rhs = stackTop[-1];                       \
+        Value &lhs = stackTop[-2];                       \
+        lhs = Value(result);                             \
+        --stackTop;                                      \
+        pc++;                                            \
+        TVM_NEXT();                                      \
+    } while (0)
+#define TVM_TYPED_COMPARE(get, op)                       \
+    do                                                   \
+    {                                                    \
+        Value &rhs = stackTop[-1];                       \
+        Value &lhs = stackTop[-2];                       \
+        lhs = Value(lhs.get() op rhs.get());             \
+        --stackTop;                                      \
+        pc++;                                            \
+        TVM_NEXT();                                      \
+    } while (0)
+
+// Quickened handler bodies: the typed fast path if the guard holds
+#define TVM_QUICK_GUARD(is)                                                 \
+    (stackTop[-1].is() && stackTop[-2].is())
+#define TVM_QUICK_BINARY(is, result, generic)                               \
+    do                                                                      \
+    {                                                                       \
+        if (TVM_QUICK_GUARD(is))                                            \
+        {                                                                   \
+            TVM_TYPED_BINARY(result);                                       \
+        }                                                                   \
+        deoptimize(code[pc], generic);                                      \
+        TVM_REDISPATCH();                                                   \
+    } while (0)
+#define TVM_QUICK_COMPARE(is, get, op, generic)                             \
+    do                                                                      \
+    {                                                                       \
+        if (TVM_QUICK_GUARD(is))                                            \
+        {                                                                   \
+            TVM_TYPED_COMPARE(get, op);                                     \
+        }                                                                   \
+        deoptimize(code[pc], generic);                                      \
+        TVM_REDISPATCH();                                                   \
+    } while (0)
+
+    template <bool Threaded>
+    void VM::run()
     {
-        switch (instr.opcode)
-        {
-        // Stack operations
-        case OP_PUSH:
-        {
-            const auto &cst = getConstant(instr.operand);
-            Value val;
-            val.type = cst.type;
+        DecodedInstruction *code = this->code.data(); // Mutable for quickening
+        uint64_t executed = 0;
 
-            switch (cst.type)
+#if TVM_THREADED_DISPATCH
+        void *dispatchTable[256];
+        if constexpr (Threaded)
+        {
+            for (auto &target : dispatchTable)
             {
-            case TYPE_INT:
-                val.as.intVal = cst.as.intVal;
-                break;
-            case TYPE_FLOAT:
-                val.as.floatVal = cst.as.floatVal;
-                break;
-            case TYPE_BOOL:
-                val.as.boolVal = cst.as.boolVal;
-                break;
-            case TYPE_STRING:
-            case TYPE_ARRAY_INT:
-            case TYPE_ARRAY_FLOAT:
-            case TYPE_ARRAY_STRING:
-                val.as.stringIdx = cst.as.stringIdx;
-                break;
-            case TYPE_NIL:
-                val.as.intVal = 0;
-                break;
+                target = &&L_UNKNOWN;
             }
-            push(val);
-            break;
+            dispatchTable[OP_PUSH] = &&L_OP_PUSH;
+            dispatchTable[OP_POP] = &&L_OP_POP;
+            dispatchTable[OP_DUP] = &&L_OP_DUP;
+            dispatchTable[OP_SWAP] = &&L_OP_SWAP;
+            dispatchTable[OP_ADD] = &&L_OP_ADD;
+            dispatchTable[OP_SUB] = &&L_OP_SUB;
+            dispatchTable[OP_MUL] = &&L_OP_MUL;
+            dispatchTable[OP_DIV] = &&L_OP_DIV;
+            dispatchTable[OP_MOD] = &&L_OP_MOD;
+            dispatchTable[OP_NEG] = &&L_OP_NEG;
+            dispatchTable[OP_INC] = &&L_OP_INC;
+            dispatchTable[OP_DEC] = &&L_OP_DEC;
+            dispatchTable[OP_EQ] = &&L_OP_EQ;
+            dispatchTable[OP_NEQ] = &&L_OP_NEQ;
+            dispatchTable[OP_LT] = &&L_OP_LT;
+            dispatchTable[OP_LTE] = &&L_OP_LTE;
+            dispatchTable[OP_GT] = &&L_OP_GT;
+            dispatchTable[OP_GTE] = &&L_OP_GTE;
+            dispatchTable[OP_AND] = &&L_OP_AND;
+            dispatchTable[OP_OR] = &&L_OP_OR;
+            dispatchTable[OP_NOT] = &&L_OP_NOT;
+            dispatchTable[OP_LOAD] = &&L_OP_LOAD;
+            dispatchTable[OP_STORE] = &&L_OP_STORE;
+            dispatchTable[OP_LOAD_GLOBAL] = &&L_OP_LOAD_GLOBAL;
+            dispatchTable[OP_STORE_GLOBAL] = &&L_OP_STORE_GLOBAL;
+            dispatchTable[OP_LOAD_STR] = &&L_OP_LOAD_STR;
+            dispatchTable[OP_APPEND_LOCAL] = &&L_OP_APPEND_LOCAL;
+            dispatchTable[OP_JMP] = &&L_OP_JMP;
+            dispatchTable[OP_JMP_IF] = &&L_OP_JMP_IF;
+            dispatchTable[OP_JMP_IFNOT] = &&L_OP_JMP_IFNOT;
+            dispatchTable[OP_CALL] = &&L_OP_CALL;
+            dispatchTable[OP_RET] = &&L_OP_RET;
+            dispatchTable[OP_CALL_NATIVE] = &&L_OP_CALL_NATIVE;
+            dispatchTable[OP_TAILCALL] = &&L_OP_TAILCALL;
+            dispatchTable[OP_NEW_ARRAY] = &&L_OP_NEW_ARRAY;
+            dispatchTable[OP_LOAD_INDEX] = &&L_OP_LOAD_INDEX;
+            dispatchTable[OP_STORE_INDEX] = &&L_OP_STORE_INDEX;
+            dispatchTable[OP_ARRAY_LEN] = &&L_OP_ARRAY_LEN;
+            dispatchTable[OP_LOAD_INDEX_UNCHECKED] = &&L_OP_LOAD_INDEX_UNCHECKED;
+            dispatchTable[OP_STORE_INDEX_UNCHECKED] = &&L_OP_STORE_INDEX_UNCHECKED;
+            dispatchTable[OP_PRINT] = &&L_OP_PRINT;
+            dispatchTable[OP_READ] = &&L_OP_READ;
+            dispatchTable[OP_PRINTLN] = &&L_OP_PRINTLN;
+            dispatchTable[OP_LOAD_LOAD_ADD] = &&L_OP_LOAD_LOAD_ADD;
+            dispatchTable[OP_LT_LOCAL_CONST_JMP_IFNOT] = &&L_OP_LT_LOCAL_CONST_JMP_IFNOT;
+            dispatchTable[OP_INC_LOCAL] = &&L_OP_INC_LOCAL;
+            dispatchTable[OP_STORE_POP] = &&L_OP_STORE_POP;
+            dispatchTable[OP_ADD_INT] = &&L_OP_ADD_INT;
+            dispatchTable[OP_SUB_INT] = &&L_OP_SUB_INT;
+            dispatchTable[OP_MUL_INT] = &&L_OP_MUL_INT;
+            dispatchTable[OP_DIV_INT] = &&L_OP_DIV_INT;
+            dispatchTable[OP_MOD_INT] = &&L_OP_MOD_INT;
+            dispatchTable[OP_ADD_FLOAT] = &&L_OP_ADD_FLOAT;
+            dispatchTable[OP_SUB_FLOAT] = &&L_OP_SUB_FLOAT;
+            dispatchTable[OP_MUL_FLOAT] = &&L_OP_MUL_FLOAT;
+            dispatchTable[OP_DIV_FLOAT] = &&L_OP_DIV_FLOAT;
+            dispatchTable[OP_LT_INT] = &&L_OP_LT_INT;
+            dispatchTable[OP_LTE_INT] = &&L_OP_LTE_INT;
+            dispatchTable[OP_GT_INT] = &&L_OP_GT_INT;
+            dispatchTable[OP_GTE_INT] = &&L_OP_GTE_INT;
+            dispatchTable[OP_EQ_INT] = &&L_OP_EQ_INT;
+            dispatchTable[OP_NEQ_INT] = &&L_OP_NEQ_INT;
+            dispatchTable[OP_EQ_STR] = &&L_OP_EQ_STR;
+            dispatchTable[OP_NEQ_STR] = &&L_OP_NEQ_STR;
+            dispatchTable[OP_LT_FLOAT] = &&L_OP_LT_FLOAT;
+            dispatchTable[OP_LTE_FLOAT] = &&L_OP_LTE_FLOAT;
+            dispatchTable[OP_GT_FLOAT] = &&L_OP_GT_FLOAT;
+            dispatchTable[OP_GTE_FLOAT] = &&L_OP_GTE_FLOAT;
+            dispatchTable[OP_EQ_FLOAT] = &&L_OP_EQ_FLOAT;
+            dispatchTable[OP_NEQ_FLOAT] = &&L_OP_NEQ_FLOAT;
+            dispatchTable[OP_ADD_INT_QUICK] = &&L_OP_ADD_INT_QUICK;
+            dispatchTable[OP_SUB_INT_QUICK] = &&L_OP_SUB_INT_QUICK;
+            dispatchTable[OP_MUL_INT_QUICK] = &&L_OP_MUL_INT_QUICK;
+            dispatchTable[OP_LT_INT_QUICK] = &&L_OP_LT_INT_QUICK;
+            dispatchTable[OP_LTE_INT_QUICK] = &&L_OP_LTE_INT_QUICK;
+            dispatchTable[OP_GT_INT_QUICK] = &&L_OP_GT_INT_QUICK;
+            dispatchTable[OP_GTE_INT_QUICK] = &&L_OP_GTE_INT_QUICK;
+            dispatchTable[OP_ADD_FLOAT_QUICK] = &&L_OP_ADD_FLOAT_QUICK;
+            dispatchTable[OP_SUB_FLOAT_QUICK] = &&L_OP_SUB_FLOAT_QUICK;
+            dispatchTable[OP_MUL_FLOAT_QUICK] = &&L_OP_MUL_FLOAT_QUICK;
+            dispatchTable[OP_LT_FLOAT_QUICK] = &&L_OP_LT_FLOAT_QUICK;
+            dispatchTable[OP_LTE_FLOAT_QUICK] = &&L_OP_LTE_FLOAT_QUICK;
+            dispatchTable[OP_GT_FLOAT_QUICK] = &&L_OP_GT_FLOAT_QUICK;
+            dispatchTable[OP_GTE_FLOAT_QUICK] = &&L_OP_GTE_FLOAT_QUICK;
+            dispatchTable[OP_HALT] = &&L_OP_HALT;
+
+            ++executed;
+            goto *dispatchTable[code[pc].opcode];
         }
-        case OP_POP:
-            pop();
-            break;
-        case OP_DUP:
+#endif
+
+    dispatch:
+        ++executed;
+        if (trace && pc < program->code.size())
         {
-            Value top = peek();
-            push(top);
-            break;
+            traceInstruction(program->code[pc]);
+            traceStack();
         }
-        case OP_SWAP:
+
+        switch (code[pc].opcode)
+        {
+        // Stack operations
+        TVM_CASE(OP_PUSH)
+            push(code[pc].value);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_POP)
+            pop();
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_DUP)
+        {
+            Value top = peek();
+            push(top);
+            pc++;
+            TVM_NEXT();
+        }
+        TVM_CASE(OP_SWAP)
         {
             Value a = pop();
             Value b = pop();
             push(a);
             push(b);
-            break;
+            pc++;
+            TVM_NEXT();
         }
 
         // Arithmetic
-        case OP_ADD:
+        TVM_CASE(OP_ADD)
+            quicken(code[pc], OP_ADD_INT_QUICK, OP_ADD_FLOAT_QUICK);
             opAdd();
-            break;
-        case OP_SUB:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_SUB)
+            quicken(code[pc], OP_SUB_INT_QUICK, OP_SUB_FLOAT_QUICK);
             opSub();
-            break;
-        case OP_MUL:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_MUL)
+            quicken(code[pc], OP_MUL_INT_QUICK, OP_MUL_FLOAT_QUICK);
             opMul();
-            break;
-        case OP_DIV:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_DIV)
             opDiv();
-            break;
-        case OP_MOD:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_MOD)
             opMod();
-            break;
-        case OP_NEG:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_NEG)
             opNeg();
-            break;
-        case OP_INC:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_INC)
             opInc();
-            break;
-        case OP_DEC:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_DEC)
             opDec();
-            break;
+            pc++;
+            TVM_NEXT();
 
         // Comparisons
-        case OP_EQ:
+        TVM_CASE(OP_EQ)
             opEq();
-            break;
-        case OP_NEQ:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_NEQ)
             opNeq();
-            break;
-        case OP_LT:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_LT)
+            quicken(code[pc], OP_LT_INT_QUICK, OP_LT_FLOAT_QUICK);
             opLt();
-            break;
-        case OP_LTE:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_LTE)
+            quicken(code[pc], OP_LTE_INT_QUICK, OP_LTE_FLOAT_QUICK);
             opLte();
-            break;
-        case OP_GT:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_GT)
+            quicken(code[pc], OP_GT_INT_QUICK, OP_GT_FLOAT_QUICK);
             opGt();
-            break;
-        case OP_GTE:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_GTE)
+            quicken(code[pc], OP_GTE_INT_QUICK, OP_GTE_FLOAT_QUICK);
             opGte();
-            break;
+            pc++;
+            TVM_NEXT();
 
         // Logic
-        case OP_AND:
+        TVM_CASE(OP_AND)
             opAnd();
-            break;
-        case OP_OR:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_OR)
             opOr();
-            break;
-        case OP_NOT:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_NOT)
             opNot();
-            break;
+            pc++;
+            TVM_NEXT();
 
         // Variables
-        case OP_LOAD:
-            opLoad(instr.operand);
-            break;
-        case OP_STORE:
-            opStore(instr.operand);
-            break;
-        case OP_LOAD_GLOBAL:
-            opLoadGlobal(instr.operand);
-            break;
-        case OP_STORE_GLOBAL:
-            opStoreGlobal(instr.operand);
-            break;
+        TVM_CASE(OP_LOAD)
+            opLoad(code[pc].operand);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_STORE)
+            opStore(code[pc].operand);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_LOAD_GLOBAL)
+            opLoadGlobal(code[pc].operand);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_STORE_GLOBAL)
+            opStoreGlobal(code[pc].operand);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_LOAD_STR)
+            opLoadStr(code[pc].operand);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_APPEND_LOCAL)
+            opAppendLocal(code[pc].operand);
+            pc++;
+            TVM_NEXT();
 
         // Control flow
-        case OP_JMP:
-            opJmp(instr.operand);
-            break;
-        case OP_JMP_IF:
-            opJmpIf(instr.operand);
-            break;
-        case OP_JMP_IFNOT:
-            opJmpIfNot(instr.operand);
-            break;
-        case OP_CALL:
-            callFunction(instr.operand);
-            break;
-        case OP_RET:
+        TVM_CASE(OP_JMP)
+        {
+#if TVM_JIT
+            // A loop header is where a hot loop moves into native code, which
+            // then runs the rest of the call like enter() does
+            bool backward = code[pc].operand <= pc;
+            opJmp(code[pc].operand);
+            if (jit && backward && jit->enterLoop(callStack.back().func, pc))
+            {
+                if (!running || callStack.size() == exitDepth)
+                {
+                    instructionsExecuted += executed;
+                    return;
+                }
+            }
+#else
+            opJmp(code[pc].operand);
+#endif
+            TVM_NEXT();
+        }
+        TVM_CASE(OP_JMP_IF)
+            opJmpIf(code[pc].operand);
+            TVM_NEXT();
+        TVM_CASE(OP_JMP_IFNOT)
+            opJmpIfNot(code[pc].operand);
+            TVM_NEXT();
+        TVM_CASE(OP_CALL)
+        {
+            const FunctionInfo *callee = code[pc].target.func;
+            callFunction(callee);
+#if TVM_JIT
+            // A compiled body returns with the frame popped and pc at the
+            // return address, so the loop just carries on from there.
+            if (jit && jit->enter(callee) && !running)
+            {
+                instructionsExecuted += executed;
+                return;
+            }
+#endif
+            TVM_NEXT();
+        }
+        TVM_CASE(OP_RET)
             returnFromFunction();
-            break;
-        case OP_CALL_NATIVE:
-            callNative(instr.operand);
-            break;
+            if (!running || callStack.size() == exitDepth)
+            {
+                instructionsExecuted += executed;
+                return;
+            }
+            TVM_NEXT();
+        TVM_CASE(OP_CALL_NATIVE)
+            code[pc].target.native(*this);
+            pc++;
+            TVM_NEXT();
+        // Stays in the interpreter even for a compiled callee, so a chain of
+        // tail calls runs in constant C stack as well as value stack
+        TVM_CASE(OP_TAILCALL)
+            tailCallFunction(code[pc].target.func);
+            TVM_NEXT();
 
         // Arrays
-        case OP_NEW_ARRAY:
-            opNewArray(instr.operand);
-            break;
-        case OP_LOAD_INDEX:
+        TVM_CASE(OP_NEW_ARRAY)
+            opNewArray(code[pc].operand);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_LOAD_INDEX)
             opLoadIndex();
-            break;
-        case OP_STORE_INDEX:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_STORE_INDEX)
             opStoreIndex();
-            break;
-        case OP_ARRAY_LEN:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_ARRAY_LEN)
             opArrayLen();
-            break;
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_LOAD_INDEX_UNCHECKED)
+            opLoadIndexUnchecked(code[pc].operand);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_STORE_INDEX_UNCHECKED)
+            opStoreIndexUnchecked(code[pc].operand);
+            pc++;
+            TVM_NEXT();
 
         // I/O
-        case OP_PRINT:
+        TVM_CASE(OP_PRINT)
             opPrint();
-            break;
-        case OP_READ:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_READ)
             opRead();
-            break;
-        case OP_PRINTLN:
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(OP_PRINTLN)
             opPrintln();
-            break;
+            pc++;
+            TVM_NEXT();
+
+        // Type-specialised: the compiler proved the operand types, but the
+        // verifier cannot, so each form checks the tags like a quickened
+        // one and falls back to its generic opcode if they do not hold.
+        TVM_CASE(OP_ADD_INT)
+            TVM_QUICK_BINARY(isInt, wrapAdd(lhs.asInt(), rhs.asInt()), OP_ADD);
+        TVM_CASE(OP_SUB_INT)
+            TVM_QUICK_BINARY(isInt, wrapSub(lhs.asInt(), rhs.asInt()), OP_SUB);
+        TVM_CASE(OP_MUL_INT)
+            TVM_QUICK_BINARY(isInt, wrapMul(lhs.asInt(), rhs.asInt()), OP_MUL);
+        TVM_CASE(OP_DIV_INT)
+            if (TVM_QUICK_GUARD(isInt))
+            {
+                if (stackTop[-1].asInt() == 0)
+                {
+                    runtimeError("Division by zero");
+                }
+                TVM_TYPED_BINARY(wrapDiv(lhs.asInt(), rhs.asInt()));
+            }
+            deoptimize(code[pc], OP_DIV);
+            TVM_REDISPATCH();
+        TVM_CASE(OP_MOD_INT)
+            if (TVM_QUICK_GUARD(isInt))
+            {
+                if (stackTop[-1].asInt() == 0)
+                {
+                    runtimeError("Modulo by zero");
+                }
+                TVM_TYPED_BINARY(wrapMod(lhs.asInt(), rhs.asInt()));
+            }
+            deoptimize(code[pc], OP_MOD);
+            TVM_REDISPATCH();
+        TVM_CASE(OP_ADD_FLOAT)
+            TVM_QUICK_BINARY(isFloat, lhs.asFloat() + rhs.asFloat(), OP_ADD);
+        TVM_CASE(OP_SUB_FLOAT)
+            TVM_QUICK_BINARY(isFloat, lhs.asFloat() - rhs.asFloat(), OP_SUB);
+        TVM_CASE(OP_MUL_FLOAT)
+            TVM_QUICK_BINARY(isFloat, lhs.asFloat() * rhs.asFloat(), OP_MUL);
+        TVM_CASE(OP_DIV_FLOAT)
+            if (TVM_QUICK_GUARD(isFloat))
+            {
+                if (stackTop[-1].asFloat() == 0.0)
+                {
+                    runtimeError("Division by zero");
+                }
+                TVM_TYPED_BINARY(lhs.asFloat() / rhs.asFloat());
+            }
+            deoptimize(code[pc], OP_DIV);
+            TVM_REDISPATCH();
+        TVM_CASE(OP_LT_INT)
+            TVM_QUICK_COMPARE(isInt, asInt, <, OP_LT);
+        TVM_CASE(OP_LTE_INT)
+            TVM_QUICK_COMPARE(isInt, asInt, <=, OP_LTE);
+        TVM_CASE(OP_GT_INT)
+            TVM_QUICK_COMPARE(isInt, asInt, >, OP_GT);
+        TVM_CASE(OP_GTE_INT)
+            TVM_QUICK_COMPARE(isInt, asInt, >=, OP_GTE);
+        TVM_CASE(OP_LT_FLOAT)
+            TVM_QUICK_COMPARE(isFloat, asFloat, <, OP_LT);
+        TVM_CASE(OP_LTE_FLOAT)
+            TVM_QUICK_COMPARE(isFloat, asFloat, <=, OP_LTE);
+        TVM_CASE(OP_GT_FLOAT)
+            TVM_QUICK_COMPARE(isFloat, asFloat, >, OP_GT);
+        TVM_CASE(OP_GTE_FLOAT)
+            TVM_QUICK_COMPARE(isFloat, asFloat, >=, OP_GTE);
+        TVM_CASE(OP_EQ_INT)
+            TVM_QUICK_COMPARE(isInt, asInt, ==, OP_EQ);
+        TVM_CASE(OP_NEQ_INT)
+            TVM_QUICK_COMPARE(isInt, asInt, !=, OP_NEQ);
+        TVM_CASE(OP_EQ_FLOAT)
+            TVM_QUICK_COMPARE(isFloat, asFloat, ==, OP_EQ);
+        TVM_CASE(OP_NEQ_FLOAT)
+            TVM_QUICK_COMPARE(isFloat, asFloat, !=, OP_NEQ);
+        TVM_CASE(OP_EQ_STR)
+            if (TVM_QUICK_GUARD(isString))
+            {
+                stackTop[-2] = Value(stringEquals(stackTop[-2], stackTop[-1]));
+                --stackTop;
+                pc++;
+                TVM_NEXT();
+            }
+            deoptimize(code[pc], OP_EQ);
+            TVM_REDISPATCH();
+        TVM_CASE(OP_NEQ_STR)
+            if (TVM_QUICK_GUARD(isString))
+            {
+                stackTop[-2] = Value(!stringEquals(stackTop[-2], stackTop[-1]));
+                --stackTop;
+                pc++;
+                TVM_NEXT();
+            }
+            deoptimize(code[pc], OP_NEQ);
+            TVM_REDISPATCH();
+
+        // Quickened: same fast path as the typed forms, behind a guard that
+        // reverts the site to its generic opcode and re-dispatches it.
+        TVM_CASE(OP_ADD_INT_QUICK)
+            TVM_QUICK_BINARY(isInt, wrapAdd(lhs.asInt(), rhs.asInt()), OP_ADD);
+        TVM_CASE(OP_SUB_INT_QUICK)
+            TVM_QUICK_BINARY(isInt, wrapSub(lhs.asInt(), rhs.asInt()), OP_SUB);
+        TVM_CASE(OP_MUL_INT_QUICK)
+            TVM_QUICK_BINARY(isInt, wrapMul(lhs.asInt(), rhs.asInt()), OP_MUL);
+        TVM_CASE(OP_LT_INT_QUICK)
+            TVM_QUICK_COMPARE(isInt, asInt, <, OP_LT);
+        TVM_CASE(OP_LTE_INT_QUICK)
+            TVM_QUICK_COMPARE(isInt, asInt, <=, OP_LTE);
+        TVM_CASE(OP_GT_INT_QUICK)
+            TVM_QUICK_COMPARE(isInt, asInt, >, OP_GT);
+        TVM_CASE(OP_GTE_INT_QUICK)
+            TVM_QUICK_COMPARE(isInt, asInt, >=, OP_GTE);
+        TVM_CASE(OP_ADD_FLOAT_QUICK)
+            TVM_QUICK_BINARY(isFloat, lhs.asFloat() + rhs.asFloat(), OP_ADD);
+        TVM_CASE(OP_SUB_FLOAT_QUICK)
+            TVM_QUICK_BINARY(isFloat, lhs.asFloat() - rhs.asFloat(), OP_SUB);
+        TVM_CASE(OP_MUL_FLOAT_QUICK)
+            TVM_QUICK_BINARY(isFloat, lhs.asFloat() * rhs.asFloat(), OP_MUL);
+        TVM_CASE(OP_LT_FLOAT_QUICK)
+            TVM_QUICK_COMPARE(isFloat, asFloat, <, OP_LT);
+        TVM_CASE(OP_LTE_FLOAT_QUICK)
+            TVM_QUICK_COMPARE(isFloat, asFloat, <=, OP_LTE);
+        TVM_CASE(OP_GT_FLOAT_QUICK)
+            TVM_QUICK_COMPARE(isFloat, asFloat, >, OP_GT);
+        TVM_CASE(OP_GTE_FLOAT_QUICK)
+            TVM_QUICK_COMPARE(isFloat, asFloat, >=, OP_GTE);
+
+        // Superinstructions: the covered instructions are skipped in one step
+        TVM_CASE(OP_LOAD_LOAD_ADD)
+            push(valueAdd(localSlot(code[pc].operand), localSlot(code[pc].aux)));
+            pc += 3;
+            TVM_NEXT();
+        TVM_CASE(OP_LT_LOCAL_CONST_JMP_IFNOT)
+            pc = valueLess(localSlot(code[pc].operand), code[pc].value) ? pc + 4 : code[pc].aux;
+            TVM_NEXT();
+        TVM_CASE(OP_INC_LOCAL)
+        {
+            Value &slot = localSlot(code[pc].operand);
+            if (slot.isInt())
+            {
+                slot = Value(wrapAdd(slot.asInt(), code[pc].value.asInt()));
+            }
+            else
+            {
+                slot = valueAdd(slot, code[pc].value);
+            }
+            pc += 5;
+            TVM_NEXT();
+        }
+        TVM_CASE(OP_STORE_POP)
+            localSlot(code[pc].operand) = pop();
+            pc += 2;
+            TVM_NEXT();
 
         // System
-        case OP_HALT:
+        TVM_CASE(OP_HALT)
             opHalt();
-            break;
+            instructionsExecuted += executed;
+            return;
 
         default:
-            runtimeError("Unknown opcode: " + std::to_string(static_cast<int>(instr.opcode)));
+#if TVM_THREADED_DISPATCH
+        L_UNKNOWN:
+#endif
+            runtimeError("Unknown opcode: " + std::to_string(static_cast<int>(code[pc].opcode)));
         }
     }
 
-    Value VM::pop()
+#undef TVM_TYPED_BINARY
+#undef TVM_TYPED_COMPARE
+#undef TVM_QUICK_GUARD
+#undef TVM_QUICK_BINARY
+#undef TVM_QUICK_COMPARE
+
+    void VM::runInterpreter()
     {
-        if (stack.empty())
+        // Tracing needs a hook before every instruction, which only the
+        // switch loop provides.
+        if (dispatchMode == DispatchMode::Threaded && !trace)
         {
-            runtimeError("Stack underflow");
+            run<true>();
         }
-        Value val = stack.back();
-        stack.pop_back();
-        return val;
-    }
-
-    void VM::push(const Value &val)
-    {
-        stack.push_back(val);
-    }
-
-    Value &VM::peek(int offset)
-    {
-        if (offset >= (int)stack.size())
+        else
         {
-            runtimeError("Stack peek out of bounds");
+            run<false>();
         }
-        return stack[stack.size() - 1 - offset];
     }
 
-    const Constant &VM::getConstant(uint32_t index) const
+    void VM::quicken(DecodedInstruction &instr, OpCode intForm, OpCode floatForm)
     {
-        if (index >= program->constants.size())
+        if (!quickening || instr.deopts >= MAX_DEOPTS)
         {
-            runtimeError("Constant index out of bounds");
+            return;
         }
-        return program->constants[index];
-    }
 
-    const std::string &VM::getString(uint32_t index) const
-    {
-        if (index >= program->strings.size())
+        ValueType right = stackTop[-1].type();
+        ValueType left = stackTop[-2].type();
+        if (left == TYPE_INT && right == TYPE_INT)
+        {
+            instr.opcode = intForm;
+        }
+        else if (left == TYPE_FLOAT && right == TYPE_FLOAT)
+        {
+            instr.opcode = floatForm;
+        }
+        else
         {
-            runtimeError("String index out of bounds");
+            return;
         }
-        return program->strings[index];
+        quickenedSites++;
     }
-    void VM::opAdd()
+
+    void VM::deoptimize(DecodedInstruction &instr, OpCode generic)
     {
-        Value b = pop();
-        Value a = pop();
+        instr.opcode = generic;
+        instr.deopts++;
+        deoptimizedSites++;
+    }
 
-        if (a.type == TYPE_INT && b.type == TYPE_INT)
+    Value VM::valueAdd(const Value &a, const Value &b)
+    {
+        if (a.isInt() && b.isInt())
         {
-            push(Value(a.as.intVal + b.as.intVal));
-            return;
+            return Value(wrapAdd(a.asInt(), b.asInt()));
         }
 
-        if (a.type == TYPE_FLOAT && b.type == TYPE_FLOAT)
+        if (a.isFloat() && b.isFloat())
         {
-            push(Value(a.as.floatVal + b.as.floatVal));
-            return;
+            return Value(a.asFloat() + b.asFloat());
         }
 
-        if (a.type == TYPE_INT && b.type == TYPE_FLOAT)
+        if (a.isInt() && b.isFloat())
         {
-            push(Value(static_cast<double>(a.as.intVal) + b.as.floatVal));
-            return;
+            return Value(static_cast<double>(a.asInt()) + b.asFloat());
         }
 
-        if (a.type == TYPE_FLOAT && b.type == TYPE_INT)
+        if (a.isFloat() && b.isInt())
         {
-            push(Value(a.as.floatVal + static_cast<double>(b.as.intVal)));
-            return;
+            return Value(a.asFloat() + static_cast<double>(b.asInt()));
         }
 
-        if (a.type == TYPE_STRING || b.type == TYPE_STRING)
+        if (a.type() == TYPE_STRING || b.type() == TYPE_STRING)
         {
-            std::string result = a.toString(program) + b.toString(program);
-            uint32_t idx = program->strings.size();
-            const_cast<BytecodeFile *>(program)->strings.push_back(result);
-            push(Value(result, idx));
-            return;
+            std::string text;
+            appendText(text, a);
+            appendText(text, b);
+            return newString(text);
         }
 
-        push(Value());
+        return Value();
     }
 
-    void VM::opSub()
+    Value VM::valueSub(const Value &a, const Value &b)
     {
-        Value b = pop();
-        Value a = pop();
-
-        if (a.type == TYPE_INT && b.type == TYPE_INT)
-        {
-            push(Value(a.as.intVal - b.as.intVal));
-        }
-        else if (a.type == TYPE_FLOAT && b.type == TYPE_FLOAT)
+        if (a.isInt() && b.isInt())
         {
-            push(Value(a.as.floatVal - b.as.floatVal));
+            return Value(wrapSub(a.asInt(), b.asInt()));
         }
-        else
+        if (a.isFloat() && b.isFloat())
         {
-            runtimeError("Invalid types for subtraction");
+            return Value(a.asFloat() - b.asFloat());
         }
+        runtimeError("Invalid types for subtraction");
+        return Value();
     }
 
-    void VM::opMul()
+    Value VM::valueMul(const Value &a, const Value &b)
     {
-        Value b = pop();
-        Value a = pop();
-
-        if (a.type == TYPE_INT && b.type == TYPE_INT)
+        if (a.isInt() && b.isInt())
         {
-            push(Value(a.as.intVal * b.as.intVal));
+            return Value(wrapMul(a.asInt(), b.asInt()));
         }
-        else if (a.type == TYPE_FLOAT && b.type == TYPE_FLOAT)
+        if (a.isFloat() && b.isFloat())
         {
-            push(Value(a.as.floatVal * b.as.floatVal));
-        }
-        else
-        {
-            runtimeError("Invalid types for multiplication");
+            return Value(a.asFloat() * b.asFloat());
         }
+        runtimeError("Invalid types for multiplication");
+        return Value();
     }
 
-    void VM::opDiv()
+    Value VM::valueDiv(const Value &a, const Value &b)
     {
-        Value b = pop();
-        Value a = pop();
-
-        if (b.type == TYPE_INT && b.as.intVal == 0)
+        if (b.isInt() && b.asInt() == 0)
         {
             runtimeError("Division by zero");
         }
-        if (b.type == TYPE_FLOAT && b.as.floatVal == 0.0)
+        if (b.isFloat() && b.asFloat() == 0.0)
         {
             runtimeError("Division by zero");
         }
 
-        if (a.type == TYPE_INT && b.type == TYPE_INT)
+        if (a.isInt() && b.isInt())
         {
-            push(Value(a.as.intVal / b.as.intVal));
+            return Value(wrapDiv(a.asInt(), b.asInt()));
         }
-        else if (a.type == TYPE_FLOAT && b.type == TYPE_FLOAT)
+        if (a.isFloat() && b.isFloat())
         {
-            push(Value(a.as.floatVal / b.as.floatVal));
+            return Value(a.asFloat() / b.asFloat());
         }
-        else
+        runtimeError("Invalid types for division");
+        return Value();
+    }
+
+    Value VM::valueMod(const Value &a, const Value &b)
+    {
+        if (a.isInt() && b.isInt())
         {
-            runtimeError("Invalid types for division");
+            if (b.asInt() == 0)
+            {
+                runtimeError("Modulo by zero");
+            }
+            return Value(wrapMod(a.asInt(), b.asInt()));
         }
+        runtimeError("Invalid types for modulo");
+        return Value();
     }
 
-    void VM::opMod()
+    Value VM::valueNeg(const Value &a)
     {
-        Value b = pop();
-        Value a = pop();
+        if (a.isInt())
+        {
+            return Value(wrapNeg(a.asInt()));
+        }
+        if (a.isFloat())
+        {
+            return Value(-a.asFloat());
+        }
+        runtimeError("Invalid type for negation");
+        return Value();
+    }
 
-        if (a.type == TYPE_INT && b.type == TYPE_INT)
+    // Numbers compare by value (an int widened against a float), strings by
+    // contents, arrays by identity. Values of other differing types are
+    // never equal.
+    bool VM::valueEquals(const Value &a, const Value &b)
+    {
+        ValueType left = a.type();
+        ValueType right = b.type();
+        if (left != right)
         {
-            if (b.as.intVal == 0)
+            if (left == TYPE_INT && right == TYPE_FLOAT)
             {
-                runtimeError("Modulo by zero");
+                return static_cast<double>(a.asInt()) == b.asFloat();
+            }
+            if (left == TYPE_FLOAT && right == TYPE_INT)
+            {
+                return a.asFloat() == static_cast<double>(b.asInt());
             }
-            push(Value(a.as.intVal % b.as.intVal));
+            return false;
         }
-        else
+
+        switch (left)
         {
-            runtimeError("Invalid types for modulo");
+        case TYPE_NIL:
+            return true;
+        case TYPE_INT:
+            return a.asInt() == b.asInt();
+        case TYPE_FLOAT:
+            return a.asFloat() == b.asFloat();
+        case TYPE_BOOL:
+            return a.asBool() == b.asBool();
+        case TYPE_STRING:
+            return stringEquals(a, b);
+        default:
+            return a.asIndex() == b.asIndex();
         }
     }
 
-    void VM::opNeg()
+    // The same heap handle is the same string; otherwise the bytes decide.
+    // Inline strings have no handle and are at most a word to compare.
+    bool VM::stringEquals(const Value &a, const Value &b) const
     {
-        Value a = pop();
+        if (!a.isInlineString() && !b.isInlineString() && a.asIndex() == b.asIndex())
+        {
+            return true;
+        }
+        return heap.stringView(a) == heap.stringView(b);
+    }
 
-        if (a.type == TYPE_INT)
+    bool VM::valueLess(const Value &a, const Value &b)
+    {
+        if (a.isInt() && b.isInt())
         {
-            push(Value(-a.as.intVal));
+            return a.asInt() < b.asInt();
         }
-        else if (a.type == TYPE_FLOAT)
+        if (a.isFloat() && b.isFloat())
         {
-            push(Value(-a.as.floatVal));
+            return a.asFloat() < b.asFloat();
         }
-        else
+        runtimeError("Invalid types for comparison");
+        return false;
+    }
+
+    bool VM::valueLessEqual(const Value &a, const Value &b)
+    {
+        if (a.isInt() && b.isInt())
+        {
+            return a.asInt() <= b.asInt();
+        }
+        if (a.isFloat() && b.isFloat())
+        {
+            return a.asFloat() <= b.asFloat();
+        }
+        runtimeError("Invalid types for comparison");
+        return false;
+    }
+
+    bool VM::valueGreater(const Value &a, const Value &b)
+    {
+        if (a.isInt() && b.isInt())
+        {
+            return a.asInt() > b.asInt();
+        }
+        if (a.isFloat() && b.isFloat())
         {
-            runtimeError("Invalid type for negation");
+            return a.asFloat() > b.asFloat();
         }
+        runtimeError("Invalid types for comparison");
+        return false;
+    }
+
+    bool VM::valueGreaterEqual(const Value &a, const Value &b)
+    {
+        if (a.isInt() && b.isInt())
+        {
+            return a.asInt() >= b.asInt();
+        }
+        if (a.isFloat() && b.isFloat())
+        {
+            return a.asFloat() >= b.asFloat();
+        }
+        runtimeError("Invalid types for comparison");
+        return false;
+    }
+
+    void VM::opAdd()
+    {
+        Value b = pop();
+        Value a = pop();
+        push(valueAdd(a, b));
+    }
+
+    void VM::opSub()
+    {
+        Value b = pop();
+        Value a = pop();
+        push(valueSub(a, b));
+    }
+
+    void VM::opMul()
+    {
+        Value b = pop();
+        Value a = pop();
+        push(valueMul(a, b));
+    }
+
+    void VM::opDiv()
+    {
+        Value b = pop();
+        Value a = pop();
+        push(valueDiv(a, b));
+    }
+
+    void VM::opMod()
+    {
+        Value b = pop();
+        Value a = pop();
+        push(valueMod(a, b));
+    }
+
+    void VM::opNeg()
+    {
+        Value a = pop();
+        push(valueNeg(a));
     }
 
     void VM::opInc()
     {
         Value &a = peek();
 
-        if (a.type == TYPE_INT)
+        if (a.isInt())
         {
-            a.as.intVal++;
+            a = Value(wrapAdd(a.asInt(), 1));
         }
-        else if (a.type == TYPE_FLOAT)
+        else if (a.isFloat())
         {
-            a.as.floatVal += 1.0;
+            a = Value(a.asFloat() + 1.0);
         }
         else
         {
@@ -631,13 +1695,13 @@ namespace TVM
     {
         Value &a = peek();
 
-        if (a.type == TYPE_INT)
+        if (a.isInt())
         {
-            a.as.intVal--;
+            a = Value(wrapSub(a.asInt(), 1));
         }
-        else if (a.type == TYPE_FLOAT)
+        else if (a.isFloat())
         {
-            a.as.floatVal -= 1.0;
+            a = Value(a.asFloat() - 1.0);
         }
         else
         {
@@ -649,342 +1713,691 @@ namespace TVM
     {
         Value b = pop();
         Value a = pop();
-        push(Value(a.toString(program) == b.toString(program)));
+        push(Value(valueEquals(a, b)));
     }
 
     void VM::opNeq()
     {
         Value b = pop();
         Value a = pop();
-        push(Value(a.toString(program) != b.toString(program)));
+        push(Value(!valueEquals(a, b)));
     }
 
     void VM::opLt()
     {
         Value b = pop();
         Value a = pop();
+        push(Value(valueLess(a, b)));
+    }
+
+    void VM::opLte()
+    {
+        Value b = pop();
+        Value a = pop();
+        push(Value(valueLessEqual(a, b)));
+    }
+
+    void VM::opGt()
+    {
+        Value b = pop();
+        Value a = pop();
+        push(Value(valueGreater(a, b)));
+    }
+
+    void VM::opGte()
+    {
+        Value b = pop();
+        Value a = pop();
+        push(Value(valueGreaterEqual(a, b)));
+    }
+
+    void VM::opAnd()
+    {
+        Value b = pop();
+        Value a = pop();
+        push(Value(a.isTruthy() && b.isTruthy()));
+    }
 
-        if (a.type == TYPE_INT && b.type == TYPE_INT)
+    void VM::opOr()
+    {
+        Value b = pop();
+        Value a = pop();
+        push(Value(a.isTruthy() || b.isTruthy()));
+    }
+
+    void VM::opNot()
+    {
+        Value a = pop();
+        push(Value(!a.isTruthy()));
+    }
+
+    void VM::opLoad(uint32_t index)
+    {
+        push(stack[frameBase + index]);
+    }
+
+    void VM::opStore(uint32_t index)
+    {
+        stack[frameBase + index] = stackTop[-1];
+    }
+
+    void VM::opLoadStr(uint32_t index)
+    {
+        push(localString(stack[frameBase + index]));
+    }
+
+    void VM::opAppendLocal(uint32_t index)
+    {
+        appendLocal(stack[frameBase + index], peek());
+        pop();
+    }
+
+    Value VM::localString(const Value &local)
+    {
+        return local.type() == TYPE_STRING_BUILDER ? builderString(local) : local;
+    }
+
+    void VM::appendLocal(Value &local, const Value &piece)
+    {
+        switch (local.type())
         {
-            push(Value(a.as.intVal < b.as.intVal));
+        case TYPE_STRING:
+            // First append: the local becomes a builder holding its value
+            local = newBuilder(heap.stringView(local));
+            break;
+        case TYPE_STRING_BUILDER:
+            break;
+        default:
+            // The local was only declared str; add as `s = s + x` would
+            local = valueAdd(local, piece);
+            return;
         }
-        else if (a.type == TYPE_FLOAT && b.type == TYPE_FLOAT)
+        appendTo(local, piece);
+    }
+
+    void VM::opLoadGlobal(uint32_t index)
+    {
+        push(globals[index]);
+    }
+
+    void VM::opStoreGlobal(uint32_t index)
+    {
+        globals[index] = peek();
+    }
+
+    void VM::opJmp(uint32_t address)
+    {
+        if (address <= pc)
         {
-            push(Value(a.as.floatVal < b.as.floatVal));
+            pollHeap();
+        }
+        pc = address;
+    }
+
+    void VM::opJmpIf(uint32_t address)
+    {
+        Value cond = pop();
+        if (cond.isTruthy())
+        {
+            opJmp(address);
         }
         else
         {
-            runtimeError("Invalid types for comparison");
+            pc++;
         }
     }
 
-    void VM::opLte()
+    void VM::opJmpIfNot(uint32_t address)
     {
-        Value b = pop();
-        Value a = pop();
+        Value cond = pop();
+        if (!cond.isTruthy())
+        {
+            opJmp(address);
+        }
+        else
+        {
+            pc++;
+        }
+    }
 
-        if (a.type == TYPE_INT && b.type == TYPE_INT)
+    void VM::callFunction(const FunctionInfo *func)
+    {
+        // The arguments already on top of the stack become the callee's
+        // first locals; the remaining local slots are cleared to nil.
+        pollHeap();
+        uint32_t base = stackSize() - func->arity;
+        reserveFrame(base, func);
+        callStack.push_back(CallFrame{pc + 1, base, func, 0});
+        Value *localsEnd = stack.get() + base + std::max(func->locals, func->arity);
+        std::fill(stackTop, localsEnd, Value());
+        stackTop = localsEnd;
+
+        frameBase = base;
+        frameLocals = func->locals;
+        pc = func->address;
+    }
+
+    void VM::tailCallFunction(const FunctionInfo *func)
+    {
+        // The current frame's locals are dead, so the arguments move down
+        // over them and func takes over the frame record. Its return address
+        // is left alone: func returns straight to our caller.
+        pollHeap();
+        reserveFrame(frameBase, func);
+        Value *base = stack.get() + frameBase;
+        std::copy(stackTop - func->arity, stackTop, base);
+        Value *localsEnd = base + std::max(func->locals, func->arity);
+        std::fill(base + func->arity, localsEnd, Value());
+        stackTop = localsEnd;
+
+        callStack.back().func = func;
+        frameLocals = func->locals;
+        pc = func->address;
+    }
+
+    void VM::reserveFrame(uint32_t base, const FunctionInfo *func)
+    {
+        size_t needed = static_cast<size_t>(base) + std::max(func->locals, func->arity) + func->maxStack;
+        if (needed > stackSlots)
+        {
+            runtimeError("Stack overflow calling " + func->name + " (stack size " +
+                         std::to_string(stackSlots) + " slots)");
+        }
+    }
+
+    void VM::returnFromFunction()
+    {
+        if (callStack.empty())
+        {
+            running = false;
+            return;
+        }
+
+        const CallFrame &frame = callStack.back();
+        if (frame.returnAddr == UINT32_MAX)
+        {
+            running = false;
+            return;
+        }
+
+        Value returnValue;
+        if (stackSize() > frame.localStart + frameLocals)
         {
-            push(Value(a.as.intVal <= b.as.intVal));
+            returnValue = stackTop[-1];
+        }
+
+        stackTop = stack.get() + frame.localStart;
+        *stackTop++ = returnValue;
+        pc = frame.returnAddr;
+        callStack.pop_back();
+
+        frameBase = callStack.back().localStart;
+        frameLocals = callStack.back().func->locals;
+    }
+
+    // Pops the length. The constant gives the array type and a pool entry
+    // the array starts as a copy of (literals), zero-filled past its end.
+    void VM::opNewArray(uint32_t constIndex)
+    {
+        Value length = pop();
+        push(newArray(length, constIndex));
+    }
+
+    Value VM::newArray(const Value &length, uint32_t constIndex)
+    {
+        if (!length.isInt() || length.asInt() < 0 || length.asInt() > static_cast<int64_t>(UINT32_MAX))
+        {
+            runtimeError("Array length must be an integer from 0 to " + std::to_string(UINT32_MAX));
+        }
+        uint32_t count = static_cast<uint32_t>(length.asInt());
+
+        const Constant &cst = program->constants[constIndex];
+        reserveHeap(Heap::arrayBytes(cst.type, count));
+        Value array = heap.makeArray(cst.type, count);
+
+        switch (cst.type)
+        {
+        case TYPE_ARRAY_INT:
+        {
+            const auto &init = program->intArrays[cst.as.arrayIdx];
+            std::copy_n(init.begin(), std::min<size_t>(count, init.size()), heap.array(array)->ints());
+            break;
         }
-        else if (a.type == TYPE_FLOAT && b.type == TYPE_FLOAT)
+        case TYPE_ARRAY_FLOAT:
         {
-            push(Value(a.as.floatVal <= b.as.floatVal));
+            const auto &init = program->floatArrays[cst.as.arrayIdx];
+            std::copy_n(init.begin(), std::min<size_t>(count, init.size()), heap.array(array)->floats());
+            break;
         }
-        else
+        default:
         {
-            runtimeError("Invalid types for comparison");
+            // Each element may allocate, so keep the array alive meanwhile
+            Root root(*this, array);
+            const auto &init = program->stringArrays[cst.as.arrayIdx];
+            for (size_t i = 0; i < std::min<size_t>(count, init.size()); i++)
+            {
+                Value str = newString(init[i]);
+                heap.array(array)->values()[i] = str;
+            }
+            break;
         }
+        }
+        return array;
     }
 
-    void VM::opGt()
+    HeapArray *VM::checkArray(const Value &array) const
     {
-        Value b = pop();
-        Value a = pop();
-
-        if (a.type == TYPE_INT && b.type == TYPE_INT)
+        if (!isArrayType(array.type()))
         {
-            push(Value(a.as.intVal > b.as.intVal));
+            runtimeError(std::string("Expected an array, got ") + valueTypeName(array.type()));
         }
-        else if (a.type == TYPE_FLOAT && b.type == TYPE_FLOAT)
+        return heap.array(array);
+    }
+
+    HeapArray *VM::checkIndex(const Value &array, const Value &index) const
+    {
+        HeapArray *elements = checkArray(array);
+        if (!index.isInt())
         {
-            push(Value(a.as.floatVal > b.as.floatVal));
+            runtimeError("Array index must be integer");
         }
-        else
+        // A negative index wraps to a huge unsigned one
+        if (static_cast<uint64_t>(index.asInt()) >= elements->length)
         {
-            runtimeError("Invalid types for comparison");
+            runtimeError("Array index " + std::to_string(index.asInt()) + " out of bounds for length " +
+                         std::to_string(elements->length));
         }
+        return elements;
     }
 
-    void VM::opGte()
+    HeapArray *VM::checkNumericArray(const Value &array, const char *native) const
     {
-        Value b = pop();
-        Value a = pop();
-
-        if (a.type == TYPE_INT && b.type == TYPE_INT)
+        if (array.type() != TYPE_ARRAY_INT && array.type() != TYPE_ARRAY_FLOAT)
         {
-            push(Value(a.as.intVal >= b.as.intVal));
+            runtimeError(std::string(native) + " expects an int[] or float[], got " + valueTypeName(array.type()));
         }
-        else if (a.type == TYPE_FLOAT && b.type == TYPE_FLOAT)
+        return heap.array(array);
+    }
+
+    void VM::checkSameType(const Value &a, const Value &b, const char *native) const
+    {
+        if (a.type() != b.type())
         {
-            push(Value(a.as.floatVal >= b.as.floatVal));
+            runtimeError(std::string(native) + " expects arrays of the same type, got " + valueTypeName(a.type()) +
+                         " and " + valueTypeName(b.type()));
         }
-        else
+    }
+
+    static Value elementAt(ValueType type, HeapArray *elements, size_t index)
+    {
+        switch (type)
         {
-            runtimeError("Invalid types for comparison");
+        case TYPE_ARRAY_INT:
+            return Value(elements->ints()[index]);
+        case TYPE_ARRAY_FLOAT:
+            return Value(elements->floats()[index]);
+        default:
+            return elements->values()[index];
         }
     }
 
-    void VM::opAnd()
+    Value VM::loadIndexed(const Value &array, const Value &index)
     {
-        Value b = pop();
-        Value a = pop();
-        push(Value(a.isTruthy() && b.isTruthy()));
+        HeapArray *elements = checkIndex(array, index);
+        return elementAt(array.type(), elements, static_cast<size_t>(index.asInt()));
     }
 
-    void VM::opOr()
+    void VM::storeIndexed(const Value &array, const Value &index, const Value &value)
     {
-        Value b = pop();
-        Value a = pop();
-        push(Value(a.isTruthy() || b.isTruthy()));
+        HeapArray *elements = checkIndex(array, index);
+        storeElement(array.type(), elements, static_cast<size_t>(index.asInt()), value);
     }
 
-    void VM::opNot()
+    void VM::opLoadIndex()
     {
-        Value a = pop();
-        push(Value(!a.isTruthy()));
+        Value index = pop();
+        Value array = pop();
+        push(loadIndexed(array, index));
     }
 
-    void VM::opLoad(uint32_t index)
+    void VM::opStoreIndex()
     {
-        if (index >= locals.size())
-        {
-            runtimeError("Local variable index out of bounds");
-        }
-        push(locals[index]);
+        Value value = pop();
+        Value index = pop();
+        Value array = pop();
+        storeIndexed(array, index, value);
+        push(value);
     }
 
-    void VM::opStore(uint32_t index)
+    void VM::opLoadIndexUnchecked(uint32_t operand)
     {
-        if (index >= locals.size())
-        {
-            runtimeError("Local variable index out of bounds");
-        }
-        locals[index] = peek();
+        const Value &array = stack[frameBase + (operand >> 16)];
+        size_t index = static_cast<size_t>(stack[frameBase + (operand & 0xFFFF)].asInt());
+        push(elementAt(array.type(), heap.array(array), index));
     }
 
-    void VM::opLoadGlobal(uint32_t index)
+    // The value stays on the stack, as after STORE_INDEX
+    void VM::opStoreIndexUnchecked(uint32_t operand)
     {
-        if (index >= globals.size())
-        {
-            // Expand globals if needed
-            globals.resize(index + 1);
-        }
-        push(globals[index]);
+        const Value &array = stack[frameBase + (operand >> 16)];
+        size_t index = static_cast<size_t>(stack[frameBase + (operand & 0xFFFF)].asInt());
+        storeElement(array.type(), heap.array(array), index, peek());
     }
 
-    void VM::opStoreGlobal(uint32_t index)
+    // Elements are untagged, so the value must have the element type; an
+    // int stored into a float array is widened.
+    void VM::storeElement(ValueType type, HeapArray *elements, size_t i, const Value &value)
     {
-        if (index >= globals.size())
+        switch (type)
         {
-            globals.resize(index + 1);
+        case TYPE_ARRAY_INT:
+            if (!value.isInt())
+            {
+                runtimeError(std::string("Cannot store ") + valueTypeName(value.type()) + " in an int array");
+            }
+            elements->ints()[i] = value.asInt();
+            break;
+        case TYPE_ARRAY_FLOAT:
+            if (value.isFloat())
+            {
+                elements->floats()[i] = value.asFloat();
+            }
+            else if (value.isInt())
+            {
+                elements->floats()[i] = static_cast<double>(value.asInt());
+            }
+            else
+            {
+                runtimeError(std::string("Cannot store ") + valueTypeName(value.type()) + " in a float array");
+            }
+            break;
+        default:
+            if (value.type() != TYPE_STRING)
+            {
+                runtimeError(std::string("Cannot store ") + valueTypeName(value.type()) + " in a str array");
+            }
+            elements->values()[i] = value;
+            break;
         }
-        globals[index] = peek();
     }
 
-    void VM::opJmp(uint32_t address)
+    void VM::opArrayLen()
     {
-        if (address >= program->code.size())
-        {
-            runtimeError("Jump address out of bounds");
-        }
-        pc = address;
+        Value array = pop();
+        push(Value(static_cast<int64_t>(checkArray(array)->length)));
     }
 
-    void VM::opJmpIf(uint32_t address)
+    void VM::writeValue(const Value &value)
     {
-        Value cond = pop();
-        if (cond.isTruthy())
+        switch (value.type())
         {
-            opJmp(address);
+        case TYPE_STRING:
+            output.write(heap.stringView(value));
+            break;
+        case TYPE_INT:
+            output.writeInt(value.asInt());
+            break;
+        case TYPE_FLOAT:
+            output.writeFloat(value.asFloat());
+            break;
+        case TYPE_BOOL:
+            output.write(value.asBool() ? "true" : "false");
+            break;
+        case TYPE_NIL:
+            output.write("nil");
+            break;
+        case TYPE_STRING_BUILDER:
+            output.write(heap.builder(value)->view());
+            break;
+        default:
+            output.write(toString(value));
+            break;
         }
     }
 
-    void VM::opJmpIfNot(uint32_t address)
+    void VM::opPrint()
     {
-        Value cond = pop();
-        if (!cond.isTruthy())
+        Value val = pop();
+        writeValue(val);
+        output.endPrint();
+    }
+
+    void VM::opRead()
+    {
+        push(readLine());
+    }
+
+    Value VM::readLine()
+    {
+        output.flush(); // Show any prompt before waiting for input
+        std::string_view line;
+        return newString(input.readLine(line) ? line : std::string_view());
+    }
+
+    Value VM::newString(std::string_view chars)
+    {
+        if (chars.size() > Value::INLINE_STRING_MAX)
         {
-            opJmp(address);
+            reserveHeap(Heap::stringBytes(chars.size()));
         }
+        return heap.makeString(chars);
     }
 
-    void VM::callFunction(uint32_t funcIndex)
+    std::string VM::toString(const Value &value) const
     {
-        const FunctionInfo *func = nullptr;
-        for (const auto &f : program->functions)
+        ValueType type = value.type();
+        if (type == TYPE_STRING)
         {
-            if (f.address == funcIndex)
-            {
-                func = &f;
-                break;
-            }
+            return std::string(heap.stringView(value));
         }
-
-        if (!func)
+        if (type == TYPE_STRING_BUILDER)
         {
-            runtimeError("Function not found at address: " + std::to_string(funcIndex));
+            return std::string(heap.builder(value)->view());
         }
-
-        if (stack.size() < func->arity)
+        if (!isArrayType(type))
         {
-            runtimeError("Not enough arguments for function " + func->name);
+            return value.toString(program);
         }
 
-        CallFrame frame;
-        frame.returnAddr = pc + 1;
-        frame.localStart = locals.size();
-        frame.argCount = func->arity;
-        frame.func = func;
-        callStack.push_back(frame);
-
-        locals.resize(frame.localStart + func->locals);
-
-        for (int i = func->arity - 1; i >= 0; i--)
+        HeapArray *elements = heap.array(value);
+        std::string text = "[";
+        for (uint32_t i = 0; i < elements->length; i++)
         {
-            if (!stack.empty())
+            if (i > 0)
             {
-                locals[frame.localStart + i] = pop();
+                text += ", ";
             }
-            else
+            if (type == TYPE_ARRAY_INT)
             {
-                locals[frame.localStart + i] = Value();
+                text += intToString(elements->ints()[i]);
             }
-        }
-
-        for (int i = 0; i < func->arity; i++)
-        {
-            if (!stack.empty())
+            else if (type == TYPE_ARRAY_FLOAT)
+            {
+                text += floatToString(elements->floats()[i]);
+            }
+            else
             {
-                stack.pop_back();
+                text += heap.stringView(elements->values()[i]);
             }
         }
-
-        pc = func->address;
+        return text + "]";
     }
 
-    void VM::returnFromFunction()
+    // Appends what toString(value) gives, formatting numbers in place
+    void VM::appendText(std::string &out, const Value &value) const
     {
-        if (callStack.empty())
+        char number[NUMBER_TEXT_MAX];
+        if (value.type() == TYPE_STRING)
         {
-            running = false;
-            return;
+            out += heap.stringView(value);
         }
-
-        CallFrame frame = callStack.back();
-        callStack.pop_back();
-
-        if (frame.returnAddr == UINT32_MAX)
+        else if (value.isInt())
         {
-            running = false;
-            return;
+            out.append(number, formatInt(number, value.asInt()));
         }
-
-        Value returnValue;
-        if (!stack.empty())
+        else if (value.isFloat())
         {
-            returnValue = pop();
+            out.append(number, formatFloat(number, value.asFloat()));
+        }
+        else
+        {
+            out += toString(value);
         }
-
-        locals.resize(frame.localStart);
-        pc = frame.returnAddr;
-        push(returnValue);
     }
 
-    void VM::callNative(uint32_t nativeIndex)
+    // A number passes through (an int read as float widens, a float read
+    // as int truncates); a string is parsed as a whole
+    bool VM::parseIntValue(const Value &value, int64_t &result) const
     {
-        if (nativeIndex >= program->nativeImports.size())
+        if (value.isInt())
         {
-            runtimeError("Native import index out of bounds");
+            result = value.asInt();
+            return true;
         }
-
-        const std::string &name = program->nativeImports[nativeIndex];
-        auto it = nativeFuncs.find(name);
-        if (it == nativeFuncs.end())
+        if (value.isFloat())
         {
-            runtimeError("Native function not implemented: " + name);
+            double x = value.asFloat();
+            // NaN and doubles outside int64's range do not convert
+            if (!(x >= -9223372036854775808.0 && x < 9223372036854775808.0))
+            {
+                return false;
+            }
+            result = static_cast<int64_t>(x);
+            return true;
         }
-
-        // Call native function
-        it->second(*this);
+        return value.type() == TYPE_STRING && parseInt(heap.stringView(value), result);
     }
 
-    void VM::opNewArray(uint32_t constIndex)
+    bool VM::parseFloatValue(const Value &value, double &result) const
     {
-        // Simplified array creation
-        // In real implementation, would create array based on type in constant
-        (void)constIndex;
-        push(Value()); // nil for now
+        if (value.isFloat() || value.isInt())
+        {
+            result = value.isFloat() ? value.asFloat() : static_cast<double>(value.asInt());
+            return true;
+        }
+        return value.type() == TYPE_STRING && parseFloat(heap.stringView(value), result);
     }
 
-    void VM::opLoadIndex()
+    std::string VM::debugString(const Value &value) const
     {
-        Value index = pop();
-        Value array = pop();
-        (void)array;
-
-        if (index.type != TYPE_INT)
+        if (isArrayType(value.type()))
         {
-            runtimeError("Array index must be integer");
+            return "[" + std::string(valueTypeName(value.type())) + " of length " +
+                   std::to_string(heap.array(value)->length) + "]";
         }
+        return toString(value);
+    }
 
-        // Simplified - always return nil
-        push(Value());
+    Value VM::newBuilder(std::string_view chars)
+    {
+        size_t capacity = Heap::builderCapacity(0, chars.size());
+        reserveHeap(Heap::builderBytes(capacity));
+        return heap.makeBuilder(chars, capacity);
     }
 
-    void VM::opStoreIndex()
+    HeapStringBuilder *VM::checkBuilder(const Value &value, const char *native) const
     {
-        Value value = pop();
-        Value index = pop();
-        Value array = pop();
-        (void)array;
+        if (value.type() != TYPE_STRING_BUILDER)
+        {
+            runtimeError(std::string(native) + " expects a string builder, got " + valueTypeName(value.type()));
+        }
+        return heap.builder(value);
+    }
 
-        if (index.type != TYPE_INT)
+    void VM::appendTo(const Value &builder, const Value &piece)
+    {
+        char number[NUMBER_TEXT_MAX];
+        std::string text;
+        std::string_view chars;
+        if (piece.type() == TYPE_STRING)
         {
-            runtimeError("Array index must be integer");
+            chars = heap.stringView(piece);
+        }
+        else if (piece.isInt())
+        {
+            chars = std::string_view(number, formatInt(number, piece.asInt()) - number);
+        }
+        else if (piece.isFloat())
+        {
+            chars = std::string_view(number, formatFloat(number, piece.asFloat()) - number);
+        }
+        else
+        {
+            text = toString(piece); // Also copies a builder appended to itself
+            chars = text;
         }
 
-        // Simplified - do nothing
-        push(value);
+        HeapStringBuilder *target = heap.builder(builder);
+        if (chars.size() > std::numeric_limits<uint32_t>::max() - target->length)
+        {
+            runtimeError("String too long");
+        }
+        size_t bytes = Heap::appendBytes(target, chars.size());
+        if (bytes > 0)
+        {
+            reserveHeap(bytes);
+        }
+        heap.append(target, chars);
     }
 
-    void VM::opArrayLen()
+    Value VM::builderString(const Value &builder)
     {
-        Value array = pop();
-        // Simplified - always return 0
-        (void)array;
-        push(Value(static_cast<int64_t>(0)));
+        // The collector never moves objects, so `source` survives newString
+        HeapStringBuilder *source = heap.builder(builder);
+        if (source->snapshot.type() == TYPE_NIL)
+        {
+            source->snapshot = newString(source->view());
+        }
+        return source->snapshot;
     }
 
-    void VM::opPrint()
+    // Collects first if the heap asks for it; fails if the allocation still
+    // does not fit under --max-heap.
+    void VM::reserveHeap(size_t bytes)
     {
-        Value val = pop();
-        std::cout << val.toString(program);
+        if (heap.collectionDue(bytes))
+        {
+            collectGarbage();
+        }
+        if (!heap.fits(bytes))
+        {
+            runtimeError("Out of memory: heap limit of " + std::to_string(heap.getMaxBytes()) +
+                         " bytes exceeded");
+        }
     }
 
-    void VM::opRead()
+    // Roots: every frame's locals and operands on the value stack (the
+    // register engine leaves stackTop at its high-water mark, which only
+    // over-approximates), the globals, values natives hold in C++
+    // variables, and the linked constants. String constants are pool
+    // objects, which are never collected; big int constants are boxed.
+    void VM::collectGarbage()
     {
-        std::string input;
-        std::getline(std::cin, input);
-        uint32_t idx = program->strings.size();
-        const_cast<BytecodeFile *>(program)->strings.push_back(input);
-        push(Value(input, idx));
+        heap.beginCollection();
+        for (const Value *slot = stack.get(); slot < stackTop; slot++)
+        {
+            heap.mark(*slot);
+        }
+        for (const Value &global : globals)
+        {
+            heap.mark(global);
+        }
+        for (const Value *root : nativeRoots)
+        {
+            heap.mark(*root);
+        }
+        for (const Value &constant : constantValues)
+        {
+            heap.mark(constant);
+        }
+        heap.sweep();
     }
 
     void VM::opPrintln()
     {
         Value val = pop();
-        std::cout << val.toString(program) << std::endl;
+        writeValue(val);
+        output.endLine();
     }
 
     void VM::opHalt()
@@ -1006,35 +2419,8 @@ namespace TVM
         switch (instr.opcode)
         {
         case OP_PUSH:
-        {
-            const auto &cst = getConstant(instr.operand);
-            Value val;
-            val.type = cst.type;
-
-            switch (cst.type)
-            {
-            case TYPE_INT:
-                val.as.intVal = cst.as.intVal;
-                break;
-            case TYPE_FLOAT:
-                val.as.floatVal = cst.as.floatVal;
-                break;
-            case TYPE_BOOL:
-                val.as.boolVal = cst.as.boolVal;
-                break;
-            case TYPE_STRING:
-            case TYPE_ARRAY_INT:
-            case TYPE_ARRAY_FLOAT:
-            case TYPE_ARRAY_STRING:
-                val.as.stringIdx = cst.as.stringIdx;
-                break;
-            case TYPE_NIL:
-                val.as.intVal = 0;
-                break;
-            }
-            push(val);
+            std::cout << "PUSH " << instr.operand;
             break;
-        }
         case OP_POP:
             std::cout << "POP";
             break;
@@ -1059,6 +2445,12 @@ namespace TVM
         case OP_STORE:
             std::cout << "STORE " << instr.operand;
             break;
+        case OP_LOAD_STR:
+            std::cout << "LOAD_STR " << instr.operand;
+            break;
+        case OP_APPEND_LOCAL:
+            std::cout << "APPEND_LOCAL " << instr.operand;
+            break;
         case OP_JMP:
             std::cout << "JMP " << instr.operand;
             break;
@@ -1077,12 +2469,114 @@ namespace TVM
         case OP_CALL_NATIVE:
             std::cout << "CALL_NATIVE " << instr.operand;
             break;
+        case OP_TAILCALL:
+            std::cout << "TAILCALL " << instr.operand;
+            break;
         case OP_PRINT:
             std::cout << "PRINT";
             break;
         case OP_PRINTLN:
             std::cout << "PRINTLN";
             break;
+        case OP_LOAD_LOAD_ADD:
+            std::cout << "LOAD_LOAD_ADD " << instr.operand;
+            break;
+        case OP_LT_LOCAL_CONST_JMP_IFNOT:
+            std::cout << "LT_LOCAL_CONST_JMP_IFNOT " << instr.operand;
+            break;
+        case OP_INC_LOCAL:
+            std::cout << "INC_LOCAL " << instr.operand;
+            break;
+        case OP_STORE_POP:
+            std::cout << "STORE_POP " << instr.operand;
+            break;
+        case OP_ADD_INT:
+            std::cout << "ADD_INT";
+            break;
+        case OP_SUB_INT:
+            std::cout << "SUB_INT";
+            break;
+        case OP_MUL_INT:
+            std::cout << "MUL_INT";
+            break;
+        case OP_DIV_INT:
+            std::cout << "DIV_INT";
+            break;
+        case OP_MOD_INT:
+            std::cout << "MOD_INT";
+            break;
+        case OP_ADD_FLOAT:
+            std::cout << "ADD_FLOAT";
+            break;
+        case OP_SUB_FLOAT:
+            std::cout << "SUB_FLOAT";
+            break;
+        case OP_MUL_FLOAT:
+            std::cout << "MUL_FLOAT";
+            break;
+        case OP_DIV_FLOAT:
+            std::cout << "DIV_FLOAT";
+            break;
+        case OP_LT_INT:
+            std::cout << "LT_INT";
+            break;
+        case OP_LTE_INT:
+            std::cout << "LTE_INT";
+            break;
+        case OP_GT_INT:
+            std::cout << "GT_INT";
+            break;
+        case OP_GTE_INT:
+            std::cout << "GTE_INT";
+            break;
+        case OP_EQ_INT:
+            std::cout << "EQ_INT";
+            break;
+        case OP_NEQ_INT:
+            std::cout << "NEQ_INT";
+            break;
+        case OP_EQ_STR:
+            std::cout << "EQ_STR";
+            break;
+        case OP_NEQ_STR:
+            std::cout << "NEQ_STR";
+            break;
+        case OP_LT_FLOAT:
+            std::cout << "LT_FLOAT";
+            break;
+        case OP_LTE_FLOAT:
+            std::cout << "LTE_FLOAT";
+            break;
+        case OP_GT_FLOAT:
+            std::cout << "GT_FLOAT";
+            break;
+        case OP_GTE_FLOAT:
+            std::cout << "GTE_FLOAT";
+            break;
+        case OP_EQ_FLOAT:
+            std::cout << "EQ_FLOAT";
+            break;
+        case OP_NEQ_FLOAT:
+            std::cout << "NEQ_FLOAT";
+            break;
+        case OP_NEW_ARRAY:
+            std::cout << "NEW_ARRAY " << instr.operand;
+            break;
+        case OP_LOAD_INDEX:
+            std::cout << "LOAD_INDEX";
+            break;
+        case OP_STORE_INDEX:
+            std::cout << "STORE_INDEX";
+            break;
+        case OP_ARRAY_LEN:
+            std::cout << "ARRAY_LEN";
+            break;
+        case OP_LOAD_INDEX_UNCHECKED:
+            std::cout << "LOAD_INDEX_UNCHECKED " << (instr.operand >> 16) << "[" << (instr.operand & 0xFFFF) << "]";
+            break;
+        case OP_STORE_INDEX_UNCHECKED:
+            std::cout << "STORE_INDEX_UNCHECKED " << (instr.operand >> 16) << "[" << (instr.operand & 0xFFFF) << "]";
+            break;
         case OP_HALT:
             std::cout << "HALT";
             break;
@@ -1096,10 +2590,10 @@ namespace TVM
 
     void VM::traceStack() const
     {
-        std::cout << "  Stack [" << stack.size() << "]: ";
-        for (const auto &val : stack)
+        std::cout << "  Stack [" << stackSize() << "]: ";
+        for (const Value *val = stack.get(); val < stackTop; val++)
         {
-            std::cout << val.toString(program) << " ";
+            std::cout << debugString(*val) << " ";
         }
         std::cout << std::endl;
     }
@@ -1110,13 +2604,35 @@ namespace TVM
         std::cout << "PC: " << pc << std::endl;
         std::cout << "Running: " << (running ? "yes" : "no") << std::endl;
         std::cout << "Call stack depth: " << callStack.size() << std::endl;
-        std::cout << "Locals: " << locals.size() << std::endl;
+        std::cout << "Frame: base=" << frameBase << ", locals=" << frameLocals << std::endl;
         std::cout << "Globals: " << globals.size() << std::endl;
 
-        std::cout << "\nStack (" << stack.size() << " items):" << std::endl;
-        for (int i = stack.size() - 1; i >= 0; i--)
+        // A stack overflow leaves the whole stack full: show the top slots
+        // and the active frame's locals, not a million lines
+        size_t size = stackSize();
+        size_t shownFrom = size > DUMP_STACK_SLOTS ? size - DUMP_STACK_SLOTS : 0;
+        std::cout << "\nStack (" << size << " items):" << std::endl;
+        for (size_t i = size; i-- > shownFrom;)
+        {
+            std::cout << "  [" << i << "] " << debugString(stack[i]) << std::endl;
+        }
+        size_t frameEnd = std::min<size_t>(frameBase + frameLocals, shownFrom);
+        if (frameBase < frameEnd)
+        {
+            if (frameEnd < shownFrom)
+            {
+                std::cout << "  ... " << (shownFrom - frameEnd) << " more" << std::endl;
+            }
+            std::cout << "  Locals of the active frame:" << std::endl;
+            for (size_t i = frameEnd; i-- > frameBase;)
+            {
+                std::cout << "  [" << i << "] " << debugString(stack[i]) << std::endl;
+            }
+            shownFrom = frameBase;
+        }
+        if (shownFrom > 0)
         {
-            std::cout << "  [" << i << "] " << stack[i].toString(program) << std::endl;
+            std::cout << "  ... " << shownFrom << " more" << std::endl;
         }
 
         if (pc < program->code.size())
@@ -1,5 +1,8 @@
 #pragma once
 #include "../shared/bytecode.h"
+#include "heap.h"
+#include "output.h"
+#include "input.h"
 #include <vector>
 #include <stack>
 #include <map>
@@ -7,20 +10,121 @@
 #include <string>
 #include <memory>
 #include <iostream>
+#include <algorithm>
 
 namespace TVM {
 
+class VM;
+class Jit;
+
+using NativeFunction = void (*)(VM&);
+
+// Instruction after the load-time link pass. Operands that used to be looked
+// up on every execution are resolved once, so the hot loop does no table
+// walks or bounds-checked pool reads.
+struct DecodedInstruction {
+    OpCode opcode;
+    uint8_t deopts;                   // Times a quickened form was reverted here
+    uint32_t operand;
+    uint32_t aux;                     // Superinstructions: second local or jump target
+    Value value;                      // OP_PUSH and superinstructions: the constant
+    union {
+        const FunctionInfo* func;     // OP_CALL, OP_TAILCALL: callee, nullptr if unresolved
+        NativeFunction native;        // OP_CALL_NATIVE: nullptr if unresolved
+    } target;
+    
+    DecodedInstruction() : opcode(OP_HALT), deopts(0), operand(0), aux(0) { target.func = nullptr; }
+};
+
+// Linked form of a register (version 2) instruction
+struct DecodedRegInstruction {
+    RegOpCode opcode;
+    uint8_t a;
+    uint16_t b;
+    uint32_t c;
+    union {
+        const FunctionInfo* func;     // ROP_CALL, ROP_TAILCALL: callee, nullptr if unresolved
+        NativeFunction native;        // ROP_CALL_NATIVE: nullptr if unresolved
+    } target;
+    
+    DecodedRegInstruction() : opcode(ROP_HALT), a(0), b(0), c(0) { target.func = nullptr; }
+};
+
+enum class DispatchMode {
+    Switch,     // Portable central switch
+    Threaded    // Computed-goto, one indirect jump per handler
+};
+
+// Instruction set of the kernels behind the whole-array natives (Array.sum,
+// Array.dot, ...)
+enum class SimdLevel {
+    Scalar,     // Portable loops
+    SSE2,       // x86-64 baseline
+    AVX2        // Chosen at run time when the CPU has it
+};
+
+struct ArrayKernels;
+
 class VM {
 public:
     VM();
     ~VM();
     
+    // The program must have passed BytecodeVerifier (verifier.h): handlers
+    // do not re-check what it proves.
     void execute(BytecodeFile& bytecode);
     
+    // Values the named native pops, or -1 if it is not implemented
+    int32_t nativeArity(const std::string& name) const;
+    
     bool isRunning() const { return running; }
     void stop() { running = false; }
     
-    // Debug
+    // Dispatch
+    static bool threadedDispatchAvailable();
+    void setDispatchMode(DispatchMode mode);
+    DispatchMode getDispatchMode() const { return dispatchMode; }
+    
+    // Quickening: generic arithmetic/comparison sites rewrite themselves
+    // into type-specialised forms after observing their operands
+    void setQuickening(bool enable) { quickening = enable; }
+    
+    // Baseline JIT (x86-64 Linux builds only): stack-bytecode functions
+    // called `threshold` times are compiled to native code
+    static bool jitAvailable();
+    static constexpr uint32_t DEFAULT_JIT_THRESHOLD = 100;
+    void setJit(bool enable, uint32_t threshold = DEFAULT_JIT_THRESHOLD);
+    
+    // Array kernels: defaults to the widest level the CPU supports. Returns
+    // false, keeping the current level, if `level` is unavailable.
+    static bool simdAvailable(SimdLevel level);
+    bool setSimd(SimdLevel level);
+    SimdLevel getSimd() const { return simdLevel; }
+    
+    // Statistics
+    uint64_t getInstructionCount() const { return instructionsExecuted; }
+    uint64_t getQuickenedCount() const { return quickenedSites; }
+    uint64_t getDeoptimizedCount() const { return deoptimizedSites; }
+    uint32_t getJitCompiledCount() const;
+    
+    // Value stack capacity in slots; a call that could exceed it fails with
+    // a stack overflow before its body runs
+    static constexpr size_t DEFAULT_STACK_SLOTS = 1024 * 1024;
+    void setStackSize(size_t slots) { stackSlots = std::max<size_t>(slots, 1); }
+    
+    // Heap: limit in bytes (0 = none), and a stress mode that collects
+    // before every allocation
+    void setMaxHeap(size_t bytes) { heap.setMaxBytes(bytes); }
+    void setGcStress(bool enable) { heap.setStress(enable); }
+    const GcStats& getGcStats() const { return heap.getStats(); }
+    size_t getHeapBytes() const { return heap.getLiveBytes(); }
+    
+    // Stdout buffering; the default depends on whether stdout is a TTY
+    void setOutputMode(OutputMode mode) { output.setMode(mode); }
+    
+    // Debug. dumpState() prints at most DUMP_STACK_SLOTS slots from the
+    // top of the stack, plus the active frame's locals.
+    static constexpr size_t DUMP_STACK_SLOTS = 32;
     void setTrace(bool enable) { trace = enable; }
     void dumpState();
     
@@ -28,36 +132,127 @@ private:
     BytecodeFile* program;
     bool running;
     bool trace;
+    DispatchMode dispatchMode;
     
     uint32_t pc;                    // Program counter
-    std::vector<Value> stack;       // Value stack
+    uint64_t instructionsExecuted;
+    bool quickening;
+    uint64_t quickenedSites;        // Rewrites to a quickened form
+    uint64_t deoptimizedSites;      // Guard failures that reverted one
+    
+    // A site that deopted this often stays generic
+    static constexpr uint8_t MAX_DEOPTS = 1;
+    
+    friend class Jit;
+    friend struct JitHelpers;
+    Jit* jit;                       // Only while executing with the JIT on
+    bool jitEnabled;
+    uint32_t jitThreshold;
+    
+    SimdLevel simdLevel;
+    const ArrayKernels* kernels;    // Table for simdLevel
+    
+    // Set while the JIT runs a callee through the interpreter: OP_RET
+    // returns from the loop once it pops the call stack back to this size.
+    uint32_t exitDepth;
+    std::vector<DecodedInstruction> code;   // Linked form of program->code
+    std::vector<DecodedRegInstruction> regCode; // Linked form of program->regCode
+    std::vector<Value> constantValues;      // Linked constant pool; the register engine's K table
+    
+    // Value stack; also holds every frame's locals. Its capacity is fixed
+    // for a run and each call checks up front that the callee's locals plus
+    // its maxStack fit, so pushes and pops need no checks of their own.
+    std::unique_ptr<Value[]> stack;
+    size_t stackSlots;
+    Value* stackTop;                // One past the topmost value
     std::vector<Value> globals;     // Global variables
-    std::vector<Value> locals;      // Local variables (current frame)
+    Heap heap;                      // Strings and arrays; see collectGarbage()
+    OutputBuffer output;            // Stdout of print/println
+    InputBuffer input;              // Stdin of Console.read and the IO natives
+    
+    // Values a native holds only in C++ variables while it allocates. Roots
+    // of the collector alongside the stack and the globals.
+    std::vector<const Value*> nativeRoots;
     
+    // Keeps a native's local value alive for the guard's lifetime
+    class Root {
+    public:
+        Root(VM& vm, const Value& value) : vm(vm) { vm.nativeRoots.push_back(&value); }
+        ~Root() { vm.nativeRoots.pop_back(); }
+        Root(const Root&) = delete;
+        Root& operator=(const Root&) = delete;
+    private:
+        VM& vm;
+    };
+    
+    // Calls use register windows: a callee's arguments stay where the caller
+    // pushed them and become its first locals, so call/return only moves the
+    // frame base instead of copying values around.
     struct CallFrame {
         uint32_t returnAddr;
-        uint32_t localStart;
-        uint32_t argCount;
+        uint32_t localStart;        // Stack index of local 0
         const TVM::FunctionInfo* func;
+        uint32_t resultReg;         // Register engine: caller's destination
     };
     
+    static constexpr size_t INITIAL_CALL_FRAMES = 4 * 1024;
+    
     std::vector<CallFrame> callStack;
+    uint32_t frameBase;             // localStart of the active frame
+    uint32_t frameLocals;           // Local slot count of the active frame
     
-    std::map<std::string, std::function<void(VM&)>> nativeFuncs;
+    struct Native {
+        NativeFunction function;
+        uint8_t arity;              // Arguments it pops
+    };
+    std::map<std::string, Native> nativeFuncs;
     
     void initNativeFunctions();
+    void defineNative(const std::string& name, uint8_t arity, NativeFunction function);
+    void link();
+    void linkConstants();
+    void linkSuperinstruction(DecodedInstruction& instr);
     
-    Value pop();
-    void push(const Value& val);
-    Value& peek(int offset = 0);
+    Value pop() { return *--stackTop; }
+    void push(const Value& val) { *stackTop++ = val; }
+    uint32_t stackSize() const { return static_cast<uint32_t>(stackTop - stack.get()); }
+    void reserveFrame(uint32_t base, const FunctionInfo* func);
+    Value& localSlot(uint32_t index) { return stack[frameBase + index]; }
+    Value& peek(int offset = 0) { return stackTop[-1 - offset]; }
     
-    const Constant& getConstant(uint32_t index) const;
-    const std::string& getString(uint32_t index) const;
+    const Constant& getConstant(uint32_t index) const { return program->constants[index]; }
+    static Value constantValue(const Constant& cst);
     
-    void executeInstruction(Instruction& instr);
-    void callFunction(uint32_t funcIndex);
+    template <bool Threaded>
+    void run();
+    void runInterpreter();
+    void callFunction(const FunctionInfo* func);
+    void tailCallFunction(const FunctionInfo* func);
     void returnFromFunction();
-    void callNative(uint32_t nativeIndex);
+    
+    // Register engine (vm_register.cpp)
+    void linkRegister();
+    template <bool Threaded>
+    void runRegister();
+    void callRegister(const DecodedRegInstruction& instr);
+    void tailCallRegister(const DecodedRegInstruction& instr);
+    bool returnRegister(uint32_t reg);
+    void callRegisterNative(const DecodedRegInstruction& instr);
+    void traceRegisterInstruction(const DecodedRegInstruction& instr) const;
+    
+    // Operator semantics shared by the stack and register interpreters
+    Value valueAdd(const Value& a, const Value& b);
+    Value valueSub(const Value& a, const Value& b);
+    Value valueMul(const Value& a, const Value& b);
+    Value valueDiv(const Value& a, const Value& b);
+    Value valueMod(const Value& a, const Value& b);
+    Value valueNeg(const Value& a);
+    bool valueEquals(const Value& a, const Value& b);
+    bool stringEquals(const Value& a, const Value& b) const;
+    bool valueLess(const Value& a, const Value& b);
+    bool valueLessEqual(const Value& a, const Value& b);
+    bool valueGreater(const Value& a, const Value& b);
+    bool valueGreaterEqual(const Value& a, const Value& b);
     
     void opAdd();
     void opSub();
@@ -83,24 +278,79 @@ private:
     void opStore(uint32_t index);
     void opLoadGlobal(uint32_t index);
     void opStoreGlobal(uint32_t index);
+    void opLoadStr(uint32_t index);
+    void opAppendLocal(uint32_t index);
+    // The two halves of in-place appends, shared by the stack and register
+    // interpreters; both may collect, so local and piece must be rooted.
+    Value localString(const Value& local);
+    void appendLocal(Value& local, const Value& piece);
     
     void opJmp(uint32_t address);
     void opJmpIf(uint32_t address);
     void opJmpIfNot(uint32_t address);
     
-    // Arrays
+    // Arrays. The first three are shared by the stack and register
+    // interpreters; newArray() may collect.
+    Value newArray(const Value& length, uint32_t constIndex);
+    Value loadIndexed(const Value& array, const Value& index);
+    void storeIndexed(const Value& array, const Value& index, const Value& value);
     void opNewArray(uint32_t constIndex);
     void opLoadIndex();
     void opStoreIndex();
     void opArrayLen();
+    void opLoadIndexUnchecked(uint32_t operand);
+    void opStoreIndexUnchecked(uint32_t operand);
+    void storeElement(ValueType type, HeapArray* elements, size_t index, const Value& value);
+    HeapArray* checkArray(const Value& array) const;
+    HeapArray* checkIndex(const Value& array, const Value& index) const;
+    // Argument checks of the Array.* natives, which name themselves in errors
+    HeapArray* checkNumericArray(const Value& array, const char* native) const;
+    void checkSameType(const Value& a, const Value& b, const char* native) const;
     
     // I/O
+    void writeValue(const Value& value); // toString(value) into the output buffer
     void opPrint();
-    void opRead();
     void opPrintln();
+    void opRead();
+    Value readLine();
     
     void opHalt();
     
+    // Runtime strings. newString() may collect, so a native or handler
+    // must have pushed, stored or Root-ed every heap value it still needs.
+    Value newString(std::string_view chars);
+    std::string toString(const Value& value) const;
+    std::string debugString(const Value& value) const; // Arrays by length only
+    void appendText(std::string& out, const Value& value) const;
+    bool parseIntValue(const Value& value, int64_t& result) const;
+    bool parseFloatValue(const Value& value, double& result) const;
+    
+    // String builders. These may collect too; the builder and the piece
+    // must be reachable from a root.
+    Value newBuilder(std::string_view chars);
+    HeapStringBuilder* checkBuilder(const Value& value, const char* native) const;
+    void appendTo(const Value& builder, const Value& piece);
+    Value builderString(const Value& builder); // Contents, cached until the next append
+    
+    // Garbage collection
+    void reserveHeap(size_t bytes);
+    void collectGarbage();
+    
+    // Safe point for back-edges and calls, where every live value is on the
+    // stack or in a global: boxing ints never collects, so a loop that only
+    // boxes them collects here
+    void pollHeap()
+    {
+        if (heap.collectionRequested())
+        {
+            collectGarbage();
+        }
+    }
+    
+    // Quickening: rewrite a generic site to its typed form, and back
+    void quicken(DecodedInstruction& instr, OpCode intForm, OpCode floatForm);
+    void deoptimize(DecodedInstruction& instr, OpCode generic);
+    
     // Runtime errors
     void runtimeError(const std::string& message) const;
     
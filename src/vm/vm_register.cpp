@@ -0,0 +1,416 @@
+#include "vm.h"
+#include "dispatch.h"
+#include <iostream>
+#include <unordered_map>
+
+// Interpreter for register bytecode (version 2). Frames use the same value
+// stack and register windows as the stack engine: R points at the active
+// frame's local 0, and a call's argument registers become the callee's
+// first registers. The stack never moves, so R is re-derived only when the
+// active frame changes.
+
+namespace TVM
+{
+
+    void VM::linkRegister()
+    {
+        std::unordered_map<uint32_t, const FunctionInfo *> functionsByAddress;
+        for (const auto &func : program->functions)
+        {
+            functionsByAddress.emplace(func.address, &func);
+        }
+
+        linkConstants();
+
+        const auto &source = program->regCode;
+        regCode.assign(source.size(), DecodedRegInstruction());
+
+        for (pc = 0; pc < source.size(); pc++)
+        {
+            DecodedRegInstruction &instr = regCode[pc];
+            instr.opcode = source[pc].opcode;
+            instr.a = source[pc].a;
+            instr.b = source[pc].b;
+            instr.c = source[pc].c;
+
+            if (instr.opcode == ROP_CALL || instr.opcode == ROP_TAILCALL)
+            {
+                instr.target.func = functionsByAddress.at(instr.c);
+            }
+            else if (instr.opcode == ROP_CALL_NATIVE)
+            {
+                const std::string &name = program->nativeImports[instr.c & NATIVE_INDEX_MASK];
+                instr.target.native = nativeFuncs.at(name).function;
+            }
+        }
+
+        if (regCode.empty() || regCode.back().opcode != ROP_HALT)
+        {
+            regCode.push_back(DecodedRegInstruction());
+        }
+        pc = 0;
+    }
+
+    void VM::callRegister(const DecodedRegInstruction &instr)
+    {
+        pollHeap();
+        const FunctionInfo *func = instr.target.func;
+        uint32_t base = frameBase + instr.b;
+        reserveFrame(base, func);
+        Value *top = stack.get() + base + func->locals;
+        if (stackTop < top)
+        {
+            stackTop = top;
+        }
+        // Registers past the arguments may hold the caller's dead temporaries
+        std::fill(stack.get() + base + func->arity, top, Value());
+
+        callStack.push_back(CallFrame{pc + 1, base, func, instr.a});
+        frameBase = base;
+        frameLocals = func->locals;
+        pc = func->address;
+    }
+
+    void VM::tailCallRegister(const DecodedRegInstruction &instr)
+    {
+        // As VM::tailCallFunction: the arguments move down to R0 and func
+        // takes over the frame record, keeping its return address and
+        // result register.
+        pollHeap();
+        const FunctionInfo *func = instr.target.func;
+        reserveFrame(frameBase, func);
+        Value *frame = stack.get() + frameBase;
+        for (uint32_t i = 0; i < func->arity; i++)
+        {
+            frame[i] = frame[instr.b + i];
+        }
+        Value *top = frame + func->locals;
+        if (stackTop < top)
+        {
+            stackTop = top;
+        }
+        std::fill(frame + func->arity, top, Value());
+
+        callStack.back().func = func;
+        frameLocals = func->locals;
+        pc = func->address;
+    }
+
+    bool VM::returnRegister(uint32_t reg)
+    {
+        const CallFrame &frame = callStack.back();
+        if (frame.returnAddr == UINT32_MAX)
+        {
+            running = false;
+            return false;
+        }
+
+        Value result = stack[frameBase + reg];
+        uint32_t resultReg = frame.resultReg;
+        pc = frame.returnAddr;
+        callStack.pop_back();
+
+        frameBase = callStack.back().localStart;
+        frameLocals = callStack.back().func->locals;
+        stack[frameBase + resultReg] = result;
+        return true;
+    }
+
+    void VM::callRegisterNative(const DecodedRegInstruction &instr)
+    {
+        // Natives speak the stack protocol: stage the argument registers
+        // above every live frame, then collect at most one result.
+        Value *top = stackTop;
+        uint32_t argc = instr.c >> NATIVE_ARGC_SHIFT;
+        if (stackSize() + std::max<uint32_t>(argc, 1) > stackSlots)
+        {
+            runtimeError("Stack overflow calling a native function");
+        }
+        for (uint32_t i = 0; i < argc; i++)
+        {
+            push(stack[frameBase + instr.b + i]);
+        }
+
+        instr.target.native(*this);
+
+        Value result;
+        if (stackTop > top)
+        {
+            result = stackTop[-1];
+        }
+        stackTop = top;
+        stack[frameBase + instr.a] = result;
+    }
+
+// Operand accessors for the current instruction
+#define RA R[code[pc].a]
+#define RB R[code[pc].b]
+#define RK_B ((code[pc].b & RK_CONSTANT_B) ? K[code[pc].b & ~RK_CONSTANT_B] : R[code[pc].b])
+#define RK_C ((code[pc].c & RK_CONSTANT_C) ? K[code[pc].c & ~RK_CONSTANT_C] : R[code[pc].c])
+
+    template <bool Threaded>
+    void VM::runRegister()
+    {
+        const DecodedRegInstruction *code = regCode.data();
+        const Value *K = constantValues.data();
+        Value *R = stack.get() + frameBase;
+        uint64_t executed = 0;
+
+#if TVM_THREADED_DISPATCH
+        void *dispatchTable[256];
+        if constexpr (Threaded)
+        {
+            for (auto &target : dispatchTable)
+            {
+                target = &&L_UNKNOWN;
+            }
+            dispatchTable[ROP_MOVE] = &&L_ROP_MOVE;
+            dispatchTable[ROP_LOADK] = &&L_ROP_LOADK;
+            dispatchTable[ROP_ADD] = &&L_ROP_ADD;
+            dispatchTable[ROP_SUB] = &&L_ROP_SUB;
+            dispatchTable[ROP_MUL] = &&L_ROP_MUL;
+            dispatchTable[ROP_DIV] = &&L_ROP_DIV;
+            dispatchTable[ROP_MOD] = &&L_ROP_MOD;
+            dispatchTable[ROP_NEG] = &&L_ROP_NEG;
+            dispatchTable[ROP_EQ] = &&L_ROP_EQ;
+            dispatchTable[ROP_NEQ] = &&L_ROP_NEQ;
+            dispatchTable[ROP_LT] = &&L_ROP_LT;
+            dispatchTable[ROP_LTE] = &&L_ROP_LTE;
+            dispatchTable[ROP_GT] = &&L_ROP_GT;
+            dispatchTable[ROP_GTE] = &&L_ROP_GTE;
+            dispatchTable[ROP_NOT] = &&L_ROP_NOT;
+            dispatchTable[ROP_JMP] = &&L_ROP_JMP;
+            dispatchTable[ROP_JMP_IF] = &&L_ROP_JMP_IF;
+            dispatchTable[ROP_JMP_IFNOT] = &&L_ROP_JMP_IFNOT;
+            dispatchTable[ROP_CALL] = &&L_ROP_CALL;
+            dispatchTable[ROP_RET] = &&L_ROP_RET;
+            dispatchTable[ROP_CALL_NATIVE] = &&L_ROP_CALL_NATIVE;
+            dispatchTable[ROP_TAILCALL] = &&L_ROP_TAILCALL;
+            dispatchTable[ROP_JMP_IFNOT_EQ] = &&L_ROP_JMP_IFNOT_EQ;
+            dispatchTable[ROP_JMP_IFNOT_NEQ] = &&L_ROP_JMP_IFNOT_NEQ;
+            dispatchTable[ROP_JMP_IFNOT_LT] = &&L_ROP_JMP_IFNOT_LT;
+            dispatchTable[ROP_JMP_IFNOT_LTE] = &&L_ROP_JMP_IFNOT_LTE;
+            dispatchTable[ROP_JMP_IFNOT_GT] = &&L_ROP_JMP_IFNOT_GT;
+            dispatchTable[ROP_JMP_IFNOT_GTE] = &&L_ROP_JMP_IFNOT_GTE;
+            dispatchTable[ROP_NEW_ARRAY] = &&L_ROP_NEW_ARRAY;
+            dispatchTable[ROP_LOAD_INDEX] = &&L_ROP_LOAD_INDEX;
+            dispatchTable[ROP_STORE_INDEX] = &&L_ROP_STORE_INDEX;
+            dispatchTable[ROP_ARRAY_LEN] = &&L_ROP_ARRAY_LEN;
+            dispatchTable[ROP_LOAD_STR] = &&L_ROP_LOAD_STR;
+            dispatchTable[ROP_APPEND] = &&L_ROP_APPEND;
+            dispatchTable[ROP_PRINT] = &&L_ROP_PRINT;
+            dispatchTable[ROP_READ] = &&L_ROP_READ;
+            dispatchTable[ROP_PRINTLN] = &&L_ROP_PRINTLN;
+            dispatchTable[ROP_HALT] = &&L_ROP_HALT;
+
+            ++executed;
+            goto *dispatchTable[code[pc].opcode];
+        }
+#endif
+
+    dispatch:
+        ++executed;
+        if (trace)
+        {
+            traceRegisterInstruction(code[pc]);
+        }
+
+        switch (code[pc].opcode)
+        {
+        // Moves
+        TVM_CASE(ROP_MOVE)
+            RA = RB;
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_LOADK)
+            RA = K[code[pc].c];
+            pc++;
+            TVM_NEXT();
+
+        // Arithmetic
+        TVM_CASE(ROP_ADD)
+            RA = valueAdd(RB, RK_C);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_SUB)
+            RA = valueSub(RB, RK_C);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_MUL)
+            RA = valueMul(RB, RK_C);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_DIV)
+            RA = valueDiv(RB, RK_C);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_MOD)
+            RA = valueMod(RB, RK_C);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_NEG)
+            RA = valueNeg(RB);
+            pc++;
+            TVM_NEXT();
+
+        // Comparison
+        TVM_CASE(ROP_EQ)
+            RA = Value(valueEquals(RB, RK_C));
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_NEQ)
+            RA = Value(!valueEquals(RB, RK_C));
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_LT)
+            RA = Value(valueLess(RB, RK_C));
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_LTE)
+            RA = Value(valueLessEqual(RB, RK_C));
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_GT)
+            RA = Value(valueGreater(RB, RK_C));
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_GTE)
+            RA = Value(valueGreaterEqual(RB, RK_C));
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_NOT)
+            RA = Value(!RB.isTruthy());
+            pc++;
+            TVM_NEXT();
+
+        // Control flow
+        TVM_CASE(ROP_JMP)
+            if (code[pc].c <= pc)
+            {
+                pollHeap();
+            }
+            pc = code[pc].c;
+            TVM_NEXT();
+        TVM_CASE(ROP_JMP_IF)
+            pc = RA.isTruthy() ? code[pc].c : pc + 1;
+            TVM_NEXT();
+        TVM_CASE(ROP_JMP_IFNOT)
+            pc = RA.isTruthy() ? pc + 1 : code[pc].c;
+            TVM_NEXT();
+        TVM_CASE(ROP_JMP_IFNOT_EQ)
+            pc = valueEquals(RA, RK_B) ? pc + 1 : code[pc].c;
+            TVM_NEXT();
+        TVM_CASE(ROP_JMP_IFNOT_NEQ)
+            pc = !valueEquals(RA, RK_B) ? pc + 1 : code[pc].c;
+            TVM_NEXT();
+        TVM_CASE(ROP_JMP_IFNOT_LT)
+            pc = valueLess(RA, RK_B) ? pc + 1 : code[pc].c;
+            TVM_NEXT();
+        TVM_CASE(ROP_JMP_IFNOT_LTE)
+            pc = valueLessEqual(RA, RK_B) ? pc + 1 : code[pc].c;
+            TVM_NEXT();
+        TVM_CASE(ROP_JMP_IFNOT_GT)
+            pc = valueGreater(RA, RK_B) ? pc + 1 : code[pc].c;
+            TVM_NEXT();
+        TVM_CASE(ROP_JMP_IFNOT_GTE)
+            pc = valueGreaterEqual(RA, RK_B) ? pc + 1 : code[pc].c;
+            TVM_NEXT();
+        TVM_CASE(ROP_CALL)
+            callRegister(code[pc]);
+            R = stack.get() + frameBase;
+            TVM_NEXT();
+        TVM_CASE(ROP_RET)
+            if (!returnRegister(code[pc].a))
+            {
+                instructionsExecuted += executed;
+                return;
+            }
+            R = stack.get() + frameBase;
+            TVM_NEXT();
+        TVM_CASE(ROP_CALL_NATIVE)
+            callRegisterNative(code[pc]);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_TAILCALL)
+            tailCallRegister(code[pc]);
+            TVM_NEXT();
+
+        // Arrays
+        TVM_CASE(ROP_NEW_ARRAY)
+            RA = newArray(RB, code[pc].c);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_LOAD_INDEX)
+            RA = loadIndexed(RB, RK_C);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_STORE_INDEX)
+            storeIndexed(RA, RK_B, RK_C);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_ARRAY_LEN)
+            RA = Value(static_cast<int64_t>(checkArray(RB)->length));
+            pc++;
+            TVM_NEXT();
+
+        // Strings
+        TVM_CASE(ROP_LOAD_STR)
+            RA = localString(RB);
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_APPEND)
+            appendLocal(RA, RK_C);
+            pc++;
+            TVM_NEXT();
+
+        // I/O
+        TVM_CASE(ROP_PRINT)
+            writeValue(RA);
+            output.endPrint();
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_READ)
+            RA = readLine();
+            pc++;
+            TVM_NEXT();
+        TVM_CASE(ROP_PRINTLN)
+            writeValue(RA);
+            output.endLine();
+            pc++;
+            TVM_NEXT();
+
+        // System
+        TVM_CASE(ROP_HALT)
+            opHalt();
+            instructionsExecuted += executed;
+            return;
+
+        default:
+#if TVM_THREADED_DISPATCH
+        L_UNKNOWN:
+#endif
+            runtimeError("Unknown register opcode: " + std::to_string(static_cast<int>(code[pc].opcode)));
+        }
+    }
+
+#undef RA
+#undef RB
+#undef RK_B
+#undef RK_C
+
+    template void VM::runRegister<true>();
+    template void VM::runRegister<false>();
+
+    void VM::traceRegisterInstruction(const DecodedRegInstruction &instr) const
+    {
+        std::cout << "PC=" << pc << " op=0x" << std::hex << static_cast<int>(instr.opcode) << std::dec
+                  << " A=" << static_cast<int>(instr.a) << " B=" << instr.b << " C=" << instr.c
+                  << "  [base=" << frameBase << "]";
+        for (uint32_t i = 0; i < frameLocals && frameBase + i < stackSize(); i++)
+        {
+            std::cout << " r" << i << "=" << toString(stack[frameBase + i]);
+        }
+        std::cout << std::endl;
+    }
+
+} // namespace TVM
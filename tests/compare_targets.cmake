@@ -0,0 +1,40 @@
+# Compiles one program for the stack and the register target, runs both
+# and fails unless each exits cleanly with the same output.
+#   cmake -DTAILC=... -DTAIL=... -DSOURCE=prog.tail -DINPUT=stdin.txt
+#         -DWORK_DIR=... -P compare_targets.cmake
+
+get_filename_component(name ${SOURCE} NAME_WE)
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+foreach(target stack register)
+    set(program ${WORK_DIR}/${name}.${target}.tailc)
+    execute_process(
+        COMMAND ${TAILC} ${SOURCE} --target=${target} -o ${program}
+        RESULT_VARIABLE status
+        OUTPUT_VARIABLE log
+        ERROR_VARIABLE log
+    )
+    if(NOT status EQUAL 0)
+        message(FATAL_ERROR "${name}: tailc --target=${target} failed:\n${log}")
+    endif()
+
+    execute_process(
+        COMMAND ${TAIL} ${program}
+        INPUT_FILE ${INPUT}
+        RESULT_VARIABLE status
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE output
+    )
+    if(NOT status EQUAL 0)
+        message(FATAL_ERROR "${name}: the ${target} build exited with ${status}:\n${output}")
+    endif()
+
+    # The loader names the file it read
+    string(REGEX REPLACE "^Loading [^\n]*\n" "" output "${output}")
+    set(output_${target} "${output}")
+endforeach()
+
+if(NOT output_stack STREQUAL output_register)
+    message(FATAL_ERROR "${name}: the targets disagree\n"
+                        "--- stack\n${output_stack}\n--- register\n${output_register}")
+endif()
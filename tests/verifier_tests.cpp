@@ -0,0 +1,151 @@
+#include "compiler/compiler.h"
+#include "compiler/optimizer.h"
+#include "shared/lexer.h"
+#include "shared/parser.h"
+#include "vm/verifier.h"
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+// Verifier regression tests. Each case compiles a small program, edits its
+// bytecode the way a hand-patched .tailc would, and checks that the
+// verifier rejects the edit, or accepts the program if it was left alone.
+
+namespace
+{
+    // for-loops bounded by Array.length index without bounds checks
+    const char *BOUNDED_LOOP = R"(
+fn Main() {
+    int a[] = [1, 2, 3];
+    int s = 0;
+    for (int i = 0; i < Array.length(a); i = i + 1) {
+        s = s + a[i];
+        s = s + 1;
+    }
+    Console.println(s);
+}
+)";
+
+    TVM::BytecodeFile compile(const std::string &source)
+    {
+        // The parser and compiler trace to stdout
+        std::ostringstream trace;
+        std::streambuf *saved = std::cout.rdbuf(trace.rdbuf());
+        Tail::Lexer lexer(source);
+        auto tokens = lexer.tokenize();
+        Tail::Parser parser(tokens);
+        auto ast = parser.parse();
+        if (!lexer.getErrors().empty() || !parser.getErrors().empty())
+        {
+            std::cout.rdbuf(saved);
+            throw std::runtime_error("Test program does not parse");
+        }
+
+        Tail::CompilerOptions options;
+        Tail::AstOptimizer(options.optimizationLevel).run(ast);
+        TVM::BytecodeFile program = Tail::Compiler(options).compile(ast);
+        std::cout.rdbuf(saved);
+        return program;
+    }
+
+    uint32_t find(const TVM::BytecodeFile &program, TVM::OpCode op, uint32_t from = 0)
+    {
+        for (uint32_t pc = from; pc < program.code.size(); pc++)
+        {
+            if (program.code[pc].opcode == op)
+            {
+                return pc;
+            }
+        }
+        throw std::runtime_error("Test program has no opcode " + std::to_string(op));
+    }
+
+    // The unchecked a[i] in BOUNDED_LOOP's body: LOAD s; LOAD_INDEX_UNCHECKED;
+    // ADD; STORE_POP s; POP, then s's INC_LOCAL
+    struct Access
+    {
+        uint32_t pc;
+        uint32_t array;
+        uint32_t index;
+    };
+
+    Access uncheckedAccess(const TVM::BytecodeFile &program)
+    {
+        uint32_t pc = find(program, TVM::OP_LOAD_INDEX_UNCHECKED);
+        uint32_t operand = program.code[pc].operand;
+        return Access{pc, operand >> 16, operand & 0xFFFF};
+    }
+
+    struct Case
+    {
+        const char *name;
+        const char *source;
+        std::function<void(TVM::BytecodeFile &)> edit;
+        const char *error; // Expected in the message; nullptr if it must verify
+    };
+
+    const Case CASES[] = {
+        {"bounded loop verifies", BOUNDED_LOOP, [](TVM::BytecodeFile &) {}, nullptr},
+        {"body stores to the index", BOUNDED_LOOP,
+         [](TVM::BytecodeFile &program) {
+             Access access = uncheckedAccess(program);
+             program.code[access.pc + 2].operand = access.index;
+             program.code[access.pc + 3] = TVM::Instruction(TVM::OP_POP);
+         },
+         "writes its array or index"},
+        // APPEND_LOCAL adds to a local that holds no string
+        {"body appends to the index", BOUNDED_LOOP,
+         [](TVM::BytecodeFile &program) {
+             Access access = uncheckedAccess(program);
+             program.code[access.pc + 1] = TVM::Instruction(TVM::OP_APPEND_LOCAL, access.index);
+         },
+         "writes its array or index"},
+        {"body appends to the array", BOUNDED_LOOP,
+         [](TVM::BytecodeFile &program) {
+             Access access = uncheckedAccess(program);
+             program.code[access.pc + 1] = TVM::Instruction(TVM::OP_APPEND_LOCAL, access.array);
+         },
+         "writes its array or index"},
+        // INC_LOCAL i; PUSH 1; ADD; STORE i; POP
+        {"body increments the index", BOUNDED_LOOP,
+         [](TVM::BytecodeFile &program) {
+             Access access = uncheckedAccess(program);
+             uint32_t increment = find(program, TVM::OP_INC_LOCAL, access.pc);
+             program.code[increment].operand = access.index;
+             program.code[increment + 3].operand = access.index;
+         },
+         "writes its array or index"},
+    };
+}
+
+int main()
+{
+    TVM::VM vm;
+    int failures = 0;
+    for (const Case &test : CASES)
+    {
+        std::string error;
+        try
+        {
+            TVM::BytecodeFile program = compile(test.source);
+            test.edit(program);
+            TVM::BytecodeVerifier(program, vm).verify();
+        }
+        catch (const std::exception &e)
+        {
+            error = e.what();
+        }
+
+        bool passed = test.error ? error.find(test.error) != std::string::npos : error.empty();
+        std::cout << (passed ? "PASS " : "FAIL ") << test.name;
+        if (!passed)
+        {
+            std::cout << ": " << (error.empty() ? "verified" : error);
+            failures++;
+        }
+        std::cout << std::endl;
+    }
+    return failures == 0 ? 0 : 1;
+}